@@ -0,0 +1,69 @@
+--
+-- A stored procedure to allocate an IP address with one round trip
+-- to the database.  See the allocate_find query in queries.conf.
+--
+-- The procedure finds a free address, marks it as used, and returns
+-- it, all in one transaction.  If the pool is full, it returns NULL.
+--
+-- SKIP LOCKED requires MySQL 8.0.1 or later.  It means that concurrent
+-- allocations take different addresses, rather than waiting on the
+-- same row.  For older versions, remove "SKIP LOCKED".
+--
+-- The table name is fixed as "radippool".  Change it here if you use
+-- a different ippool_table.
+--
+DELIMITER $$
+
+DROP PROCEDURE IF EXISTS fr_allocate_framedipaddress;
+CREATE PROCEDURE fr_allocate_framedipaddress (
+	IN v_pool_name VARCHAR(30),
+	IN v_username VARCHAR(64),
+	IN v_callingstationid VARCHAR(30),
+	IN v_nasipaddress VARCHAR(15),
+	IN v_pool_key VARCHAR(30),
+	IN v_lease_duration INT
+)
+SQL SECURITY INVOKER
+BEGIN
+	DECLARE r_id INT UNSIGNED;
+	DECLARE r_address VARCHAR(15);
+
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+
+	--
+	-- Prefer the address the user had last session
+	--
+	SELECT id, framedipaddress INTO r_id, r_address
+	FROM radippool
+	WHERE pool_name = v_pool_name
+	AND (expiry_time < NOW() OR expiry_time IS NULL)
+	ORDER BY
+		(username <> v_username),
+		(callingstationid <> v_callingstationid),
+		expiry_time
+	LIMIT 1
+	FOR UPDATE SKIP LOCKED;
+
+	IF r_id IS NOT NULL THEN
+		UPDATE radippool
+		SET
+			nasipaddress = v_nasipaddress,
+			pool_key = v_pool_key,
+			callingstationid = v_callingstationid,
+			username = v_username,
+			expiry_time = NOW() + INTERVAL v_lease_duration SECOND
+		WHERE id = r_id;
+	END IF;
+
+	COMMIT;
+
+	SELECT r_address;
+END$$
+
+DELIMITER ;
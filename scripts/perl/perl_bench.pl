@@ -0,0 +1,23 @@
+#
+#  Policy for perl_bench.sh.  Reads two attributes of the request,
+#  and sets a reply attribute and Auth-Type.
+#
+#  $Id$
+#
+use strict;
+use warnings;
+
+our (%RAD_REQUEST, %RAD_REPLY, %RAD_CONFIG);
+
+use constant RLM_MODULE_OK => 2;
+
+sub authorize {
+	my $user = $RAD_REQUEST{'User-Name'};
+
+	if ($RAD_REQUEST{'NAS-Identifier'} eq 'nas1') {
+		$RAD_REPLY{'Reply-Message'} = "Hello $user";
+	}
+	$RAD_CONFIG{'Auth-Type'} = 'Accept';
+
+	return RLM_MODULE_OK;
+}
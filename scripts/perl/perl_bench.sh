@@ -0,0 +1,155 @@
+#!/bin/sh
+#
+#  perl_bench.sh	Measure how many Access-Requests per second a
+#			policy in rlm_perl can handle, with the %RAD_*
+#			hashes copied ("copy") and tied ("tied").
+#
+#  Version:	$Id$
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or (at
+#  your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+#
+#  Copyright 2016 The FreeRADIUS server project
+#
+
+#
+#  Run from the top of a built source tree, with rlm_perl built.  For
+#  each number of threads, and each mode, the server is started with
+#  perl_bench.conf, and radclient sends the requests with 200 in
+#  flight.  Each request has 16 attributes, and the policy in
+#  perl_bench.pl reads two of them.  The CPU time is that used by the
+#  server process during the run.
+#
+#  Examples:
+#
+#    scripts/perl/perl_bench.sh
+#    scripts/perl/perl_bench.sh -n 50000 -t "1 2 4 8"
+#
+
+requests=10000
+threads="1 4"
+port=18350
+
+usage() {
+	echo "Usage: $0 [-n requests] [-t \"threads ...\"] [-p port]" >&2
+	exit 1
+}
+
+while getopts "n:t:p:h" opt; do
+	case "$opt" in
+	n)	requests=$OPTARG ;;
+	t)	threads=$OPTARG ;;
+	p)	port=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+
+top=$(pwd)
+bin=$top/build/bin/local
+if [ ! -x "$bin/radiusd" ] || [ ! -x "$bin/radclient" ]; then
+	echo "$0: Run this from the top of a built source tree" >&2
+	exit 1
+fi
+
+benchdir=$(mktemp -d "${TMPDIR:-/tmp}/perl_bench.XXXXXX") || exit 1
+trap 'kill $(cat "$benchdir/radiusd.pid" 2>/dev/null) 2>/dev/null; rm -rf "$benchdir"' EXIT
+
+export LD_LIBRARY_PATH=$top/build/lib/local/.libs${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+
+cp "$top/scripts/perl/perl_bench.pl" "$benchdir/"
+
+#
+#  The requests.
+#
+i=0
+while [ $i -lt "$requests" ]; do
+	cat <<EOR
+User-Name = "user$i"
+NAS-Identifier = "nas1"
+NAS-IP-Address = 192.0.2.1
+NAS-Port = $i
+NAS-Port-Type = Ethernet
+Service-Type = Framed-User
+Framed-Protocol = PPP
+Called-Station-Id = "00-11-22-33-44-55:ssid"
+Calling-Station-Id = "66-77-88-99-AA-BB"
+Acct-Session-Id = "$i"
+Framed-MTU = 1500
+Connect-Info = "CONNECT 11Mbps 802.11b"
+Event-Timestamp = 1500000000
+NAS-Port-Id = "eth0/0"
+Class = 0x0102030405
+CHAP-Challenge = 0x00112233445566778899aabbccddeeff
+
+EOR
+	i=$((i + 1))
+done > "$benchdir/requests"
+
+#
+#  Server CPU time in clock ticks.
+#
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+printf "threads\tmode\treq/s\tserver CPU per request\n"
+
+for t in $threads; do
+	for mode in copy tied; do
+		if [ "$mode" = "tied" ]; then tied=yes; else tied=no; fi
+
+		{
+			echo "tied = $tied"
+			echo "threads = $t"
+			echo "port = $port"
+			echo "benchdir = $benchdir"
+			echo "libdir = $top/build/lib/local/.libs"
+			cat "$top/scripts/perl/perl_bench.conf"
+		} > "$benchdir/radiusd.conf"
+
+		rm -f "$benchdir/radiusd.pid"
+		"$bin/radiusd" -d "$benchdir" -D "$top/share" -l "$benchdir/radius.log" || exit 1
+
+		#
+		#  Wait for the server, and load the script.
+		#
+		tries=0
+		until echo 'User-Name = "warmup"' | "$bin/radclient" -D "$top/share" -q -r 1 -t 1 \
+			"127.0.0.1:$port" auth testing123 >/dev/null 2>&1; do
+			tries=$((tries + 1))
+			if [ $tries -ge 10 ]; then
+				echo "$0: The server didn't start, see $benchdir/radius.log" >&2
+				trap - EXIT
+				exit 1
+			fi
+		done
+
+		pid=$(cat "$benchdir/radiusd.pid")
+		cpu0=$(cpu_ticks "$pid")
+		start=$(date +%s.%N)
+
+		"$bin/radclient" -D "$top/share" -q -p 200 -r 1 -t 10 -f "$benchdir/requests" \
+			"127.0.0.1:$port" auth testing123 > "$benchdir/radclient.out" 2>&1
+
+		end=$(date +%s.%N)
+		cpu1=$(cpu_ticks "$pid")
+
+		kill "$pid"
+		while kill -0 "$pid" 2>/dev/null; do sleep 0.1; done
+
+		awk -v t="$t" -v mode="$mode" -v n="$requests" -v s="$start" -v e="$end" \
+		    -v cpu="$((cpu1 - cpu0))" -v hz="$(getconf CLK_TCK)" \
+		    'BEGIN { printf "%s\t%s\t%d\t%dus\n", t, mode, n / (e - s), (cpu * 1000000 / hz) / n }'
+	done
+done
@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+#
+#  sqlippool_bench.py	Measure how many IP allocations per second the
+#			rlm_sqlippool queries can do, with a number of
+#			concurrent workers.
+#
+#  Version:	$Id$
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or (at
+#  your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+#
+#  Copyright 2016 The FreeRADIUS server project
+#
+
+#
+#  Each worker is a separate process with its own connection, like a
+#  server thread with a connection from the pool.  It runs the same
+#  statements as raddb/mods-config/sql/ippool/<dialect>/queries.conf:
+#
+#    multi	allocate_begin, allocate_find, allocate_update and
+#		allocate_commit, as separate statements.
+#    single	allocate_find doing the whole allocation in one statement.
+#
+#  Leases are short, so addresses are re-used during the run.  Any
+#  address handed out twice within one second is counted as a duplicate,
+#  as it can't have expired in between.
+#
+#  Examples:
+#
+#    sqlippool_bench.py -d sqlite:/tmp/ippool.db -w 1,2,4,8
+#    sqlippool_bench.py -d "postgresql:dbname=radius user=radius" -m single
+#
+#  PostgreSQL needs the psycopg2 module.  The table is dropped and
+#  created again, so don't point this at a live database.
+#
+
+import argparse
+import multiprocessing
+import os
+import random
+import sys
+import time
+
+QUERIES = {
+	'sqlite': {
+		'create': [
+			"DROP TABLE IF EXISTS {table}",
+			"CREATE TABLE {table} ( "
+			"id int PRIMARY KEY, "
+			"pool_name varchar(30) NOT NULL, "
+			"framedipaddress varchar(15) NOT NULL default '', "
+			"nasipaddress varchar(15) NOT NULL default '', "
+			"callingstationid varchar(30) NOT NULL default '', "
+			"expiry_time DATETIME NULL default NULL, "
+			"username varchar(64) NOT NULL default '', "
+			"pool_key varchar(30) NOT NULL default '')",
+			"CREATE INDEX {table}_poolname_expire ON {table}(pool_name, expiry_time)",
+			"CREATE INDEX {table}_framedipaddress ON {table}(framedipaddress)",
+		],
+		'insert': "INSERT INTO {table} (id, pool_name, framedipaddress) VALUES (?, ?, ?)",
+		'multi': [
+			("BEGIN IMMEDIATE", None),
+			("SELECT framedipaddress FROM {table} "
+			 "WHERE pool_name = ? "
+			 "AND (expiry_time < datetime('now') OR expiry_time IS NULL) "
+			 "ORDER BY (username <> ?), (callingstationid <> ?), expiry_time "
+			 "LIMIT 1", ('pool', 'user', 'mac')),
+			("UPDATE {table} SET "
+			 "nasipaddress = '127.0.0.1', pool_key = ?, callingstationid = ?, username = ?, "
+			 "expiry_time = datetime(strftime('%s', 'now') + ?, 'unixepoch') "
+			 "WHERE framedipaddress = ?", ('key', 'mac', 'user', 'lease', 'ip')),
+			("COMMIT", None),
+		],
+		'single': [
+			("UPDATE {table} SET "
+			 "nasipaddress = '127.0.0.1', pool_key = ?, callingstationid = ?, username = ?, "
+			 "expiry_time = datetime(strftime('%s', 'now') + ?, 'unixepoch') "
+			 "WHERE id = ( "
+			 "SELECT id FROM {table} "
+			 "WHERE pool_name = ? "
+			 "AND (expiry_time < datetime('now') OR expiry_time IS NULL) "
+			 "ORDER BY (username <> ?), (callingstationid <> ?), expiry_time "
+			 "LIMIT 1) "
+			 "RETURNING framedipaddress", ('key', 'mac', 'user', 'lease', 'pool', 'user', 'mac')),
+		],
+	},
+	'postgresql': {
+		'create': [
+			"DROP TABLE IF EXISTS {table}",
+			"CREATE TABLE {table} ( "
+			"id BIGSERIAL PRIMARY KEY, "
+			"pool_name varchar(64) NOT NULL, "
+			"framedipaddress INET NOT NULL, "
+			"nasipaddress varchar(16) NOT NULL default '', "
+			"pool_key varchar(64) NOT NULL default 0, "
+			"callingstationid text NOT NULL default '', "
+			"expiry_time TIMESTAMP(0) without time zone NOT NULL default 'now'::timestamp(0), "
+			"username text DEFAULT '')",
+			"CREATE INDEX {table}_poolname_expire ON {table} USING btree (pool_name, expiry_time)",
+			"CREATE INDEX {table}_framedipaddress ON {table} USING btree (framedipaddress)",
+		],
+		'insert': "INSERT INTO {table} (id, pool_name, framedipaddress) VALUES (%s, %s, %s)",
+		'multi': [
+			("START TRANSACTION", None),
+			("SELECT framedipaddress FROM {table} "
+			 "WHERE pool_name = %s "
+			 "AND expiry_time < 'now'::timestamp(0) "
+			 "ORDER BY (username <> %s), (callingstationid <> %s), expiry_time "
+			 "LIMIT 1 "
+			 "FOR UPDATE", ('pool', 'user', 'mac')),
+			("UPDATE {table} SET "
+			 "nasipaddress = '127.0.0.1', pool_key = %s, callingstationid = %s, username = %s, "
+			 "expiry_time = 'now'::timestamp(0) + (%s || ' second')::interval "
+			 "WHERE framedipaddress = %s", ('key', 'mac', 'user', 'lease', 'ip')),
+			("COMMIT", None),
+		],
+		'single': [
+			("UPDATE {table} SET "
+			 "nasipaddress = '127.0.0.1', pool_key = %s, callingstationid = %s, username = %s, "
+			 "expiry_time = 'now'::timestamp(0) + (%s || ' second')::interval "
+			 "WHERE id = ( "
+			 "SELECT id FROM {table} "
+			 "WHERE pool_name = %s "
+			 "AND expiry_time < 'now'::timestamp(0) "
+			 "ORDER BY (username <> %s), (callingstationid <> %s), expiry_time "
+			 "LIMIT 1 "
+			 "FOR UPDATE SKIP LOCKED) "
+			 "RETURNING framedipaddress", ('key', 'mac', 'user', 'lease', 'pool', 'user', 'mac')),
+		],
+	},
+}
+
+def connect(args):
+	if args.dialect == 'sqlite':
+		import sqlite3
+
+		#
+		#  isolation_level = None stops the module starting
+		#  transactions of its own, so we send exactly the
+		#  statements the server would.
+		#
+		return sqlite3.connect(args.dsn, timeout = 60, isolation_level = None)
+
+	import psycopg2
+
+	conn = psycopg2.connect(args.dsn)
+	conn.autocommit = True
+	return conn
+
+def setup(args):
+	conn = connect(args)
+	cur = conn.cursor()
+	for query in QUERIES[args.dialect]['create']:
+		cur.execute(query.format(table = args.table))
+
+	insert = QUERIES[args.dialect]['insert'].format(table = args.table)
+	cur.execute("BEGIN")
+	for i in range(args.addresses):
+		cur.execute(insert, (i + 1, args.pool, '10.%d.%d.%d' % ((i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff)))
+	cur.execute("COMMIT")
+	conn.close()
+
+def worker(args, mode, start, results):
+	conn = connect(args)
+	cur = conn.cursor()
+
+	queries = [(q.format(table = args.table), params) for q, params in QUERIES[args.dialect][mode]]
+	allocated = []
+	empty = 0
+	errors = 0
+
+	while time.time() < start:
+		time.sleep(0.001)
+
+	end = start + args.duration
+	while time.time() < end:
+		values = {
+			'pool': args.pool,
+			'user': 'user%d' % random.randrange(args.addresses * 4),
+			'mac': '%012x' % random.randrange(1 << 48),
+			'key': str(os.getpid()),
+			'lease': args.lease,
+		}
+		ip = None
+
+		try:
+			for query, params in queries:
+				if params is None:
+					cur.execute(query)
+					continue
+
+				cur.execute(query, tuple(values[p] for p in params))
+				if cur.description is not None:
+					row = cur.fetchone()
+					if row is None:
+						#
+						#  Pool is full.  Skip the
+						#  update, as the server does.
+						#
+						break
+					ip = str(row[0])
+					values['ip'] = ip
+		except Exception:
+			errors += 1
+			try:
+				cur.execute("ROLLBACK")
+			except Exception:
+				pass
+			continue
+
+		if ip is None:
+			empty += 1
+			if mode == 'multi':
+				cur.execute("COMMIT")
+			continue
+
+		allocated.append((ip, time.time()))
+
+	conn.close()
+	results.put((allocated, empty, errors))
+
+def run(args, mode, workers):
+	setup(args)
+
+	results = multiprocessing.Queue()
+	start = time.time() + 0.5
+	procs = [multiprocessing.Process(target = worker, args = (args, mode, start, results)) for i in range(workers)]
+	for p in procs:
+		p.start()
+
+	allocated = []
+	empty = 0
+	errors = 0
+	for p in procs:
+		a, e, err = results.get()
+		allocated += a
+		empty += e
+		errors += err
+
+	for p in procs:
+		p.join()
+
+	#
+	#  An address allocated twice within one second can't have
+	#  expired in between, so two workers must have been given it.
+	#
+	duplicates = 0
+	last = {}
+	for ip, when in sorted(allocated, key = lambda x: x[1]):
+		if ip in last and (when - last[ip]) < 1.0:
+			duplicates += 1
+		last[ip] = when
+
+	print("%-8s %7d %10d %12.1f %8d %8d %10d" % (mode, workers, len(allocated),
+						   len(allocated) / args.duration, empty, errors, duplicates))
+	sys.stdout.flush()
+
+def main():
+	parser = argparse.ArgumentParser(description = 'Benchmark rlm_sqlippool allocation queries.')
+	parser.add_argument('-d', '--database', required = True,
+			    help = 'sqlite:<file> or postgresql:<libpq connection string>')
+	parser.add_argument('-m', '--mode', choices = ['multi', 'single', 'both'], default = 'both',
+			    help = 'which allocation queries to run (default both)')
+	parser.add_argument('-w', '--workers', default = '1,2,4,8,16',
+			    help = 'comma separated list of worker counts (default 1,2,4,8,16)')
+	parser.add_argument('-n', '--addresses', type = int, default = 65536,
+			    help = 'number of addresses in the pool (default 65536)')
+	parser.add_argument('-t', '--duration', type = float, default = 5.0,
+			    help = 'seconds to run each test for (default 5)')
+	parser.add_argument('-l', '--lease', type = int, default = 2,
+			    help = 'lease duration in seconds (default 2)')
+	parser.add_argument('--table', default = 'sqlippool_bench',
+			    help = 'table to create (default sqlippool_bench)')
+	args = parser.parse_args()
+
+	args.dialect, sep, args.dsn = args.database.partition(':')
+	if not sep or args.dialect not in QUERIES:
+		parser.error('database must start with "sqlite:" or "postgresql:"')
+
+	#
+	#  The duplicate check needs leases to outlast the one
+	#  second window, including rounding of expiry times.
+	#
+	if args.lease < 2:
+		parser.error('lease must be at least 2 seconds')
+
+	args.pool = 'bench'
+
+	modes = ['multi', 'single'] if args.mode == 'both' else [args.mode]
+
+	print("%-8s %7s %10s %12s %8s %8s %10s" % ('mode', 'workers', 'allocs', 'allocs/s', 'empty', 'errors', 'duplicates'))
+	for mode in modes:
+		for workers in [int(w) for w in args.workers.split(',')]:
+			run(args, mode, workers)
+
+if __name__ == '__main__':
+	main()
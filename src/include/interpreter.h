@@ -134,6 +134,8 @@ static inline modcallable *mod_xlattocallable(modxlat *p)
 }
 
 int modcall(rlm_components_t component, modcallable *c, REQUEST *request);
+rlm_rcode_t modcall_async(rlm_components_t component, int idx, modcallable *c, REQUEST *request);
+rlm_rcode_t modcall_resume(REQUEST *request, rlm_components_t *component, int *idx);
 
 #ifdef __cplusplus
 }
@@ -79,6 +79,13 @@ RCSIDH(libradius_h, "$Id$")
 #  include <limits.h>
 #endif
 
+/*
+ *  Batched UDP I/O with recvmmsg() and sendmmsg().
+ */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#  define WITH_UDP_MMSG
+#endif
+
 #include <freeradius-devel/threads.h>
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/token.h>
@@ -243,6 +250,8 @@ void		fr_radius_make_secret(uint8_t *digest, uint8_t const *vector, char const *
 
 void		fr_radius_print_hex(RADIUS_PACKET const *packet);
 
+int		fr_radius_send_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
+
 int		fr_radius_send(RADIUS_PACKET *, RADIUS_PACKET const *, char const *secret);
 
 ssize_t		fr_radius_len(uint8_t const *data, size_t data_len);
@@ -255,8 +264,22 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 
 void		fr_radius_recv_discard(int sockfd);
 
+typedef struct udp_mmsg udp_mmsg_t;
+
+#ifdef WITH_UDP_MMSG
+ssize_t		fr_radius_recv_header_mmsg(udp_mmsg_t *mm, unsigned int i,
+					   fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code);
+
+RADIUS_PACKET	*fr_radius_recv_mmsg(TALLOC_CTX *ctx, int fd, udp_mmsg_t *mm, unsigned int i, bool require_ma);
+
+int		fr_radius_send_mmsg(udp_mmsg_t *mm, RADIUS_PACKET *packet);
+#endif
+
 int		fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
+int		fr_radius_verify_multi(RADIUS_PACKET *packet[], RADIUS_PACKET *original[], char const *secret[],
+				       int rcode[], unsigned int num);
+
 int		fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
 int		fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
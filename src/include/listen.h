@@ -87,6 +87,13 @@ struct rad_listen {
 	bool			nodup;
 	bool			synchronous;
 	uint32_t		workers;
+	uint32_t		batch;		//!< Maximum number of packets to read or write
+						//!< with one system call.
+	uint32_t		reuseport;	//!< Number of copies of this socket to open
+						//!< with SO_REUSEPORT.
+	fr_event_list_t		*el;		//!< Event list of the network thread which
+						//!< reads this socket, if any.
+	rbtree_t		*requests;	//!< Live requests read by the network thread.
 
 #ifdef WITH_TLS
 	fr_tls_server_conf_t	*tls;
@@ -170,6 +177,25 @@ typedef struct listen_socket_t {
 #endif
 
 	RADCLIENT_LIST		*clients;
+
+#ifdef WITH_UDP_MMSG
+	udp_mmsg_t		*recv_mmsg;	//!< Packets read by the last call to recvmmsg().
+	struct listen_pending_t	*recv_pending;	//!< Packets from recv_mmsg waiting to be verified.
+	uint32_t		num_pending;	//!< Number of entries in recv_pending.
+	udp_mmsg_t		*send_mmsg;	//!< Replies waiting to be sent.
+	udp_mmsg_t		*send_mmsg_out;	//!< Replies being sent.
+	pthread_mutex_t		send_mutex;	//!< Protects send_mmsg and the send_* fields.
+	bool			send_hold;	//!< Hold replies until the current batch of
+						//!< requests has been processed.
+	bool			send_busy;	//!< A thread is writing replies to the socket.
+
+	uint64_t		recv_batches;	//!< Calls to recvmmsg() which returned packets.
+	uint64_t		recv_batch_packets;	//!< Packets read by recvmmsg().
+	uint32_t		recv_batch_max;	//!< Most packets read by one call.
+	uint64_t		send_batches;	//!< Calls to sendmmsg().
+	uint64_t		send_batch_packets;	//!< Replies written by sendmmsg().
+	uint32_t		send_batch_max;	//!< Most replies written by one call.
+#endif
 } listen_socket_t;
 
 int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_name);
@@ -78,10 +78,61 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
 #endif
 
+/* md5_multi.c */
+#define FR_MD5_MULTI_MAX	(8)		//!< Most lanes used by any fr_md5_multi() engine.
+
+/** A message for fr_md5_multi()
+ *
+ * The message is the concatenation of in[0] and in[1], so a packet and
+ * a shared secret can be hashed without copying them together.
+ */
+typedef struct fr_md5_multi_t {
+	uint32_t	state[4];			//!< MD5 state.
+	uint64_t	done;				//!< Bytes hashed into state by fr_md5_multi_init().
+	uint8_t const	*in[2];				//!< Data to hash.
+	size_t		inlen[2];			//!< Length of each input.
+	uint8_t		digest[MD5_DIGEST_LENGTH];	//!< Written by fr_md5_multi().
+} fr_md5_multi_t;
+
+void	fr_md5_multi_init(fr_md5_multi_t *m, uint8_t const *prefix);
+void	fr_md5_multi(fr_md5_multi_t *m, unsigned int num);
+char const *fr_md5_multi_engine(void);
+
 /* hmac.c */
+
+/** HMAC-MD5 state after the key has been absorbed
+ *
+ * Each of the padded keys is a full MD5 block, so calculating them once
+ * for a key which is used many times saves two MD5 transforms per HMAC.
+ */
+typedef struct fr_hmac_md5_key_t {
+	FR_MD5_CTX	inner;			//!< After absorbing K XOR ipad.
+	FR_MD5_CTX	outer;			//!< After absorbing K XOR opad.
+	fr_md5_multi_t	inner_multi;		//!< The same, for fr_md5_multi().
+	fr_md5_multi_t	outer_multi;
+} fr_hmac_md5_key_t;
+
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
+void	fr_hmac_md5_key_init(fr_hmac_md5_key_t *hkey, uint8_t const *key, size_t key_len);
+void	fr_hmac_md5_key(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			fr_hmac_md5_key_t const *hkey)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
+
+/* radius.c */
+
+/** Pre-computed HMAC-MD5 key for a RADIUS shared secret
+ *
+ * @see fr_radius_secret
+ */
+typedef struct fr_radius_secret_t {
+	char		*secret;		//!< Copy of the secret, NULL if not cached.
+	size_t		len;			//!< Length of the secret.
+	fr_hmac_md5_key_t hmac;			//!< Message-Authenticator key.
+} fr_radius_secret_t;
+
+fr_radius_secret_t const *fr_radius_secret(fr_radius_secret_t *tmp, char const *secret);
 
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
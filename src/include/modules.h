@@ -183,6 +183,21 @@ rlm_rcode_t	process_send_coa(int type, REQUEST *request);
 #endif
 
 rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request);
+rlm_rcode_t indexed_modcall_async(rlm_components_t comp, int idx, REQUEST *request);
+rlm_rcode_t indexed_modcall_resume(REQUEST *request, rlm_components_t *comp, int *idx);
+
+/*
+ *	Let modules wait for I/O without holding on to a thread
+ */
+typedef rlm_rcode_t (*modcall_resume_t)(REQUEST *request, void *instance, void *ctx);
+typedef void (*modcall_cancel_t)(REQUEST *request, void *ctx);
+
+rlm_rcode_t	modcall_yield(REQUEST *request, modcall_resume_t resume, modcall_cancel_t cancel, void *ctx)
+		CC_HINT(nonnull(1,2));
+void		modcall_signal(REQUEST *request) CC_HINT(nonnull);
+bool		modcall_park(REQUEST *request) CC_HINT(nonnull);
+void		modcall_cancel(REQUEST *request) CC_HINT(nonnull);
+void		modcall_cancel_all(void);
 
 int virtual_servers_bootstrap(CONF_SECTION *config);
 int virtual_servers_init(CONF_SECTION *config);
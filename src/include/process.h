@@ -53,11 +53,27 @@ typedef	void (*fr_request_process_t)(REQUEST *, int);
 
 extern time_t fr_start_time;
 
+/** Statistics for the talloc pools which hold requests
+ *
+ */
+typedef struct request_pool_stats_t {
+	uint32_t		size;		//!< Size of the pools being allocated now.
+	uint32_t		p95;		//!< 95th percentile of the sampled usage.
+	uint64_t		sampled;	//!< Number of pools which were measured.
+	uint64_t		overflows;	//!< Number of sampled pools which were too small.
+	size_t			max;		//!< Largest sampled usage.
+} request_pool_stats_t;
+
+TALLOC_CTX *request_pool_alloc(void);
+void request_pool_stats_get(request_pool_stats_t *stats);
+
 /*
  *	In threads.c
  */
 int request_enqueue(REQUEST *request);
 
+void request_resume(REQUEST *request);
+
 int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *packet,
 		    RADCLIENT *client, RAD_REQUEST_FUNP fun);
 
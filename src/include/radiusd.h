@@ -31,6 +31,7 @@ RCSIDH(radiusd_h, "$Id$")
 #include <freeradius-devel/event.h>
 
 typedef struct rad_request REQUEST;
+typedef struct modcall_yield_t modcall_yield_t;
 
 #include <freeradius-devel/log.h>
 
@@ -91,8 +92,9 @@ typedef enum rlm_rcodes {
 	RLM_MODULE_NOOP,	//!< Module succeeded without doing anything.
 	RLM_MODULE_UPDATED,	//!< OK (pairs modified).
 	RLM_MODULE_NUMCODES,	//!< How many valid return codes there are.
-	RLM_MODULE_UNKNOWN	//!< Error resolving rcode (should not be
+	RLM_MODULE_UNKNOWN,	//!< Error resolving rcode (should not be
 				//!< returned by modules).
+	RLM_MODULE_YIELD	//!< Module is waiting for I/O, see modcall_yield().
 } rlm_rcode_t;
 extern const FR_NAME_NUMBER modreturn_table[];
 
@@ -148,6 +150,8 @@ typedef struct main_config {
 	struct timeval	init_delay;			//!< Initial request processing delay.
 
 	uint32_t       	talloc_pool_size;		//!< Size of pool to allocate to hold each #REQUEST.
+	bool		timer_wheel;			//!< Use a timer wheel for the main event list.
+	uint32_t	regex_cache_size;		//!< Maximum number of runtime compiled regexes to cache.
 	bool		debug_memory;			//!< Cleanup the server properly on exit, freeing
 							//!< up any memory we allocated.
 	bool		memory_report;			//!< Print a memory report on what's left unfreed.
@@ -258,6 +262,9 @@ struct rad_request {
 	rad_child_state_t	child_state;
 
 	pthread_t    		child_pid;	//!< Current thread handling the request.
+	bool			can_park;	//!< Set when the request is being run by a worker thread,
+						//!< which may give it up while a module waits for I/O.
+	modcall_yield_t		*yield;		//!< Interpreter state, whilst a module is waiting for I/O.
 
 	main_config_t		*root;		//!< Pointer to the main config hack to try and deal with hup.
 
@@ -466,6 +473,26 @@ void	regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value,
 
 int	regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t num);
 
+/*
+ *	Cache of expressions compiled at runtime.
+ */
+typedef struct regex_cache_stats {
+	uint32_t	max_entries;		//!< Maximum number of expressions in the cache.
+	uint32_t	entries;		//!< Expressions currently in the cache.
+	uint64_t	hits;			//!< Lookups which found a compiled expression.
+	uint64_t	misses;			//!< Lookups which had to compile the expression.
+	uint64_t	evictions;		//!< Expressions removed to make room for new ones.
+} regex_cache_stats_t;
+
+ssize_t	regex_cache_compile(REQUEST *request, regex_t **out, char const *pattern, size_t len,
+			    bool ignore_case, bool multiline);
+
+void	regex_cache_release(regex_t *preg);
+
+void	regex_cache_max_entries_set(uint32_t max_entries);
+
+void	regex_cache_stats_get(regex_cache_stats_t *stats);
+
 /*
  *	Named capture groups only supported by PCRE.
  */
@@ -592,6 +619,7 @@ int radius_event_start(bool spawn_flag);
 void radius_event_free(void);
 int radius_event_process(void);
 void radius_update_listener(rad_listen_t *listener);
+int radius_event_thread_start(rad_listen_t *listener);
 void revive_home_server(void *ctx, struct timeval *now);
 void mark_home_server_dead(home_server_t *home, struct timeval *when);
 
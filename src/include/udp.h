@@ -52,6 +52,25 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+#ifdef WITH_UDP_MMSG
+udp_mmsg_t *udp_mmsg_alloc(TALLOC_CTX *ctx, unsigned int size, size_t max_len);
+
+unsigned int udp_mmsg_num(udp_mmsg_t const *mm);
+
+int udp_recv_mmsg(int sockfd, udp_mmsg_t *mm);
+
+ssize_t udp_mmsg_get(udp_mmsg_t *mm, unsigned int i, uint8_t **data,
+		     fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		     fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		     struct timeval *when);
+
+int udp_mmsg_add(int sockfd, udp_mmsg_t *mm, void const *data, size_t data_len,
+		 fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
+		 fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
+
+int udp_send_mmsg(int sockfd, udp_mmsg_t *mm);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,7 +32,17 @@ extern "C" {
 #endif
 
 #ifdef WITH_UDPFROMTO
+/*
+ *	Size of the buffer needed to hold the control data for a
+ *	single message.
+ */
+#define UDPFROMTO_CMSG_LEN	256
+
 int udpfromto_init(int s);
+void udpfromto_cmsg_recv(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen,
+			 int *if_index, struct timeval *when);
+int udpfromto_cmsg_send(int s, struct msghdr *msgh, char *cbuf,
+			struct sockaddr *from, socklen_t fromlen, int if_index);
 int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t *fromlen,
 	       struct sockaddr *to, socklen_t *tolen,
@@ -84,6 +84,8 @@ ssize_t radius_axlat_struct(char **out, REQUEST *request, xlat_exp_t const *xlat
 
 ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head, char const **error);
 
+int		xlat_compiled_add(char const *fmt, char *tokens, xlat_exp_t *head);
+
 size_t xlat_snprint(char *buffer, size_t bufsize, xlat_exp_t const *node);
 
 #define XLAT_DEFAULT_BUF_LEN	2048
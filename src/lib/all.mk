@@ -20,6 +20,7 @@ SOURCES		:= cbuff.c \
 		   missing.c \
 		   md4.c \
 		   md5.c \
+		   md5_multi.c \
 		   net.c \
 		   pair.c \
 		   pcap.c \
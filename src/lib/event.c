@@ -37,6 +37,14 @@ RCSID("$Id$")
 #endif
 #endif	/* HAVE_KQUEUE */
 
+/*
+ *	Prefer kqueue, then epoll, then select.
+ */
+#if !defined(HAVE_KQUEUE) && defined(HAVE_EPOLL_CREATE1) && defined(HAVE_SYS_EPOLL_H)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 typedef struct fr_event_fd_t {
 	int			fd;
 	fr_event_fd_handler_t	handler;
@@ -45,11 +53,51 @@ typedef struct fr_event_fd_t {
 
 #define FR_EV_MAX_FDS (256)
 
+/*
+ *	With epoll there's no limit on the number of FDs.  The table
+ *	of readers is indexed by FD, and grows as needed.  This is
+ *	just the maximum number of events we process per call to
+ *	epoll_wait().
+ */
+#define FR_EV_MAX_EVENTS (256)
+
 #undef USEC
 #define USEC (1000000)
 
+/*
+ *	The timer wheel has FR_EV_WHEEL_LEVELS levels of
+ *	FR_EV_WHEEL_SIZE slots.  Level 0 has one slot per tick, level
+ *	1 one slot per FR_EV_WHEEL_SIZE ticks, and so on.  With the
+ *	default 1ms tick, level 0 covers 256ms and level 3 about 49
+ *	days.  Anything further out is parked in level 3, and
+ *	re-placed when its slot is cascaded.
+ */
+#define FR_EV_WHEEL_BITS	(8)
+#define FR_EV_WHEEL_SIZE	(1 << FR_EV_WHEEL_BITS)
+#define FR_EV_WHEEL_MASK	(FR_EV_WHEEL_SIZE - 1)
+#define FR_EV_WHEEL_LEVELS	(4)
+#define FR_EV_WHEEL_MAX		(((uint64_t) 1 << (FR_EV_WHEEL_BITS * FR_EV_WHEEL_LEVELS)) - 1)
+#define FR_EV_WHEEL_TICK	(1000)
+
+#define FR_EV_WHEEL_EXPIRED	(-1)
+
+typedef struct fr_event_wheel_t {
+	uint32_t	tick;			//!< Length of a tick in microseconds.
+	struct timespec	origin;			//!< Monotonic time of tick 0.
+	uint64_t	now;			//!< Monotonic microseconds since origin, taken with el->now.
+	uint64_t	current;		//!< Next tick to process.  Earlier ticks have been run.
+	int		num_events;
+
+	uint64_t	occupied[FR_EV_WHEEL_SIZE / 64];	//!< Which level 0 slots have events.
+	fr_event_t	*slots[FR_EV_WHEEL_LEVELS][FR_EV_WHEEL_SIZE];
+
+	fr_event_t	*expired;		//!< Events which are due, oldest first.
+	fr_event_t	**expired_tail;
+} fr_event_wheel_t;
+
 struct fr_event_list_t {
 	fr_heap_t	*times;
+	fr_event_wheel_t *wheel;	//!< If set, timers are kept here instead of "times".
 
 	int		exit;
 
@@ -59,16 +107,26 @@ struct fr_event_list_t {
 	bool		dispatch;
 
 	int		num_readers;
-#ifndef HAVE_KQUEUE
-	int		max_readers;
+#ifdef HAVE_KQUEUE
+	int		kq;
+	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
+	fr_event_fd_t	readers[FR_EV_MAX_FDS];
 
-	bool		changed;
+#elif defined(HAVE_EPOLL)
+	int		epfd;
+	int		num_events;	//!< Number of events returned by the last epoll_wait().
+	int		event_idx;	//!< The event currently being serviced.
+	struct epoll_event events[FR_EV_MAX_EVENTS];
+
+	int		max_readers;	//!< Number of entries in the readers table.
+	fr_event_fd_t	*readers;	//!< Indexed by FD.
 
 #else
-	int		kq;
-	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
-#endif
+	int		max_readers;
+
+	bool		changed;
 	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+#endif
 };
 
 /*
@@ -80,6 +138,11 @@ struct fr_event_t {
 	struct timeval		when;
 	fr_event_t		**parent;
 	int			heap;
+
+	uint64_t		expires;	//!< Tick when the event is due (wheel only).
+	int			slot;		//!< level * FR_EV_WHEEL_SIZE + index, or FR_EV_WHEEL_EXPIRED.
+	fr_event_t		*next;		//!< Next event in the same slot.
+	fr_event_t		**prev_next;	//!< What points to us.
 };
 
 
@@ -98,6 +161,231 @@ static int fr_event_list_time_cmp(void const *one, void const *two)
 }
 
 
+/*
+ *	Take a snapshot of the current time.  The wall clock time is
+ *	what callers see, the monotonic time drives the timer wheel.
+ */
+static void wheel_snapshot(fr_event_list_t *el)
+{
+	struct timespec ts;
+	int64_t usec;
+
+	gettimeofday(&el->now, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	usec = (int64_t) (ts.tv_sec - el->wheel->origin.tv_sec) * USEC;
+	usec += (ts.tv_nsec - el->wheel->origin.tv_nsec) / 1000;
+	el->wheel->now = (usec < 0) ? 0 : usec;
+}
+
+/*
+ *	Find the first non-empty slot in level 0, starting at "idx".
+ *	Returns FR_EV_WHEEL_SIZE if there are none.
+ */
+static unsigned int wheel_next_slot(fr_event_wheel_t *wheel, unsigned int idx)
+{
+	while (idx < FR_EV_WHEEL_SIZE) {
+		uint64_t bits = wheel->occupied[idx / 64] >> (idx & 63);
+
+		if (bits) return idx + __builtin_ctzll(bits);
+
+		idx = (idx | 63) + 1;
+	}
+
+	return FR_EV_WHEEL_SIZE;
+}
+
+static void wheel_unlink(fr_event_wheel_t *wheel, fr_event_t *ev)
+{
+	*ev->prev_next = ev->next;
+	if (ev->next) {
+		ev->next->prev_next = ev->prev_next;
+
+	} else if (ev->slot == FR_EV_WHEEL_EXPIRED) {
+		wheel->expired_tail = ev->prev_next;
+	}
+
+	if ((ev->slot >= 0) && (ev->slot < FR_EV_WHEEL_SIZE) && !wheel->slots[0][ev->slot]) {
+		wheel->occupied[ev->slot / 64] &= ~((uint64_t) 1 << (ev->slot & 63));
+	}
+
+	ev->next = NULL;
+	ev->prev_next = NULL;
+}
+
+static void wheel_expire(fr_event_wheel_t *wheel, fr_event_t *ev)
+{
+	ev->slot = FR_EV_WHEEL_EXPIRED;
+	ev->next = NULL;
+	ev->prev_next = wheel->expired_tail;
+	*wheel->expired_tail = ev;
+	wheel->expired_tail = &ev->next;
+}
+
+/*
+ *	Put an event into the slot for its expiry time.  This is O(1).
+ *	Events which fall into the same tick share a slot, and are run
+ *	together.
+ */
+static void wheel_place(fr_event_wheel_t *wheel, fr_event_t *ev)
+{
+	uint64_t	expires = ev->expires, delta;
+	int		level, idx;
+	fr_event_t	**head;
+
+	if (expires < wheel->current) {
+		wheel_expire(wheel, ev);
+		return;
+	}
+
+	delta = expires - wheel->current;
+	if (delta > FR_EV_WHEEL_MAX) {
+		expires = wheel->current + FR_EV_WHEEL_MAX;
+		delta = FR_EV_WHEEL_MAX;
+	}
+
+	for (level = 0; level < (FR_EV_WHEEL_LEVELS - 1); level++) {
+		if (delta < ((uint64_t) 1 << (FR_EV_WHEEL_BITS * (level + 1)))) break;
+	}
+
+	idx = (expires >> (FR_EV_WHEEL_BITS * level)) & FR_EV_WHEEL_MASK;
+	head = &wheel->slots[level][idx];
+
+	ev->slot = (level * FR_EV_WHEEL_SIZE) + idx;
+	ev->next = *head;
+	if (ev->next) ev->next->prev_next = &ev->next;
+	ev->prev_next = head;
+	*head = ev;
+
+	if (level == 0) wheel->occupied[idx / 64] |= ((uint64_t) 1 << (idx & 63));
+}
+
+/*
+ *	We're at the start of a new level 0 rotation.  Move the events
+ *	from the matching slots in the higher levels down.
+ */
+static void wheel_cascade(fr_event_wheel_t *wheel)
+{
+	int level;
+
+	for (level = 1; level < FR_EV_WHEEL_LEVELS; level++) {
+		int		idx;
+		fr_event_t	*ev, *next;
+
+		idx = (wheel->current >> (FR_EV_WHEEL_BITS * level)) & FR_EV_WHEEL_MASK;
+
+		ev = wheel->slots[level][idx];
+		wheel->slots[level][idx] = NULL;
+
+		for (; ev != NULL; ev = next) {
+			next = ev->next;
+			wheel_place(wheel, ev);
+		}
+
+		if (idx != 0) break;
+	}
+}
+
+/*
+ *	Move every event due at or before "now" onto the expired list.
+ *	Empty slots are skipped using the occupancy bitmap.
+ */
+static void wheel_advance(fr_event_wheel_t *wheel, uint64_t now)
+{
+	while (wheel->current <= now) {
+		unsigned int	idx = wheel->current & FR_EV_WHEEL_MASK;
+		unsigned int	next;
+		fr_event_t	*ev;
+
+		if (idx == 0) wheel_cascade(wheel);
+
+		ev = wheel->slots[0][idx];
+		if (ev) {
+			wheel->slots[0][idx] = NULL;
+			wheel->occupied[idx / 64] &= ~((uint64_t) 1 << (idx & 63));
+
+			ev->prev_next = wheel->expired_tail;
+			*wheel->expired_tail = ev;
+			while (ev) {
+				ev->slot = FR_EV_WHEEL_EXPIRED;
+				wheel->expired_tail = &ev->next;
+				ev = ev->next;
+			}
+		}
+
+		/*
+		 *	Jump to the next slot with events, or the next
+		 *	rotation, but not past "now".  Events inserted
+		 *	later for earlier ticks would otherwise be
+		 *	treated as already expired.
+		 */
+		next = wheel_next_slot(wheel, idx + 1);
+		wheel->current += next - idx;
+		if (wheel->current > (now + 1)) wheel->current = now + 1;
+	}
+}
+
+/*
+ *	Return how long until we next need to service the wheel.
+ */
+static bool wheel_timeout(fr_event_list_t *el, struct timeval *when)
+{
+	fr_event_wheel_t	*wheel = el->wheel;
+	uint64_t		now, target, usec;
+
+	if (wheel->num_events == 0) return false;
+
+	timerclear(when);
+	if (wheel->expired) return true;
+
+	wheel_snapshot(el);
+	now = wheel->now / wheel->tick;
+
+	/*
+	 *	If we're at the start of a rotation, the higher levels
+	 *	haven't been cascaded yet, so we need to wake up then.
+	 *	Otherwise we wake up for the next level 0 slot, or
+	 *	at the end of the rotation.
+	 */
+	target = wheel->current;
+	if ((target & FR_EV_WHEEL_MASK) != 0) {
+		target -= (target & FR_EV_WHEEL_MASK);
+		target += wheel_next_slot(wheel, wheel->current & FR_EV_WHEEL_MASK);
+	}
+	if (target <= now) return true;
+
+	usec = ((target * wheel->tick) > wheel->now) ? (target * wheel->tick) - wheel->now : 0;
+	when->tv_sec = usec / USEC;
+	when->tv_usec = usec % USEC;
+
+	return true;
+}
+
+/*
+ *	Run every timer which is due.
+ */
+static void wheel_run(fr_event_list_t *el)
+{
+	fr_event_wheel_t *wheel = el->wheel;
+
+	wheel_snapshot(el);
+	wheel_advance(wheel, wheel->now / wheel->tick);
+
+	while (wheel->expired) {
+		fr_event_callback_t	callback;
+		void			*ctx;
+		fr_event_t		*ev = wheel->expired;
+		struct timeval		when = el->now;
+
+		callback = ev->callback;
+		ctx = ev->ctx;
+
+		fr_event_delete(el, ev->parent);
+
+		callback(ctx, &when);
+	}
+}
+
 static int _event_list_free(fr_event_list_t *list)
 {
 	fr_event_list_t *el = list;
@@ -107,10 +395,24 @@ static int _event_list_free(fr_event_list_t *list)
 		fr_event_delete(el, &ev);
 	}
 
+	if (el->wheel) {
+		int i, j;
+
+		while ((ev = el->wheel->expired) != NULL) fr_event_delete(el, ev->parent);
+
+		for (i = 0; i < FR_EV_WHEEL_LEVELS; i++) {
+			for (j = 0; j < FR_EV_WHEEL_SIZE; j++) {
+				while ((ev = el->wheel->slots[i][j]) != NULL) fr_event_delete(el, ev->parent);
+			}
+		}
+	}
+
 	fr_heap_delete(el->times);
 
 #ifdef HAVE_KQUEUE
 	close(el->kq);
+#elif defined(HAVE_EPOLL)
+	close(el->epfd);
 #endif
 
 	return 0;
@@ -134,19 +436,37 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 		return NULL;
 	}
 
+#ifdef HAVE_EPOLL
+	el->max_readers = FR_EV_MAX_FDS;
+	el->readers = talloc_array(el, fr_event_fd_t, el->max_readers);
+	if (!el->readers) {
+		talloc_free(el);
+		return NULL;
+	}
+	el->epfd = -1;
+#endif
+
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
 	}
 
-#ifndef HAVE_KQUEUE
-	el->changed = true;	/* force re-set of fds's */
-
-#else
+#ifdef HAVE_KQUEUE
 	el->kq = kqueue();
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
 	}
+
+#elif defined(HAVE_EPOLL)
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (el->epfd < 0) {
+		fr_strerror_printf("Failed creating epoll FD: %s", fr_syserror(errno));
+		talloc_free(el);
+		return NULL;
+	}
+
+#else
+	el->changed = true;	/* force re-set of fds's */
 #endif
 
 	el->status = status;
@@ -154,6 +474,57 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 	return el;
 }
 
+/** Use a timer wheel instead of a heap for timer events
+ *
+ * Inserting and deleting events is O(1) instead of O(log n), and events
+ * which fall into the same tick are run together.  Expiry is driven by
+ * the monotonic clock, so changes to the system time don't cause timers
+ * to fire early or late.  The cost is that timers may fire up to one tick
+ * late.
+ *
+ * Times passed to #fr_event_insert are still wall clock times.  They are
+ * converted to monotonic time when the event is inserted.
+ *
+ * Must be called before any events are inserted.
+ *
+ * @param[in] el	to change.
+ * @param[in] tick	resolution of the wheel in microseconds.  0 means
+ *			use the default of 1ms.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_timer_wheel(fr_event_list_t *el, uint32_t tick)
+{
+	fr_event_wheel_t *wheel;
+
+	if (!el) {
+		fr_strerror_printf("Invalid arguments (NULL event list)");
+		return -1;
+	}
+
+	if (el->wheel) return 0;
+
+	if (fr_heap_num_elements(el->times) > 0) {
+		fr_strerror_printf("Can't switch to a timer wheel when events have been inserted");
+		return -1;
+	}
+
+	wheel = talloc_zero(el, fr_event_wheel_t);
+	if (!wheel) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	wheel->tick = tick ? tick : FR_EV_WHEEL_TICK;
+	wheel->expired_tail = &wheel->expired;
+	clock_gettime(CLOCK_MONOTONIC, &wheel->origin);
+
+	el->wheel = wheel;
+
+	return 0;
+}
+
 int fr_event_list_num_fds(fr_event_list_t *el)
 {
 	if (!el) return 0;
@@ -165,6 +536,8 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return 0;
 
+	if (el->wheel) return el->wheel->num_events;
+
 	return fr_heap_num_elements(el->times);
 }
 
@@ -193,6 +566,13 @@ int fr_event_delete(fr_event_list_t *el, fr_event_t **parent)
 	}
 	*parent = NULL;
 
+	if (el->wheel) {
+		wheel_unlink(el->wheel, ev);
+		el->wheel->num_events--;
+		talloc_free(ev);
+		return 1;
+	}
+
 	ret = fr_heap_extract(el->times, ev);
 	(void)fr_cond_assert(ret == 1);	/* events MUST be in the heap */
 	talloc_free(ev);
@@ -239,8 +619,13 @@ int fr_event_insert(fr_event_list_t *el, fr_event_callback_t callback, void *ctx
 		ev = *parent;
 #endif
 
-		ret = fr_heap_extract(el->times, ev);
-		if (!fr_cond_assert(ret == 1)) return 0;	/* events MUST be in the heap */
+		if (el->wheel) {
+			wheel_unlink(el->wheel, ev);
+			el->wheel->num_events--;
+		} else {
+			ret = fr_heap_extract(el->times, ev);
+			if (!fr_cond_assert(ret == 1)) return 0;	/* events MUST be in the heap */
+		}
 
 		memset(ev, 0, sizeof(*ev));
 	} else {
@@ -253,6 +638,30 @@ int fr_event_insert(fr_event_list_t *el, fr_event_callback_t callback, void *ctx
 	ev->when = *when;
 	ev->parent = parent;
 
+	if (el->wheel) {
+		fr_event_wheel_t	*wheel = el->wheel;
+		int64_t			delta;
+
+		/*
+		 *	Convert the wall clock time to monotonic
+		 *	ticks, rounding up so that we never run an
+		 *	event early.  While dispatching, the snapshot
+		 *	taken at the start of the loop is used.
+		 */
+		if (!el->dispatch) wheel_snapshot(el);
+
+		delta = (int64_t) (when->tv_sec - el->now.tv_sec) * USEC;
+		delta += when->tv_usec - el->now.tv_usec;
+		if (delta < 0) delta = 0;
+
+		ev->expires = (wheel->now + delta + wheel->tick - 1) / wheel->tick;
+		wheel_place(wheel, ev);
+		wheel->num_events++;
+
+		*parent = ev;
+		return 1;
+	}
+
 	if (!fr_heap_insert(el->times, ev)) {
 		talloc_free(ev);
 		return 0;
@@ -271,6 +680,41 @@ int fr_event_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
+	/*
+	 *	With a timer wheel, "when" is ignored on input.  The
+	 *	wheel uses its own clock.
+	 */
+	if (el->wheel) {
+		fr_event_wheel_t *wheel = el->wheel;
+
+		if (!wheel->expired) {
+			wheel_snapshot(el);
+			wheel_advance(wheel, wheel->now / wheel->tick);
+		}
+
+		ev = wheel->expired;
+		if (!ev) {
+			struct timeval delay;
+
+			if (!wheel_timeout(el, &delay)) {
+				timerclear(when);
+				return 0;
+			}
+
+			timeradd(&el->now, &delay, when);
+			return 0;
+		}
+
+		callback = ev->callback;
+		ctx = ev->ctx;
+
+		fr_event_delete(el, ev->parent);
+
+		*when = el->now;
+		callback(ctx, when);
+		return 1;
+	}
+
 	if (fr_heap_num_elements(el->times) == 0) {
 		when->tv_sec = 0;
 		when->tv_usec = 0;
@@ -352,10 +796,12 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		return 0;
 	}
 
+#ifndef HAVE_EPOLL
 	if (el->num_readers >= FR_EV_MAX_FDS) {
 		fr_strerror_printf("Too many readers");
 		return 0;
 	}
+#endif
 	ef = NULL;
 
 #ifdef HAVE_KQUEUE
@@ -396,6 +842,69 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		break;
 	}
 
+#elif defined(HAVE_EPOLL)
+	/*
+	 *	The table is indexed by FD, so there's no searching.
+	 *	FDs are allocated lowest first, so the table is only
+	 *	as large as the highest FD we've seen.
+	 */
+	if (fd >= el->max_readers) {
+		fr_event_fd_t	*readers;
+		int		max_readers = el->max_readers;
+
+		while (max_readers <= fd) max_readers *= 2;
+
+		readers = talloc_realloc(el, el->readers, fr_event_fd_t, max_readers);
+		if (!readers) {
+			fr_strerror_printf("Out of memory");
+			return 0;
+		}
+
+		for (i = el->max_readers; i < max_readers; i++) {
+			readers[i].fd = -1;
+		}
+
+		el->readers = readers;
+		el->max_readers = max_readers;
+	}
+
+	/*
+	 *	Be fail-safe on multiple inserts.
+	 */
+	if (el->readers[fd].fd == fd) {
+		if ((el->readers[fd].handler != handler) ||
+		    (el->readers[fd].ctx != ctx)) {
+			fr_strerror_printf("Multiple handlers for same FD");
+			return 0;
+		}
+
+		/*
+		 *	No change.
+		 */
+		return 1;
+	}
+
+	{
+		struct epoll_event evset;
+
+		/*
+		 *	Level triggered, so that handlers which read
+		 *	one packet at a time will be called again
+		 *	if there's more data.
+		 */
+		memset(&evset, 0, sizeof(evset));
+		evset.events = EPOLLIN;
+		evset.data.fd = fd;
+
+		if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &evset) < 0) {
+			fr_strerror_printf("Failed inserting event for FD %i: %s", fd, fr_syserror(errno));
+			return 0;
+		}
+	}
+
+	ef = &el->readers[fd];
+	el->num_readers++;
+
 #else  /* HAVE_KQUEUE */
 
 	for (i = 0; i <= el->max_readers; i++) {
@@ -434,7 +943,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 	ef->handler = handler;
 	ef->ctx = ctx;
 
-#ifndef HAVE_KQUEUE
+#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
 	el->changed = true;
 #endif
 
@@ -474,6 +983,35 @@ int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 		return 1;
 	}
 
+#elif defined(HAVE_EPOLL)
+	if ((fd >= el->max_readers) || (el->readers[fd].fd != fd)) return 0;
+
+	/*
+	 *	The caller MAY have closed it, in which case the
+	 *	kernel has removed it from the list.  So we ignore
+	 *	the return code from epoll_ctl().
+	 */
+	{
+		struct epoll_event evset;
+
+		memset(&evset, 0, sizeof(evset));
+		(void) epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, &evset);
+	}
+
+	/*
+	 *	If we're in the middle of servicing events, make sure
+	 *	that any pending events for this FD are ignored.  The
+	 *	FD number may be re-used before we get to them.
+	 */
+	for (i = el->event_idx + 1; i < el->num_events; i++) {
+		if (el->events[i].data.fd == fd) el->events[i].data.fd = -1;
+	}
+
+	el->readers[fd].fd = -1;
+	el->num_readers--;
+
+	return 1;
+
 #else
 
 	for (i = 0; i < el->max_readers; i++) {
@@ -510,6 +1048,8 @@ int fr_event_loop(fr_event_list_t *el)
 	struct timeval when, *wake;
 #ifdef HAVE_KQUEUE
 	struct timespec ts_when, *ts_wake;
+#elif defined(HAVE_EPOLL)
+	int timeout;
 #else
 	int maxfd = 0;
 	fd_set read_fds, master_fds;
@@ -521,7 +1061,7 @@ int fr_event_loop(fr_event_list_t *el)
 	el->dispatch = true;
 
 	while (!el->exit) {
-#ifndef HAVE_KQUEUE
+#if !defined(HAVE_KQUEUE) && !defined(HAVE_EPOLL)
 		/*
 		 *	Cache the list of FD's to watch.
 		 */
@@ -551,7 +1091,10 @@ int fr_event_loop(fr_event_list_t *el)
 		when.tv_sec = 0;
 		when.tv_usec = 0;
 
-		if (fr_heap_num_elements(el->times) > 0) {
+		if (el->wheel) {
+			wake = wheel_timeout(el, &when) ? &when : NULL;
+
+		} else if (fr_heap_num_elements(el->times) > 0) {
 			fr_event_t *ev;
 
 			ev = fr_heap_peek(el->times);
@@ -591,17 +1134,7 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->status) el->status(wake);
 
-#ifndef HAVE_KQUEUE
-		read_fds = master_fds;
-		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
-		if ((rcode < 0) && (errno != EINTR)) {
-			fr_strerror_printf("Failed in select: %s", fr_syserror(errno));
-			el->dispatch = false;
-			return -1;
-		}
-
-#else  /* HAVE_KQUEUE */
-
+#ifdef HAVE_KQUEUE
 		if (wake) {
 			ts_wake = &ts_when;
 			ts_when.tv_sec = when.tv_sec;
@@ -611,9 +1144,45 @@ int fr_event_loop(fr_event_list_t *el)
 		}
 
 		rcode = kevent(el->kq, NULL, 0, el->events, FR_EV_MAX_FDS, ts_wake);
+
+#elif defined(HAVE_EPOLL)
+		/*
+		 *	epoll only does milliseconds.  Round up, so
+		 *	that we don't wake up just before the event
+		 *	is due, and spin.
+		 */
+		if (wake) {
+			timeout = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+		} else {
+			timeout = -1;
+		}
+
+		el->num_events = 0;
+		rcode = epoll_wait(el->epfd, el->events, FR_EV_MAX_EVENTS, timeout);
+		if ((rcode < 0) && (errno != EINTR)) {
+			fr_strerror_printf("Failed in epoll_wait: %s", fr_syserror(errno));
+			el->dispatch = false;
+			return -1;
+		}
+
+#else
+		read_fds = master_fds;
+		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+		if ((rcode < 0) && (errno != EINTR)) {
+			fr_strerror_printf("Failed in select: %s", fr_syserror(errno));
+			el->dispatch = false;
+			return -1;
+		}
 #endif	/* HAVE_KQUEUE */
 
-		if (fr_heap_num_elements(el->times) > 0) {
+		/*
+		 *	The wheel takes one timestamp, and runs
+		 *	everything which is due as a batch.
+		 */
+		if (el->wheel) {
+			if (el->wheel->num_events > 0) wheel_run(el);
+
+		} else if (fr_heap_num_elements(el->times) > 0) {
 			do {
 				gettimeofday(&el->now, NULL);
 				when = el->now;
@@ -622,7 +1191,36 @@ int fr_event_loop(fr_event_list_t *el)
 
 		if (rcode <= 0) continue;
 
-#ifndef HAVE_KQUEUE
+#ifdef HAVE_EPOLL
+		/*
+		 *	Loop over the events.  Handlers may delete
+		 *	FDs, which marks any of their events which
+		 *	we haven't got to yet as invalid.
+		 */
+		el->num_events = rcode;
+		for (i = 0; i < el->num_events; i++) {
+			fr_event_fd_t *ef;
+			int fd = el->events[i].data.fd;
+
+			if (fd < 0) continue;
+
+			el->event_idx = i;
+
+			/*
+			 *	EPOLLHUP and EPOLLERR are always
+			 *	reported.  Call the handler, which
+			 *	SHOULD notice the error, and delete
+			 *	the connection.
+			 */
+			ef = &el->readers[fd];
+			if (ef->fd != fd) continue;
+
+			ef->handler(el, ef->fd, ef->ctx);
+		}
+		el->num_events = 0;
+		el->event_idx = 0;
+
+#elif !defined(HAVE_KQUEUE)
 		/*
 		 *	Loop over all of the sockets to see if there's
 		 *	an event for that socket.
@@ -679,10 +1277,16 @@ int fr_event_loop(fr_event_list_t *el)
 #ifdef TESTING
 
 /*
- *  cc -g -I .. -c rbtree.c -o rbtree.o && cc -g -I .. -c isaac.c -o isaac.o && cc -DTESTING -I .. -c event.c  -o event_mine.o && cc event_mine.o rbtree.o isaac.o -o event
+ *  cc -g -DTESTING -I ../include event.c -o event -lfreeradius-radius -ltalloc
  *
  *  ./event
  *
+ *  Checks that timers in the wheel cascade down its levels, and
+ *  can be deleted, then times inserts and deletes with the heap
+ *  and with the wheel.
+ *
+ *  ./event -p
+ *
  *  And hit CTRL-S to stop the output, CTRL-Q to continue.
  *  It normally alternates printing the time and sleeping,
  *  but when you hit CTRL-S/CTRL-Q, you should see a number
@@ -693,11 +1297,11 @@ int fr_event_loop(fr_event_list_t *el)
  *   valgrind --tool=memcheck --leak-check=full --show-reachable=yes ./event
  */
 
-static void print_time(void *ctx)
+static void print_time(void *ctx, UNUSED struct timeval *now)
 {
 	struct timeval *when = ctx;
 
-	printf("%d.%06d\n", when->tv_sec, when->tv_usec);
+	printf("%d.%06d\n", (int) when->tv_sec, (int) when->tv_usec);
 	fflush(stdout);
 }
 
@@ -716,23 +1320,262 @@ static uint32_t event_rand(void)
 	return num;
 }
 
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) + ((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static void when_add(struct timeval *when, struct timeval const *now, uint64_t usec)
+{
+	when->tv_sec = now->tv_sec + (usec / USEC);
+	when->tv_usec = now->tv_usec + (usec % USEC);
+	if (when->tv_usec >= USEC) {
+		when->tv_usec -= USEC;
+		when->tv_sec++;
+	}
+}
+
+/*
+ *	Make the wheel think "usec" has passed, by moving its
+ *	origin back.
+ */
+static void wheel_skip(fr_event_list_t *el, uint64_t usec)
+{
+	struct timespec *origin = &el->wheel->origin;
+
+	origin->tv_sec -= usec / USEC;
+	origin->tv_nsec -= (usec % USEC) * 1000;
+	if (origin->tv_nsec < 0) {
+		origin->tv_nsec += 1000000000;
+		origin->tv_sec--;
+	}
+}
+
+static uint64_t	fired;
+static int	num_fired;
+
+/*
+ *	Record the wheel time that the timer ran at.
+ */
+static void wheel_fired(void *ctx, UNUSED struct timeval *now)
+{
+	fr_event_list_t *el = ctx;
+
+	fired = el->wheel->now;
+	num_fired++;
+}
+
+static void wheel_run_all(fr_event_list_t *el)
+{
+	struct timeval when;
+
+	while (fr_event_run(el, &when)) {
+		/* nothing */
+	}
+}
+
+/*
+ *	Insert a timer "usec" in the future, and check that it
+ *	runs at the right time, after passing through the higher
+ *	levels of the wheel.
+ */
+static void wheel_check_cascade(uint64_t usec)
+{
+	fr_event_list_t	*el;
+	fr_event_t	*ev = NULL;
+	struct timeval	when;
+	uint64_t	start;
+
+	el = fr_event_list_create(NULL, NULL);
+	if (!el || (fr_event_list_timer_wheel(el, 0) < 0)) fr_exit(1);
+
+	num_fired = 0;
+
+	wheel_snapshot(el);
+	start = el->wheel->now;
+	when_add(&when, &el->now, usec);
+	if (!fr_event_insert(el, wheel_fired, el, &when, &ev)) {
+		fprintf(stderr, "Failed inserting timer\n");
+		fr_exit(1);
+	}
+
+	if (ev->slot < FR_EV_WHEEL_SIZE) {
+		fprintf(stderr, "Timer for +%" PRIu64 "us was put in level 0\n", usec);
+		fr_exit(1);
+	}
+
+	/*
+	 *	Just before it's due, leaving some slack for the
+	 *	real clock moving on while we run.
+	 */
+	wheel_skip(el, usec - (10 * el->wheel->tick));
+	wheel_run_all(el);
+	if (num_fired != 0) {
+		fprintf(stderr, "Timer for +%" PRIu64 "us ran %" PRIu64 "us early\n",
+			usec, usec - (fired - start));
+		fr_exit(1);
+	}
+
+	wheel_skip(el, 11 * el->wheel->tick);
+	wheel_run_all(el);
+	if ((num_fired != 1) || ev) {
+		fprintf(stderr, "Timer for +%" PRIu64 "us didn't run\n", usec);
+		fr_exit(1);
+	}
+
+	if ((fired - start) < usec) {
+		fprintf(stderr, "Timer for +%" PRIu64 "us ran at +%" PRIu64 "us\n", usec, fired - start);
+		fr_exit(1);
+	}
+
+	talloc_free(el);
+}
+
+/*
+ *	Timers in the higher levels, and past the end of the wheel,
+ *	can be deleted, and don't run once deleted.
+ */
+static void wheel_check_delete(void)
+{
+	fr_event_list_t	*el;
+	fr_event_t	*ev[4];
+	struct timeval	when;
+	uint64_t	usec[4] = {
+		(uint64_t) 300 * 1000,				/* level 1 */
+		(uint64_t) 3600 * USEC,				/* level 2 */
+		(uint64_t) 2 * 86400 * USEC,			/* level 3 */
+		(uint64_t) 60 * 86400 * USEC			/* past the end */
+	};
+	int		i;
+
+	el = fr_event_list_create(NULL, NULL);
+	if (!el || (fr_event_list_timer_wheel(el, 0) < 0)) fr_exit(1);
+
+	memset(ev, 0, sizeof(ev));
+	num_fired = 0;
+
+	wheel_snapshot(el);
+	for (i = 0; i < 4; i++) {
+		when_add(&when, &el->now, usec[i]);
+		if (!fr_event_insert(el, wheel_fired, el, &when, &ev[i])) {
+			fprintf(stderr, "Failed inserting timer\n");
+			fr_exit(1);
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		int level = (i < (FR_EV_WHEEL_LEVELS - 1)) ? i + 1 : FR_EV_WHEEL_LEVELS - 1;
+
+		if ((ev[i]->slot / FR_EV_WHEEL_SIZE) == level) continue;
+
+		fprintf(stderr, "Timer for +%" PRIu64 "us is in slot %d\n", usec[i], ev[i]->slot);
+		fr_exit(1);
+	}
+
+	/*
+	 *	Delete the timers at the far end of the wheel.
+	 */
+	fr_event_delete(el, &ev[2]);
+	fr_event_delete(el, &ev[3]);
+	if (fr_event_list_num_elements(el) != 2) {
+		fprintf(stderr, "Bad count %d after deletes\n", fr_event_list_num_elements(el));
+		fr_exit(1);
+	}
+
+	for (i = 0; i < FR_EV_WHEEL_SIZE; i++) {
+		if (!el->wheel->slots[FR_EV_WHEEL_LEVELS - 1][i]) continue;
+
+		fprintf(stderr, "Slot %d of the last level isn't empty after deletes\n", i);
+		fr_exit(1);
+	}
+
+	/*
+	 *	Run everything up to past the deleted timers.  Only
+	 *	the two remaining ones should run.
+	 */
+	for (i = 0; i < 4; i++) {
+		wheel_skip(el, usec[i] - (i ? usec[i - 1] : 0));
+		wheel_run_all(el);
+	}
+	wheel_skip(el, (uint64_t) 86400 * USEC);
+	wheel_run_all(el);
+
+	if ((num_fired != 2) || (fr_event_list_num_elements(el) != 0)) {
+		fprintf(stderr, "%d timers ran, %d left, expected 2 and 0\n",
+			num_fired, fr_event_list_num_elements(el));
+		fr_exit(1);
+	}
+
+	talloc_free(el);
+}
+
+static void bench_fired(UNUSED void *ctx, UNUSED struct timeval *now)
+{
+}
+
+#define BENCH_TIMERS	5000
+#define BENCH_OPS	(1000 * 1000)
+
+/*
+ *	Keep BENCH_TIMERS timers outstanding, and time moving a
+ *	random one to a new random time in the next 30 seconds.
+ *	Each op is one delete and one insert, which is what the
+ *	server does when a request changes state.
+ */
+static void event_bench(char const *name, bool wheel, uint32_t *rnd)
+{
+	fr_event_list_t	*el;
+	fr_event_t	**ev;
+	struct timeval	now, when, start;
+	double		secs;
+	int		i;
+
+	el = fr_event_list_create(NULL, NULL);
+	if (!el) fr_exit(1);
+	if (wheel && (fr_event_list_timer_wheel(el, 0) < 0)) fr_exit(1);
+
+	ev = talloc_zero_array(el, fr_event_t *, BENCH_TIMERS);
+	if (!ev) fr_exit(1);
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < BENCH_TIMERS; i++) {
+		when_add(&when, &now, rnd[i] % (30 * USEC));
+		if (!fr_event_insert(el, bench_fired, NULL, &when, &ev[i])) fr_exit(1);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_OPS; i++) {
+		fr_event_t **parent = &ev[rnd[i] % BENCH_TIMERS];
+
+		fr_event_delete(el, parent);
+		when_add(&when, &now, rnd[(i + BENCH_TIMERS) % BENCH_OPS] % (30 * USEC));
+		if (!fr_event_insert(el, bench_fired, NULL, &when, parent)) fr_exit(1);
+	}
+	secs = elapsed(&start);
+
+	printf("%s\tinsert+delete\t%.3fs\t%.0f ns/op\n", name, secs, (secs * 1e9) / BENCH_OPS);
+	fflush(stdout);
+
+	talloc_free(el);
+}
 
 #define MAX 100
-int main(int argc, char **argv)
+static void event_print(void)
 {
-	int i, rcode;
+	int i;
 	struct timeval array[MAX];
+	fr_event_t *ev[MAX];
 	struct timeval now, when;
 	fr_event_list_t *el;
 
 	el = fr_event_list_create(NULL, NULL);
-	if (!el) exit(1);
+	if (!el) fr_exit(1);
 
-	memset(&rand_pool, 0, sizeof(rand_pool));
-	rand_pool.randrsl[1] = time(NULL);
-
-	fr_randinit(&rand_pool, 1);
-	rand_pool.randcnt = 0;
+	memset(ev, 0, sizeof(ev));
 
 	gettimeofday(&array[0], NULL);
 	for (i = 1; i < MAX; i++) {
@@ -743,7 +1586,7 @@ int main(int argc, char **argv)
 			array[i].tv_usec -= 1000000;
 			array[i].tv_sec++;
 		}
-		fr_event_insert(el, print_time, &array[i], &array[i]);
+		fr_event_insert(el, print_time, &array[i], &array[i], &ev[i]);
 	}
 
 	while (fr_event_list_num_elements(el)) {
@@ -761,7 +1604,43 @@ int main(int argc, char **argv)
 	}
 
 	talloc_free(el);
+}
 
-	return 0;
+int main(int argc, char **argv)
+{
+	uint32_t	*rnd;
+	int		i;
+
+	memset(&rand_pool, 0, sizeof(rand_pool));
+	rand_pool.randrsl[1] = time(NULL);
+
+	fr_randinit(&rand_pool, 1);
+	rand_pool.randcnt = 0;
+
+	if ((argc > 1) && (strcmp(argv[1], "-p") == 0)) {
+		event_print();
+		fr_exit(0);
+	}
+
+	/*
+	 *	Into level 1, level 2, and level 3, and across
+	 *	level 0 rotation boundaries.
+	 */
+	wheel_check_cascade((uint64_t) 300 * 1000);
+	wheel_check_cascade((uint64_t) 65 * USEC + 537);
+	wheel_check_cascade((uint64_t) 5 * 3600 * USEC);
+	wheel_check_cascade((uint64_t) 2 * 86400 * USEC + 12345);
+	wheel_check_delete();
+
+	rnd = talloc_array(NULL, uint32_t, BENCH_OPS);
+	if (!rnd) fr_exit(1);
+	for (i = 0; i < BENCH_OPS; i++) rnd[i] = event_rand();
+
+	event_bench("heap", false, rnd);
+	event_bench("wheel", true, rnd);
+
+	talloc_free(rnd);
+
+	fr_exit(0);
 }
 #endif
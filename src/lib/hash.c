@@ -11,6 +11,9 @@
  *  rather than being able to move 1/2 of the entries in the chain with
  *  one update.
  *
+ *  Tables created with fr_hash_table_create_open() use open addressing
+ *  instead.  See below.
+ *
  * Version:	$Id$
  *
  *   This library is free software; you can redistribute it and/or
@@ -47,6 +50,17 @@ typedef struct fr_hash_entry_t {
 	void const 	*data;
 } fr_hash_entry_t;
 
+/*
+ *	A slot in an open addressing table.  The full hash is kept
+ *	next to the data, so that we rarely call the comparison
+ *	function for data which doesn't match, and don't need to
+ *	re-hash the data when the table grows.
+ */
+typedef struct fr_hash_slot_t {
+	uint32_t	key;
+	void const	*data;
+} fr_hash_slot_t;
+
 
 struct fr_hash_table_t {
 	int			num_elements;
@@ -61,8 +75,23 @@ struct fr_hash_table_t {
 	fr_hash_entry_t	null;
 
 	fr_hash_entry_t	**buckets;
+
+	/*
+	 *	Open addressing.  If "ctrl" is set, "buckets" isn't
+	 *	used, and num_buckets, next_grow, and mask refer to
+	 *	the slots.
+	 */
+	uint8_t			*ctrl;		/* one byte per slot */
+	fr_hash_slot_t		*slots;
+	int			num_used;	/* full + deleted slots */
 };
 
+/*
+ *	This should be a power of two.  Changing it to 4 doesn't seem
+ *	to make any difference.
+ */
+#define GROW_FACTOR (2)
+
 #ifdef TESTING
 static int grow = 0;
 #endif
@@ -271,6 +300,315 @@ static int _fr_hash_table_free(fr_hash_table_t *ht)
 	return 0;
 }
 
+/*
+ *	Open addressing.
+ *
+ *	The slots are split into groups.  Each slot has a control
+ *	byte, which is either EMPTY, DELETED, or the low 7 bits of the
+ *	hash of its data.  The rest of the hash selects the first
+ *	group to look at.  The control bytes of a whole group are
+ *	checked at once, so a lookup usually reads one group of
+ *	control bytes, and one slot.  There are no nodes to allocate,
+ *	and no pointers to chase.
+ *
+ *	Probing moves between groups with triangular steps, which
+ *	visits every group when the number of groups is a power of
+ *	two.  It stops at the first group which has an EMPTY slot.
+ *
+ *	Deleted slots become EMPTY if their group still has an EMPTY
+ *	slot, as no probe can have continued past that group.
+ *	Otherwise they're marked DELETED, and re-used by later
+ *	inserts.  Nothing is ever moved except when the table is
+ *	resized, so deleting entries during a walk is safe.
+ *
+ *	Unlike the split-ordered table, lookups never modify the
+ *	table.
+ */
+#define CTRL_EMPTY	(0x80)
+#define CTRL_DELETED	(0xfe)
+#define CTRL_FULL(_x)	(((_x) & 0x80) == 0)
+
+#define KEY_GROUP(_key)	((_key) >> 7)
+#define KEY_CTRL(_key)	((uint8_t) ((_key) & 0x7f))
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+
+#  define GROUP_SIZE	(16)
+#  define GROUP_SHIFT	(0)
+
+typedef uint32_t group_mask_t;
+
+static inline group_mask_t group_match(uint8_t const *ctrl, uint8_t c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *) ctrl), _mm_set1_epi8((char) c)));
+}
+
+static inline group_mask_t group_empty(uint8_t const *ctrl)
+{
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+/*
+ *	EMPTY and DELETED both have the high bit set.
+ */
+static inline group_mask_t group_empty_or_deleted(uint8_t const *ctrl)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i const *) ctrl));
+}
+#else
+/*
+ *	Check 8 control bytes at a time, using 64-bit integer
+ *	operations.  The result has the high bit set in each byte
+ *	which matches.
+ */
+#  define GROUP_SIZE	(8)
+#  define GROUP_SHIFT	(3)
+
+#  define GROUP_LSBS	(0x0101010101010101ULL)
+#  define GROUP_MSBS	(0x8080808080808080ULL)
+
+typedef uint64_t group_mask_t;
+
+static inline uint64_t group_load(uint8_t const *ctrl)
+{
+	uint64_t group;
+
+	memcpy(&group, ctrl, sizeof(group));
+#  ifdef WORDS_BIGENDIAN
+	group = __builtin_bswap64(group);
+#  endif
+
+	return group;
+}
+
+/*
+ *	This may also set bits for bytes which follow a real match.
+ *	The caller checks the control byte again, so that's fine.
+ */
+static inline group_mask_t group_match(uint8_t const *ctrl, uint8_t c)
+{
+	uint64_t x = group_load(ctrl) ^ (GROUP_LSBS * c);
+
+	return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline group_mask_t group_empty(uint8_t const *ctrl)
+{
+	uint64_t group = group_load(ctrl);
+
+	return group & ~(group << 6) & GROUP_MSBS;
+}
+
+static inline group_mask_t group_empty_or_deleted(uint8_t const *ctrl)
+{
+	uint64_t group = group_load(ctrl);
+
+	return group & ~(group << 7) & GROUP_MSBS;
+}
+#endif
+
+#define GROUP_FIRST(_mask)	(__builtin_ctzll(_mask) >> GROUP_SHIFT)
+#define GROUP_NEXT(_mask)	((_mask) & ((_mask) - 1))
+
+/*
+ *	Find the slot holding data.  Returns -1 if it's not there.
+ */
+static int open_find(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	uint32_t	group, step = 0;
+	uint32_t	num_groups = ht->num_buckets / GROUP_SIZE;
+	uint8_t		c = KEY_CTRL(key);
+
+	group = KEY_GROUP(key) & (num_groups - 1);
+
+	while (true) {
+		uint8_t const	*ctrl = ht->ctrl + (group * GROUP_SIZE);
+		group_mask_t	match;
+
+		for (match = group_match(ctrl, c); match; match = GROUP_NEXT(match)) {
+			int i = (group * GROUP_SIZE) + GROUP_FIRST(match);
+
+			if ((ht->ctrl[i] != c) || (ht->slots[i].key != key)) continue;
+
+			if (!ht->cmp || (ht->cmp(data, ht->slots[i].data) == 0)) return i;
+		}
+
+		if (group_empty(ctrl)) return -1;
+
+		if (++step >= num_groups) return -1;
+		group = (group + step) & (num_groups - 1);
+	}
+}
+
+/*
+ *	Find a slot which can be used for a new entry.  There's
+ *	always one, as the table is never allowed to fill up.
+ */
+static int open_find_free(fr_hash_table_t *ht, uint32_t key)
+{
+	uint32_t	group, step = 0;
+	uint32_t	num_groups = ht->num_buckets / GROUP_SIZE;
+
+	group = KEY_GROUP(key) & (num_groups - 1);
+
+	while (true) {
+		group_mask_t	match;
+
+		match = group_empty_or_deleted(ht->ctrl + (group * GROUP_SIZE));
+		if (match) return (group * GROUP_SIZE) + GROUP_FIRST(match);
+
+		if (!fr_cond_assert(++step < num_groups)) return -1;
+		group = (group + step) & (num_groups - 1);
+	}
+}
+
+/*
+ *	Allocate new slots, and move the entries over.  If the table
+ *	is mostly DELETED slots, it stays the same size.
+ */
+static int open_resize(fr_hash_table_t *ht)
+{
+	int		i, num_buckets, old_buckets;
+	uint8_t		*ctrl, *old_ctrl;
+	fr_hash_slot_t	*slots, *old_slots;
+
+	num_buckets = ht->num_buckets;
+	if (ht->num_elements >= (ht->next_grow >> 1)) num_buckets *= GROW_FACTOR;
+
+	ctrl = talloc_array(NULL, uint8_t, num_buckets);
+	if (!ctrl) return 0;
+
+	slots = talloc_array(NULL, fr_hash_slot_t, num_buckets);
+	if (!slots) {
+		talloc_free(ctrl);
+		return 0;
+	}
+	memset(ctrl, CTRL_EMPTY, num_buckets);
+
+	old_ctrl = ht->ctrl;
+	old_slots = ht->slots;
+	old_buckets = ht->num_buckets;
+
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->num_buckets = num_buckets;
+	ht->next_grow = num_buckets - (num_buckets >> 3);
+	ht->num_used = ht->num_elements;
+
+	for (i = 0; i < old_buckets; i++) {
+		int j;
+
+		if (!CTRL_FULL(old_ctrl[i])) continue;
+
+		j = open_find_free(ht, old_slots[i].key);
+		ctrl[j] = old_ctrl[i];
+		slots[j] = old_slots[i];
+	}
+
+	talloc_free(old_ctrl);
+	talloc_free(old_slots);
+
+#ifdef TESTING
+	grow = 1;
+	fprintf(stderr, "RESIZE TO %d\n", ht->num_buckets);
+#endif
+
+	return 1;
+}
+
+static int open_insert(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	int i;
+
+	if (open_find(ht, key, data) >= 0) return 0;
+
+	/*
+	 *	Keep at least 1/8 of the slots EMPTY, so that probes
+	 *	stay short.
+	 */
+	if ((ht->num_used >= ht->next_grow) && !open_resize(ht)) {
+		if (ht->num_used >= (ht->num_buckets - 1)) return 0;
+	}
+
+	i = open_find_free(ht, key);
+	if (i < 0) return 0;
+
+	if (ht->ctrl[i] == CTRL_EMPTY) ht->num_used++;
+
+	ht->ctrl[i] = KEY_CTRL(key);
+	ht->slots[i].key = key;
+	ht->slots[i].data = data;
+	ht->num_elements++;
+
+	return 1;
+}
+
+static void const *open_yank(fr_hash_table_t *ht, void const *data)
+{
+	int i;
+
+	i = open_find(ht, ht->hash(data), data);
+	if (i < 0) return NULL;
+
+	if (group_empty(ht->ctrl + (i & ~(GROUP_SIZE - 1)))) {
+		ht->ctrl[i] = CTRL_EMPTY;
+		ht->num_used--;
+	} else {
+		ht->ctrl[i] = CTRL_DELETED;
+	}
+	ht->num_elements--;
+
+	return ht->slots[i].data;
+}
+
+static int _fr_hash_table_open_free(fr_hash_table_t *ht)
+{
+	talloc_free(ht->ctrl);
+	talloc_free(ht->slots);
+
+	return 0;
+}
+
+/*
+ *	Create a table which uses open addressing.
+ *
+ *	Memory usage in bytes is 17 to 20 per slot on 64-bit systems,
+ *	with between 1/2 and 7/8 of the slots used.  Entries may be
+ *	deleted during a walk, but not inserted.
+ */
+fr_hash_table_t *fr_hash_table_create_open(TALLOC_CTX *ctx,
+					   fr_hash_table_hash_t hashNode,
+					   fr_hash_table_cmp_t cmpNode,
+					   fr_hash_table_free_t freeNode)
+{
+	fr_hash_table_t *ht;
+
+	if (!hashNode) return NULL;
+
+	ht = talloc_zero(NULL, fr_hash_table_t);
+	if (!ht) return NULL;
+	talloc_set_destructor(ht, _fr_hash_table_open_free);
+	fr_talloc_link_ctx(ctx, ht);
+
+	ht->free = freeNode;
+	ht->hash = hashNode;
+	ht->cmp = cmpNode;
+	ht->num_buckets = FR_HASH_NUM_BUCKETS;
+	ht->mask = ht->num_buckets - 1;
+	ht->next_grow = ht->num_buckets - (ht->num_buckets >> 3);
+
+	ht->ctrl = talloc_array(NULL, uint8_t, ht->num_buckets);
+	ht->slots = talloc_array(NULL, fr_hash_slot_t, ht->num_buckets);
+	if (!ht->ctrl || !ht->slots) {
+		talloc_free(ht);
+		return NULL;
+	}
+	memset(ht->ctrl, CTRL_EMPTY, ht->num_buckets);
+
+	return ht;
+}
+
 /*
  *	Create the table.
  *
@@ -369,12 +707,6 @@ static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
 	if (!ht->buckets[entry]) ht->buckets[entry] = &ht->null;
 }
 
-/*
- *	This should be a power of two.  Changing it to 4 doesn't seem
- *	to make any difference.
- */
-#define GROW_FACTOR (2)
-
 /*
  *	Grow the hash table.
  */
@@ -412,6 +744,8 @@ int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 	if (!ht || !data) return 0;
 
 	key = ht->hash(data);
+	if (ht->ctrl) return open_insert(ht, key, data);
+
 	entry = key & ht->mask;
 	reversed = reverse(key);
 
@@ -477,6 +811,21 @@ int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 
 	if (!ht || !data) return 0;
 
+	if (ht->ctrl) {
+		int i;
+
+		i = open_find(ht, ht->hash(data), data);
+		if (i < 0) return fr_hash_table_insert(ht, data);
+
+		if (ht->free) {
+			memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
+			ht->free(tofree);
+		}
+		ht->slots[i].data = data;
+
+		return 1;
+	}
+
 	node = fr_hash_table_find(ht, data);
 	if (!node) return fr_hash_table_insert(ht, data);
 
@@ -498,6 +847,17 @@ void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 	fr_hash_entry_t *node;
 	void *out;
 
+	if (ht && ht->ctrl) {
+		int i;
+
+		i = open_find(ht, ht->hash(data), data);
+		if (i < 0) return NULL;
+
+		memcpy(&out, &ht->slots[i].data, sizeof(out));
+
+		return out;
+	}
+
 	node = fr_hash_table_find(ht, data);
 	if (!node) return NULL;
 
@@ -521,6 +881,15 @@ void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 
 	if (!ht) return NULL;
 
+	if (ht->ctrl) {
+		void const *found;
+
+		found = open_yank(ht, data);
+		memcpy(&old, &found, sizeof(old));
+
+		return old;
+	}
+
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
@@ -566,6 +935,20 @@ void fr_hash_table_free(fr_hash_table_t *ht)
 
 	if (!ht) return;
 
+	if (ht->ctrl) {
+		if (ht->free) for (i = 0; i < ht->num_buckets; i++) {
+			void *tofree;
+
+			if (!CTRL_FULL(ht->ctrl[i])) continue;
+
+			memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
+			ht->free(tofree);
+		}
+
+		talloc_free(ht);
+		return;
+	}
+
 	/*
 	 *	Walk over the buckets, freeing them all.
 	 */
@@ -614,6 +997,21 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
 
 	if (!ht || !callback) return 0;
 
+	if (ht->ctrl) {
+		for (i = ht->num_buckets - 1; i >= 0; i--) {
+			void *arg;
+
+			if (!CTRL_FULL(ht->ctrl[i])) continue;
+
+			memcpy(&arg, &ht->slots[i].data, sizeof(arg));
+			rcode = callback(context, arg);
+
+			if (rcode != 0) return rcode;
+		}
+
+		return 0;
+	}
+
 	for (i = ht->num_buckets - 1; i >= 0; i--) {
 		fr_hash_entry_t *node, *next;
 
@@ -627,7 +1025,7 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
 
 			next = node->next;
 
-			memcpy(&arg, node->data, sizeof(arg));
+			memcpy(&arg, &node->data, sizeof(arg));
 			rcode = callback(context, arg);
 
 			if (rcode != 0) return rcode;
@@ -652,6 +1050,43 @@ int fr_hash_table_info(fr_hash_table_t *ht)
 	uninitialized = collisions = 0;
 	memset(array, 0, sizeof(array));
 
+	/*
+	 *	For open addressing, show how many groups each entry
+	 *	is from its home group.
+	 */
+	if (ht->ctrl) {
+		int deleted = 0;
+		uint32_t num_groups = ht->num_buckets / GROUP_SIZE;
+
+		for (i = 0; i < ht->num_buckets; i++) {
+			uint32_t group, home, step;
+
+			if (ht->ctrl[i] == CTRL_DELETED) deleted++;
+			if (!CTRL_FULL(ht->ctrl[i])) continue;
+
+			group = i / GROUP_SIZE;
+			home = KEY_GROUP(ht->slots[i].key) & (num_groups - 1);
+
+			for (step = 0; (home != group) && (step < 255); ) {
+				home = (home + ++step) & (num_groups - 1);
+			}
+			array[step]++;
+		}
+
+		printf("HASH TABLE %p\tslots: %d\t(%d deleted)\n", ht,
+		       ht->num_buckets, deleted);
+		printf("\tnum entries %d\tgroup size %d\n",
+		       ht->num_elements, GROUP_SIZE);
+
+		for (i = 0; i < 256; i++) {
+			if (!array[i]) continue;
+			printf("%d\t%d\n", i + 1, array[i]);
+		}
+		printf("\n");
+
+		return 0;
+	}
+
 	for (i = 0; i < ht->num_buckets; i++) {
 		uint32_t key;
 		int load;
@@ -800,69 +1235,149 @@ static uint32_t hash_int(void const *data)
 }
 
 #define MAX 1024*1024
-int main(int argc, char **argv)
+
+static fr_hash_table_t *hash_create(bool open)
+{
+	if (open) return fr_hash_table_create_open(NULL, hash_int, NULL, NULL);
+
+	return fr_hash_table_create(NULL, hash_int, NULL, NULL);
+}
+
+static double elapsed(struct timeval *start)
 {
-	int i, *p, *q, k;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) + ((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+/*
+ *	Time inserts, lookups which succeed, lookups which fail,
+ *	and deletes, for one type of table.
+ */
+static void hash_bench(char const *name, bool open, int *array)
+{
+	int i, *q;
 	fr_hash_table_t *ht;
-	int *array;
+	struct timeval start;
 
-	ht = fr_hash_table_create(NULL, hash_int, NULL, NULL);
+	ht = hash_create(open);
 	if (!ht) {
 		fprintf(stderr, "Hash create failed\n");
 		fr_exit(1);
 	}
 
-	array = talloc_zero_array(NULL, int, MAX);
-	if (!array) fr_exit(1);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < MAX; i++) {
+		if (!fr_hash_table_insert(ht, array + i)) {
+			fprintf(stderr, "Failed insert %08x\n", i);
+			fr_exit(1);
+		}
+	}
+	printf("%s\tinsert\t%.3fs\n", name, elapsed(&start));
+
+	fr_hash_table_info(ht);
 
+	gettimeofday(&start, NULL);
 	for (i = 0; i < MAX; i++) {
-		p = array + i;
-		*p = i;
+		q = fr_hash_table_finddata(ht, &i);
+		if (!q || *q != i) {
+			fprintf(stderr, "Failed finding %d\n", i);
+			fr_exit(1);
+		}
+	}
+	printf("%s\tfind\t%.3fs\n", name, elapsed(&start));
 
-		if (!fr_hash_table_insert(ht, p)) {
-			fprintf(stderr, "Failed insert %08x\n", i);
+	gettimeofday(&start, NULL);
+	for (i = MAX; i < (2 * MAX); i++) {
+		q = fr_hash_table_finddata(ht, &i);
+		if (q) {
+			fprintf(stderr, "Found missing %d\n", i);
 			fr_exit(1);
 		}
-#ifdef TEST_INSERT
-		q = fr_hash_table_finddata(ht, p);
-		if (q != p) {
-			fprintf(stderr, "Bad data %d\n", i);
+	}
+	printf("%s\tmiss\t%.3fs\n", name, elapsed(&start));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < MAX; i++) {
+		if (!fr_hash_table_delete(ht, &i)) {
+			fprintf(stderr, "Failed deleting %d\n", i);
 			fr_exit(1);
 		}
-#endif
 	}
+	printf("%s\tdelete\t%.3fs\n", name, elapsed(&start));
 
-	fr_hash_table_info(ht);
+	if (fr_hash_table_num_elements(ht) != 0) {
+		fprintf(stderr, "Table not empty after deletes\n");
+		fr_exit(1);
+	}
+
+	fr_hash_table_free(ht);
+}
+
+/*
+ *	Delete every other entry during a walk.
+ */
+static int hash_walk_delete(void *ctx, void *data)
+{
+	fr_hash_table_t *ht = ctx;
+	int *p = data;
+
+	if ((*p & 0x01) != 0) return 0;
+
+	return !fr_hash_table_delete(ht, p);
+}
+
+int main(int argc, char **argv)
+{
+	int i, *q;
+	fr_hash_table_t *ht;
+	int *array;
+
+	array = talloc_zero_array(NULL, int, MAX);
+	if (!array) fr_exit(1);
+
+	for (i = 0; i < MAX; i++) array[i] = i;
+
+	hash_bench("chained", false, array);
+	hash_bench("open", true, array);
 
 	/*
-	 *	Build this to see how lookups result in shortening
-	 *	of the hash chains.
+	 *	Mixed inserts and deletes, to check that tombstones
+	 *	are cleaned up, and that walks see the right data.
 	 */
-	if (1) {
-		for (i = 0; i < MAX ; i++) {
-			q = fr_hash_table_finddata(ht, &i);
-			if (!q || *q != i) {
-				fprintf(stderr, "Failed finding %d\n", i);
-				fr_exit(1);
-			}
-
-#if 0
-			if (!fr_hash_table_delete(ht, &i)) {
-				fprintf(stderr, "Failed deleting %d\n", i);
-				fr_exit(1);
-			}
-			q = fr_hash_table_finddata(ht, &i);
-			if (q) {
-				fprintf(stderr, "Failed to delete %08x\n", i);
-				fr_exit(1);
-			}
-#endif
+	ht = hash_create(true);
+	for (i = 0; i < MAX; i++) {
+		if (!fr_hash_table_insert(ht, array + i)) {
+			fprintf(stderr, "Failed insert %08x\n", i);
+			fr_exit(1);
+		}
+		if ((i > 16) && !fr_hash_table_delete(ht, array + i - 16)) {
+			fprintf(stderr, "Failed deleting %d\n", i - 16);
+			fr_exit(1);
 		}
+	}
+	fr_hash_table_info(ht);
 
-		fr_hash_table_info(ht);
+	for (i = MAX - 16; i < MAX; i++) {
+		q = fr_hash_table_finddata(ht, &i);
+		if (!q || *q != i) {
+			fprintf(stderr, "Failed finding %d\n", i);
+			fr_exit(1);
+		}
 	}
 
+	if (fr_hash_table_walk(ht, hash_walk_delete, ht) != 0) {
+		fprintf(stderr, "Failed walking\n");
+		fr_exit(1);
+	}
+	if (fr_hash_table_num_elements(ht) != 8) {
+		fprintf(stderr, "Bad count %d after walk\n", fr_hash_table_num_elements(ht));
+		fr_exit(1);
+	}
 	fr_hash_table_free(ht);
+
 	talloc_free(array);
 
 	fr_exit(0);
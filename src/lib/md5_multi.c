@@ -0,0 +1,695 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file md5_multi.c
+ * @brief MD5 of several independent messages at once.
+ *
+ * MD5 is a long chain of dependent 32-bit operations, so one message
+ * can't be made much faster.  But the messages in a batch of packets
+ * are independent, so we can put each one in a lane of a SIMD register,
+ * and hash 4 (SSE2) or 8 (AVX2) of them for the price of one.
+ *
+ * The engine is picked at run time, depending on what the CPU supports.
+ * There's a portable one-lane engine for everything else.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)) || defined(__clang__))
+#  define MD5_MULTI_X86 (1)
+#  include <immintrin.h>
+#endif
+
+/*
+ *	MD5_BLOCK_LENGTH is only defined when we're not using
+ *	OpenSSL's MD5, so use our own.
+ */
+#define FR_MD5_MULTI_BLOCK_LENGTH (64)
+
+typedef void (*md5_multi_transform_t)(uint32_t *state[], uint8_t const *block[]);
+
+typedef struct md5_multi_engine_t {
+	char const		*name;
+	unsigned int		lanes;
+	md5_multi_transform_t	transform;
+} md5_multi_engine_t;
+
+#define GET_32BIT_LE(_p) ((uint32_t)(_p)[0] | ((uint32_t)(_p)[1] << 8) | \
+			  ((uint32_t)(_p)[2] << 16) | ((uint32_t)(_p)[3] << 24))
+
+#define PUT_32BIT_LE(cp, value) do {\
+	(cp)[3] = (value) >> 24;\
+	(cp)[2] = (value) >> 16;\
+	(cp)[1] = (value) >> 8;\
+	(cp)[0] = (value);\
+} while (0)
+
+/*
+ *	The 64 steps of MD5, written in terms of V_* operations on
+ *	whatever type holds one word from each lane.  Each engine
+ *	defines the operations, and expands this.
+ *
+ *	F2(x, y, z) is F1(z, x, y), and F4 uses XOR with all ones for
+ *	NOT, as not every instruction set has one.
+ */
+#define F1(x, y, z) V_XOR(z, V_AND(x, V_XOR(y, z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) V_XOR(V_XOR(x, y), z)
+#define F4(x, y, z) V_XOR(y, V_OR(x, V_XOR(z, V_ONES)))
+
+#define MD5STEP(f, w, x, y, z, i, k, s) do { \
+	w = V_ADD(w, V_ADD(f(x, y, z), V_ADD(in[i], V_SET1(k)))); \
+	w = V_ADD(V_ROTL(w, s), x); \
+} while (0)
+
+#define MD5_MULTI_STEPS \
+	MD5STEP(F1, a, b, c, d,  0, 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c,  1, 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b,  2, 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a,  3, 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d,  4, 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c,  5, 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b,  6, 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a,  7, 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d,  8, 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c,  9, 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, 10, 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, 11, 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, 12, 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, 13, 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, 14, 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, 15, 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d,  1, 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c,  6, 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, 11, 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a,  0, 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d,  5, 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, 10, 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, 15, 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a,  4, 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d,  9, 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, 14, 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b,  3, 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a,  8, 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, 13, 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c,  2, 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b,  7, 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, 12, 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d,  5, 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c,  8, 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, 11, 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, 14, 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d,  1, 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c,  4, 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b,  7, 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, 10, 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, 13, 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c,  0, 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b,  3, 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a,  6, 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d,  9, 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, 12, 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, 15, 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a,  2, 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d,  0, 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c,  7, 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, 14, 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a,  5, 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, 12, 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c,  3, 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, 10, 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a,  1, 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d,  8, 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, 15, 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b,  6, 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, 13, 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d,  4, 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, 11, 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b,  2, 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a,  9, 0xeb86d391, 21)
+
+/*
+ *	One lane, using plain integers.
+ */
+#define V_ADD(_a, _b)	((_a) + (_b))
+#define V_AND(_a, _b)	((_a) & (_b))
+#define V_OR(_a, _b)	((_a) | (_b))
+#define V_XOR(_a, _b)	((_a) ^ (_b))
+#define V_ROTL(_a, _s)	(((_a) << (_s)) | ((_a) >> (32 - (_s))))
+#define V_SET1(_k)	((uint32_t) (_k))
+#define V_ONES		(0xffffffff)
+
+static void md5_multi_x1(uint32_t *state[], uint8_t const *block[])
+{
+	uint32_t	a, b, c, d, in[16];
+	int		i;
+
+	for (i = 0; i < 16; i++) in[i] = GET_32BIT_LE(block[0] + (i * 4));
+
+	a = state[0][0];
+	b = state[0][1];
+	c = state[0][2];
+	d = state[0][3];
+
+	MD5_MULTI_STEPS;
+
+	state[0][0] += a;
+	state[0][1] += b;
+	state[0][2] += c;
+	state[0][3] += d;
+}
+
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+#undef V_SET1
+#undef V_ONES
+
+#ifdef MD5_MULTI_X86
+/*
+ *	x86 is little endian, so the message words can be loaded
+ *	directly.
+ */
+static inline uint32_t load_32(uint8_t const *p)
+{
+	uint32_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+/*
+ *	Four lanes, using SSE2.
+ */
+#define V_ADD(_a, _b)	_mm_add_epi32(_a, _b)
+#define V_AND(_a, _b)	_mm_and_si128(_a, _b)
+#define V_OR(_a, _b)	_mm_or_si128(_a, _b)
+#define V_XOR(_a, _b)	_mm_xor_si128(_a, _b)
+#define V_ROTL(_a, _s)	_mm_or_si128(_mm_slli_epi32(_a, _s), _mm_srli_epi32(_a, 32 - (_s)))
+#define V_SET1(_k)	_mm_set1_epi32((int) (_k))
+#define V_ONES		ones
+
+#define SET_LANES_4(_x)	_mm_set_epi32(_x(3), _x(2), _x(1), _x(0))
+
+#define STATE_A(_j)	(int) state[_j][0]
+#define STATE_B(_j)	(int) state[_j][1]
+#define STATE_C(_j)	(int) state[_j][2]
+#define STATE_D(_j)	(int) state[_j][3]
+
+__attribute__((target("sse2")))
+static void md5_multi_x4_sse2(uint32_t *state[], uint8_t const *block[])
+{
+	__m128i		a, b, c, d, aa, bb, cc, dd, in[16];
+	__m128i		ones = _mm_set1_epi32(-1);
+	uint32_t	out[4][4];
+	int		i, j;
+
+	for (i = 0; i < 16; i++) {
+#define WORD(_j) (int) load_32(block[_j] + (i * 4))
+		in[i] = SET_LANES_4(WORD);
+#undef WORD
+	}
+
+	aa = a = SET_LANES_4(STATE_A);
+	bb = b = SET_LANES_4(STATE_B);
+	cc = c = SET_LANES_4(STATE_C);
+	dd = d = SET_LANES_4(STATE_D);
+
+	MD5_MULTI_STEPS;
+
+	_mm_storeu_si128((__m128i *) out[0], V_ADD(a, aa));
+	_mm_storeu_si128((__m128i *) out[1], V_ADD(b, bb));
+	_mm_storeu_si128((__m128i *) out[2], V_ADD(c, cc));
+	_mm_storeu_si128((__m128i *) out[3], V_ADD(d, dd));
+
+	for (j = 0; j < 4; j++) for (i = 0; i < 4; i++) state[j][i] = out[i][j];
+}
+
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+#undef V_SET1
+
+/*
+ *	Eight lanes, using AVX2.
+ */
+#define V_ADD(_a, _b)	_mm256_add_epi32(_a, _b)
+#define V_AND(_a, _b)	_mm256_and_si256(_a, _b)
+#define V_OR(_a, _b)	_mm256_or_si256(_a, _b)
+#define V_XOR(_a, _b)	_mm256_xor_si256(_a, _b)
+#define V_ROTL(_a, _s)	_mm256_or_si256(_mm256_slli_epi32(_a, _s), _mm256_srli_epi32(_a, 32 - (_s)))
+#define V_SET1(_k)	_mm256_set1_epi32((int) (_k))
+
+#define SET_LANES_8(_x)	_mm256_set_epi32(_x(7), _x(6), _x(5), _x(4), _x(3), _x(2), _x(1), _x(0))
+
+__attribute__((target("avx2")))
+static void md5_multi_x8_avx2(uint32_t *state[], uint8_t const *block[])
+{
+	__m256i		a, b, c, d, aa, bb, cc, dd, in[16];
+	__m256i		ones = _mm256_set1_epi32(-1);
+	uint32_t	out[4][8];
+	int		i, j;
+
+	for (i = 0; i < 16; i++) {
+#define WORD(_j) (int) load_32(block[_j] + (i * 4))
+		in[i] = SET_LANES_8(WORD);
+#undef WORD
+	}
+
+	aa = a = SET_LANES_8(STATE_A);
+	bb = b = SET_LANES_8(STATE_B);
+	cc = c = SET_LANES_8(STATE_C);
+	dd = d = SET_LANES_8(STATE_D);
+
+	MD5_MULTI_STEPS;
+
+	_mm256_storeu_si256((__m256i *) out[0], V_ADD(a, aa));
+	_mm256_storeu_si256((__m256i *) out[1], V_ADD(b, bb));
+	_mm256_storeu_si256((__m256i *) out[2], V_ADD(c, cc));
+	_mm256_storeu_si256((__m256i *) out[3], V_ADD(d, dd));
+
+	for (j = 0; j < 8; j++) for (i = 0; i < 4; i++) state[j][i] = out[i][j];
+}
+
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROTL
+#undef V_SET1
+#undef V_ONES
+#endif	/* MD5_MULTI_X86 */
+
+static md5_multi_engine_t const md5_multi_engines[] = {
+#ifdef MD5_MULTI_X86
+	{ "avx2",	8,	md5_multi_x8_avx2 },
+	{ "sse2",	4,	md5_multi_x4_sse2 },
+#endif
+	{ "scalar",	1,	md5_multi_x1 }
+};
+
+static md5_multi_engine_t const *md5_multi_engine = NULL;
+
+/*
+ *	Pick the widest engine the CPU supports.  This may be called
+ *	by several threads at once, but they'll all pick the same one.
+ */
+static md5_multi_engine_t const *md5_multi_engine_select(void)
+{
+	md5_multi_engine_t const *engine;
+	char const *force;
+	size_t i;
+
+	if (md5_multi_engine) return md5_multi_engine;
+
+	engine = &md5_multi_engines[(sizeof(md5_multi_engines) / sizeof(*md5_multi_engines)) - 1];
+
+#ifdef MD5_MULTI_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		engine = &md5_multi_engines[0];
+	} else if (__builtin_cpu_supports("sse2")) {
+		engine = &md5_multi_engines[1];
+	}
+#endif
+
+	/*
+	 *	Allow a narrower engine to be forced, for testing.
+	 */
+	force = getenv("FR_MD5_MULTI_ENGINE");
+	if (force) for (i = 0; i < (sizeof(md5_multi_engines) / sizeof(*md5_multi_engines)); i++) {
+		if ((strcmp(force, md5_multi_engines[i].name) == 0) &&
+		    (md5_multi_engines[i].lanes <= engine->lanes)) {
+			engine = &md5_multi_engines[i];
+			break;
+		}
+	}
+
+	md5_multi_engine = engine;
+
+	return engine;
+}
+
+/** Return the name of the engine fr_md5_multi() uses
+ *
+ * @return "avx2", "sse2", or "scalar".
+ */
+char const *fr_md5_multi_engine(void)
+{
+	return md5_multi_engine_select()->name;
+}
+
+/** Initialise a message for fr_md5_multi()
+ *
+ * @param[out] m to initialise.
+ * @param[in] prefix Optional block of FR_MD5_MULTI_BLOCK_LENGTH bytes, which is
+ *	hashed now.  This lets a prefix which is common to many messages (such as an
+ *	HMAC key pad) be hashed once, and the state copied to each message.
+ */
+void fr_md5_multi_init(fr_md5_multi_t *m, uint8_t const *prefix)
+{
+	uint32_t *state[1];
+
+	memset(m, 0, sizeof(*m));
+	m->state[0] = 0x67452301;
+	m->state[1] = 0xefcdab89;
+	m->state[2] = 0x98badcfe;
+	m->state[3] = 0x10325476;
+
+	if (!prefix) return;
+
+	state[0] = m->state;
+	md5_multi_x1(state, &prefix);
+	m->done = FR_MD5_MULTI_BLOCK_LENGTH;
+}
+
+/*
+ *	Return a pointer to block "n" of a message, including the
+ *	padding.  If the block lies entirely within one of the
+ *	inputs, it's used directly.  Otherwise it's built in
+ *	"buffer".
+ */
+static uint8_t const *md5_multi_block(fr_md5_multi_t const *m, size_t len, size_t num_blocks,
+				      size_t n, uint8_t buffer[FR_MD5_MULTI_BLOCK_LENGTH])
+{
+	size_t		offset = n * FR_MD5_MULTI_BLOCK_LENGTH;
+	size_t		used = 0;
+	uint64_t	bits;
+
+	if ((offset + FR_MD5_MULTI_BLOCK_LENGTH) <= m->inlen[0]) return m->in[0] + offset;
+
+	if ((offset >= m->inlen[0]) && ((offset - m->inlen[0] + FR_MD5_MULTI_BLOCK_LENGTH) <= m->inlen[1])) {
+		return m->in[1] + (offset - m->inlen[0]);
+	}
+
+	/*
+	 *	The end of the first input.
+	 */
+	if (offset < m->inlen[0]) {
+		used = m->inlen[0] - offset;
+		memcpy(buffer, m->in[0] + offset, used);
+	}
+
+	/*
+	 *	Some (or all) of the second input.
+	 */
+	if ((offset + used) < len) {
+		size_t start = offset + used - m->inlen[0];
+		size_t copy = m->inlen[1] - start;
+
+		if (copy > (FR_MD5_MULTI_BLOCK_LENGTH - used)) copy = FR_MD5_MULTI_BLOCK_LENGTH - used;
+		memcpy(buffer + used, m->in[1] + start, copy);
+		used += copy;
+	}
+
+	if (used == FR_MD5_MULTI_BLOCK_LENGTH) return buffer;
+
+	/*
+	 *	The message ends in this block.  Add the 0x80, unless
+	 *	it ended exactly at the end of the previous block, and
+	 *	the 0x80 is already there.
+	 */
+	if ((offset + used) == len) {
+		buffer[used++] = 0x80;
+	}
+	memset(buffer + used, 0, FR_MD5_MULTI_BLOCK_LENGTH - used);
+
+	/*
+	 *	And the length of the message in bits, at the end of
+	 *	the last block.
+	 */
+	if (n == (num_blocks - 1)) {
+		bits = (m->done + len) << 3;
+		for (used = 0; used < 8; used++) buffer[56 + used] = bits >> (used * 8);
+	}
+
+	return buffer;
+}
+
+/** Calculate the MD5 digests of several independent messages
+ *
+ * Each message is the concatenation of in[0] and in[1], hashed after
+ * whatever was absorbed by fr_md5_multi_init().  The digest is written
+ * to m->digest.
+ *
+ * @param[in,out] m Array of messages.
+ * @param[in] num Number of messages.
+ */
+void fr_md5_multi(fr_md5_multi_t *m, unsigned int num)
+{
+	md5_multi_engine_t const *engine = md5_multi_engine_select();
+	unsigned int	i, lane, active = 0, next = 0;
+
+	/*
+	 *	Per-lane state.  Empty lanes hash a dummy block, and
+	 *	the result is thrown away.
+	 */
+	fr_md5_multi_t	*msg[FR_MD5_MULTI_MAX];
+	size_t		len[FR_MD5_MULTI_MAX];
+	size_t		num_blocks[FR_MD5_MULTI_MAX];
+	size_t		block_num[FR_MD5_MULTI_MAX];
+	uint8_t		buffer[FR_MD5_MULTI_MAX][FR_MD5_MULTI_BLOCK_LENGTH];
+	uint32_t	dummy_state[4];
+	uint32_t	*state[FR_MD5_MULTI_MAX];
+	uint8_t const	*block[FR_MD5_MULTI_MAX];
+
+	/*
+	 *	One message would leave all but one of the SIMD lanes
+	 *	idle, which is slower than using the scalar engine.
+	 */
+	if (num == 1) engine = &md5_multi_engines[(sizeof(md5_multi_engines) / sizeof(*md5_multi_engines)) - 1];
+
+	memset(msg, 0, sizeof(msg));
+
+	while (true) {
+		/*
+		 *	Fill empty lanes with the next messages.
+		 */
+		for (lane = 0; (lane < engine->lanes) && (next < num); lane++) {
+			if (msg[lane]) continue;
+
+			msg[lane] = &m[next++];
+			len[lane] = msg[lane]->inlen[0] + msg[lane]->inlen[1];
+			num_blocks[lane] = (len[lane] + 8 + FR_MD5_MULTI_BLOCK_LENGTH) / FR_MD5_MULTI_BLOCK_LENGTH;
+			block_num[lane] = 0;
+			active++;
+		}
+
+		if (!active) break;
+
+		for (lane = 0; lane < engine->lanes; lane++) {
+			if (!msg[lane]) {
+				state[lane] = dummy_state;
+				block[lane] = buffer[lane];
+				continue;
+			}
+
+			state[lane] = msg[lane]->state;
+			block[lane] = md5_multi_block(msg[lane], len[lane], num_blocks[lane],
+						      block_num[lane], buffer[lane]);
+		}
+
+		engine->transform(state, block);
+
+		/*
+		 *	Write out the digests of any messages which
+		 *	are done, and free their lanes.
+		 */
+		for (lane = 0; lane < engine->lanes; lane++) {
+			if (!msg[lane]) continue;
+			if (++block_num[lane] < num_blocks[lane]) continue;
+
+			for (i = 0; i < 4; i++) PUT_32BIT_LE(msg[lane]->digest + (i * 4), msg[lane]->state[i]);
+
+			msg[lane] = NULL;
+			active--;
+		}
+	}
+}
+
+#ifdef TESTING
+/*
+ *  cc -DTESTING -I ../include md5_multi.c md5.c -o md5_multi
+ *
+ *  ./md5_multi
+ *
+ *  Checks every engine against fr_md5_calc(), for messages of many
+ *  lengths, split in many places.  Then times each engine on a batch
+ *  of Accounting-Request sized messages, on batches too small to fill
+ *  the lanes, and fr_md5_calc() one message at a time.
+ */
+#include <sys/time.h>
+
+#define NUM_MSGS	(64)
+#define BENCH_LOOPS	(20000)
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) + ((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	fr_md5_multi_t	m[NUM_MSGS];
+	uint8_t		data[512], expected[NUM_MSGS][MD5_DIGEST_LENGTH];
+	size_t		e, i, len, split;
+	struct timeval	start;
+	double		t;
+
+	for (i = 0; i < sizeof(data); i++) data[i] = (i * 7) + 3;
+
+	for (e = 0; e < (sizeof(md5_multi_engines) / sizeof(*md5_multi_engines)); e++) {
+#ifdef MD5_MULTI_X86
+		__builtin_cpu_init();
+		if ((md5_multi_engines[e].lanes == 8) && !__builtin_cpu_supports("avx2")) continue;
+#endif
+		md5_multi_engine = &md5_multi_engines[e];
+
+		for (len = 0; len < 300; len++) {
+			for (split = 0; split <= len; split += 13) {
+				for (i = 0; i < NUM_MSGS; i++) {
+					fr_md5_multi_init(&m[i], NULL);
+					m[i].in[0] = data + i;
+					m[i].inlen[0] = split;
+					m[i].in[1] = data + i + split;
+					m[i].inlen[1] = len - split;
+
+					fr_md5_calc(expected[i], data + i, len);
+				}
+
+				/*
+				 *	Odd numbers of messages, to
+				 *	check partly filled lanes.
+				 */
+				fr_md5_multi(m, NUM_MSGS - (len % 3));
+
+				for (i = 0; i < (NUM_MSGS - (len % 3)); i++) {
+					if (memcmp(m[i].digest, expected[i], MD5_DIGEST_LENGTH) != 0) {
+						fprintf(stderr, "%s: bad digest for len %zu split %zu msg %zu\n",
+							md5_multi_engines[e].name, len, split, i);
+						exit(1);
+					}
+				}
+			}
+		}
+
+		/*
+		 *	HMAC-MD5, using a pre-hashed key pad.
+		 */
+		{
+			fr_hmac_md5_key_t	hkey;
+			fr_md5_multi_t		inner, outer;
+			uint8_t			digest[MD5_DIGEST_LENGTH];
+
+			fr_hmac_md5_key_init(&hkey, (uint8_t const *) "Jefe", 4);
+			memcpy(&inner, &hkey.inner_multi, sizeof(inner));
+			memcpy(&outer, &hkey.outer_multi, sizeof(outer));
+
+			inner.in[0] = (uint8_t const *) "what do ya want for nothing?";
+			inner.inlen[0] = 28;
+			fr_md5_multi(&inner, 1);
+
+			outer.in[0] = inner.digest;
+			outer.inlen[0] = MD5_DIGEST_LENGTH;
+			fr_md5_multi(&outer, 1);
+
+			fr_hmac_md5(digest, inner.in[0], 28, (uint8_t const *) "Jefe", 4);
+			if (memcmp(digest, outer.digest, MD5_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "%s: bad HMAC-MD5\n", md5_multi_engines[e].name);
+				exit(1);
+			}
+		}
+
+		gettimeofday(&start, NULL);
+		for (len = 0; len < BENCH_LOOPS; len++) {
+			for (i = 0; i < NUM_MSGS; i++) {
+				fr_md5_multi_init(&m[i], NULL);
+				m[i].in[0] = data;
+				m[i].inlen[0] = 200;
+				m[i].in[1] = (uint8_t const *) "testing123";
+				m[i].inlen[1] = 10;
+			}
+			fr_md5_multi(m, NUM_MSGS);
+		}
+		t = elapsed(&start);
+
+		printf("%s\t%d messages in %.3fs\t(%.0f/s)\n", md5_multi_engines[e].name,
+		       BENCH_LOOPS * NUM_MSGS, t, (BENCH_LOOPS * NUM_MSGS) / t);
+
+		/*
+		 *	Small batches, which don't fill the lanes.
+		 */
+		for (split = 1; split <= (2 * md5_multi_engines[e].lanes); split++) {
+			size_t loops = (BENCH_LOOPS * NUM_MSGS) / split;
+
+			gettimeofday(&start, NULL);
+			for (len = 0; len < loops; len++) {
+				for (i = 0; i < split; i++) {
+					fr_md5_multi_init(&m[i], NULL);
+					m[i].in[0] = data;
+					m[i].inlen[0] = 200;
+					m[i].in[1] = (uint8_t const *) "testing123";
+					m[i].inlen[1] = 10;
+				}
+				fr_md5_multi(m, split);
+			}
+			t = elapsed(&start);
+
+			printf("%s\tbatch of %zu\t\t(%.0f/s)\n", md5_multi_engines[e].name, split, (loops * split) / t);
+		}
+	}
+
+	/*
+	 *	One message at a time, as fr_radius_verify() does.
+	 */
+	gettimeofday(&start, NULL);
+	for (len = 0; len < BENCH_LOOPS; len++) {
+		for (i = 0; i < NUM_MSGS; i++) {
+			FR_MD5_CTX ctx;
+
+			fr_md5_init(&ctx);
+			fr_md5_update(&ctx, data, 200);
+			fr_md5_update(&ctx, (uint8_t const *) "testing123", 10);
+			fr_md5_final(expected[i], &ctx);
+		}
+	}
+	t = elapsed(&start);
+
+	printf("fr_md5\t%d messages in %.3fs\t(%.0f/s)\n", BENCH_LOOPS * NUM_MSGS, t, (BENCH_LOOPS * NUM_MSGS) / t);
+
+	return 0;
+}
+#endif
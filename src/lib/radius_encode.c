@@ -105,10 +105,10 @@ int fr_radius_encode_chap_password(uint8_t *output, RADIUS_PACKET *packet, int i
  */
 int fr_radius_encode_tunnel_password(char *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
 {
-	uint8_t		buffer[AUTH_VECTOR_LEN + FR_MAX_STRING_LEN + 3];
+	FR_MD5_CTX	context, old;
 	unsigned char	digest[AUTH_VECTOR_LEN];
 	char		*salt;
-	int		i, n, secretlen;
+	int		i, n;
 	unsigned	len, n2;
 
 	len = *pwlen;
@@ -156,18 +156,18 @@ int fr_radius_encode_tunnel_password(char *passwd, size_t *pwlen, char const *se
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = strlen(secret);
-	memcpy(buffer, secret, secretlen);
+	fr_md5_init(&old);
+	fr_md5_update(&old, (uint8_t const *) secret, strlen(secret));
 
 	for (n2 = 0; n2 < len; n2 +=AUTH_PASS_LEN) {
+		fr_md5_copy(&context, &old);
 		if (!n2) {
-			memcpy(buffer + secretlen, vector, AUTH_VECTOR_LEN);
-			memcpy(buffer + secretlen + AUTH_VECTOR_LEN, salt, 2);
-			fr_md5_calc(digest, buffer, secretlen + AUTH_VECTOR_LEN + 2);
+			fr_md5_update(&context, vector, AUTH_VECTOR_LEN);
+			fr_md5_update(&context, (uint8_t const *) salt, 2);
 		} else {
-			memcpy(buffer + secretlen, passwd + n2 - AUTH_PASS_LEN, AUTH_PASS_LEN);
-			fr_md5_calc(digest, buffer, secretlen + AUTH_PASS_LEN);
+			fr_md5_update(&context, (uint8_t const *) passwd + n2 - AUTH_PASS_LEN, AUTH_PASS_LEN);
 		}
+		fr_md5_final(digest, &context);
 		for (i = 0; i < AUTH_PASS_LEN; i++) passwd[i + n2] ^= digest[i];
 	}
 	passwd[n2] = 0;
@@ -239,3 +239,327 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+#ifdef WITH_UDP_MMSG
+/** A single datagram in a #udp_mmsg_t
+ *
+ */
+typedef struct udp_mmsg_entry {
+	struct iovec		iov;
+	struct sockaddr_storage	src;		//!< Source address of received datagrams.
+	struct sockaddr_storage	dst;		//!< Destination address.
+	socklen_t		sizeof_dst;
+	int			if_index;
+	struct timeval		when;
+#ifdef WITH_UDPFROMTO
+	char			cbuf[UDPFROMTO_CMSG_LEN];
+#endif
+	uint8_t			*data;
+} udp_mmsg_entry_t;
+
+/** A batch of datagrams, read with recvmmsg() or written with sendmmsg()
+ *
+ */
+struct udp_mmsg {
+	unsigned int		size;		//!< Maximum number of datagrams in the batch.
+	unsigned int		num;		//!< Number of datagrams received, or waiting to be sent.
+	size_t			max_len;	//!< Maximum length of a datagram.
+
+	struct mmsghdr		*hdr;		//!< Passed to recvmmsg() / sendmmsg().
+	udp_mmsg_entry_t	*entry;
+};
+
+/** Allocate a batch of datagram buffers
+ *
+ * @param[in] ctx to allocate the batch in.
+ * @param[in] size maximum number of datagrams per call.
+ * @param[in] max_len maximum length of a datagram.  Longer datagrams are
+ *	truncated on receive, and discarded by #udp_mmsg_get.
+ * @return
+ *	- New batch.
+ *	- NULL on error.
+ */
+udp_mmsg_t *udp_mmsg_alloc(TALLOC_CTX *ctx, unsigned int size, size_t max_len)
+{
+	udp_mmsg_t	*mm;
+	uint8_t		*data;
+	unsigned int	i;
+
+	if (!size || !max_len) {
+		fr_strerror_printf("Invalid batch size");
+		return NULL;
+	}
+
+	mm = talloc_zero(ctx, udp_mmsg_t);
+	if (!mm) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		talloc_free(mm);
+		return NULL;
+	}
+
+	mm->size = size;
+	mm->max_len = max_len;
+
+	mm->hdr = talloc_zero_array(mm, struct mmsghdr, size);
+	if (!mm->hdr) goto oom;
+
+	mm->entry = talloc_zero_array(mm, udp_mmsg_entry_t, size);
+	if (!mm->entry) goto oom;
+
+	/*
+	 *	One contiguous chunk for all of the datagrams.
+	 */
+	data = talloc_array(mm, uint8_t, size * max_len);
+	if (!data) goto oom;
+
+	for (i = 0; i < size; i++) {
+		mm->entry[i].data = data + (i * max_len);
+		mm->hdr[i].msg_hdr.msg_iov = &mm->entry[i].iov;
+		mm->hdr[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return mm;
+}
+
+/** Return the number of datagrams received, or waiting to be sent
+ *
+ */
+unsigned int udp_mmsg_num(udp_mmsg_t const *mm)
+{
+	return mm->num;
+}
+
+/** Read as many datagrams as are available (up to the batch size) with one system call
+ *
+ * @param[in] sockfd we're reading from.
+ * @param[in] mm batch to read into.  Any datagrams previously held are discarded.
+ * @return
+ *	- >= 0 the number of datagrams received.
+ *	- < 0 on failure.
+ */
+int udp_recv_mmsg(int sockfd, udp_mmsg_t *mm)
+{
+	struct sockaddr_storage	si;
+	socklen_t		sizeof_si = sizeof(si);
+	unsigned int		i;
+	int			received;
+
+	mm->num = 0;
+
+	/*
+	 *	recvmsg() doesn't provide the destination port, so we
+	 *	get the address the socket is bound to, and overwrite
+	 *	the IP address with the one from the control data.
+	 */
+	if (getsockname(sockfd, (struct sockaddr *)&si, &sizeof_si) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < mm->size; i++) {
+		struct msghdr *msgh = &mm->hdr[i].msg_hdr;
+
+		mm->entry[i].iov.iov_base = mm->entry[i].data;
+		mm->entry[i].iov.iov_len = mm->max_len;
+
+		msgh->msg_name = &mm->entry[i].src;
+		msgh->msg_namelen = sizeof(mm->entry[i].src);
+#ifdef WITH_UDPFROMTO
+		msgh->msg_control = mm->entry[i].cbuf;
+		msgh->msg_controllen = sizeof(mm->entry[i].cbuf);
+#else
+		msgh->msg_control = NULL;
+		msgh->msg_controllen = 0;
+#endif
+		msgh->msg_flags = 0;
+	}
+
+	received = recvmmsg(sockfd, mm->hdr, mm->size, MSG_DONTWAIT, NULL);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+		fr_strerror_printf("Failed receiving datagrams: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned int) received; i++) {
+		udp_mmsg_entry_t *entry = &mm->entry[i];
+
+		memcpy(&entry->dst, &si, sizeof_si);
+		entry->sizeof_dst = sizeof_si;
+
+#ifdef WITH_UDPFROMTO
+		udpfromto_cmsg_recv(&mm->hdr[i].msg_hdr, (struct sockaddr *)&entry->dst, &entry->sizeof_dst,
+				    &entry->if_index, &entry->when);
+#else
+		entry->if_index = 0;
+		gettimeofday(&entry->when, NULL);
+#endif
+	}
+
+	mm->num = received;
+
+	return received;
+}
+
+/** Get a datagram which was read by #udp_recv_mmsg
+ *
+ * @param[in] mm batch to get the datagram from.
+ * @param[in] i index of the datagram.
+ * @param[out] data where to write a pointer to the datagram.  Only valid until
+ *	the next call to #udp_recv_mmsg.
+ * @param[out] src_ipaddr of the datagram.
+ * @param[out] src_port of the datagram.
+ * @param[out] dst_ipaddr of the datagram.
+ * @param[out] dst_port of the datagram.
+ * @param[out] if_index of the interface that received the datagram.
+ * @param[out] when the datagram was received.
+ * @return
+ *	- > 0 on success (length of the datagram).
+ *	- < 0 if the datagram was truncated, or is from an unknown address family.
+ */
+ssize_t udp_mmsg_get(udp_mmsg_t *mm, unsigned int i, uint8_t **data,
+		     fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		     fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		     struct timeval *when)
+{
+	udp_mmsg_entry_t	*entry;
+	struct msghdr		*msgh;
+
+	if (i >= mm->num) return -1;
+
+	entry = &mm->entry[i];
+	msgh = &mm->hdr[i].msg_hdr;
+
+	if ((msgh->msg_flags & MSG_TRUNC) != 0) {
+		FR_DEBUG_STRERROR_PRINTF("Discarding datagram: Larger than %zu bytes", mm->max_len);
+		return -1;
+	}
+
+	if (!fr_ipaddr_from_sockaddr(&entry->src, msgh->msg_namelen, src_ipaddr, src_port) ||
+	    !fr_ipaddr_from_sockaddr(&entry->dst, entry->sizeof_dst, dst_ipaddr, dst_port)) {
+		FR_DEBUG_STRERROR_PRINTF("Unknown address family");
+		return -1;
+	}
+
+	if (if_index) *if_index = entry->if_index;
+	if (when) *when = entry->when;
+
+	*data = entry->data;
+
+	return mm->hdr[i].msg_len;
+}
+
+/** Add a datagram to a batch, to be sent by #udp_send_mmsg
+ *
+ * The data is copied, so the caller may free it as soon as this function returns.
+ *
+ * @param[in] sockfd the batch will be written to.
+ * @param[in] mm batch to add the datagram to.
+ * @param[in] data to send.
+ * @param[in] data_len length of data to send.
+ * @param[in] src_ipaddr of the packet.
+ * @param[in] src_port of the packet.
+ * @param[in] if_index of the packet.
+ * @param[in] dst_ipaddr of the packet.
+ * @param[in] dst_port of the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the batch is full, or the datagram is too large.
+ */
+int udp_mmsg_add(UDP_UNUSED int sockfd, udp_mmsg_t *mm, void const *data, size_t data_len,
+		 UDP_UNUSED fr_ipaddr_t *src_ipaddr, UDP_UNUSED uint16_t src_port, UDP_UNUSED int if_index,
+		 fr_ipaddr_t *dst_ipaddr, uint16_t dst_port)
+{
+	udp_mmsg_entry_t	*entry;
+	struct msghdr		*msgh;
+
+	if (mm->num >= mm->size) {
+		fr_strerror_printf("Batch is full");
+		return -1;
+	}
+
+	if (data_len > mm->max_len) {
+		fr_strerror_printf("Datagram too large");
+		return -1;
+	}
+
+	entry = &mm->entry[mm->num];
+	msgh = &mm->hdr[mm->num].msg_hdr;
+
+	if (!fr_ipaddr_to_sockaddr(dst_ipaddr, dst_port, &entry->dst, &entry->sizeof_dst)) return -1;
+
+	memcpy(entry->data, data, data_len);
+	entry->iov.iov_base = entry->data;
+	entry->iov.iov_len = data_len;
+
+	msgh->msg_name = &entry->dst;
+	msgh->msg_namelen = entry->sizeof_dst;
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+	msgh->msg_flags = 0;
+
+#ifdef WITH_UDPFROMTO
+	/*
+	 *	Same rules as udp_send(), if they don't specify a
+	 *	source IP address, don't set one.
+	 */
+	if ((src_ipaddr->af != AF_UNSPEC) && (dst_ipaddr->af != AF_UNSPEC) &&
+	    !fr_is_inaddr_any(src_ipaddr)) {
+		socklen_t sizeof_src;
+
+		fr_ipaddr_to_sockaddr(src_ipaddr, src_port, &entry->src, &sizeof_src);
+
+		if (udpfromto_cmsg_send(sockfd, msgh, entry->cbuf,
+					(struct sockaddr *)&entry->src, sizeof_src, if_index) < 0) {
+			fr_strerror_printf("Failed setting source address: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
+	mm->num++;
+
+	return 0;
+}
+
+/** Send all of the datagrams in a batch with as few system calls as possible
+ *
+ * Datagrams which can't be sent are skipped.  The batch is empty when this
+ * function returns.
+ *
+ * @param[in] sockfd we're writing to.
+ * @param[in] mm batch to send.
+ * @return the number of datagrams sent.
+ */
+int udp_send_mmsg(int sockfd, udp_mmsg_t *mm)
+{
+	unsigned int	i = 0;
+	int		sent = 0;
+
+	while (i < mm->num) {
+		int rcode;
+
+		rcode = sendmmsg(sockfd, mm->hdr + i, mm->num - i, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	sendmmsg() only returns an error if the
+			 *	first datagram can't be sent.  Skip it and
+			 *	carry on with the rest.
+			 */
+			fr_strerror_printf("udp_sendmmsg failed: %s", fr_syserror(errno));
+			i++;
+			continue;
+		}
+
+		i += rcode;
+		sent += rcode;
+	}
+
+	mm->num = 0;
+
+	return sent;
+}
+#endif
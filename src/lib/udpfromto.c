@@ -157,6 +157,79 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Extract the destination address, interface and timestamp from a received message
+ *
+ * Used by recvfromto(), and by callers using recvmmsg() who need the same
+ * information for each message in the batch.
+ *
+ * @param[in] msgh as filled in by recvmsg() or recvmmsg().
+ * @param[in,out] to Destination address.  Should be initialised with the address
+ *	the socket is bound to, the IP address will be overwritten with the one
+ *	from the control data.
+ * @param[out] tolen Length of the structure pointed to by to.
+ * @param[out] if_index The interface which received the datagram (may be NULL).
+ * @param[out] when the packet was received (may be NULL).
+ */
+void udpfromto_cmsg_recv(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen,
+			 int *if_index, struct timeval *when)
+{
+	struct cmsghdr *cmsg;
+
+	if (if_index) *if_index = 0;
+	if (when) {
+		when->tv_sec = 0;
+		when->tv_usec = 0;
+	}
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*tolen = sizeof(struct sockaddr_in);
+			if (if_index) *if_index = i->ipi_ifindex;
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = *i;
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i =
+				(struct in6_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*tolen = sizeof(struct sockaddr_in6);
+			if (if_index) *if_index = i->ipi6_ifindex;
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
+		}
+#endif
+	}
+
+	if (when && !when->tv_sec) gettimeofday(when, NULL);
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -188,9 +261,8 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 	       int *if_index, struct timeval *when)
 {
 	struct msghdr msgh;
-	struct cmsghdr *cmsg;
 	struct iovec iov;
-	char cbuf[256];
+	char cbuf[UDPFROMTO_CMSG_LEN];
 	int err;
 	struct sockaddr_storage si;
 	socklen_t si_len = sizeof(si);
@@ -292,89 +364,32 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 
 	if (fromlen) *fromlen = msgh.msg_namelen;
 
-	if (if_index) *if_index = 0;
-	if (when) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-	}
-
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
-
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*tolen = sizeof(struct sockaddr_in);
-			if (if_index) *if_index = i->ipi_ifindex;
-			break;
-		}
-#endif
-
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = *i;
-			*tolen = sizeof(struct sockaddr_in);
-			break;
-		}
-#endif
-
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i =
-				(struct in6_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*tolen = sizeof(struct sockaddr_in6);
-			if (if_index) *if_index = i->ipi6_ifindex;
-			break;
-		}
-#endif
-
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
-		}
-#endif
-	}
-
-	if (when && !when->tv_sec) gettimeofday(when, NULL);
+	udpfromto_cmsg_recv(&msgh, to, tolen, if_index, when);
 
 	return err;
 }
 
-/** Send packet via a file descriptor, setting the src address and outbound interface
+/** Add the control data needed to set the src address and outbound interface of a message
  *
- * Abstracts away the complexity of using the complexity of using sendmsg().
+ * Used by sendfromto(), and by callers using sendmmsg() who need to set the
+ * source address of each message in the batch.
  *
- * @param[in] s The file descriptor to write to.
- * @param[out] buf Where to read datagram data.
- * @param[in] len of datagram data.
- * @param[in] flags passed unmolested to sendmsg.
- * @param[out] from The source address.
+ * @param[in] s The file descriptor the message will be written to.
+ * @param[in,out] msgh to add the control data to.
+ * @param[in] cbuf Buffer for the control data.  Must be at least #UDPFROMTO_CMSG_LEN bytes.
+ * @param[in] from The source address.
  * @param[in] fromlen Length of the structure pointed to by from.
- * @param[out] to The destination address.
- * @param[in] tolen Length of the structure pointed to by to.
- * @param[out] if_index The interface on which to send the datagram.  Only used if to
- *	is not NULL.  If automatic interface selection is desired, value should be 0.
+ * @param[in] if_index The interface on which to send the datagram.  If automatic
+ *	interface selection is desired, value should be 0.
  * @return
- *	- 0 on success.
+ *	- 1 if control data was added.
+ *	- 0 if no control data is needed, or it can't be set, and the message
+ *	  should be sent with sendto().
  *	- -1 on failure.
  */
-int sendfromto(int s, void *buf, size_t len, int flags,
-	       struct sockaddr *from, socklen_t fromlen,
-	       struct sockaddr *to, socklen_t tolen, int if_index)
+int udpfromto_cmsg_send(UNUSED int s, struct msghdr *msgh, char *cbuf,
+			struct sockaddr *from, socklen_t fromlen, int if_index)
 {
-	struct msghdr msgh;
-	struct iovec iov;
-	char cbuf[256];
-
 	/*
 	 *	Unknown address family, die.
 	 */
@@ -434,20 +449,12 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	 *	No "from", just use regular sendto.
 	 */
 	if (!from || (fromlen == 0)) {
-		return sendto(s, buf, len, flags, to, tolen);
+		msgh->msg_control = NULL;
+		msgh->msg_controllen = 0;
+		return 0;
 	}
 
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
-
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = tolen;
+	memset(cbuf, 0, UDPFROMTO_CMSG_LEN);
 
 # if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 	if (from->sa_family == AF_INET) {
@@ -457,10 +464,10 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -475,10 +482,10 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -496,10 +503,10 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -511,6 +518,55 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	}
 #  endif	/* IPV6_PKTINFO */
 
+	return 1;
+}
+
+/** Send packet via a file descriptor, setting the src address and outbound interface
+ *
+ * Abstracts away the complexity of using the complexity of using sendmsg().
+ *
+ * @param[in] s The file descriptor to write to.
+ * @param[out] buf Where to read datagram data.
+ * @param[in] len of datagram data.
+ * @param[in] flags passed unmolested to sendmsg.
+ * @param[out] from The source address.
+ * @param[in] fromlen Length of the structure pointed to by from.
+ * @param[out] to The destination address.
+ * @param[in] tolen Length of the structure pointed to by to.
+ * @param[out] if_index The interface on which to send the datagram.  Only used if to
+ *	is not NULL.  If automatic interface selection is desired, value should be 0.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sendfromto(int s, void *buf, size_t len, int flags,
+	       struct sockaddr *from, socklen_t fromlen,
+	       struct sockaddr *to, socklen_t tolen, int if_index)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	char cbuf[UDPFROMTO_CMSG_LEN];
+	int rcode;
+
+	/* Set up iov and msgh structures. */
+	memset(&msgh, 0, sizeof(msgh));
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = tolen;
+
+	rcode = udpfromto_cmsg_send(s, &msgh, cbuf, from, fromlen, if_index);
+	if (rcode < 0) return -1;
+
+	/*
+	 *	No "from", just use regular sendto.
+	 */
+	if (rcode == 0) return sendto(s, buf, len, flags, to, tolen);
+
 	return sendmsg(s, &msgh, flags);
 }
 
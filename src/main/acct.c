@@ -27,6 +27,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
 
 #ifdef WITH_ACCOUNTING
 /*
@@ -37,7 +38,9 @@ RCSID("$Id$")
  */
 int rad_accounting(REQUEST *request)
 {
-	int result = RLM_MODULE_OK;
+	int		result = RLM_MODULE_OK;
+	VALUE_PAIR	*vp;
+	int		acct_type = 0;
 
 
 #ifdef WITH_PROXY
@@ -46,14 +49,30 @@ int rad_accounting(REQUEST *request)
 #define WAS_PROXIED (0)
 #endif
 
+	/*
+	 *	A module in the preacct or accounting section was
+	 *	waiting for I/O, and the request has been given back
+	 *	to us.
+	 */
+	if (request->yield) {
+		rlm_components_t comp;
+
+		result = indexed_modcall_resume(request, &comp, &acct_type);
+		if (comp == MOD_PREACCT) goto preacct_resumed;
+
+		rad_assert(comp == MOD_ACCOUNTING);
+		goto accounting_resumed;
+	}
+
 	/*
 	 *	Run the modules only once, before proxying.
 	 */
 	if (!WAS_PROXIED) {
-		VALUE_PAIR	*vp;
-		int		acct_type = 0;
+		result = indexed_modcall_async(MOD_PREACCT, 0, request);
+
+	preacct_resumed:
+		if (result == RLM_MODULE_YIELD) return result;
 
-		result = process_preacct(request);
 		switch (result) {
 		/*
 		 *	The module has a number of OK return codes.
@@ -90,7 +109,11 @@ int rad_accounting(REQUEST *request)
 			DEBUG2("  Found Acct-Type %s",
 			       fr_dict_enum_name_by_da(NULL, vp->da, acct_type));
 		}
-		result = process_accounting(acct_type, request);
+		result = indexed_modcall_async(MOD_ACCOUNTING, acct_type, request);
+
+	accounting_resumed:
+		if (result == RLM_MODULE_YIELD) return result;
+
 		switch (result) {
 		/*
 		 *	In case the accounting module returns FAIL,
@@ -356,6 +356,19 @@ int rad_authenticate(REQUEST *request)
 	char		autz_retry = 0;
 	int		autz_type = 0;
 
+	/*
+	 *	A module in the authorize section was waiting for
+	 *	I/O, and the request has been given back to us.
+	 */
+	if (request->yield) {
+		rlm_components_t comp;
+
+		result = indexed_modcall_resume(request, &comp, &autz_type);
+		rad_assert(comp == MOD_AUTHORIZE);
+		autz_retry = (autz_type != 0);
+		goto autz_resumed;
+	}
+
 #ifdef WITH_PROXY
 	/*
 	 *	If this request got proxied to another server, we need
@@ -432,7 +445,11 @@ int rad_authenticate(REQUEST *request)
 	 *	Get the user's authorization information from the database
 	 */
 autz_redo:
-	result = process_authorize(autz_type, request);
+	result = indexed_modcall_async(MOD_AUTHORIZE, autz_type, request);
+
+autz_resumed:
+	if (result == RLM_MODULE_YIELD) return result;
+
 	switch (result) {
 	case RLM_MODULE_NOOP:
 	case RLM_MODULE_NOTFOUND:
@@ -661,6 +678,15 @@ int rad_virtual_server(REQUEST *request)
 	VALUE_PAIR *vp;
 	int result;
 
+	/*
+	 *	A module was waiting for I/O, and the request has
+	 *	been given back to us.
+	 */
+	if (request->yield) {
+		RINDENT();
+		goto resume;
+	}
+
 	RDEBUG("Virtual server %s received request", request->server);
 	rdebug_pair_list(L_DBG_LVL_1, request, request->packet->vps, NULL);
 
@@ -765,7 +791,12 @@ int rad_virtual_server(REQUEST *request)
 	 */
 	rad_assert(request->packet->code == PW_CODE_ACCESS_REQUEST);
 
+resume:
 	result = rad_authenticate(request);
+	if (result == RLM_MODULE_YIELD) {
+		REXDENT();
+		return result;
+	}
 
 	if (request->reply->code == PW_CODE_ACCESS_REJECT) {
 		fr_pair_delete_by_num(&request->config, 0, PW_POST_AUTH_TYPE, TAG_ANY);
@@ -2466,6 +2466,21 @@ static int command_stats_state(rad_listen_t *listener, UNUSED int argc, UNUSED c
 	return CMD_OK;
 }
 
+static int command_stats_pool(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	request_pool_stats_t stats;
+
+	request_pool_stats_get(&stats);
+
+	cprintf(listener, "pool_size\t\t%" PRIu32 "\n", stats.size);
+	cprintf(listener, "pool_p95\t\t%" PRIu32 "\n", stats.p95);
+	cprintf(listener, "pool_max\t\t%zu\n", stats.max);
+	cprintf(listener, "pool_sampled\t\t%" PRIu64 "\n", stats.sampled);
+	cprintf(listener, "pool_overflows\t\t%" PRIu64 "\n", stats.overflows);
+
+	return CMD_OK;
+}
+
 static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
 	int array[RAD_LISTEN_MAX], pps[2];
@@ -2484,6 +2499,58 @@ static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED c
 	return CMD_OK;
 }
 
+#ifdef WITH_TLS
+static int command_stats_tls(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	tls_stats_t	stats;
+	uint64_t	handshakes;
+
+	tls_stats_get(&stats);
+	handshakes = stats.handshakes_full + stats.handshakes_resumed;
+
+	cprintf(listener, "handshakes_full\t\t%" PRIu64 "\n", stats.handshakes_full);
+	cprintf(listener, "handshakes_resumed\t%" PRIu64 "\n", stats.handshakes_resumed);
+	cprintf(listener, "resumption_rate\t\t%.1f%%\n",
+		handshakes ? ((double)stats.handshakes_resumed * 100) / handshakes : 0.0);
+	cprintf(listener, "handshake_cpu_usec\t%" PRIu64 "\n", stats.handshake_cpu_usec);
+	cprintf(listener, "handshakes_per_core\t%.1f/s\n",
+		stats.handshake_cpu_usec ? ((double)handshakes * 1000000) / stats.handshake_cpu_usec : 0.0);
+
+	cprintf(listener, "tickets_issued\t\t%" PRIu64 "\n", stats.tickets_issued);
+	cprintf(listener, "tickets_accepted\t%" PRIu64 "\n", stats.tickets_accepted);
+	cprintf(listener, "tickets_rejected\t%" PRIu64 "\n", stats.tickets_rejected);
+
+	cprintf(listener, "cache_hits\t\t%" PRIu64 "\n", stats.cache_hits);
+	cprintf(listener, "cache_misses\t\t%" PRIu64 "\n", stats.cache_misses);
+	cprintf(listener, "cache_inserts\t\t%" PRIu64 "\n", stats.cache_inserts);
+	cprintf(listener, "cache_expired\t\t%" PRIu64 "\n", stats.cache_expired);
+	cprintf(listener, "cache_evictions\t\t%" PRIu64 "\n", stats.cache_evictions);
+
+	return CMD_OK;
+}
+#endif
+
+#ifdef HAVE_REGEX
+static int command_stats_regex(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	regex_cache_stats_t	stats;
+	uint64_t		lookups;
+
+	regex_cache_stats_get(&stats);
+	lookups = stats.hits + stats.misses;
+
+	cprintf(listener, "cache_size\t\t%u\n", stats.max_entries);
+	cprintf(listener, "cache_entries\t\t%u\n", stats.entries);
+	cprintf(listener, "cache_hits\t\t%" PRIu64 "\n", stats.hits);
+	cprintf(listener, "cache_misses\t\t%" PRIu64 "\n", stats.misses);
+	cprintf(listener, "cache_evictions\t\t%" PRIu64 "\n", stats.evictions);
+	cprintf(listener, "cache_hit_rate\t\t%.1f%%\n",
+		lookups ? ((double)stats.hits * 100) / lookups : 0.0);
+
+	return CMD_OK;
+}
+#endif
+
 #ifndef NDEBUG
 static int command_stats_memory(rad_listen_t *listener, int argc, char *argv[])
 {
@@ -2735,7 +2802,22 @@ static int command_stats_socket(rad_listen_t *listener, int argc, char *argv[])
 
 	if (sock->type != RAD_LISTEN_AUTH) auth = false;
 
-	return command_print_stats(listener, &sock->stats, auth, 0);
+	command_print_stats(listener, &sock->stats, auth, 0);
+
+#ifdef WITH_UDP_MMSG
+	if (sock->batch) {
+		listen_socket_t *data = sock->data;
+
+		cprintf(listener, "recv_batches\t%" PRIu64 "\n", data->recv_batches);
+		cprintf(listener, "recv_batch_packets\t%" PRIu64 "\n", data->recv_batch_packets);
+		cprintf(listener, "recv_batch_max\t%u\n", data->recv_batch_max);
+		cprintf(listener, "send_batches\t%" PRIu64 "\n", data->send_batches);
+		cprintf(listener, "send_batch_packets\t%" PRIu64 "\n", data->send_batch_packets);
+		cprintf(listener, "send_batch_max\t%u\n", data->send_batch_max);
+	}
+#endif
+
+	return CMD_OK;
 }
 #endif	/* WITH_STATS */
 
@@ -2887,6 +2969,10 @@ static fr_command_table_t command_table_stats[] = {
 	  command_stats_home_server, NULL },
 #endif
 
+	{ "pool", FR_READ,
+	  "stats pool - show statistics for the memory pools used by requests",
+	  command_stats_pool, NULL },
+
 	{ "queue", FR_READ,
 	  "stats queue - show statistics for packet queues",
 	  command_stats_queue, NULL },
@@ -2895,6 +2981,18 @@ static fr_command_table_t command_table_stats[] = {
 	  "stats state - show statistics for states",
 	  command_stats_state, NULL },
 
+#ifdef WITH_TLS
+	{ "tls", FR_READ,
+	  "stats tls - show statistics for TLS handshakes and session resumption",
+	  command_stats_tls, NULL },
+#endif
+
+#ifdef HAVE_REGEX
+	{ "regex", FR_READ,
+	  "stats regex - show statistics for the cache of regexes compiled at runtime",
+	  command_stats_regex, NULL },
+#endif
+
 	{ "socket", FR_READ,
 	  "stats socket <ipaddr> <port> [udp|tcp] "
 	  "- show statistics for given socket",
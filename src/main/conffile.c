@@ -1433,7 +1433,11 @@ int cf_section_parse_pass2(CONF_SECTION *cs, void *base, CONF_PARSER const varia
 		}
 
 		/*
-		 *	Parse (and throw away) the xlat string (for validation).
+		 *	Parse the xlat string (for validation).
+		 *
+		 *	The tree is kept for the copy of the string the
+		 *	module uses, so that it doesn't have to be parsed
+		 *	again each time the module expands it.
 		 *
 		 *	FIXME: All of these should be converted from PW_TYPE_XLAT
 		 *	to PW_TYPE_TMPL.
@@ -1468,6 +1472,14 @@ int cf_section_parse_pass2(CONF_SECTION *cs, void *base, CONF_PARSER const varia
 				return -1;
 			}
 
+			/*
+			 *	Only single strings hold a copy of
+			 *	this CONF_PAIR's value.
+			 */
+			if (!multi && xlat && (type == PW_TYPE_STRING) && *(char const **)data &&
+			    (strcmp(*(char const **)data, cp->value) == 0) &&
+			    (xlat_compiled_add(*(char const **)data, value, xlat) == 0)) continue;
+
 			talloc_free(value);
 			talloc_free(xlat);
 
@@ -185,8 +185,8 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	default:
 		if (!rad_cond_assert(rhs_type == PW_TYPE_STRING)) return -1;
 		if (!rad_cond_assert(rhs && rhs->strvalue)) return -1;
-		slen = regex_compile(request, &rreg, rhs->strvalue, rhs->length,
-				     map->rhs->tmpl_iflag, map->rhs->tmpl_mflag, true, true);
+		slen = regex_cache_compile(request, &rreg, rhs->strvalue, rhs->length,
+					   map->rhs->tmpl_iflag, map->rhs->tmpl_mflag);
 		if (slen <= 0) {
 			REMARKER(rhs->strvalue, -slen, fr_strerror());
 			EVAL_DEBUG("FAIL %d", __LINE__);
@@ -218,7 +218,7 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 		break;
 	}
 
-	if (preg) talloc_free(rreg);
+	if (preg && rreg) regex_cache_release(rreg);
 
 	return ret;
 }
@@ -71,6 +71,244 @@ static void safe_unlock(module_instance_t *instance)
 		pthread_mutex_unlock(instance->mutex);
 }
 
+/*
+ *	State kept whilst a module waits for I/O.
+ */
+struct modcall_yield_t {
+	REQUEST			*request;	//!< Which is waiting.
+	modcall_resume_t	resume;		//!< Called once the I/O has completed.
+	modcall_cancel_t	cancel;		//!< Called to abort the I/O when the server stops.
+	void			*ctx;		//!< Passed to resume and cancel.
+
+	bool			signalled;	//!< The I/O has completed.
+	bool			parked;		//!< The request was given up by its thread, and
+						//!< must be queued again when signalled.
+	pthread_cond_t		cond;		//!< For callers which wait for the I/O to complete.
+
+	struct modcall_stack_t	*stack;		//!< Interpreter stack, whilst the request is parked.
+
+	modcall_yield_t		*prev;		//!< Previous yield which hasn't been resumed.
+	modcall_yield_t		*next;		//!< Next yield which hasn't been resumed.
+};
+
+/*
+ *	Protects signalled and parked, for all requests, and the list
+ *	of yields.  They're only touched a few times per yield, so
+ *	there's no point in having one per request.
+ */
+static pthread_mutex_t modcall_yield_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *	Yields which haven't been resumed, so that they can be
+ *	cancelled when the server stops.
+ */
+static modcall_yield_t *modcall_yield_head = NULL;
+static bool modcall_yield_stopping = false;
+static pthread_cond_t modcall_yield_drained = PTHREAD_COND_INITIALIZER;
+
+static int _modcall_yield_free(modcall_yield_t *yield)
+{
+	pthread_mutex_lock(&modcall_yield_mutex);
+	if (yield->prev) {
+		yield->prev->next = yield->next;
+	} else {
+		modcall_yield_head = yield->next;
+	}
+	if (yield->next) yield->next->prev = yield->prev;
+
+	if (!modcall_yield_head && modcall_yield_stopping) pthread_cond_broadcast(&modcall_yield_drained);
+	pthread_mutex_unlock(&modcall_yield_mutex);
+
+	pthread_cond_destroy(&yield->cond);
+	return 0;
+}
+
+/** Tell the interpreter that a module is waiting for I/O
+ *
+ * Must be called before the module starts the I/O, and the module must
+ * then return the result of this function.  Once the I/O has completed,
+ * something (usually another thread) calls modcall_signal(), and the
+ * interpreter calls resume, with the same instance the module was called
+ * with.  The result of resume is used as the result of the module.
+ *
+ * Where possible, the thread running the request goes off to do other
+ * work in the meantime.  Otherwise the interpreter waits for the signal.
+ *
+ * If the module doesn't return #RLM_MODULE_YIELD after all, the yield
+ * is cancelled, and modcall_signal() must not be called.
+ *
+ * When the server stops, cancel is called for each request which is still
+ * waiting, so that it's resumed (on a worker thread, as usual) before the
+ * modules are detached.  cancel is called with the yield mutex held, so it
+ * must not call modcall_signal() itself.  It should abort the I/O, and leave
+ * whatever is performing it to signal the request.  If cancel is NULL, the
+ * server waits for the I/O to complete.
+ *
+ * @param[in] request	which is waiting.
+ * @param[in] resume	function to call when the I/O has completed.
+ * @param[in] cancel	function to call to abort the I/O, may be NULL.
+ * @param[in] ctx	to pass to resume and cancel.
+ * @return
+ *	- #RLM_MODULE_YIELD on success.
+ *	- #RLM_MODULE_FAIL if we're out of memory, or the server is stopping.
+ *	  The module must not start the I/O.
+ */
+rlm_rcode_t modcall_yield(REQUEST *request, modcall_resume_t resume, modcall_cancel_t cancel, void *ctx)
+{
+	modcall_yield_t *yield;
+
+	rad_assert(request->yield == NULL);
+
+	yield = talloc_zero(request, modcall_yield_t);
+	if (!yield) return RLM_MODULE_FAIL;
+
+	yield->request = request;
+	yield->resume = resume;
+	yield->cancel = cancel;
+	yield->ctx = ctx;
+	pthread_cond_init(&yield->cond, NULL);
+
+	pthread_mutex_lock(&modcall_yield_mutex);
+	if (modcall_yield_stopping) {
+		pthread_mutex_unlock(&modcall_yield_mutex);
+
+		REDEBUG("Not waiting for I/O, the server is stopping");
+		pthread_cond_destroy(&yield->cond);
+		talloc_free(yield);
+		return RLM_MODULE_FAIL;
+	}
+	yield->next = modcall_yield_head;
+	if (yield->next) yield->next->prev = yield;
+	modcall_yield_head = yield;
+	pthread_mutex_unlock(&modcall_yield_mutex);
+
+	talloc_set_destructor(yield, _modcall_yield_free);
+
+	request->yield = yield;
+
+	return RLM_MODULE_YIELD;
+}
+
+/** Tell the interpreter that the I/O a module was waiting for has completed
+ *
+ * May be called from any thread, exactly once per call to modcall_yield().
+ * The caller must not touch the request afterwards.
+ *
+ * @param[in] request	which was waiting.
+ */
+void modcall_signal(REQUEST *request)
+{
+	modcall_yield_t	*yield;
+	bool		parked;
+
+	pthread_mutex_lock(&modcall_yield_mutex);
+	yield = request->yield;
+	rad_assert(yield != NULL);
+	rad_assert(!yield->signalled);
+
+	yield->signalled = true;
+	parked = yield->parked;
+	yield->parked = false;
+	if (!parked) pthread_cond_signal(&yield->cond);
+	pthread_mutex_unlock(&modcall_yield_mutex);
+
+	/*
+	 *	Nothing else has a reference to the request, so
+	 *	it's up to us to get it run again.
+	 */
+	if (parked) request_resume(request);
+}
+
+/** Give up the thread running a request, whilst a module waits for I/O
+ *
+ * @param[in] request	which is waiting.
+ * @return
+ *	- true if the request is parked.  The caller must not touch it again.
+ *	- false if the I/O has already completed, and the request should be resumed now.
+ */
+bool modcall_park(REQUEST *request)
+{
+	bool parked;
+
+	rad_assert(request->yield != NULL);
+
+	pthread_mutex_lock(&modcall_yield_mutex);
+	parked = !request->yield->signalled;
+	request->yield->parked = parked;
+	pthread_mutex_unlock(&modcall_yield_mutex);
+
+	return parked;
+}
+
+/*
+ *	Wait for the I/O a module is doing to complete.
+ */
+static void modcall_wait(REQUEST *request)
+{
+	modcall_yield_t *yield = request->yield;
+
+	pthread_mutex_lock(&modcall_yield_mutex);
+	while (!yield->signalled) pthread_cond_wait(&yield->cond, &modcall_yield_mutex);
+	pthread_mutex_unlock(&modcall_yield_mutex);
+}
+
+/*
+ *	Check that a module which yielded called modcall_yield(), and
+ *	that one which didn't, didn't.
+ */
+static void modcall_yield_check(REQUEST *request, modsingle *sp)
+{
+	if (request->rcode == RLM_MODULE_YIELD) {
+		if (request->yield) return;
+
+		RERROR("Module %s returned yield without calling modcall_yield()", sp->modinst->name);
+		request->rcode = RLM_MODULE_FAIL;
+		return;
+	}
+
+	TALLOC_FREE(request->yield);
+}
+
+/*
+ *	Call the resume function of a module whose I/O has completed.
+ */
+static rlm_rcode_t CC_HINT(nonnull) call_modresume(rlm_components_t component, modsingle *sp, REQUEST *request)
+{
+	modcall_yield_t		*yield = request->yield;
+	modcall_resume_t	resume = yield->resume;
+	void			*ctx = yield->ctx;
+
+	rad_assert(yield->signalled);
+	rad_assert(yield->stack == NULL);
+
+	request->yield = NULL;
+	talloc_free(yield);
+
+	RDEBUG3("modsingle[%s]: resuming %s (%s) for request %d",
+		comp2str[component], sp->modinst->name,
+		sp->modinst->module->name, request->number);
+
+	/*
+	 *	Always call the module, even if the request has been
+	 *	told to stop, so that it can clean up.
+	 */
+	request->module = sp->modinst->name;
+
+	safe_lock(sp->modinst);
+	request->rcode = resume(request, sp->modinst->data, ctx);
+	safe_unlock(sp->modinst);
+
+	request->module = NULL;
+
+	modcall_yield_check(request, sp);
+
+	RDEBUG3("modsingle[%s]: returned from %s (%s) for request %d",
+		comp2str[component], sp->modinst->name,
+		sp->modinst->module->name, request->number);
+
+	return request->rcode;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, modsingle *sp, REQUEST *request)
 {
 	int blocked;
@@ -101,6 +339,8 @@ static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, m
 
 	request->module = NULL;
 
+	modcall_yield_check(request, sp);
+
 	/*
 	 *	Wasn't blocked, and now is.  Complain!
 	 */
@@ -153,7 +393,10 @@ typedef struct modcall_stack_entry_t {
 
 typedef struct modcall_stack_t {
 	rlm_components_t component;
+	int idx;			/* of the Autz-Type, Acct-Type, etc. section */
 	int depth;
+	bool yielded;			/* a module in the top frame is waiting for I/O */
+	uint8_t indent;			/* to restore when the module is resumed */
 	modcall_stack_entry_t entry[MODCALL_STACK_MAX];
 } modcall_stack_t;
 
@@ -162,7 +405,8 @@ typedef enum modcall_action_t {
 	MODCALL_NEXT_SIBLING,
 	MODCALL_PUSHED_CHILD,
 	MODCALL_CALL_CHILD_AND_RESUME,
-	MODCALL_BREAK
+	MODCALL_BREAK,
+	MODCALL_YIELD
 } modcall_action_t;
 
 
@@ -678,7 +922,17 @@ static modcall_action_t modcall_single(REQUEST *request, modcall_stack_t *stack,
 	 */
 	sp = mod_callabletosingle(c);
 
-	*presult = call_modsingle(c->method, sp, request);
+	if (request->yield) {
+		*presult = call_modresume(c->method, sp, request);
+	} else {
+		*presult = call_modsingle(c->method, sp, request);
+	}
+
+	if (*presult == RLM_MODULE_YIELD) {
+		RDEBUG2("%s (yield)", c->name ? c->name : "");
+		return MODCALL_YIELD;
+	}
+
 	*priority = c->actions[*presult];
 
 	RDEBUG2("%s (%s)", c->name ? c->name : "",
@@ -849,6 +1103,22 @@ static void modcall_interpret(REQUEST *request, modcall_stack_t *stack, rlm_rcod
 	modcall_stack_entry_t *entry;
 	modcall_action_t action = MODCALL_BREAK;
 
+	/*
+	 *	A module in the top frame was waiting for I/O.  Go
+	 *	straight back to it, skipping the checks, so that it
+	 *	can clean up even if we've been told to stop.
+	 */
+	if (stack->yielded) {
+		stack->yielded = false;
+
+		result = RLM_MODULE_UNKNOWN;
+		priority = -1;
+
+		entry = &stack->entry[stack->depth];
+		c = entry->c;
+		goto resume;
+	}
+
 redo:
 	result = RLM_MODULE_UNKNOWN;
 	priority = -1;
@@ -882,11 +1152,23 @@ redo:
 
 		if (modcall_brace[c->type]) RDEBUG2("%s {", c->debug_name);
 
+	resume:
 		action = modcall_functions[c->type](request, stack, &result, &priority);
 		switch (action) {
 		case MODCALL_PUSHED_CHILD:
 			goto redo;
 
+		case MODCALL_YIELD:
+			/*
+			 *	Leave everything as it is.  We're called
+			 *	again with the same stack once the I/O has
+			 *	completed.
+			 */
+			stack->yielded = true;
+			*presult = RLM_MODULE_YIELD;
+			*ppriority = priority;
+			return;
+
 		case MODCALL_CALL_CHILD_AND_RESUME:
 			/*
 			 *	push child, run child, and resume with
@@ -1045,8 +1327,203 @@ int modcall(rlm_components_t component, modcallable *c, REQUEST *request)
 	 */
 	modcall_interpret(request, &stack, &result, &priority);
 
+	/*
+	 *	We can't give up the thread, so wait for any module
+	 *	which yields.
+	 */
+	while (result == RLM_MODULE_YIELD) {
+		modcall_wait(request);
+		modcall_interpret(request, &stack, &result, &priority);
+	}
+
 	/*
 	 *	Return the result.
 	 */
 	return result;
 }
+
+/*
+ *	Move a stack which has yielded off of the C stack, so that
+ *	it can be resumed by another thread.
+ */
+static modcall_stack_t *modcall_stack_save(REQUEST *request, modcall_stack_t *stack)
+{
+	modcall_stack_t *saved;
+#ifdef WITH_UNLANG
+	int i;
+#endif
+
+	saved = talloc_memdup(request, stack, sizeof(*stack));
+	if (!saved) return NULL;
+
+#ifdef WITH_UNLANG
+	/*
+	 *	xlat_foreach() finds the current value of each
+	 *	"foreach" via a pointer into the stack.
+	 */
+	for (i = 1; i <= saved->depth; i++) {
+		modcall_stack_entry_t *entry = &saved->entry[i];
+
+		if (!entry->resume || (entry->c->type != MOD_FOREACH)) continue;
+
+		request_data_add(request, (void *)radius_get_vp, entry->foreach.depth,
+				 &entry->foreach.variable, false, false, false);
+	}
+#endif
+
+	return saved;
+}
+
+/** Call a module section, giving up the thread if a module yields
+ *
+ * If the request isn't being run by a worker thread, this is the same
+ * as modcall().
+ *
+ * @param[in] component	of the section.
+ * @param[in] idx	of the Autz-Type, Acct-Type, etc. sub-section, or 0.
+ * @param[in] c		section to call.
+ * @param[in] request	to run.
+ * @return
+ *	- #RLM_MODULE_YIELD if a module is waiting for I/O.  The caller
+ *	  should return, and then call modcall_park().  Once the request
+ *	  is resumed, it should call modcall_resume().
+ *	- The result of the section.
+ */
+rlm_rcode_t modcall_async(rlm_components_t component, int idx, modcallable *c, REQUEST *request)
+{
+	int priority;
+	rlm_rcode_t result;
+	modcall_stack_t stack;
+	uint8_t indent = request->log.unlang_indent;
+
+	if (!request->can_park) return modcall(component, c, request);
+
+	memset(&stack, 0, sizeof(stack));
+
+	result = default_component_results[component];
+	priority = 0;
+
+	stack.component = component;
+	stack.idx = idx;
+	stack.depth = 0;
+
+	modcall_push(&stack, c, result, true);
+
+	modcall_interpret(request, &stack, &result, &priority);
+	if (result != RLM_MODULE_YIELD) return result;
+
+	rad_assert(request->yield != NULL);
+
+	request->yield->stack = modcall_stack_save(request, &stack);
+	if (!request->yield->stack) {
+		while (result == RLM_MODULE_YIELD) {
+			modcall_wait(request);
+			modcall_interpret(request, &stack, &result, &priority);
+		}
+		return result;
+	}
+
+	request->yield->stack->indent = request->log.unlang_indent;
+	request->log.unlang_indent = indent;
+
+	return RLM_MODULE_YIELD;
+}
+
+/** Continue a module section, after the module which yielded has been signalled
+ *
+ * @param[in] request		to run.
+ * @param[out] component	of the section.
+ * @param[out] idx		of the section, as passed to modcall_async().
+ * @return
+ *	- #RLM_MODULE_YIELD if another module is waiting for I/O.
+ *	- The result of the section.
+ */
+rlm_rcode_t modcall_resume(REQUEST *request, rlm_components_t *component, int *idx)
+{
+	int priority;
+	rlm_rcode_t result;
+	modcall_stack_t *stack;
+	uint8_t indent = request->log.unlang_indent;
+
+	rad_assert(request->yield != NULL);
+	rad_assert(request->yield->stack != NULL);
+
+	stack = request->yield->stack;
+	request->yield->stack = NULL;
+
+	*component = stack->component;
+	*idx = stack->idx;
+
+	request->component = comp2str[stack->component];
+	request->log.unlang_indent = stack->indent;
+
+	modcall_interpret(request, stack, &result, &priority);
+	if (result == RLM_MODULE_YIELD) {
+		rad_assert(request->yield != NULL);
+
+		stack->indent = request->log.unlang_indent;
+		request->log.unlang_indent = indent;
+		request->yield->stack = stack;
+
+		return RLM_MODULE_YIELD;
+	}
+
+	talloc_free(stack);
+
+	return result;
+}
+
+/** Finish a parked request which won't be run again
+ *
+ * Called by a worker thread, when a request which was told to stop
+ * whilst it was parked is resumed.  The module which yielded is resumed
+ * so that it can clean up, and the rest of the section is skipped.
+ *
+ * @param[in] request	which was parked.
+ */
+void modcall_cancel(REQUEST *request)
+{
+	int priority;
+	rlm_rcode_t result;
+	modcall_stack_t *stack;
+
+	if (!request->yield || !request->yield->stack) return;
+
+	rad_assert(request->master_state == REQUEST_STOP_PROCESSING);
+
+	stack = request->yield->stack;
+	request->yield->stack = NULL;
+
+	do {
+		modcall_wait(request);
+		modcall_interpret(request, stack, &result, &priority);
+	} while (result == RLM_MODULE_YIELD);
+
+	talloc_free(stack);
+}
+
+/** Resume every request which is waiting for I/O, before the server stops
+ *
+ * Modules are asked to abort the I/O they're performing, via the cancel
+ * function they passed to modcall_yield().  The requests are resumed by
+ * worker threads as usual, so the thread pool must still be running.
+ * Once this has been called, modcall_yield() fails.
+ *
+ * Returns once all of the requests have been resumed.
+ */
+void modcall_cancel_all(void)
+{
+	modcall_yield_t *yield;
+
+	pthread_mutex_lock(&modcall_yield_mutex);
+	modcall_yield_stopping = true;
+
+	for (yield = modcall_yield_head; yield; yield = yield->next) {
+		if (yield->signalled || !yield->cancel) continue;
+
+		yield->cancel(yield->request, yield->ctx);
+	}
+
+	while (modcall_yield_head) pthread_cond_wait(&modcall_yield_drained, &modcall_yield_mutex);
+	pthread_mutex_unlock(&modcall_yield_mutex);
+}
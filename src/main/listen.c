@@ -116,6 +116,7 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 	fr_dict_enum_t const *dv;
 	void	*handle = NULL;
 	fr_protocol_t	*proto = NULL;
+	uint32_t	i;
 
 	if (!listen_ctx) listen_ctx = talloc_init("listen_config_t");
 
@@ -332,6 +333,32 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 
 	if (handle) talloc_set_destructor(lc, _listen_config_free);
 
+	/*
+	 *	Open the socket once for each network thread.  The
+	 *	copies are independent listeners, parsed from the same
+	 *	configuration.
+	 */
+	for (i = 1; i < lc->listener->reuseport; i++) {
+		listen_config_t *copy;
+
+		copy = talloc_zero(listen_ctx, listen_config_t);
+		if (!copy) return -1;
+
+		copy->server = server;
+		copy->cs = cs;
+		copy->server_name = server_name;
+		copy->type = lc->type;
+		copy->proto = proto;
+
+		copy->listener = listen_parse(copy);
+		if (!copy->listener) {
+			talloc_free(copy);
+			return -1;
+		}
+
+		lc->next = copy;
+		lc = copy;
+	}
 
 	return 0;
 }
@@ -1222,6 +1249,10 @@ static CONF_PARSER performance_config[] = {
 	{ FR_CONF_OFFSET("synchronous", PW_TYPE_BOOLEAN, rad_listen_t, synchronous) },
 
 	{ FR_CONF_OFFSET("workers", PW_TYPE_INTEGER, rad_listen_t, workers) },
+
+	{ FR_CONF_OFFSET("batch", PW_TYPE_INTEGER, rad_listen_t, batch) },
+
+	{ FR_CONF_OFFSET("reuseport", PW_TYPE_INTEGER, rad_listen_t, reuseport) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1238,6 +1269,329 @@ static CONF_PARSER limit_config[] = {
 };
 
 
+#ifdef WITH_UDP_MMSG
+/*
+ *	Batched I/O.  Requests are read with recvmmsg(), and replies
+ *	are collected and written with sendmmsg().
+ *
+ *	Replies are held while the event loop processes a batch of
+ *	requests, and written when it's done.  Replies from worker
+ *	threads are written immediately, unless another thread is
+ *	already writing, in which case that thread picks them up.
+ *	So a reply is never delayed waiting for more replies.
+ */
+
+/*
+ *	A packet from a batch which has been read, but not yet
+ *	verified.  Their authenticators are checked together by
+ *	udp_socket_batch_verify(), which uses the SIMD MD5 code.
+ */
+typedef struct listen_pending_t {
+	TALLOC_CTX		*ctx;
+	RADIUS_PACKET		*packet;
+	RADCLIENT		*client;
+	RAD_REQUEST_FUNP	fun;
+} listen_pending_t;
+
+static int udp_socket_batch_init(rad_listen_t *this)
+{
+	listen_socket_t *sock = this->data;
+
+	sock->recv_mmsg = udp_mmsg_alloc(sock, this->batch, MAX_RADIUS_LEN);
+	if (!sock->recv_mmsg) {
+	error:
+		ERROR("Failed allocating batch buffers: %s", fr_strerror());
+		return -1;
+	}
+
+	sock->recv_pending = talloc_array(sock, listen_pending_t, this->batch);
+	if (!sock->recv_pending) goto error;
+
+	sock->send_mmsg_out = udp_mmsg_alloc(sock, this->batch, MAX_RADIUS_LEN);
+	if (!sock->send_mmsg_out) goto error;
+
+	if (pthread_mutex_init(&sock->send_mutex, NULL) != 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Set last, _listener_free uses this to check if the
+	 *	mutex needs to be destroyed.
+	 */
+	sock->send_mmsg = udp_mmsg_alloc(sock, this->batch, MAX_RADIUS_LEN);
+	if (!sock->send_mmsg) {
+		pthread_mutex_destroy(&sock->send_mutex);
+		goto error;
+	}
+
+	return 0;
+}
+
+/*
+ *	Write any replies which are waiting.  Must be called with
+ *	send_mutex held, and returns with it held.
+ */
+static void udp_socket_batch_flush(rad_listen_t *listener)
+{
+	listen_socket_t *sock = listener->data;
+
+	sock->send_busy = true;
+
+	while (udp_mmsg_num(sock->send_mmsg) > 0) {
+		udp_mmsg_t	*out = sock->send_mmsg;
+		unsigned int	num;
+		int		sent;
+
+		/*
+		 *	Other threads can add replies to the empty
+		 *	batch while we're writing this one.
+		 */
+		sock->send_mmsg = sock->send_mmsg_out;
+		sock->send_mmsg_out = out;
+		num = udp_mmsg_num(out);
+
+		pthread_mutex_unlock(&sock->send_mutex);
+		sent = udp_send_mmsg(listener->fd, out);
+		if (sent < (int) num) ERROR("Failed sending %u replies: %s", num - sent, fr_strerror());
+		pthread_mutex_lock(&sock->send_mutex);
+
+		sock->send_batches++;
+		sock->send_batch_packets += num;
+		if (num > sock->send_batch_max) sock->send_batch_max = num;
+	}
+
+	sock->send_busy = false;
+}
+
+/*
+ *	Send a reply, adding it to the current batch if there's
+ *	space.
+ *
+ *	The reply is encoded and signed before the mutex is taken, so
+ *	the lock is only held to copy it into the batch.
+ */
+static int udp_socket_batch_send(rad_listen_t *listener, RADIUS_PACKET *packet,
+				 RADIUS_PACKET const *original, char const *secret)
+{
+	listen_socket_t *sock = listener->data;
+
+	if (fr_radius_send_encode(packet, original, secret) < 0) return -1;
+
+	pthread_mutex_lock(&sock->send_mutex);
+	if (udp_mmsg_num(sock->send_mmsg) >= listener->batch) {
+		pthread_mutex_unlock(&sock->send_mutex);
+
+		return fr_radius_send(packet, original, secret);
+	}
+
+	if (fr_radius_send_mmsg(sock->send_mmsg, packet) < 0) {
+		pthread_mutex_unlock(&sock->send_mutex);
+		return -1;
+	}
+
+	if (!sock->send_hold && !sock->send_busy) udp_socket_batch_flush(listener);
+	pthread_mutex_unlock(&sock->send_mutex);
+
+	return 0;
+}
+
+typedef int (*udp_socket_recv_packet_t)(rad_listen_t *listener, udp_mmsg_t *mm, unsigned int i);
+
+/*
+ *	Verify the authenticators of all of the packets which were
+ *	read in a batch, and pass the good ones to the server core.
+ */
+static int udp_socket_batch_verify(rad_listen_t *listener)
+{
+	listen_socket_t		*sock = listener->data;
+	uint32_t		i, num = sock->num_pending;
+	int			processed = 0;
+	RADIUS_PACKET		*packets[num];
+	char const		*secrets[num];
+	int			rcode[num];
+
+	if (!num) return 0;
+	sock->num_pending = 0;
+
+	for (i = 0; i < num; i++) {
+		packets[i] = sock->recv_pending[i].packet;
+		secrets[i] = sock->recv_pending[i].client->secret;
+	}
+
+	(void) fr_radius_verify_multi(packets, NULL, secrets, rcode, num);
+
+	for (i = 0; i < num; i++) {
+		listen_pending_t	*pending = &sock->recv_pending[i];
+		RADCLIENT		*client = pending->client;
+
+		if (rcode[i] < 0) {
+			char buffer[INET6_ADDRSTRLEN];
+
+			if (listener->type == RAD_LISTEN_AUTH) {
+				FR_STATS_INC(auth, total_bad_authenticators);
+			}
+#ifdef WITH_ACCOUNTING
+			else {
+				FR_STATS_INC(acct, total_bad_authenticators);
+			}
+#endif
+
+			if (DEBUG_ENABLED) ERROR("Dropping %s packet from client %s (%s) with invalid authenticator",
+						 fr_packet_codes[pending->packet->code], client->shortname,
+						 inet_ntop(pending->packet->src_ipaddr.af,
+							   &pending->packet->src_ipaddr.ipaddr,
+							   buffer, sizeof(buffer)));
+			talloc_free(pending->ctx);
+			continue;
+		}
+
+		if (!request_receive(pending->ctx, listener, pending->packet, client, pending->fun)) {
+			if (listener->type == RAD_LISTEN_AUTH) {
+				FR_STATS_INC(auth, total_packets_dropped);
+			}
+#ifdef WITH_ACCOUNTING
+			else {
+				FR_STATS_INC(acct, total_packets_dropped);
+			}
+#endif
+			talloc_free(pending->ctx);
+			continue;
+		}
+
+		processed++;
+	}
+
+	return processed;
+}
+
+/*
+ *	Read as many packets as are available (up to "batch"), and
+ *	process them.
+ */
+static int udp_socket_batch_recv(rad_listen_t *listener, udp_socket_recv_packet_t recv_packet)
+{
+	listen_socket_t	*sock = listener->data;
+	int		num, i, processed = 0;
+
+	num = udp_recv_mmsg(listener->fd, sock->recv_mmsg);
+	if (num <= 0) {
+		if ((num < 0) && DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+		return 0;
+	}
+
+	sock->recv_batches++;
+	sock->recv_batch_packets += num;
+	if ((uint32_t) num > sock->recv_batch_max) sock->recv_batch_max = num;
+
+	pthread_mutex_lock(&sock->send_mutex);
+	sock->send_hold = true;
+	pthread_mutex_unlock(&sock->send_mutex);
+
+	for (i = 0; i < num; i++) recv_packet(listener, sock->recv_mmsg, i);
+
+	processed = udp_socket_batch_verify(listener);
+
+	pthread_mutex_lock(&sock->send_mutex);
+	sock->send_hold = false;
+	if (!sock->send_busy) udp_socket_batch_flush(listener);
+	pthread_mutex_unlock(&sock->send_mutex);
+
+	return processed;
+}
+#endif
+
+/*
+ *	Read the header of the next packet, either from the socket,
+ *	or from a batch read by udp_socket_batch_recv().
+ */
+static ssize_t udp_socket_recv_header(rad_listen_t *listener, udp_mmsg_t *mm, unsigned int i,
+				      fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code)
+{
+#ifdef WITH_UDP_MMSG
+	if (mm) return fr_radius_recv_header_mmsg(mm, i, src_ipaddr, src_port, code);
+#else
+	UNUSED_VAR(mm);
+	UNUSED_VAR(i);
+#endif
+
+	return fr_radius_recv_header(listener->fd, src_ipaddr, src_port, code);
+}
+
+/*
+ *	Pass a packet to the server core.  Packets from a batch are
+ *	held until the whole batch has been read, and then verified
+ *	together by udp_socket_batch_verify().
+ */
+static int udp_socket_request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, udp_mmsg_t *mm,
+				      RADIUS_PACKET *packet, RADCLIENT *client, RAD_REQUEST_FUNP fun)
+{
+#ifdef WITH_UDP_MMSG
+	if (mm) {
+		listen_socket_t		*sock = listener->data;
+		listen_pending_t	*pending;
+
+		rad_assert(sock->num_pending < listener->batch);
+
+		pending = &sock->recv_pending[sock->num_pending++];
+		pending->ctx = ctx;
+		pending->packet = packet;
+		pending->client = client;
+		pending->fun = fun;
+
+		return 1;
+	}
+#else
+	UNUSED_VAR(mm);
+#endif
+
+	return request_receive(ctx, listener, packet, client, fun);
+}
+
+/*
+ *	Discard the next packet.  Packets in a batch have already
+ *	been read, so there's nothing to do.
+ */
+static void udp_socket_recv_discard(rad_listen_t *listener, udp_mmsg_t *mm)
+{
+	if (!mm) udp_recv_discard(listener->fd);
+}
+
+/*
+ *	Read the next packet, either from the socket, or from a
+ *	batch read by udp_socket_batch_recv().
+ */
+static RADIUS_PACKET *udp_socket_recv_packet(TALLOC_CTX *ctx, rad_listen_t *listener,
+					     udp_mmsg_t *mm, unsigned int i, bool require_ma)
+{
+#ifdef WITH_UDP_MMSG
+	if (mm) return fr_radius_recv_mmsg(ctx, listener->fd, mm, i, require_ma);
+#else
+	UNUSED_VAR(mm);
+	UNUSED_VAR(i);
+#endif
+
+	return fr_radius_recv(ctx, listener->fd, UDP_FLAGS_NONE, require_ma);
+}
+
+/*
+ *	Send a reply.
+ */
+static int udp_socket_send(rad_listen_t *listener, RADIUS_PACKET *packet,
+			   RADIUS_PACKET const *original, char const *secret)
+{
+#ifdef WITH_UDP_MMSG
+	listen_socket_t *sock = listener->data;
+
+	if (sock->send_mmsg) return udp_socket_batch_send(listener, packet, original, secret);
+#else
+	UNUSED_VAR(listener);
+#endif
+
+	return fr_radius_send(packet, original, secret);
+}
+
+
 #ifdef WITH_TCP
 /*
  *	TLS requires child threads to handle the listeners.  Which
@@ -1384,6 +1738,46 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			WARN("Setting 'workers' requires 'synchronous'.  Disabling 'workers'");
 			this->workers = 0;
 		}
+
+		if (this->batch) {
+#ifndef WITH_UDP_MMSG
+			WARN("System does not support recvmmsg() and sendmmsg().  Disabling 'batch'");
+			this->batch = 0;
+#else
+			FR_INTEGER_BOUND_CHECK("batch", this->batch, <=, 1024);
+
+			if (this->workers) {
+				WARN("Setting 'batch' is incompatible with 'workers'.  Disabling 'batch'");
+				this->batch = 0;
+			}
+#endif
+		}
+
+		if (this->reuseport) {
+#ifndef SO_REUSEPORT
+			WARN("System does not support SO_REUSEPORT.  Disabling 'reuseport'");
+			this->reuseport = 0;
+#else
+			FR_INTEGER_BOUND_CHECK("reuseport", this->reuseport, <=, 256);
+
+			/*
+			 *	Each copy of the socket is read and
+			 *	processed by one network thread.  Without
+			 *	'synchronous', its requests would go to the
+			 *	thread pool, which is what 'reuseport'
+			 *	avoids.
+			 */
+			if (!this->synchronous) {
+				cf_log_err_cs(cs, "Setting 'reuseport' requires 'synchronous = yes'");
+				return -1;
+			}
+
+			if (this->workers) {
+				WARN("Setting 'reuseport' is incompatible with 'workers'.  Disabling 'reuseport'");
+				this->reuseport = 0;
+			}
+#endif
+		}
 	}
 
 	subcs = cf_section_sub_find(cs, "limit");
@@ -1432,6 +1826,34 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	sock->my_port = listen_port;
 	sock->recv_buff = recv_buff;
 
+#ifdef WITH_UDP_MMSG
+	if (this->batch) {
+		if ((sock->proto != IPPROTO_UDP) ||
+		    ((this->type != RAD_LISTEN_AUTH)
+#  ifdef WITH_ACCOUNTING
+		     && (this->type != RAD_LISTEN_ACCT)
+#  endif
+			    )) {
+			WARN("Setting 'batch' is only supported for UDP auth and acct sockets.  Disabling 'batch'");
+			this->batch = 0;
+
+		} else if (udp_socket_batch_init(this) < 0) {
+			return -1;
+		}
+	}
+#endif
+
+	if (this->reuseport &&
+	    ((sock->proto != IPPROTO_UDP) ||
+	     ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	      && (this->type != RAD_LISTEN_ACCT)
+#endif
+		     ))) {
+		WARN("Setting 'reuseport' is only supported for UDP auth and acct sockets.  Disabling 'reuseport'");
+		this->reuseport = 0;
+	}
+
 #ifdef WITH_PROXY
 	if (check_config) {
 		/*
@@ -1626,7 +2048,7 @@ int common_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 /*
  *	Send an authentication response packet
  */
-static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int auth_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == auth_socket_send);
@@ -1645,8 +2067,8 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #endif
 
-	if (fr_radius_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (udp_socket_send(listener, request->reply, request->packet,
+			    request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1660,7 +2082,7 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 /*
  *	Send an accounting response packet (or not)
  */
-static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int acct_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == acct_socket_send);
@@ -1685,8 +2107,8 @@ static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #  endif
 
-	if (fr_radius_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (udp_socket_send(listener, request->reply, request->packet,
+			    request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1793,7 +2215,7 @@ static int stats_socket_recv(rad_listen_t *listener)
  *	It takes packets, not requests.  It sees if the packet looks
  *	OK.  If so, it does a number of sanity checks on it.
   */
-static int auth_socket_recv(rad_listen_t *listener)
+static int auth_socket_recv_packet(rad_listen_t *listener, udp_mmsg_t *mm, unsigned int i)
 {
 	ssize_t		rcode;
 	unsigned int	code;
@@ -1804,7 +2226,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
-	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+	rcode = udp_socket_recv_header(listener, mm, i, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(auth, total_requests);
@@ -1817,7 +2239,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	client = client_listener_find(listener, &src_ipaddr, src_port);
 	if (!client) {
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(auth, total_invalid_requests);
 		return 0;
 	}
@@ -1834,7 +2256,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	case PW_CODE_STATUS_SERVER:
 		if (!main_config.status_server) {
-			udp_recv_discard(listener->fd);
+			udp_socket_recv_discard(listener, mm);
 			FR_STATS_INC(auth, total_unknown_types);
 			WARN("Ignoring Status-Server request due to security configuration");
 			return 0;
@@ -1843,7 +2265,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(auth, total_unknown_types);
 
 		if (DEBUG_ENABLED) ERROR("Receive - Invalid packet code %d sent to authentication port from "
@@ -1851,9 +2273,9 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	ctx = request_pool_alloc();
 	if (!ctx) {
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(auth, total_packets_dropped);
 		return 0;
 	}
@@ -1863,7 +2285,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = fr_radius_recv(ctx, listener->fd, UDP_FLAGS_NONE, client->message_authenticator);
+	packet = udp_socket_recv_packet(ctx, listener, mm, i, client->message_authenticator);
 	if (!packet) {
 		FR_STATS_INC(auth, total_malformed_requests);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
@@ -1893,7 +2315,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	}
 #endif
 
-	if (!request_receive(ctx, listener, packet, client, fun)) {
+	if (!udp_socket_request_receive(ctx, listener, mm, packet, client, fun)) {
 		FR_STATS_INC(auth, total_packets_dropped);
 		talloc_free(ctx);
 		return 0;
@@ -1902,12 +2324,21 @@ static int auth_socket_recv(rad_listen_t *listener)
 	return 1;
 }
 
+static int auth_socket_recv(rad_listen_t *listener)
+{
+#ifdef WITH_UDP_MMSG
+	if (listener->batch) return udp_socket_batch_recv(listener, auth_socket_recv_packet);
+#endif
+
+	return auth_socket_recv_packet(listener, NULL, 0);
+}
+
 
 #ifdef WITH_ACCOUNTING
 /*
  *	Receive packets from an accounting socket
  */
-static int acct_socket_recv(rad_listen_t *listener)
+static int acct_socket_recv_packet(rad_listen_t *listener, udp_mmsg_t *mm, unsigned int i)
 {
 	ssize_t		rcode;
 	unsigned int	code;
@@ -1918,7 +2349,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
-	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+	rcode = udp_socket_recv_header(listener, mm, i, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(acct, total_requests);
@@ -1931,7 +2362,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	if ((client = client_listener_find(listener,
 					   &src_ipaddr, src_port)) == NULL) {
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(acct, total_invalid_requests);
 		return 0;
 	}
@@ -1948,7 +2379,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	case PW_CODE_STATUS_SERVER:
 		if (!main_config.status_server) {
-			udp_recv_discard(listener->fd);
+			udp_socket_recv_discard(listener, mm);
 			FR_STATS_INC(acct, total_unknown_types);
 
 			WARN("Ignoring Status-Server request due to security configuration");
@@ -1958,7 +2389,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(acct, total_unknown_types);
 
 		DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
@@ -1966,9 +2397,9 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	ctx = request_pool_alloc();
 	if (!ctx) {
-		udp_recv_discard(listener->fd);
+		udp_socket_recv_discard(listener, mm);
 		FR_STATS_INC(acct, total_packets_dropped);
 		return 0;
 	}
@@ -1978,7 +2409,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = fr_radius_recv(ctx, listener->fd, UDP_FLAGS_NONE, false);
+	packet = udp_socket_recv_packet(ctx, listener, mm, i, false);
 	if (!packet) {
 		FR_STATS_INC(acct, total_malformed_requests);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
@@ -1989,7 +2420,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	/*
 	 *	There can be no duplicate accounting packets.
 	 */
-	if (!request_receive(ctx, listener, packet, client, fun)) {
+	if (!udp_socket_request_receive(ctx, listener, mm, packet, client, fun)) {
 		FR_STATS_INC(acct, total_packets_dropped);
 		fr_radius_free(&packet);
 		talloc_free(ctx);
@@ -1998,6 +2429,15 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	return 1;
 }
+
+static int acct_socket_recv(rad_listen_t *listener)
+{
+#ifdef WITH_UDP_MMSG
+	if (listener->batch) return udp_socket_batch_recv(listener, acct_socket_recv_packet);
+#endif
+
+	return acct_socket_recv_packet(listener, NULL, 0);
+}
 #endif
 
 
@@ -2243,7 +2683,7 @@ static int coa_socket_recv(rad_listen_t *listener)
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	ctx = request_pool_alloc();
 	if (!ctx) {
 		udp_recv_discard(listener->fd);
 		FR_STATS_INC(coa, total_packets_dropped);
@@ -2439,8 +2879,12 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	listen_socket_t *sock;
 #endif
 
-	if (fr_radius_verify(request->packet, NULL,
-			     request->client->secret) < 0) {
+	/*
+	 *	Packets read in a batch were verified when they were
+	 *	received, see udp_socket_batch_verify().
+	 */
+	if (!request->listener->batch &&
+	    (fr_radius_verify(request->packet, NULL, request->client->secret) < 0)) {
 		return -1;
 	}
 
@@ -2850,6 +3294,26 @@ static int listen_bind(rad_listen_t *this)
 		}
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 *	Let the other copies of this socket bind to the same
+	 *	address and port.  The kernel spreads packets over
+	 *	the copies by hashing the source and destination, so
+	 *	packets from one client always go to the same copy.
+	 */
+	if (this->reuseport) {
+		int on = 1;
+
+		DEBUG4("[FD %i] Setting reuseport -- setsockopt(%i, SOL_SOCKET, SO_REUSEPORT, 1, %zu)", this->fd,
+		       this->fd, sizeof(int));
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			close(this->fd);
+			ERROR("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Bind to the interface, IP address, and port.
 	 */
@@ -2897,6 +3361,14 @@ static int listen_bind(rad_listen_t *this)
 
 static int _listener_free(rad_listen_t *this)
 {
+#ifdef WITH_UDP_MMSG
+	if (this->batch) {
+		listen_socket_t *sock = this->data;
+
+		if (sock->send_mmsg) pthread_mutex_destroy(&sock->send_mutex);
+	}
+#endif
+
 	/*
 	 *	Other code may have eaten the FD.
 	 */
@@ -3271,6 +3743,10 @@ int listen_init(rad_listen_t **head, bool spawn_workers)
 
 				DEBUG("Thread %d for %s\n", i, buffer);
 			}
+
+		} else if (this->reuseport && spawn_workers) {
+			if (radius_event_thread_start(this) < 0) return -1;
+
 		} else {
 			radius_update_listener(this);
 		}
@@ -174,6 +174,8 @@ static const CONF_PARSER resources[] = {
 	 *	it exists.
 	 */
 	{ FR_CONF_POINTER("talloc_pool_size", PW_TYPE_INTEGER, &main_config.talloc_pool_size) },
+	{ FR_CONF_POINTER("timer_wheel", PW_TYPE_BOOLEAN, &main_config.timer_wheel) },
+	{ FR_CONF_POINTER("regex_cache_size", PW_TYPE_INTEGER, &main_config.regex_cache_size) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -791,6 +793,12 @@ int main_config_init(void)
 	 */
 	main_config.talloc_pool_size = 8 * 1024; /* default */
 
+	/*
+	 *	Dynamically expanded regexes compiled at runtime.
+	 *	0 disables the cache.
+	 */
+	main_config.regex_cache_size = 1024; /* default */
+
 	/*
 	 *	Read the distribution dictionaries first, then
 	 *	the ones in raddb.
@@ -993,6 +1001,10 @@ do {\
 
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, >=, 2 * 1024);
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, <=, 1024 * 1024);
+	FR_INTEGER_BOUND_CHECK("resources.regex_cache_size", main_config.regex_cache_size, <=, 65536);
+#ifdef HAVE_REGEX
+	regex_cache_max_entries_set(main_config.regex_cache_size);
+#endif
 
 	/*
 	 * Set default initial request processing delay to 1/3 of a second.
@@ -948,7 +948,7 @@ static indexed_modcallable *new_sublist(CONF_SECTION *cs,
 	return c;
 }
 
-rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
+static rlm_rcode_t indexed_modcall_run(rlm_components_t comp, int idx, REQUEST *request, bool async)
 {
 	rlm_rcode_t rcode;
 	modcallable *list = NULL;
@@ -1007,7 +1007,40 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 	}
 	request->component = section_type_value[comp].section;
 
-	rcode = modcall(comp, list, request);
+	if (async) {
+		rcode = modcall_async(comp, idx, list, request);
+	} else {
+		rcode = modcall(comp, list, request);
+	}
+
+	request->module = NULL;
+	request->component = "<core>";
+	return rcode;
+}
+
+rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
+{
+	return indexed_modcall_run(comp, idx, request, false);
+}
+
+/** Call a section, giving up the thread if a module waits for I/O
+ *
+ * @see modcall_async
+ */
+rlm_rcode_t indexed_modcall_async(rlm_components_t comp, int idx, REQUEST *request)
+{
+	return indexed_modcall_run(comp, idx, request, true);
+}
+
+/** Continue a section called with indexed_modcall_async(), which returned #RLM_MODULE_YIELD
+ *
+ * @see modcall_resume
+ */
+rlm_rcode_t indexed_modcall_resume(REQUEST *request, rlm_components_t *comp, int *idx)
+{
+	rlm_rcode_t rcode;
+
+	rcode = modcall_resume(request, comp, idx);
 
 	request->module = NULL;
 	request->component = "<core>";
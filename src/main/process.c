@@ -39,6 +39,7 @@ RCSID("$Id$")
 
 #include <signal.h>
 #include <fcntl.h>
+#include <stdatomic.h>
 
 #ifdef HAVE_SYS_WAIT_H
 #	include <sys/wait.h>
@@ -131,8 +132,15 @@ static void request_timer(void *ctx, struct timeval *now);
 static inline void state_machine_timer(char const *file, int line, REQUEST *request,
 				       struct timeval *when, fr_state_action_t action)
 {
+	fr_event_list_t *xel = el;
+
+	/*
+	 *	Requests read by a network thread use its event list.
+	 */
+	if (request->listener && request->listener->el) xel = request->listener->el;
+
 	request->timer_action = action;
-	if (!fr_event_insert(el, request_timer, request, when, &request->ev)) {
+	if (!fr_event_insert(xel, request_timer, request, when, &request->ev)) {
 		_rad_panic(file, line, "Failed to insert event");
 	}
 }
@@ -329,7 +337,7 @@ void radius_update_listener(rad_listen_t *this)
 #  define FD_MUTEX_UNLOCK(_x)
 #endif
 
-static int request_num_counter = 1;
+static atomic_uint request_num_counter = 1;	//!< Shared with the network threads.
 #ifdef WITH_PROXY
 static int request_will_proxy(REQUEST *request) CC_HINT(nonnull);
 static int request_proxy(REQUEST *request, int retransmit) CC_HINT(nonnull);
@@ -339,6 +347,7 @@ STATE_MACHINE_DECL(request_response_delay) CC_HINT(nonnull);
 STATE_MACHINE_DECL(request_cleanup_delay) CC_HINT(nonnull);
 STATE_MACHINE_DECL(request_running) CC_HINT(nonnull);
 STATE_MACHINE_DECL(request_done) CC_HINT(nonnull);
+STATE_MACHINE_DECL(request_thread_done) CC_HINT(nonnull);
 
 STATE_MACHINE_DECL(proxy_no_reply) CC_HINT(nonnull);
 STATE_MACHINE_DECL(proxy_running) CC_HINT(nonnull);
@@ -454,6 +463,128 @@ static void request_timer(void *ctx, UNUSED struct timeval *now)
 	request->process(request, action);
 }
 
+/*
+ *	Requests received from the network are allocated from a
+ *	talloc pool, along with their packets and attributes, so that
+ *	decoding and processing a packet needs few calls to malloc().
+ *
+ *	We measure how much of the pool a sample of the requests
+ *	used, and grow the pool so that it fits the 95th percentile.
+ *	The configured "talloc_pool_size" is the minimum size.
+ */
+#define REQUEST_POOL_BUCKET	(1024)		//!< Width of each bucket in the usage histogram.
+#define REQUEST_POOL_BUCKETS	(64)		//!< Usage above 63K goes into the last bucket.
+#define REQUEST_POOL_SAMPLE	(16)		//!< Measure one request in this many.
+#define REQUEST_POOL_RESIZE	(1024)		//!< Recalculate the pool size after this many samples.
+#define REQUEST_POOL_CHUNK_HDR	(96)		//!< Approximate size of the talloc header of each chunk.
+
+static uint32_t			request_pool_size;
+static atomic_uint		request_pool_count;
+static uint64_t			request_pool_histogram[REQUEST_POOL_BUCKETS];
+static request_pool_stats_t	request_pool_stats;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		request_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define POOL_LOCK		pthread_mutex_lock(&request_pool_mutex)
+#  define POOL_UNLOCK		pthread_mutex_unlock(&request_pool_mutex)
+#else
+#  define POOL_LOCK
+#  define POOL_UNLOCK
+#endif
+
+/** Allocate a talloc pool to hold a request, and its packets
+ *
+ * @return a new pool, or NULL on error.
+ */
+TALLOC_CTX *request_pool_alloc(void)
+{
+	uint32_t size = request_pool_size;
+
+	if (size < main_config.talloc_pool_size) size = main_config.talloc_pool_size;
+
+	return talloc_pool(NULL, size);
+}
+
+/** Recalculate the pool size from the usage histogram
+ *
+ * Must be called with the pool mutex held.
+ */
+static void request_pool_resize(void)
+{
+	uint64_t	total = 0, seen = 0;
+	int		i;
+
+	for (i = 0; i < REQUEST_POOL_BUCKETS; i++) total += request_pool_histogram[i];
+	if (!total) return;
+
+	for (i = 0; i < REQUEST_POOL_BUCKETS; i++) {
+		seen += request_pool_histogram[i];
+		if ((seen * 100) >= (total * 95)) break;
+	}
+	if (i == REQUEST_POOL_BUCKETS) i--;
+
+	request_pool_stats.p95 = (i + 1) * REQUEST_POOL_BUCKET;
+	request_pool_size = request_pool_stats.p95;
+}
+
+/** Free a pool allocated by request_pool_alloc()
+ *
+ * Some of the pools are measured before they're freed, to see how
+ * big they need to be.
+ *
+ * @param[in] pool to free.
+ */
+static void request_pool_free(TALLOC_CTX *pool)
+{
+	size_t		used, size;
+	unsigned int	bucket;
+
+	if ((atomic_fetch_add_explicit(&request_pool_count, 1, memory_order_relaxed) % REQUEST_POOL_SAMPLE) != 0) {
+		talloc_free(pool);
+		return;
+	}
+
+	used = talloc_total_size(pool) + (talloc_total_blocks(pool) * REQUEST_POOL_CHUNK_HDR);
+	talloc_free(pool);
+
+	size = request_pool_size;
+	if (size < main_config.talloc_pool_size) size = main_config.talloc_pool_size;
+
+	bucket = used / REQUEST_POOL_BUCKET;
+	if (bucket >= REQUEST_POOL_BUCKETS) bucket = REQUEST_POOL_BUCKETS - 1;
+
+	POOL_LOCK;
+	request_pool_stats.sampled++;
+	if (used > size) request_pool_stats.overflows++;
+	if (used > request_pool_stats.max) request_pool_stats.max = used;
+	request_pool_histogram[bucket]++;
+
+	/*
+	 *	Halve the histogram after each resize, so that it
+	 *	follows changes in the traffic.
+	 */
+	if ((request_pool_stats.sampled % REQUEST_POOL_RESIZE) == 0) {
+		request_pool_resize();
+		for (bucket = 0; bucket < REQUEST_POOL_BUCKETS; bucket++) request_pool_histogram[bucket] /= 2;
+	}
+	POOL_UNLOCK;
+}
+
+/** Return statistics about request pools
+ *
+ * @param[out] stats to write.
+ */
+void request_pool_stats_get(request_pool_stats_t *stats)
+{
+	POOL_LOCK;
+	*stats = request_pool_stats;
+	POOL_UNLOCK;
+
+	stats->size = request_pool_size;
+	if (stats->size < main_config.talloc_pool_size) stats->size = main_config.talloc_pool_size;
+}
+
+
 /*
  *	Wrapper for talloc pools.  If there's no parent, just free the
  *	request.  If there is a parent, free the parent INSTEAD of the
@@ -474,7 +605,7 @@ static void request_free(REQUEST *request)
 
 	ptr = talloc_parent(request);
 	rad_assert(ptr != NULL);
-	talloc_free(ptr);
+	request_pool_free(ptr);
 }
 
 
@@ -539,8 +670,12 @@ static void request_done(REQUEST *request, int action)
 	/*
 	 *	If called from a child thread, mark ourselves as done,
 	 *	and wait for the master thread timer to clean us up.
+	 *
+	 *	If the request was parked, the module it was waiting
+	 *	for still has to clean up.
 	 */
 	if (!we_are_master()) {
+		modcall_cancel(request);
 		FINAL_STATE(REQUEST_DONE);
 		return;
 	}
@@ -935,6 +1070,25 @@ static void request_queue_or_run(REQUEST *request,
 }
 
 
+/** Queue a parked request again, once the module it was waiting for has been signalled
+ *
+ * Called by modcall_signal(), from whichever thread completed the I/O.
+ * The request is always resumed by a worker thread, never by the caller,
+ * so module code doesn't run on the module's own I/O threads.
+ *
+ * @param[in] request	which was parked.
+ */
+void request_resume(REQUEST *request)
+{
+	/*
+	 *	modcall_cancel_all() waits for every parked request
+	 *	to be resumed before the thread pool is stopped, so
+	 *	this only fails if we're out of memory.
+	 */
+	if (!request_enqueue(request)) RERROR("Failed resuming request");
+}
+
+
 static void request_dup(REQUEST *request)
 {
 	ERROR("(%u) Ignoring duplicate packet from "
@@ -1032,6 +1186,76 @@ static void request_cleanup_delay(REQUEST *request, int action)
 }
 
 
+/** Clean up a request which was processed by a network thread.
+ *
+ *  Requests read from 'reuseport' sockets are processed synchronously
+ *  by the network thread which read them, and never touch the main
+ *  event list.  Access-Requests with a reply are kept in the thread's
+ *  list of live requests for "cleanup_delay", so that retransmits get
+ *  the cached reply.  Everything else is cleaned up immediately.
+ *
+ *  \dot
+ *	digraph thread_done {
+ *		thread_done -> send_reply [ label = "DUP" ];
+ *		thread_done -> thread_done [ label = "TIMER < timeout" ];
+ *		thread_done -> done [ label = "TIMER >= timeout, DONE" ];
+ *	}
+ *  \enddot
+ */
+static void request_thread_done(REQUEST *request, int action)
+{
+	struct timeval when, now;
+	rad_listen_t *listener = request->listener;
+
+	VERIFY_REQUEST(request);
+
+	TRACE_STATE_MACHINE;
+
+	rad_assert(listener->el != NULL);
+
+	switch (action) {
+	case FR_ACTION_DUP:
+		if (request->reply->code != 0) {
+			listener->send(listener, request);
+		} else {
+			RDEBUG("No reply.  Ignoring retransmit");
+		}
+		return;
+
+	case FR_ACTION_TIMER:
+		if (!request->in_request_hash || (request->reply->code == 0) ||
+#ifdef WITH_ACCOUNTING
+		    (request->packet->code == PW_CODE_ACCOUNTING_REQUEST) ||
+#endif
+		    !request->root->cleanup_delay) break;
+
+		fr_event_now(listener->el, &now);
+
+		when = request->reply->timestamp;
+		when.tv_sec += request->root->cleanup_delay;
+
+		if (timercmp(&when, &now, >)) {
+			STATE_MACHINE_TIMER(FR_ACTION_TIMER);
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (request->in_request_hash) {
+		if (!rbtree_deletebydata(listener->requests, &request->packet)) {
+			rad_assert(0 == 1);
+		}
+		request->in_request_hash = false;
+	}
+
+	fr_event_delete(listener->el, &request->ev);
+	request_free(request);
+}
+
+
 /** Sit on a request until it's time to respond to it.
  *
  *  For security reasons, rejects (and maybe some other) packets are
@@ -1446,7 +1670,11 @@ static void request_running(REQUEST *request, int action)
 		break;
 
 	case FR_ACTION_RUN:
-		if (!request_pre_handler(request, action)) {
+		/*
+		 *	A resumed request has already been through
+		 *	the pre-handler.
+		 */
+		if (!request->yield && !request_pre_handler(request, action)) {
 #ifdef DEBUG_STATE_MACHINE
 			if (rad_debug_lvl) printf("(%u) ********\tSTATE %s failed in pre-handler C-%s -> C-%s\t********\n",
 					       request->number, __FUNCTION__,
@@ -1458,7 +1686,14 @@ static void request_running(REQUEST *request, int action)
 		}
 
 		rad_assert(request->handle != NULL);
-		ret = request->handle(request);
+		while (((ret = request->handle(request)) == RLM_MODULE_YIELD) && request->yield) {
+			/*
+			 *	A module is waiting for I/O.  Give the
+			 *	thread back to the pool.  The request is
+			 *	queued again by request_resume().
+			 */
+			if (modcall_park(request)) return;
+		}
 		if (ret < 0) REDEBUG2("State callback returned error (%i): %s", ret, fr_strerror());
 
 #ifdef WITH_PROXY
@@ -1505,6 +1740,7 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 	REQUEST *request = NULL;
 	struct timeval now;
 	listen_socket_t *sock = NULL;
+	rbtree_t *requests = pl;
 
 	VERIFY_PACKET(packet);
 
@@ -1531,7 +1767,14 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 	 */
 	if (listener->nodup) goto skip_dup;
 
-	packet_p = rbtree_finddata(pl, &packet);
+	/*
+	 *	Network threads have their own list of live requests.
+	 *	SO_REUSEPORT sends all packets from one client to the
+	 *	same socket, so duplicates are always found there.
+	 */
+	if (listener->requests) requests = listener->requests;
+
+	packet_p = rbtree_finddata(requests, &packet);
 	if (packet_p) {
 		rad_child_state_t child_state;
 
@@ -1587,7 +1830,11 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 		 *	the request just as we're logging the
 		 *	complaint.
 		 */
-		request_done(request, FR_ACTION_DONE);
+		if (listener->el) {
+			request->process(request, FR_ACTION_DONE);
+		} else {
+			request_done(request, FR_ACTION_DONE);
+		}
 		request = NULL;
 
 		/*
@@ -1617,7 +1864,7 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 	 *	Quench maximum number of outstanding requests.
 	 */
 	if (main_config.max_requests &&
-	    ((count = rbtree_num_elements(pl)) > main_config.max_requests)) {
+	    ((count = rbtree_num_elements(requests)) > main_config.max_requests)) {
 		RATE_LIMIT(ERROR("Dropping request (%d is too many): from client %s port %d - ID: %d", count,
 				 client->shortname,
 				 packet->src_port, packet->id);
@@ -1647,7 +1894,7 @@ skip_dup:
 	 *	Allocate a pool for the request.
 	 */
 	if (!ctx) {
-		ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+		ctx = request_pool_alloc();
 		if (!ctx) return 0;
 		talloc_set_name_const(ctx, "request_receive_pool");
 
@@ -1673,9 +1920,13 @@ skip_dup:
 	 *	Remember the request in the list.
 	 */
 	if (!listener->nodup) {
-		if (!rbtree_insert(pl, &request->packet)) {
+		if (!rbtree_insert(requests, &request->packet)) {
 			RERROR("Failed to insert request in the list of live requests: discarding it");
-			request_done(request, FR_ACTION_DONE);
+			if (listener->synchronous) {
+				request_free(request);
+			} else {
+				request_done(request, FR_ACTION_DONE);
+			}
 			return 1;
 		}
 
@@ -1696,12 +1947,28 @@ skip_dup:
 
 		if (fun(request) < 0) REDEBUG("Error processing request: %s", fr_strerror());
 
+		gettimeofday(&request->reply->timestamp, NULL);
+
 		if (request->reply->code != 0) {
 			request->listener->send(request->listener, request);
 		} else {
 			RDEBUG("Not sending reply");
 		}
 
+		/*
+		 *	Network threads keep the reply for cleanup_delay.
+		 */
+		if (listener->el) {
+			request->process = request_thread_done;
+			request_thread_done(request, FR_ACTION_TIMER);
+			return 1;
+		}
+
+		if (request->in_request_hash) {
+			rbtree_deletebydata(requests, &request->packet);
+			request->in_request_hash = false;
+		}
+
 		/*
 		 *	Don't do delayed reject.  Oh well.
 		 */
@@ -1742,7 +2009,7 @@ static REQUEST *request_setup(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PA
 	request->listener = listener;
 	request->client = client;
 	request->packet = talloc_steal(request, packet);
-	request->number = request_num_counter++;
+	request->number = atomic_fetch_add_explicit(&request_num_counter, 1, memory_order_relaxed);
 	request->priority = listener->type;
 	if (request->priority >= RAD_LISTEN_MAX) {
 		request->priority = RAD_LISTEN_AUTH;
@@ -3415,7 +3682,7 @@ static void ping_home_server(void *ctx, struct timeval *now)
 
 	request = request_alloc(NULL);
 	if (!request) return;
-	request->number = request_num_counter++;
+	request->number = atomic_fetch_add_explicit(&request_num_counter, 1, memory_order_relaxed);
 	NO_CHILD_THREAD;
 
 	request->proxy = fr_radius_alloc(request, true);
@@ -4473,7 +4740,7 @@ static void event_socket_handler(NDEBUG_UNUSED fr_event_list_t *xel, UNUSED int
 {
 	rad_listen_t *listener = talloc_get_type_abort(ctx, rad_listen_t);
 
-	rad_assert(xel == el);
+	rad_assert((xel == el) || (xel == listener->el));
 
 	if ((listener->fd < 0)
 #ifdef WITH_DETAIL
@@ -5119,6 +5386,16 @@ int radius_event_init(TALLOC_CTX *ctx) {
 	el = fr_event_list_create(ctx, event_status);
 	if (!el) return 0;
 
+	/*
+	 *	Every request arms several timers.  With lots of
+	 *	requests in flight, O(1) timers are cheaper than
+	 *	the heap.
+	 */
+	if (main_config.timer_wheel && (fr_event_list_timer_wheel(el, 0) < 0)) {
+		ERROR("Failed creating timer wheel: %s", fr_strerror());
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -5253,7 +5530,7 @@ int radius_event_start(bool have_children)
 		if (!pl) return 0;	/* leak el */
 	}
 
-	request_num_counter = 0;
+	atomic_store(&request_num_counter, 0);
 
 #ifdef WITH_PROXY
 	if (main_config.proxy_requests && !check_config) {
@@ -5437,11 +5714,195 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 	return 2;
 }
 
+/** A network thread, started by radius_event_thread_start()
+ *
+ */
+typedef struct event_thread {
+	struct event_thread	*next;		//!< Next network thread.
+	rad_listen_t		*listener;	//!< Socket the thread reads.
+	pthread_t		id;		//!< Thread ID, so we can join it.
+	int			wakeup[2];	//!< Pipe used to tell the thread to exit.
+} event_thread_t;
+
+static event_thread_t *event_threads = NULL;
+
+/*
+ *	A network thread, which does nothing other than read and
+ *	process packets from one socket, using its own event list.
+ */
+static void *event_thread(void *arg)
+{
+	rad_listen_t *this = talloc_get_type_abort(arg, rad_listen_t);
+
+	fr_event_loop(this->el);
+
+	return NULL;
+}
+
+/*
+ *	Called in the network thread when the main thread writes
+ *	to the wakeup pipe.
+ */
+static void event_thread_wakeup(fr_event_list_t *xel, UNUSED int fd, UNUSED void *ctx)
+{
+	fr_event_loop_exit(xel, 1);
+}
+
+/*
+ *	Free a request the network thread kept for cleanup_delay.
+ */
+static int event_thread_request_delete_cb(UNUSED void *ctx, void *data)
+{
+	REQUEST *request = fr_packet2myptr(REQUEST, packet, data);
+
+	request->in_request_hash = false;
+	fr_event_delete(request->listener->el, &request->ev);
+	request_free(request);
+
+	return 2;
+}
+
+/** Stop the network threads, and free their event lists and requests
+ *
+ */
+static void event_threads_free(void)
+{
+	event_thread_t *thread, *next;
+
+	ASSERT_MASTER;
+
+	/*
+	 *	Tell them all to exit first, so they can finish
+	 *	what they're doing at the same time.
+	 */
+	for (thread = event_threads; thread; thread = thread->next) {
+		if (write(thread->wakeup[1], "", 1) < 0) {
+			ERROR("Failed waking network thread: %s", fr_syserror(errno));
+		}
+	}
+
+	for (thread = event_threads; thread; thread = next) {
+		rad_listen_t *this = thread->listener;
+
+		next = thread->next;
+
+		pthread_join(thread->id, NULL);
+
+		if (this->requests) {
+			rbtree_walk(this->requests, RBTREE_DELETE_ORDER, event_thread_request_delete_cb, NULL);
+			rbtree_free(this->requests);
+			this->requests = NULL;
+		}
+
+		talloc_free(this->el);
+		this->el = NULL;
+
+		close(thread->wakeup[0]);
+		close(thread->wakeup[1]);
+		talloc_free(thread);
+	}
+	event_threads = NULL;
+}
+
+/** Start a network thread for a listener
+ *
+ * The listener is not added to the main event list.  The thread
+ * has its own event list, and its own list of live requests, so
+ * that packets are read, de-duplicated, processed, and answered
+ * without any locking.
+ *
+ * @param[in] this listener to read packets from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int radius_event_thread_start(rad_listen_t *this)
+{
+	int		rcode;
+	event_thread_t	*thread;
+	char		buffer[1024];
+
+	ASSERT_MASTER;
+	rad_assert(spawn_workers);
+	rad_assert(this->synchronous);
+
+	this->print(this, buffer, sizeof(buffer));
+
+	thread = talloc_zero(NULL, event_thread_t);
+	if (!thread) return -1;
+
+	thread->listener = this;
+	if (pipe(thread->wakeup) < 0) {
+		ERROR("Failed creating wakeup pipe for %s: %s", buffer, fr_syserror(errno));
+		talloc_free(thread);
+		return -1;
+	}
+
+	/*
+	 *	These are only used by the network thread, so they
+	 *	get their own talloc contexts.  They're freed by
+	 *	event_threads_free(), once the thread has exited.
+	 */
+	this->el = fr_event_list_create(NULL, NULL);
+	if (!this->el) {
+		ERROR("Failed creating event list for %s", buffer);
+	error:
+		rbtree_free(this->requests);
+		this->requests = NULL;
+		talloc_free(this->el);
+		this->el = NULL;
+		close(thread->wakeup[0]);
+		close(thread->wakeup[1]);
+		talloc_free(thread);
+		return -1;
+	}
+
+	if (main_config.timer_wheel && (fr_event_list_timer_wheel(this->el, 0) < 0)) {
+		ERROR("Failed creating timer wheel for %s: %s", buffer, fr_strerror());
+		goto error;
+	}
+
+	if (!this->nodup) {
+		this->requests = rbtree_create(NULL, packet_entry_cmp, NULL, 0);
+		if (!this->requests) {
+			ERROR("Failed creating request list for %s", buffer);
+			goto error;
+		}
+	}
+
+	if (!fr_event_fd_insert(this->el, 0, this->fd, event_socket_handler, this) ||
+	    !fr_event_fd_insert(this->el, 0, thread->wakeup[0], event_thread_wakeup, thread)) {
+		ERROR("Failed adding event handler for %s: %s", buffer, fr_strerror());
+		goto error;
+	}
+
+	this->status = RAD_LISTEN_STATUS_KNOWN;
+
+	rcode = pthread_create(&thread->id, NULL, event_thread, this);
+	if (rcode != 0) {
+		ERROR("Thread create failed: %s", fr_syserror(rcode));
+		goto error;
+	}
+
+	thread->next = event_threads;
+	event_threads = thread;
+
+	DEBUG("Listening on %s (network thread)", buffer);
+
+	return 0;
+}
+
 
 void radius_event_free(void)
 {
 	ASSERT_MASTER;
 
+	/*
+	 *	The network threads process requests themselves,
+	 *	so stop them before anything they use is freed.
+	 */
+	event_threads_free();
+
 #ifdef WITH_PROXY
 	/*
 	 *	There are requests in the proxy hash that aren't
@@ -629,6 +629,8 @@ int main(int argc, char *argv[])
 	 *	with destructors that may cause double frees and
 	 *	SEGVs.
 	 */
+	modcall_cancel_all();		/* Resume requests waiting for I/O */
+
 	radius_event_free();		/* Free the requests */
 
 	thread_pool_stop();		/* stop all the threads */
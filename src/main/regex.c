@@ -28,6 +28,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <stdatomic.h>
+
 #ifdef HAVE_REGEX
 
 #define REQUEST_DATA_REGEX (0xadbeef00)
@@ -39,6 +41,301 @@ typedef struct regcapture {
 	size_t		nmatch;		//!< Number of match vectors.
 } regcapture_t;
 
+/** A compiled expression in the regex cache
+ *
+ * Entries are reference counted.  The cache holds one reference while
+ * the entry is in the cache, and each user of the expression holds
+ * another, so evicted entries are only freed when nothing uses them.
+ */
+typedef struct regex_cache_entry regex_cache_entry_t;
+struct regex_cache_entry {
+	char const		*pattern;	//!< The expanded pattern.
+	size_t			len;		//!< Length of the pattern.
+	bool			ignore_case;	//!< Whether the expression was compiled case insensitive.
+	bool			multiline;	//!< Whether the expression was compiled multiline.
+
+	regex_t			*preg;		//!< The compiled expression.  A talloc child of the entry.
+
+	atomic_uint_fast32_t	refs;		//!< References held by the cache and by users.
+
+	regex_cache_entry_t	*prev;		//!< More recently used entry.
+	regex_cache_entry_t	*next;		//!< Less recently used entry.
+};
+
+/** Cache of expressions compiled at runtime
+ *
+ */
+static struct {
+	rbtree_t		*tree;		//!< Entries indexed by pattern and flags.
+	regex_cache_entry_t	*head;		//!< Most recently used entry.
+	regex_cache_entry_t	*tail;		//!< Least recently used entry.
+	uint32_t		num;		//!< Number of entries.
+	uint32_t		max_entries;	//!< Maximum number of entries.  0 disables the cache.
+
+	uint64_t		hits;		//!< Lookups which found a compiled expression.
+	uint64_t		misses;		//!< Lookups which had to compile the expression.
+	uint64_t		evictions;	//!< Entries removed to make room for new ones.
+
+	pthread_mutex_t		mutex;		//!< Protects everything above.
+} regex_cache = {
+	.max_entries = 1024,
+	.mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int regex_cache_entry_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one;
+	regex_cache_entry_t const *b = two;
+	int ret;
+
+	ret = (a->ignore_case > b->ignore_case) - (a->ignore_case < b->ignore_case);
+	if (ret != 0) return ret;
+
+	ret = (a->multiline > b->multiline) - (a->multiline < b->multiline);
+	if (ret != 0) return ret;
+
+	if (a->len < b->len) return -1;
+	if (a->len > b->len) return +1;
+
+	return memcmp(a->pattern, b->pattern, a->len);
+}
+
+/** Drop a reference to an entry, freeing it if it was the last one
+ *
+ */
+static void regex_cache_entry_release(regex_cache_entry_t *entry)
+{
+	if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1) talloc_free(entry);
+}
+
+/** Unlink an entry from the LRU list
+ *
+ * @note The mutex must be held.
+ */
+static void regex_cache_unlink(regex_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		regex_cache.head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		regex_cache.tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+/** Make an entry the most recently used
+ *
+ * @note The mutex must be held.
+ */
+static void regex_cache_link(regex_cache_entry_t *entry)
+{
+	entry->next = regex_cache.head;
+	if (regex_cache.head) {
+		regex_cache.head->prev = entry;
+	} else {
+		regex_cache.tail = entry;
+	}
+	regex_cache.head = entry;
+}
+
+/** Find the cache entry an expression belongs to
+ *
+ * @return
+ *	- The entry.
+ *	- NULL if the expression wasn't compiled by #regex_cache_compile.
+ */
+static regex_cache_entry_t *regex_cache_entry_by_preg(regex_t *preg)
+{
+	void *parent;
+
+	parent = talloc_parent(preg);
+	if (!parent) return NULL;
+
+	return talloc_get_type(parent, regex_cache_entry_t);
+}
+
+static int _regex_cache_ref_free(regex_cache_entry_t **ref)
+{
+	regex_cache_entry_release(*ref);
+
+	return 0;
+}
+
+/** Compile an expression at runtime, or find it in the regex cache
+ *
+ * Expanding the right hand side of a regular expression comparison usually
+ * produces one of a small number of patterns.  Instead of compiling the
+ * pattern for every request, compiled expressions are kept in a cache shared
+ * by all threads.  When the cache is full the least recently used expression
+ * is removed.
+ *
+ * Expressions in the cache are studied (and compiled by the PCRE JIT), as
+ * the cost is only paid once.
+ *
+ * @note The expression must be freed with #regex_cache_release.
+ *
+ * @param request The current request.
+ * @param out Where to write the compiled expression.
+ * @param pattern to compile.
+ * @param len of pattern.
+ * @param ignore_case Whether the match should be case insensitive.
+ * @param multiline If true $ matches newlines.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_cache_compile(REQUEST *request, regex_t **out, char const *pattern, size_t len,
+			    bool ignore_case, bool multiline)
+{
+	regex_cache_entry_t	find, *entry, *found;
+	ssize_t			slen;
+
+	if (!regex_cache.max_entries) {
+		return regex_compile(request, out, pattern, len, ignore_case, multiline, true, true);
+	}
+
+	find.pattern = pattern;
+	find.len = len;
+	find.ignore_case = ignore_case;
+	find.multiline = multiline;
+
+	pthread_mutex_lock(&regex_cache.mutex);
+	if (regex_cache.tree) {
+		entry = rbtree_finddata(regex_cache.tree, &find);
+		if (entry) {
+			atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+			regex_cache_unlink(entry);
+			regex_cache_link(entry);
+			regex_cache.hits++;
+			pthread_mutex_unlock(&regex_cache.mutex);
+
+			RDEBUG4("Using cached expression");
+			*out = entry->preg;
+			return len;
+		}
+	}
+	regex_cache.misses++;
+	pthread_mutex_unlock(&regex_cache.mutex);
+
+	/*
+	 *	Compile without holding the mutex, so other
+	 *	threads can use the cache.
+	 */
+	entry = talloc_zero(NULL, regex_cache_entry_t);
+	if (!entry) return 0;
+
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	if (!entry->pattern) {
+	error:
+		talloc_free(entry);
+		return 0;
+	}
+	entry->len = len;
+	entry->ignore_case = ignore_case;
+	entry->multiline = multiline;
+
+	slen = regex_compile(entry, &entry->preg, pattern, len, ignore_case, multiline, true, false);
+	if (slen <= 0) {
+		talloc_free(entry);
+		return slen;
+	}
+
+	atomic_init(&entry->refs, 1);	/* Ours */
+
+	pthread_mutex_lock(&regex_cache.mutex);
+	if (!regex_cache.tree) {
+		regex_cache.tree = rbtree_create(NULL, regex_cache_entry_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!regex_cache.tree) {
+			pthread_mutex_unlock(&regex_cache.mutex);
+			goto error;
+		}
+	}
+
+	/*
+	 *	Another thread compiled the same expression
+	 *	while we were.  Use theirs.
+	 */
+	found = rbtree_finddata(regex_cache.tree, entry);
+	if (found) {
+		atomic_fetch_add_explicit(&found->refs, 1, memory_order_relaxed);
+		pthread_mutex_unlock(&regex_cache.mutex);
+
+		talloc_free(entry);
+		*out = found->preg;
+		return len;
+	}
+
+	while (regex_cache.num && (regex_cache.num >= regex_cache.max_entries)) {
+		regex_cache_entry_t *old = regex_cache.tail;
+
+		rbtree_deletebydata(regex_cache.tree, old);
+		regex_cache_unlink(old);
+		regex_cache.num--;
+		regex_cache.evictions++;
+		regex_cache_entry_release(old);
+	}
+
+	if (regex_cache.max_entries && rbtree_insert(regex_cache.tree, entry)) {
+		atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);	/* The cache's */
+		regex_cache_link(entry);
+		regex_cache.num++;
+	}
+	pthread_mutex_unlock(&regex_cache.mutex);
+
+	*out = entry->preg;
+
+	return slen;
+}
+
+/** Release an expression returned by #regex_cache_compile
+ *
+ * @param preg to release.
+ */
+void regex_cache_release(regex_t *preg)
+{
+	regex_cache_entry_t *entry;
+
+	entry = regex_cache_entry_by_preg(preg);
+	if (!entry) {
+		talloc_free(preg);
+		return;
+	}
+
+	regex_cache_entry_release(entry);
+}
+
+/** Set the maximum number of entries in the regex cache
+ *
+ * Entries over the new limit are removed the next time an expression is added.
+ *
+ * @param max_entries 0 disables the cache.
+ */
+void regex_cache_max_entries_set(uint32_t max_entries)
+{
+	pthread_mutex_lock(&regex_cache.mutex);
+	regex_cache.max_entries = max_entries;
+	pthread_mutex_unlock(&regex_cache.mutex);
+}
+
+/** Return statistics for the regex cache
+ *
+ * @param[out] stats Where to write the statistics.
+ */
+void regex_cache_stats_get(regex_cache_stats_t *stats)
+{
+	pthread_mutex_lock(&regex_cache.mutex);
+	stats->max_entries = regex_cache.max_entries;
+	stats->entries = regex_cache.num;
+	stats->hits = regex_cache.hits;
+	stats->misses = regex_cache.misses;
+	stats->evictions = regex_cache.evictions;
+	pthread_mutex_unlock(&regex_cache.mutex);
+}
+
 /** Adds subcapture values to request data
  *
  * Allows use of %{n} expansions.
@@ -97,7 +394,24 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, s
 	} else
 #endif
 	{
+		regex_cache_entry_t *entry;
+
 		new_sc->preg = *preg;
+
+		/*
+		 *	Expressions from the regex cache may be evicted
+		 *	and freed, so keep a reference for as long as
+		 *	the subcaptures exist.
+		 */
+		entry = regex_cache_entry_by_preg(*preg);
+		if (entry) {
+			regex_cache_entry_t **ref;
+
+			atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+			MEM(ref = talloc(new_sc, regex_cache_entry_t *));
+			*ref = entry;
+			talloc_set_destructor(ref, _regex_cache_ref_free);
+		}
 	}
 
 	request_data_add(request, request, REQUEST_DATA_REGEX, new_sc, true, false, false);
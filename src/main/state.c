@@ -42,6 +42,11 @@
           \-> reply                 \-> reply                 \-> access-reject/access-accept
  * @endverbatim
  *
+ * The state tree is split into shards, each with its own mutex, hash table and
+ * expiry list.  The shard is selected from a hash of the State value, which is
+ * mostly random bytes, so concurrent sessions are spread evenly over the shards
+ * and rarely contend for the same mutex.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 RCSID("$Id$")
@@ -50,6 +55,8 @@ RCSID("$Id$")
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <stdatomic.h>
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -93,6 +100,9 @@ typedef struct state_entry {
 		uint8_t		state[sizeof(struct state_comp)];	//!< State value in binary.
 	};
 
+	uint32_t		hash;				//!< Hash of the state value.  Selects the shard
+								//!< and the hash bucket.
+
 	time_t			cleanup;			//!< When this entry should be cleaned up.
 	struct state_entry	*prev;				//!< Previous entry in the cleanup list.
 	struct state_entry	*next;				//!< Next entry in the cleanup list.
@@ -106,16 +116,33 @@ typedef struct state_entry {
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
 } fr_state_entry_t;
 
-struct fr_state_tree_t {
-	uint64_t		id;				//!< Next ID to assign.
+/** A portion of the state entries, with its own lock
+ *
+ */
+typedef struct state_shard {
+	fr_hash_table_t		*ht;				//!< Hash table used to lookup state value.
+
+	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
+	uint64_t		created;			//!< Number of states created in this shard.
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} fr_state_shard_t;
 
-	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
+/*
+ *	Must be a power of 2, and no more than 256, as the shard
+ *	is selected with the top byte of the hash.  The low bits
+ *	select the bucket in the shard's hash table.
+ */
+#define STATE_SHARDS		(64)
+
+struct fr_state_tree_t {
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+	atomic_uint_fast32_t	num_sessions;			//!< Number of sessions we track, over all shards.
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+
+	uint32_t		num_shards;			//!< Number of shards, a power of 2.
+	fr_state_shard_t	*shards;			//!< Array of shards.
 };
 
 fr_state_tree_t *global_state = NULL;
@@ -123,7 +150,19 @@ fr_state_tree_t *global_state = NULL;
 #define PTHREAD_MUTEX_LOCK if (main_config.spawn_workers) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (main_config.spawn_workers) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+#define STATE_SHARD(_state, _hash) (&(_state)->shards[((_hash) >> 24) & ((_state)->num_shards - 1)])
+
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
+
+/** Return the hash of a fr_state_entry_t, calculated from its state value
+ *
+ */
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
+
+	return entry->hash;
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -141,29 +180,39 @@ static int state_entry_cmp(void const *one, void const *two)
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
+	uint32_t i;
 	fr_state_entry_t *this;
 
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
-
 	DEBUG4("Freeing state tree %p", state);
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+		/*
+		 *	Only shards which were fully initialised
+		 *	have a hash table.
+		 */
+		if (!shard->ht) continue;
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+		if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
 
-	/*
-	 *	Free the rbtree
-	 */
-	rbtree_free(state->tree);
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(state, shard, this);
+			talloc_free(this);
+		}
+
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+		rad_assert(fr_hash_table_num_elements(shard->ht) == 0);
+
+		/*
+		 *	Free the hash table
+		 */
+		fr_hash_table_free(shard->ht);
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -179,14 +228,27 @@ static int _state_tree_free(fr_state_tree_t *state)
  */
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
+	uint32_t i;
 	fr_state_tree_t *state;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
+	/*
+	 *	Without threads there's nothing to contend with, so
+	 *	one shard will do.
+	 */
+	state->num_shards = main_config.spawn_workers ? STATE_SHARDS : 1;
 	state->max_sessions = max_sessions;
+	atomic_init(&state->num_sessions, 0);
 	state->timeout = timeout;
 
+	state->shards = talloc_zero_array(state, fr_state_shard_t, state->num_shards);
+	if (!state->shards) {
+		talloc_free(state);
+		return NULL;
+	}
+
 	/*
 	 *	Create a break in the contexts.
 	 *	We still want this to be freed at the same time
@@ -195,32 +257,39 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 *	tree.
 	 */
 	fr_talloc_link_ctx(ctx, state);
+	talloc_set_destructor(state, _state_tree_free);
 
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		if (main_config.spawn_workers && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash table, so that all the state entries
+		 *	are freed before it's destroyed.  The hash
+		 *	table isn't parented by the state tree,
+		 *	as each one is used by different threads.
+		 */
+		shard->ht = fr_hash_table_create_open(NULL, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->ht) {
+			if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
 }
 
-/** Unlink an entry and remove if from the tree
+/** Unlink an entry and remove if from the shard
  *
+ * @note Called with the shard mutex held.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -228,24 +297,25 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	fr_hash_table_delete(shard->ht, entry);
+	atomic_fetch_sub_explicit(&state->num_sessions, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -288,46 +358,119 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Fill in the state value and hash of a lookup key from the State attribute
  *
- * @note Called with the mutex held.
+ * @return
+ *	- The shard the entry would be in.
+ *	- NULL if there's no valid State attribute.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static fr_state_shard_t *state_entry_key(fr_state_tree_t *state, fr_state_entry_t *key,
+					 REQUEST *request, RADIUS_PACKET *packet)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
-	fr_state_entry_t	*entry, *next;
-	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+	VALUE_PAIR *vp;
 
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
+	if (!vp) return NULL;
+
+	if (vp->vp_length != sizeof(key->state)) return NULL;
+
+	memcpy(key->state, vp->vp_octets, sizeof(key->state));
 
 	/*
-	 *	Clean up old entries.
+	 *	Make it unique for different virtual servers handling the same request
 	 */
-	for (entry = state->head; entry != NULL; entry = next) {
+	key->state_comp.server_hash ^= fr_hash_string(request->server);
+	key->hash = fr_hash(key->state, sizeof(key->state));
+
+	return STATE_SHARD(state, key->hash);
+}
+
+/** Find the entry matching a key
+ *
+ * @note Called with the shard mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
+
+	entry = fr_hash_table_finddata(shard->ht, key);
+
+#ifdef WITH_VERIFY_PTR
+	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
+#endif
+
+	return entry;
+}
+
+/** Free a list of entries which have been unlinked from their shard
+ *
+ * We do it outside of the mutex, as freeing may involve significantly more
+ * work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now be freed also, and
+ * it may have complex destructors associated with it.
+ */
+static void state_entry_list_free(fr_state_entry_t *head)
+{
+	fr_state_entry_t *entry, *next;
+
+	for (next = head; next;) {
+		entry = next;
 		next = entry->next;
+		talloc_free(entry);
+	}
+}
 
-		if (entry == old) continue;
+/** Remove expired entries from every shard
+ *
+ * Entries are normally only cleaned up when another entry is added to
+ * the same shard, so expired entries in other shards can hold on to
+ * sessions we'd otherwise have free.
+ *
+ * @note Called with no mutexes held.
+ */
+static void state_tree_expire(fr_state_tree_t *state, time_t now)
+{
+	uint32_t i;
 
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			*free_next = entry;
-			free_next = &(entry->next);
-			state->timed_out++;
-			continue;
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
+		fr_state_entry_t *expired, *next;
+		fr_state_entry_t *free_head = NULL, **free_next = &free_head;
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		for (expired = shard->head; expired && (expired->cleanup < now); expired = next) {
+			next = expired->next;
+
+			state_entry_unlink(state, shard, expired);
+			*free_next = expired;
+			free_next = &(expired->next);
+			shard->timed_out++;
 		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-		break;
+		state_entry_list_free(free_head);
 	}
+}
 
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
+/** Create a new state entry, and move the request's session-state into it
+ *
+ * @note Called with no mutexes held.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
+					    RADIUS_PACKET *packet, RADIUS_PACKET *original,
+					    request_data_t *data)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	VALUE_PAIR		*vp;
+	fr_state_shard_t	*shard = NULL;
+	fr_state_entry_t	*entry, *expired, *next, *old = NULL, my_entry;
+	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+
+	uint8_t			old_state[sizeof(my_entry.state)];
+	int			old_tries = 0;
 
 	/*
 	 *	Record the information from the old state, we may base the
@@ -336,51 +479,45 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	Once we release the mutex, the state of old becomes indeterminate
 	 *	so we have to grab the values now.
 	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (!old->data) {
-			state_entry_unlink(state, old);
-			*free_next = old;
+	if (original) shard = state_entry_key(state, &my_entry, request, original);
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		old = state_entry_find(shard, &my_entry);
+		if (old) {
+			old_tries = old->tries;
+
+			memcpy(old_state, old->state, sizeof(old_state));
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (!old->data) {
+				state_entry_unlink(state, shard, old);
+				*free_next = old;
+			}
 		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+		state_entry_list_free(free_head);
+		free_head = NULL;
+		free_next = &free_head;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
+	 *	We're at the limit, see if any sessions in the
+	 *	other shards have expired before giving up.
 	 */
-	for (next = free_head; next;) {
-		entry = next;
-		next = entry->next;
-		talloc_free(entry);
+	if (atomic_load_explicit(&state->num_sessions, memory_order_relaxed) >= state->max_sessions) {
+		state_tree_expire(state, now);
 	}
 
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
-	 *
-	 *	We reparent the talloc chunk later (when we hold the mutex again)
-	 *	we can't do it now due to thread safety issues with talloc.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -443,21 +580,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		fr_pair_add(&packet->vps, vp);
 	}
 
-	if (DEBUG_ENABLED4) {
-		char hex[(sizeof(entry->state) * 2) + 1];
-
-		fr_bin2hex(hex, entry->state, sizeof(entry->state));
-
-		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
-		       entry->id, hex, (uint64_t)entry->cleanup - now);
-	}
-
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t)state->max_sessions) {
-		talloc_free(entry);
-		return NULL;
-	}
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -466,56 +588,91 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(request->server);
 
-	if (!rbtree_insert(state->tree, entry)) {
+	/*
+	 *	The state value is (mostly) random, so its hash spreads
+	 *	the entries evenly over the shards.
+	 */
+	entry->hash = fr_hash(entry->state, sizeof(entry->state));
+	shard = STATE_SHARD(state, entry->hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	for (expired = shard->head; expired != NULL; expired = next) {
+		next = expired->next;
+
+		/*
+		 *	Too old, we can delete it.
+		 */
+		if (expired->cleanup < now) {
+			state_entry_unlink(state, shard, expired);
+			*free_next = expired;
+			free_next = &(expired->next);
+			shard->timed_out++;
+			continue;
+		}
+
+		break;
+	}
+
+	/*
+	 *	The limit is over all shards, so count the entry
+	 *	before inserting it, and uncount it if we can't.
+	 */
+	if ((atomic_fetch_add_explicit(&state->num_sessions, 1, memory_order_relaxed) >= state->max_sessions) ||
+	    !fr_hash_table_insert(shard->ht, entry)) {
+		atomic_fetch_sub_explicit(&state->num_sessions, 1, memory_order_relaxed);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		state_entry_list_free(free_head);
 		talloc_free(entry);
 		return NULL;
 	}
 
+	/*
+	 *	IDs are unique over all shards.
+	 */
+	entry->id = (shard->created++ * state->num_shards) + (shard - state->shards);
+
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	if (!state->head) {
+	if (!shard->head) {
 		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
+		shard->head = shard->tail = entry;
 	} else {
-		rad_assert(state->tail != NULL);
+		rad_assert(shard->tail != NULL);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
 
 		entry->next = NULL;
-		state->tail = entry;
+		shard->tail = entry;
 	}
 
-	return entry;
-}
+	rad_assert(request->state_ctx);
 
-/** Find the entry, based on the State attribute
- *
- */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
-{
-	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
+	entry->ctx = request->state_ctx;
+	entry->vps = request->state;
+	entry->data = data;
 
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
-	if (!vp) return NULL;
+	request->state_ctx = NULL;
+	request->state = NULL;
 
-	if (vp->vp_length != sizeof(my_entry.state)) return NULL;
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
+	state_entry_list_free(free_head);
 
-	/*
-	 *	Make it unique for different virtual servers handling the same request
-	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(request->server);
+	if (DEBUG_ENABLED4) {
+		char hex[(sizeof(entry->state) * 2) + 1];
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+		fr_bin2hex(hex, entry->state, sizeof(entry->state));
 
-#ifdef WITH_VERIFY_PTR
-	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
-#endif
+		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
+		       entry->id, hex, (uint64_t)entry->cleanup - now);
+	}
 
 	return entry;
 }
@@ -525,16 +682,20 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
-	fr_state_entry_t *entry;
+	fr_state_shard_t *shard;
+	fr_state_entry_t *entry, my_entry;
+
+	shard = state_entry_key(state, &my_entry, request, original);
+	if (!shard) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, original);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -561,7 +722,8 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry;
+	fr_state_shard_t *shard;
+	fr_state_entry_t *entry, my_entry;
 	TALLOC_CTX *old_ctx = NULL;
 
 	rad_assert(request->state == NULL);
@@ -574,22 +736,25 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	shard = state_entry_key(state, &my_entry, request, packet);
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
 
-	entry = state_entry_find(state, request, packet);
-	if (entry) {
-		if (request->state_ctx) old_ctx = request->state_ctx;
+		entry = state_entry_find(shard, &my_entry);
+		if (entry) {
+			if (request->state_ctx) old_ctx = request->state_ctx;
 
-		request->state_ctx = entry->ctx;
-		request->state = entry->vps;
-		request_data_restore(request, entry->data);
+			request->state_ctx = entry->ctx;
+			request->state = entry->vps;
+			request_data_restore(request, entry->data);
 
-		entry->ctx = NULL;
-		entry->vps = NULL;
-		entry->data = NULL;
-	}
+			entry->ctx = NULL;
+			entry->vps = NULL;
+			entry->data = NULL;
+		}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -617,7 +782,7 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
+	fr_state_entry_t *entry;
 	request_data_t *data;
 
 	request_data_by_persistance(&data, request, true);
@@ -629,28 +794,8 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
-	old = original ? state_entry_find(state, request, original) :
-			 NULL;
-
-	entry = state_entry_create(state, request, packet, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return false;
-	}
-
-	rad_assert(entry->ctx == NULL);
-	rad_assert(request->state_ctx);
-
-	entry->ctx = request->state_ctx;
-	entry->vps = request->state;
-	entry->data = data;
-
-	request->state_ctx = NULL;
-	request->state = NULL;
-
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	entry = state_entry_create(state, request, packet, original, data);
+	if (!entry) return false;
 
 	rad_assert(request->state == NULL);
 	VERIFY_REQUEST(request);
@@ -662,7 +807,12 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	uint32_t i;
+	uint64_t created = 0;
+
+	for (i = 0; i < state->num_shards; i++) created += state->shards[i].created;
+
+	return created;
 }
 
 /** Return number of entries that timed out
@@ -670,7 +820,12 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint32_t i;
+	uint64_t timed_out = 0;
+
+	for (i = 0; i < state->num_shards; i++) timed_out += state->shards[i].timed_out;
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -678,5 +833,5 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return atomic_load_explicit(&state->num_sessions, memory_order_relaxed);
 }
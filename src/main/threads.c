@@ -60,6 +60,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  include <sys/wait.h>
 #endif
 
+#ifndef WITH_GCD
+#  include <stdatomic.h>
+#endif
+
 #ifdef HAVE_OPENSSL_CRYPTO_H
 #  include <openssl/crypto.h>
 #endif
@@ -106,6 +110,39 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  define THREAD_CANCELLED	(3)
 #  define THREAD_EXITED		(4)
 
+/*
+ *	In "work_stealing" mode there is no shared idle list or heap.
+ *
+ *	Each worker owns an inbox ring, and a heap of requests in
+ *	priority order.  The listener pushes requests into the inbox
+ *	of an idle worker (or the least loaded of two random workers)
+ *	without taking any locks.  A worker moves its inbox into its
+ *	heap, and runs the highest priority request.  Workers with
+ *	nothing to do steal the highest priority request from another
+ *	worker before going to sleep.
+ *
+ *	The heap is protected by a per-worker mutex, which is only
+ *	contended when another worker is stealing.  The same mutex
+ *	serialises the consumers of the inbox, so only the producer
+ *	side of the ring needs to be lock-free.
+ */
+#  define THREAD_RING_SIZE	(1024)		//!< Must be a power of 2.
+#  define THREAD_RING_MASK	(THREAD_RING_SIZE - 1)
+
+typedef struct thread_ring_slot_t {
+	atomic_size_t		seq;		//!< Sequence number of the slot.
+	REQUEST			*request;
+} thread_ring_slot_t;
+
+/*
+ *	Bounded MPMC queue, with per-slot sequence numbers.
+ */
+typedef struct thread_ring_t {
+	atomic_size_t		head;		//!< Next slot to write.
+	atomic_size_t		tail;		//!< Next slot to read.
+	thread_ring_slot_t	slot[THREAD_RING_SIZE];
+} thread_ring_t;
+
 /*
  *  A data structure which contains the information about
  *  the current thread.
@@ -122,6 +159,15 @@ typedef struct THREAD_HANDLE {
 	REQUEST			*request;
 
 	sem_t			semaphore;	//!< used to signal the thread when there are new requests
+
+	/*
+	 *	Only used in "work_stealing" mode.
+	 */
+	pthread_mutex_t		mutex;		//!< Protects the heap, and serialises readers of the ring.
+	fr_heap_t		*heap;		//!< Requests assigned to this thread, in priority order.
+	thread_ring_t		*ring;		//!< Inbox the listener writes to.
+	atomic_uint_fast32_t	num_queued;	//!< Requests in the ring and the heap.
+	atomic_bool		sleeping;	//!< Waiting on the semaphore.
 } THREAD_HANDLE;
 
 #endif	/* WITH_GCD */
@@ -178,6 +224,13 @@ typedef struct THREAD_POOL {
 #endif
 
 	char const	*queue_priority;
+	char const	*queue_mode;
+
+	bool		work_stealing;		//!< Use per-thread queues.
+	THREAD_HANDLE	**workers;		//!< All threads, when work stealing.
+	uint32_t	num_workers;
+	atomic_uint_fast32_t	ws_next;	//!< Where the next search for an idle worker starts.
+	atomic_uint_fast32_t	ws_queued;	//!< Requests queued over all workers.
 
 	/*
 	 *	To ensure only one thread at a time touches the scheduler.
@@ -236,6 +289,7 @@ static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_POINTER("cleanup_delay", PW_TYPE_INTEGER, &thread_pool.cleanup_delay), .dflt = "5" },
 	{ FR_CONF_POINTER("max_queue_size", PW_TYPE_INTEGER, &thread_pool.max_queue_size), .dflt = "65536" },
 	{ FR_CONF_POINTER("queue_priority", PW_TYPE_STRING, &thread_pool.queue_priority), .dflt = NULL },
+	{ FR_CONF_POINTER("queue_mode", PW_TYPE_STRING, &thread_pool.queue_mode), .dflt = "shared" },
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
 	{ FR_CONF_POINTER("auto_limit_acct", PW_TYPE_BOOLEAN, &thread_pool.auto_limit_acct) },
@@ -293,35 +347,220 @@ static void reap_children(void)
 #ifndef WITH_GCD
 static REQUEST *request_dequeue(void);
 
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
 /*
- *	Add a request to the list of waiting requests.
- *	This function gets called ONLY from the main handler thread...
+ *	Decide whether or not an accounting request should be thrown
+ *	away because the queue is filling up, and update the input
+ *	packet rate.
  *
- *	This function should never fail.
+ *	Returns true if the request should be discarded.
  */
-int request_enqueue(REQUEST *request)
+static bool request_enqueue_shed(REQUEST *request, uint32_t num_queued)
 {
-	THREAD_HANDLE *thread;
+	struct timeval now;
 
-	request->component = "<core>";
-	request->module = "<queue>";
-	request->child_state = REQUEST_QUEUED;
+	if (!thread_pool.auto_limit_acct) return false;
 
 	/*
-	 *	Give the request to a thread, doing as little work as
-	 *	possible in the contended region.
+	 *	Throw away accounting requests if we're too
+	 *	busy.  The NAS should retransmit these, and no
+	 *	one should notice.
+	 *
+	 *	In contrast, we always try to process
+	 *	authentication requests.  Those are more time
+	 *	critical, and it's harder to determine which
+	 *	we can throw away, and which we can keep.
+	 *
+	 *	We allow the queue to get half full before we
+	 *	start worrying.  Even then, we still require
+	 *	that the rate of input packets is higher than
+	 *	the rate of outgoing packets.  i.e. the queue
+	 *	is growing.
+	 *
+	 *	Once that happens, we roll a dice to see where
+	 *	the barrier is for "keep" versus "toss".  If
+	 *	the queue is smaller than the barrier, we
+	 *	allow it.  If the queue is larger than the
+	 *	barrier, we throw the packet away.  Otherwise,
+	 *	we keep it.
+	 *
+	 *	i.e. the probability of throwing the packet
+	 *	away increases from 0 (queue is half full), to
+	 *	100 percent (queue is completely full).
+	 *
+	 *	A probabilistic approach allows us to process
+	 *	SOME of the new accounting packets.
 	 */
-	pthread_mutex_lock(&thread_pool.mutex);
+	if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    (num_queued > (thread_pool.max_queue_size / 2)) &&
+	    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
+		uint32_t prob;
+		uint32_t keep;
 
-	/*
-	 *	If we're too busy, don't do anything.
-	 */
-	if ((thread_pool.num_queued + 1) >= thread_pool.max_queue_size) {
-		pthread_mutex_unlock(&thread_pool.mutex);
+		/*
+		 *	Take a random value of how full we
+		 *	want the queue to be.  It's OK to be
+		 *	half full, but we get excited over
+		 *	anything more than that.
+		 */
+		keep = (thread_pool.max_queue_size / 2);
+		prob = fr_rand() & ((1 << 10) - 1);
+		keep *= prob;
+		keep >>= 10;
+		keep += (thread_pool.max_queue_size / 2);
 
 		/*
-		 *	Mark the request as done.
+		 *	If the queue is larger than our dice
+		 *	roll, we throw the packet away.
 		 */
+		if (num_queued > keep) return true;
+	}
+
+	gettimeofday(&now, NULL);
+
+	/*
+	 *	Calculate the instantaneous arrival rate into
+	 *	the queue.
+	 */
+	thread_pool.pps_in.pps = rad_pps(&thread_pool.pps_in.pps_old,
+					 &thread_pool.pps_in.pps_now,
+					 &thread_pool.pps_in.time_old,
+					 &now);
+
+	thread_pool.pps_in.pps_now++;
+
+	return false;
+}
+#endif	/* WITH_ACCOUNTING */
+#endif
+
+/** Return the number of requests waiting to be processed
+ *
+ */
+static uint32_t thread_pool_num_queued(void)
+{
+	if (thread_pool.work_stealing) return atomic_load(&thread_pool.ws_queued);
+
+	return thread_pool.num_queued;
+}
+
+/*
+ *	Add a request to a ring.  Returns false if the ring is full.
+ */
+static bool thread_ring_push(thread_ring_t *ring, REQUEST *request)
+{
+	thread_ring_slot_t	*slot;
+	size_t			pos, seq;
+
+	pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	for (;;) {
+		intptr_t diff;
+
+		slot = &ring->slot[pos & THREAD_RING_MASK];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (intptr_t) seq - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed)) break;
+			continue;
+		}
+
+		if (diff < 0) return false;
+
+		pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	}
+
+	slot->request = request;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	return true;
+}
+
+/*
+ *	Remove a request from a ring.  Returns NULL if the ring is empty.
+ */
+static REQUEST *thread_ring_pop(thread_ring_t *ring)
+{
+	thread_ring_slot_t	*slot;
+	size_t			pos, seq;
+	REQUEST			*request;
+
+	pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	for (;;) {
+		intptr_t diff;
+
+		slot = &ring->slot[pos & THREAD_RING_MASK];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed)) break;
+			continue;
+		}
+
+		if (diff < 0) return NULL;
+
+		pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	}
+
+	request = slot->request;
+	atomic_store_explicit(&slot->seq, pos + THREAD_RING_SIZE, memory_order_release);
+
+	return request;
+}
+
+/*
+ *	Pick a worker to give a request to.
+ *
+ *	Sleeping workers are preferred, so that requests start
+ *	immediately.  If every worker is busy, we pick the less loaded
+ *	of two random workers.  Idle workers will steal from it.
+ */
+static THREAD_HANDLE *thread_ws_select(void)
+{
+	uint32_t	i, start, num = thread_pool.num_workers;
+	THREAD_HANDLE	*a, *b;
+
+	start = atomic_fetch_add_explicit(&thread_pool.ws_next, 1, memory_order_relaxed);
+	for (i = 0; i < num; i++) {
+		a = thread_pool.workers[(start + i) % num];
+		if (atomic_load_explicit(&a->sleeping, memory_order_relaxed)) return a;
+	}
+
+	a = thread_pool.workers[fr_rand() % num];
+	b = thread_pool.workers[fr_rand() % num];
+
+	return (atomic_load(&a->num_queued) <= atomic_load(&b->num_queued)) ? a : b;
+}
+
+/*
+ *	Wake up a thread if it's waiting on its semaphore.
+ */
+static void thread_ws_wake(THREAD_HANDLE *thread)
+{
+	if (atomic_exchange(&thread->sleeping, false)) sem_post(&thread->semaphore);
+}
+
+/*
+ *	Add a request to the queue of a worker.  No locks are taken
+ *	unless the workers inbox is full.
+ */
+static int request_enqueue_ws(REQUEST *request)
+{
+	THREAD_HANDLE	*thread;
+	uint32_t	num_queued;
+
+	num_queued = atomic_load(&thread_pool.ws_queued);
+
+	/*
+	 *	If we're too busy, don't do anything.  Resumed
+	 *	requests have already been accepted, and must be
+	 *	run so that their modules can clean up.
+	 */
+	if (!request->yield && ((num_queued + 1) >= thread_pool.max_queue_size)) {
 		RATE_LIMIT(ERROR("Something is blocking the server.  There are %d packets in the queue, "
 				 "waiting to be processed.  Ignoring the new request.", thread_pool.max_queue_size));
 
@@ -333,79 +572,111 @@ int request_enqueue(REQUEST *request)
 
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
-	if (thread_pool.auto_limit_acct) {
-		struct timeval now;
+	if (!request->yield && request_enqueue_shed(request, num_queued)) goto done;
+#endif
+#endif
+
+	thread = thread_ws_select();
+
+	/*
+	 *	Count the request before it becomes visible, so that
+	 *	a thread which is about to go to sleep sees it.
+	 */
+	atomic_fetch_add(&thread_pool.ws_queued, 1);
+	atomic_fetch_add(&thread->num_queued, 1);
+
+	if (!thread_ring_push(thread->ring, request)) {
+		int inserted;
 
 		/*
-		 *	Throw away accounting requests if we're too
-		 *	busy.  The NAS should retransmit these, and no
-		 *	one should notice.
-		 *
-		 *	In contrast, we always try to process
-		 *	authentication requests.  Those are more time
-		 *	critical, and it's harder to determine which
-		 *	we can throw away, and which we can keep.
-		 *
-		 *	We allow the queue to get half full before we
-		 *	start worrying.  Even then, we still require
-		 *	that the rate of input packets is higher than
-		 *	the rate of outgoing packets.  i.e. the queue
-		 *	is growing.
-		 *
-		 *	Once that happens, we roll a dice to see where
-		 *	the barrier is for "keep" versus "toss".  If
-		 *	the queue is smaller than the barrier, we
-		 *	allow it.  If the queue is larger than the
-		 *	barrier, we throw the packet away.  Otherwise,
-		 *	we keep it.
-		 *
-		 *	i.e. the probability of throwing the packet
-		 *	away increases from 0 (queue is half full), to
-		 *	100 percent (queue is completely full).
-		 *
-		 *	A probabilistic approach allows us to process
-		 *	SOME of the new accounting packets.
+		 *	The inbox is full, so the thread is well
+		 *	behind.  Put the request directly into its
+		 *	heap.
 		 */
-		if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    (thread_pool.num_queued > (thread_pool.max_queue_size / 2)) &&
-		    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
-			uint32_t prob;
-			uint32_t keep;
-
-			/*
-			 *	Take a random value of how full we
-			 *	want the queue to be.  It's OK to be
-			 *	half full, but we get excited over
-			 *	anything more than that.
-			 */
-			keep = (thread_pool.max_queue_size / 2);
-			prob = fr_rand() & ((1 << 10) - 1);
-			keep *= prob;
-			keep >>= 10;
-			keep += (thread_pool.max_queue_size / 2);
+		pthread_mutex_lock(&thread->mutex);
+		inserted = fr_heap_insert(thread->heap, request);
+		pthread_mutex_unlock(&thread->mutex);
 
-			/*
-			 *	If the queue is larger than our dice
-			 *	roll, we throw the packet away.
-			 */
-			if (thread_pool.num_queued > keep) {
-				pthread_mutex_unlock(&thread_pool.mutex);
-				goto done;
-			}
+		if (!inserted) {
+			atomic_fetch_sub(&thread->num_queued, 1);
+			atomic_fetch_sub(&thread_pool.ws_queued, 1);
+			goto done;
 		}
+	}
 
-		gettimeofday(&now, NULL);
+	thread_ws_wake(thread);
+
+	return 1;
+}
+
+/*
+ *	Add a request to the list of waiting requests.
+ *
+ *	This function gets called from the main handler thread, and
+ *	from whichever thread signals a parked request (see
+ *	request_resume()).
+ *
+ *	Returns 0 without touching the request if the thread pool
+ *	has been stopped.
+ */
+int request_enqueue(REQUEST *request)
+{
+	THREAD_HANDLE *thread;
+
+	if (thread_pool.stop_flag) return 0;
+
+	if (thread_pool.work_stealing) {
+		request->component = "<core>";
+		request->module = "<queue>";
+		request->child_state = REQUEST_QUEUED;
+
+		return request_enqueue_ws(request);
+	}
+
+	/*
+	 *	Give the request to a thread, doing as little work as
+	 *	possible in the contended region.
+	 */
+	pthread_mutex_lock(&thread_pool.mutex);
+
+	/*
+	 *	The pool may have been stopped whilst we were
+	 *	waiting for the mutex.
+	 */
+	if (thread_pool.stop_flag) {
+		pthread_mutex_unlock(&thread_pool.mutex);
+		return 0;
+	}
+
+	request->component = "<core>";
+	request->module = "<queue>";
+	request->child_state = REQUEST_QUEUED;
+
+	/*
+	 *	If we're too busy, don't do anything.  Resumed
+	 *	requests have already been accepted, and must be
+	 *	run so that their modules can clean up.
+	 */
+	if (!request->yield && ((thread_pool.num_queued + 1) >= thread_pool.max_queue_size)) {
+		pthread_mutex_unlock(&thread_pool.mutex);
 
 		/*
-		 *	Calculate the instantaneous arrival rate into
-		 *	the queue.
+		 *	Mark the request as done.
 		 */
-		thread_pool.pps_in.pps = rad_pps(&thread_pool.pps_in.pps_old,
-						 &thread_pool.pps_in.pps_now,
-						 &thread_pool.pps_in.time_old,
-						 &now);
+		RATE_LIMIT(ERROR("Something is blocking the server.  There are %d packets in the queue, "
+				 "waiting to be processed.  Ignoring the new request.", thread_pool.max_queue_size));
+
+	done:
+		request->module = "<done>";
+		request->child_state = REQUEST_DONE;
+		return 0;
+	}
 
-		thread_pool.pps_in.pps_now++;
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
+	if (!request->yield && request_enqueue_shed(request, thread_pool.num_queued)) {
+		pthread_mutex_unlock(&thread_pool.mutex);
+		goto done;
 	}
 #endif	/* WITH_ACCOUNTING */
 #endif
@@ -500,30 +771,16 @@ int request_enqueue(REQUEST *request)
 }
 
 /*
- *	Remove a request from the queue.
+ *	Check a request which was just removed from a queue.
  *
- *	Called with the thread mutex held.
+ *	Returns false if the request should be skipped.
  */
-static REQUEST *request_dequeue(void)
+static bool request_dequeue_check(REQUEST *request)
 {
 	time_t blocked;
 	static time_t last_complained = 0;
 	static time_t total_blocked = 0;
 	int num_blocked = 0;
-	REQUEST *request = NULL;
-
-retry:
-	/*
-	 *	Grab the first entry.
-	 */
-	request = fr_heap_peek(thread_pool.idle_heap);
-	if (!request) {
-		rad_assert(thread_pool.num_queued == 0);
-		return NULL;
-	}
-
-	(void) fr_heap_extract(thread_pool.idle_heap, request);
-	thread_pool.num_queued--;
 
 	VERIFY_REQUEST(request);
 
@@ -532,11 +789,14 @@ retry:
 	 *
 	 *	@fixme: with a heap, we can dynamically remove it from the heap!
 	 *	@fixme: Is this memory leaked?  Probably...
+	 *
+	 *	Resumed requests are always run, so that the module
+	 *	they were waiting for can clean up.
 	 */
-	if (request->master_state == REQUEST_STOP_PROCESSING) {
+	if ((request->master_state == REQUEST_STOP_PROCESSING) && !request->yield) {
 		request->module = "<done>";
 		request->child_state = REQUEST_DONE;
-		goto retry;
+		return false;
 	}
 
 	rad_assert(request->magic == REQUEST_MAGIC);
@@ -565,9 +825,199 @@ retry:
 		      num_blocked, (int) blocked);
 	}
 
+	return true;
+}
+
+/*
+ *	Remove a request from the queue.
+ *
+ *	Called with the thread mutex held.
+ */
+static REQUEST *request_dequeue(void)
+{
+	REQUEST *request = NULL;
+
+retry:
+	/*
+	 *	Grab the first entry.
+	 */
+	request = fr_heap_peek(thread_pool.idle_heap);
+	if (!request) {
+		rad_assert(thread_pool.num_queued == 0);
+		return NULL;
+	}
+
+	(void) fr_heap_extract(thread_pool.idle_heap, request);
+	thread_pool.num_queued--;
+
+	if (!request_dequeue_check(request)) goto retry;
+
 	return request;
 }
 
+/*
+ *	Remove the highest priority request from a workers queue.
+ *
+ *	Called with the workers mutex held.
+ */
+static REQUEST *thread_ws_extract(THREAD_HANDLE *thread)
+{
+	REQUEST *request;
+
+	/*
+	 *	Move everything in the inbox into the heap, so that
+	 *	we can see which request has the highest priority.
+	 */
+	while ((request = thread_ring_pop(thread->ring)) != NULL) {
+		if (!fr_heap_insert(thread->heap, request)) {
+			atomic_fetch_sub(&thread->num_queued, 1);
+			atomic_fetch_sub(&thread_pool.ws_queued, 1);
+			request->module = "<done>";
+			request->child_state = REQUEST_DONE;
+		}
+	}
+
+retry:
+	request = fr_heap_peek(thread->heap);
+	if (!request) return NULL;
+
+	(void) fr_heap_extract(thread->heap, request);
+	atomic_fetch_sub(&thread->num_queued, 1);
+	atomic_fetch_sub(&thread_pool.ws_queued, 1);
+
+	if (!request_dequeue_check(request)) goto retry;
+
+	return request;
+}
+
+/*
+ *	Find a request for a worker to process.  Its own queue is
+ *	checked first.  If that's empty, we try to steal a request
+ *	from another worker.
+ */
+static REQUEST *thread_ws_dequeue(THREAD_HANDLE *thread)
+{
+	uint32_t	i, start, num = thread_pool.num_workers;
+	REQUEST		*request;
+
+	if (atomic_load(&thread->num_queued) > 0) {
+		pthread_mutex_lock(&thread->mutex);
+		request = thread_ws_extract(thread);
+		pthread_mutex_unlock(&thread->mutex);
+
+		if (request) return request;
+	}
+
+	if (atomic_load(&thread_pool.ws_queued) == 0) return NULL;
+
+	/*
+	 *	Start at a random worker, so that thieves don't all
+	 *	pile on to the same victim.  Workers which are busy
+	 *	stealing from, or adding to their own queue are
+	 *	skipped.
+	 */
+	start = fr_rand();
+	for (i = 0; i < num; i++) {
+		THREAD_HANDLE *victim = thread_pool.workers[(start + i) % num];
+
+		if (victim == thread) continue;
+		if (atomic_load(&victim->num_queued) == 0) continue;
+		if (pthread_mutex_trylock(&victim->mutex) != 0) continue;
+
+		request = thread_ws_extract(victim);
+		pthread_mutex_unlock(&victim->mutex);
+
+		if (request) {
+			DEBUG3("Thread %d stole request %u from thread %d",
+			       thread->thread_num, request->number, victim->thread_num);
+			return request;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Wake up one sleeping worker, other than the caller.
+ *
+ *	Used when a worker still has requests queued after picking one
+ *	to run, so that they don't wait behind the current request.
+ */
+static void thread_ws_wake_one(THREAD_HANDLE *exclude)
+{
+	uint32_t i, start, num = thread_pool.num_workers;
+
+	start = fr_rand();
+	for (i = 0; i < num; i++) {
+		THREAD_HANDLE *thread = thread_pool.workers[(start + i) % num];
+
+		if (thread == exclude) continue;
+		if (!atomic_load_explicit(&thread->sleeping, memory_order_relaxed)) continue;
+
+		if (atomic_exchange(&thread->sleeping, false)) {
+			sem_post(&thread->semaphore);
+			return;
+		}
+	}
+}
+
+/*
+ *	Run a request which has been assigned to a thread.
+ */
+static void request_handler_run(THREAD_HANDLE *thread, REQUEST *request)
+{
+#ifdef WITH_ACCOUNTING
+	if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    thread_pool.auto_limit_acct) {
+		VALUE_PAIR *vp;
+
+		vp = radius_pair_create(request, &request->config,
+				       181, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = thread_pool.pps_in.pps;
+
+		vp = radius_pair_create(request, &request->config,
+				       182, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = thread_pool.pps_in.pps;
+
+		vp = radius_pair_create(request, &request->config,
+				       183, VENDORPEC_FREERADIUS);
+		if (vp) {
+			vp->vp_integer = thread_pool.max_queue_size - thread_pool_num_queued();
+			vp->vp_integer *= 100;
+			vp->vp_integer /= thread_pool.max_queue_size;
+		}
+	}
+#endif
+
+	thread->request_count++;
+
+	DEBUG2("Thread %d handling request %d, (%d handled so far)",
+	       thread->thread_num, request->number,
+	       thread->request_count);
+
+	request->child_pid = thread->pthread_id;
+	request->component = "<core>";
+	request->module = NULL;
+	request->child_state = REQUEST_RUNNING;
+	request->log.unlang_indent = 0;
+	request->can_park = true;
+
+	request->process(request, FR_ACTION_RUN);
+
+	thread->request = NULL;
+
+	/*
+	 *	Clean up any children we exec'd.
+	 */
+	reap_children();
+
+#  ifdef HAVE_OPENSSL_ERR_H
+	/*
+	 *	Clear the error queue for the current thread.
+	 */
+	ERR_clear_error();
+#  endif
+}
 
 /*
  *	The main thread handler for requests.
@@ -666,58 +1116,19 @@ static void *request_handler_thread(void *arg)
 		rad_assert(thread->request != NULL);
 		request = thread->request;
 
-#ifdef WITH_ACCOUNTING
-		if ((thread->request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    thread_pool.auto_limit_acct) {
-			VALUE_PAIR *vp;
-
-			vp = radius_pair_create(request, &request->config,
-					       181, VENDORPEC_FREERADIUS);
-			if (vp) vp->vp_integer = thread_pool.pps_in.pps;
-
-			vp = radius_pair_create(request, &request->config,
-					       182, VENDORPEC_FREERADIUS);
-			if (vp) vp->vp_integer = thread_pool.pps_in.pps;
-
-			vp = radius_pair_create(request, &request->config,
-					       183, VENDORPEC_FREERADIUS);
-			if (vp) {
-				vp->vp_integer = thread_pool.max_queue_size - thread_pool.num_queued;
-				vp->vp_integer *= 100;
-				vp->vp_integer /= thread_pool.max_queue_size;
-			}
-		}
-#endif
-
-		thread->request_count++;
-
-		DEBUG2("Thread %d handling request %d, (%d handled so far)",
-		       thread->thread_num, request->number,
-		       thread->request_count);
+		request_handler_run(thread, request);
 
-		request->child_pid = thread->pthread_id;
-		request->component = "<core>";
-		request->module = NULL;
-		request->child_state = REQUEST_RUNNING;
-		request->log.unlang_indent = 0;
-
-		request->process(thread->request, FR_ACTION_RUN);
-
-		thread->request = NULL;
+		pthread_mutex_lock(&thread_pool.mutex);
 
 		/*
-		 *	Clean up any children we exec'd.
+		 *	The server stopped whilst we were running a
+		 *	request.  thread_pool_stop() is walking the
+		 *	lists, so stay where we are, and exit.
 		 */
-		reap_children();
-
-#  ifdef HAVE_OPENSSL_ERR_H
-		/*
-		 *	Clear the error queue for the current thread.
-		 */
-		ERR_clear_error();
-#  endif
-
-		pthread_mutex_lock(&thread_pool.mutex);
+		if (thread_pool.stop_flag) {
+			pthread_mutex_unlock(&thread_pool.mutex);
+			break;
+		}
 
 		/*
 		 *	Manage the thread pool once a second.
@@ -809,6 +1220,96 @@ static void *request_handler_thread(void *arg)
 	return NULL;
 }
 
+/*
+ *	The thread handler for requests, in "work_stealing" mode.
+ *
+ *	Run requests from our own queue, or steal them from other
+ *	threads.  When there's nothing to do, wait on the semaphore.
+ */
+static void *request_ws_thread(void *arg)
+{
+	THREAD_HANDLE *thread = (THREAD_HANDLE *) arg;
+
+#  ifdef HAVE_GPERFTOOLS_PROFILER_H
+	ProfilerRegisterThread();
+#  endif
+
+	while (!thread_pool.stop_flag) {
+		REQUEST *request;
+
+		request = thread_ws_dequeue(thread);
+		if (!request) {
+			/*
+			 *	Tell the listener we're going to sleep,
+			 *	and then check again.  Anything
+			 *	queued before the flag was set is
+			 *	picked up here, anything queued after
+			 *	will post the semaphore.
+			 */
+			atomic_store(&thread->sleeping, true);
+
+			request = thread_ws_dequeue(thread);
+			if (!request) {
+				DEBUG2("Thread %d waiting to be assigned a request",
+				       thread->thread_num);
+
+				while (sem_wait(&thread->semaphore) != 0) {
+					if (errno == EINTR) continue;
+
+					ERROR("Thread %d failed waiting for semaphore: %s: Exiting\n",
+					      thread->thread_num, fr_syserror(errno));
+					goto done;
+				}
+				continue;
+			}
+
+			/*
+			 *	If the listener has already cleared
+			 *	the flag, the semaphore has been
+			 *	posted, and we'll get a spurious
+			 *	wakeup later.  That's harmless.
+			 */
+			atomic_store(&thread->sleeping, false);
+		}
+
+		/*
+		 *	There's more work queued for us.  Get
+		 *	someone else to help.
+		 */
+		if (atomic_load(&thread->num_queued) > 0) thread_ws_wake_one(thread);
+
+		thread->status = THREAD_ACTIVE;
+		thread->request = request;
+
+		request_handler_run(thread, request);
+
+		thread->status = THREAD_IDLE;
+	}
+
+done:
+	DEBUG2("Thread %d exiting...", thread->thread_num);
+
+#  ifdef HAVE_OPENSSL_ERR_H
+	ERR_remove_state(0);
+#  endif
+
+	trigger_exec(NULL, NULL, "server.thread.stop", true, NULL);
+	thread->status = THREAD_EXITED;
+
+	return NULL;
+}
+
+/*
+ *	Free a thread handle used in "work_stealing" mode.
+ */
+static void thread_ws_free(THREAD_HANDLE *thread)
+{
+	if (thread->heap) fr_heap_delete(thread->heap);
+	free(thread->ring);
+	pthread_mutex_destroy(&thread->mutex);
+	free(thread);
+}
+
 /*
  *	Spawn a new thread, and place it in the thread pool.
  *	Called with the thread mutex locked...
@@ -840,6 +1341,35 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 		return NULL;
 	}
 
+	if (thread_pool.work_stealing) {
+		size_t i;
+
+		rcode = pthread_mutex_init(&thread->mutex, NULL);
+		if (rcode != 0) {
+			ERROR("Failed to initialize thread mutex: %s", fr_syserror(rcode));
+			free(thread);
+			return NULL;
+		}
+
+		thread->heap = fr_heap_create(thread_pool.heap_cmp, offsetof(REQUEST, heap_id));
+		if (!thread->heap) {
+			ERROR("Failed to initialize thread queue");
+			thread_ws_free(thread);
+			return NULL;
+		}
+
+		thread->ring = rad_malloc(sizeof(*thread->ring));
+		atomic_init(&thread->ring->head, 0);
+		atomic_init(&thread->ring->tail, 0);
+		for (i = 0; i < THREAD_RING_SIZE; i++) {
+			atomic_init(&thread->ring->slot[i].seq, i);
+			thread->ring->slot[i].request = NULL;
+		}
+
+		atomic_init(&thread->num_queued, 0);
+		atomic_init(&thread->sleeping, false);
+	}
+
 	/*
 	 *	Create the thread joinable, so that it can be cleaned up
 	 *	using pthread_join().
@@ -847,11 +1377,16 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	 *	Note that the function returns non-zero on error, NOT
 	 *	-1.  The return code is the error, and errno isn't set.
 	 */
-	rcode = pthread_create(&thread->pthread_id, 0, request_handler_thread, thread);
+	rcode = pthread_create(&thread->pthread_id, 0,
+			       thread_pool.work_stealing ? request_ws_thread : request_handler_thread, thread);
 	if (rcode != 0) {
-		free(thread);
 		ERROR("Thread create failed: %s",
 		       fr_syserror(rcode));
+		if (thread_pool.work_stealing) {
+			thread_ws_free(thread);
+		} else {
+			free(thread);
+		}
 		return NULL;
 	}
 
@@ -998,6 +1533,18 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 		return -1;
 	}
 
+	if (!thread_pool.queue_mode ||
+	    (strcmp(thread_pool.queue_mode, "shared") == 0)) {
+		thread_pool.work_stealing = false;
+
+	} else if (strcmp(thread_pool.queue_mode, "work_stealing") == 0) {
+		thread_pool.work_stealing = true;
+
+	} else {
+		ERROR("FATAL: Invalid queue_mode '%s'", thread_pool.queue_mode);
+		return -1;
+	}
+
 #endif	/* WITH_GCD */
 	return 0;
 }
@@ -1061,6 +1608,35 @@ int thread_pool_init(void)
 		return -1;
 	}
 
+	/*
+	 *	With work stealing, the pool doesn't grow or shrink.
+	 *	We create max_servers threads, each with its own
+	 *	queue, and keep them for the life of the server.
+	 */
+	if (thread_pool.work_stealing) {
+		thread_pool.workers = rad_malloc(sizeof(thread_pool.workers[0]) * thread_pool.max_threads);
+		memset(thread_pool.workers, 0, sizeof(thread_pool.workers[0]) * thread_pool.max_threads);
+		atomic_init(&thread_pool.ws_next, 0);
+		atomic_init(&thread_pool.ws_queued, 0);
+
+		/*
+		 *	Nothing is queued yet, so the threads won't
+		 *	look at the list of workers until the listener
+		 *	starts.
+		 */
+		for (i = 0; i < thread_pool.max_threads; i++) {
+			thread_pool.workers[i] = spawn_thread(now, 0);
+			if (!thread_pool.workers[i]) return -1;
+
+			thread_pool.num_workers++;
+			thread_pool.total_threads++;
+		}
+
+		DEBUG2("Thread pool initialized with %u work stealing threads", thread_pool.num_workers);
+		pool_initialized = true;
+		return 0;
+	}
+
 	/*
 	 *	Create a number of waiting threads.  Note we don't
 	 *	need to lock the mutex, as nothing is sending
@@ -1115,10 +1691,29 @@ void thread_pool_stop(void)
 	if (!pool_initialized) return;
 
 	/*
-	 *	Set pool stop flag.
+	 *	Set pool stop flag.  request_enqueue() checks it with
+	 *	the mutex held, so nothing is added to the queue
+	 *	once we've started freeing it.
 	 */
+	pthread_mutex_lock(&thread_pool.mutex);
 	thread_pool.stop_flag = true;
+	pthread_mutex_unlock(&thread_pool.mutex);
+
+	if (thread_pool.work_stealing) {
+		uint32_t i;
+
+		for (i = 0; i < thread_pool.num_workers; i++) {
+			sem_post(&thread_pool.workers[i]->semaphore);
+		}
 
+		for (i = 0; i < thread_pool.num_workers; i++) {
+			pthread_join(thread_pool.workers[i]->pthread_id, NULL);
+			thread_ws_free(thread_pool.workers[i]);
+		}
+		free(thread_pool.workers);
+		thread_pool.workers = NULL;
+		thread_pool.num_workers = 0;
+	}
 
 	/*
 	 *	Join and free all threads.
@@ -1452,7 +2047,7 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		 *	fixed in size.
 		 */
 		memset(array, 0, sizeof(array[0]) * RAD_LISTEN_MAX);
-		array[0] = fr_heap_num_elements(thread_pool.idle_heap);
+		array[0] = thread_pool_num_queued();
 
 		gettimeofday(&now, NULL);
 
@@ -44,6 +44,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <utime.h>
 #endif
 #include <ctype.h>
+#include <stdatomic.h>
 
 #ifdef WITH_TLS
 #  ifdef HAVE_OPENSSL_RAND_H
@@ -57,6 +58,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  ifdef HAVE_OPENSSL_EVP_H
 #    include <openssl/evp.h>
 #  endif
+#  include <openssl/hmac.h>
 #  include <openssl/ssl.h>
 
 #ifdef ENABLE_OPENSSL_VERSION_CHECK
@@ -125,6 +127,68 @@ static unsigned int 	record_to_buff(tls_record_t *record, void *out, unsigned in
  */
 static pthread_mutex_t *tls_static_mutexes = NULL;
 
+/** Counters for all TLS configurations
+ *
+ * @see tls_stats_t for what each counter means.
+ */
+static struct {
+	atomic_uint_fast64_t	handshakes_full;
+	atomic_uint_fast64_t	handshakes_resumed;
+	atomic_uint_fast64_t	handshake_cpu_usec;
+
+	atomic_uint_fast64_t	tickets_issued;
+	atomic_uint_fast64_t	tickets_accepted;
+	atomic_uint_fast64_t	tickets_rejected;
+
+	atomic_uint_fast64_t	cache_hits;
+	atomic_uint_fast64_t	cache_misses;
+	atomic_uint_fast64_t	cache_inserts;
+	atomic_uint_fast64_t	cache_expired;
+	atomic_uint_fast64_t	cache_evictions;
+} tls_stats;
+
+#define TLS_STATS_INC(_x) atomic_fetch_add_explicit(&tls_stats._x, 1, memory_order_relaxed)
+#define TLS_STATS_GET(_x) stats->_x = atomic_load_explicit(&tls_stats._x, memory_order_relaxed)
+
+/** Return the TLS counters
+ *
+ * @param[out] stats Where to write the counters.
+ */
+void tls_stats_get(tls_stats_t *stats)
+{
+	TLS_STATS_GET(handshakes_full);
+	TLS_STATS_GET(handshakes_resumed);
+	TLS_STATS_GET(handshake_cpu_usec);
+
+	TLS_STATS_GET(tickets_issued);
+	TLS_STATS_GET(tickets_accepted);
+	TLS_STATS_GET(tickets_rejected);
+
+	TLS_STATS_GET(cache_hits);
+	TLS_STATS_GET(cache_misses);
+	TLS_STATS_GET(cache_inserts);
+	TLS_STATS_GET(cache_expired);
+	TLS_STATS_GET(cache_evictions);
+}
+
+/** CPU time used by the current thread, in microseconds
+ *
+ * Used to work out how many handshakes a core can do, independent
+ * of how busy the server is.  Returns 0 if the platform can't tell us.
+ */
+static uint64_t tls_thread_cpu_usec(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#else
+	return 0;
+#endif
+}
+
 #ifdef PSK_MAX_IDENTITY_LEN
 /** Verify the PSK identity contains no reserved chars
  *
@@ -577,7 +641,9 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_server_conf_t *co
 		session->mtu = vp->vp_integer;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache || conf->session_cache_server || conf->session_tickets) {
+		session->allow_session_resumption = true; /* otherwise it's false */
+	}
 
 	return session;
 }
@@ -601,7 +667,9 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_server_conf_t *co
  */
 int tls_handshake_recv(REQUEST *request, tls_session_t *session)
 {
-	int ret;
+	int		ret;
+	bool		in_init;
+	uint64_t	start = 0;
 
 	if (session->invalid_hb_used) return 0;
 
@@ -613,8 +681,29 @@ int tls_handshake_recv(REQUEST *request, tls_session_t *session)
 	}
 	record_init(&session->dirty_in);
 
+	/*
+	 *	Handshake messages are processed by SSL_read, so
+	 *	that's what we measure.
+	 */
+	in_init = !SSL_is_init_finished(session->ssl);
+	if (in_init) start = tls_thread_cpu_usec();
+
 	ret = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
 		       sizeof(session->clean_out.data) - session->clean_out.used);
+
+	if (in_init) {
+		atomic_fetch_add_explicit(&tls_stats.handshake_cpu_usec, tls_thread_cpu_usec() - start,
+					  memory_order_relaxed);
+
+		if (SSL_is_init_finished(session->ssl)) {
+			if (SSL_session_reused(session->ssl)) {
+				TLS_STATS_INC(handshakes_resumed);
+			} else {
+				TLS_STATS_INC(handshakes_full);
+			}
+		}
+	}
+
 	if (ret > 0) {
 		session->clean_out.used += ret;
 		return 1;
@@ -1115,9 +1204,14 @@ static CONF_PARSER cache_config[] = {
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, fr_tls_server_conf_t, session_cache_server) },
 	{ FR_CONF_OFFSET("name", PW_TYPE_STRING, fr_tls_server_conf_t, session_id_name) },
 
-	{ FR_CONF_DEPRECATED("enable", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("lifetime", PW_TYPE_INTEGER, fr_tls_server_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", PW_TYPE_INTEGER, fr_tls_server_conf_t, NULL) },
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, session_cache_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, fr_tls_server_conf_t, session_timeout), .dflt = "86400" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, fr_tls_server_conf_t, session_cache_size), .dflt = "255" },
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, fr_tls_server_conf_t, session_cache_shards), .dflt = "16" },
+
+	{ FR_CONF_OFFSET("tickets", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, session_tickets), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_key_lifetime", PW_TYPE_INTEGER, fr_tls_server_conf_t, ticket_key_lifetime), .dflt = "3600" },
+
 	{ FR_CONF_DEPRECATED("persist_dir", PW_TYPE_STRING, fr_tls_server_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -1283,6 +1377,557 @@ typedef enum {
 	CACHE_ACTION_OCSP_WRITE = 5		//!< Write OCSP status.
 } tls_cache_action_t;
 
+/** A session in the in-memory cache
+ *
+ */
+typedef struct tls_cache_entry tls_cache_entry_t;
+struct tls_cache_entry {
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];	//!< Session ID.
+	size_t			id_len;		//!< Length of the session ID.
+	time_t			expires;	//!< When the entry should be removed.
+
+	uint8_t			*data;		//!< DER encoded SSL_SESSION.
+	size_t			len;		//!< Length of the DER encoded session.
+
+	tls_cache_entry_t	*prev;		//!< Next older entry in the shard.
+	tls_cache_entry_t	*next;		//!< Next newer entry in the shard.
+};
+
+/** A portion of the in-memory cache, with its own lock
+ *
+ * All entries have the same lifetime, so the oldest entry is always
+ * the next one to expire, and the one we evict when the shard is full.
+ */
+typedef struct tls_cache_shard {
+	rbtree_t		*tree;		//!< Entries indexed by session ID.
+	tls_cache_entry_t	*head;		//!< Oldest entry.
+	tls_cache_entry_t	*tail;		//!< Newest entry.
+	uint32_t		num;		//!< Number of entries in this shard.
+	pthread_mutex_t		mutex;		//!< Protects everything above.
+} tls_cache_shard_t;
+
+struct tls_session_cache {
+	uint32_t		lifetime;	//!< How long entries are kept for.
+	uint32_t		max_entries;	//!< Maximum number of entries in all shards.  0 means no limit.
+	atomic_uint_fast32_t	num;		//!< Number of entries in all shards.
+	uint32_t		num_shards;	//!< Number of shards.
+	tls_cache_shard_t	*shards;	//!< Array of shards.
+};
+
+static int session_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one;
+	tls_cache_entry_t const *b = two;
+
+	if (a->id_len < b->id_len) return -1;
+	if (a->id_len > b->id_len) return +1;
+
+	return memcmp(a->id, b->id, a->id_len);
+}
+
+/** Unlink an entry from its shard and free it
+ *
+ * @note The shard must be locked.
+ */
+static void session_cache_entry_free(tls_session_cache_t *cache, tls_cache_shard_t *shard, tls_cache_entry_t *c)
+{
+	rbtree_deletebydata(shard->tree, c);
+
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		shard->head = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		shard->tail = c->prev;
+	}
+	shard->num--;
+	atomic_fetch_sub(&cache->num, 1);
+
+	talloc_free(c);
+}
+
+static int _session_cache_free(tls_session_cache_t *cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+		while (shard->head) session_cache_entry_free(cache, shard, shard->head);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Allocate the in-memory session cache
+ *
+ * @param[in] ctx to allocate the cache in.
+ * @param[in] conf containing the cache settings.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+static tls_session_cache_t *session_cache_alloc(TALLOC_CTX *ctx, fr_tls_server_conf_t const *conf)
+{
+	tls_session_cache_t	*cache;
+	uint32_t		i;
+
+	cache = talloc_zero(ctx, tls_session_cache_t);
+	if (!cache) return NULL;
+
+	cache->lifetime = conf->session_timeout;
+	cache->num_shards = conf->session_cache_shards;
+	cache->max_entries = conf->session_cache_size;
+	atomic_init(&cache->num, 0);
+
+	cache->shards = talloc_zero_array(cache, tls_cache_shard_t, cache->num_shards);
+	if (!cache->shards) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+	for (i = 0; i < cache->num_shards; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+		shard->tree = rbtree_create(cache->shards, session_cache_entry_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!shard->tree) goto error;
+
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+	talloc_set_destructor(cache, _session_cache_free);
+
+	return cache;
+}
+
+/** Find the shard a session belongs to, and lock it
+ *
+ */
+static tls_cache_shard_t *session_cache_shard_lock(tls_session_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t *shard;
+
+	shard = &cache->shards[fr_hash(id, id_len) % cache->num_shards];
+	pthread_mutex_lock(&shard->mutex);
+
+	return shard;
+}
+
+/** Remove entries which have reached the end of their lifetime
+ *
+ * @note The shard must be locked.
+ */
+static void session_cache_expire(tls_session_cache_t *cache, tls_cache_shard_t *shard, time_t now)
+{
+	while (shard->head && (shard->head->expires <= now)) {
+		session_cache_entry_free(cache, shard, shard->head);
+		TLS_STATS_INC(cache_expired);
+	}
+}
+
+/** Add a DER encoded session to the in-memory cache
+ *
+ * @param[in] cache to add the session to.
+ * @param[in] id of the session.
+ * @param[in] id_len Length of the session ID.
+ * @param[in] data DER encoded session.  May be NULL if we only need to know the
+ *	session exists.
+ * @param[in] len Length of the DER encoded session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int session_cache_insert(tls_session_cache_t *cache, uint8_t const *id, size_t id_len,
+				uint8_t const *data, size_t len)
+{
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	*c, *old;
+	time_t			now = time(NULL);
+
+	if (id_len > sizeof(c->id)) return -1;
+
+	c = talloc_zero(NULL, tls_cache_entry_t);
+	if (!c) return -1;
+
+	memcpy(c->id, id, id_len);
+	c->id_len = id_len;
+	c->expires = now + cache->lifetime;
+	if (data) {
+		c->data = talloc_memdup(c, data, len);
+		if (!c->data) {
+			talloc_free(c);
+			return -1;
+		}
+		c->len = len;
+	}
+
+	shard = session_cache_shard_lock(cache, id, id_len);
+
+	session_cache_expire(cache, shard, now);
+
+	old = rbtree_finddata(shard->tree, c);
+	if (old) session_cache_entry_free(cache, shard, old);
+
+	/*
+	 *	The limit is for the whole cache, but we only
+	 *	hold the lock for this shard, so make room by
+	 *	evicting its oldest entries.  If this shard is
+	 *	empty, the cache may go over the limit by a few
+	 *	entries until the other shards are written to.
+	 */
+	while (cache->max_entries && shard->head && (atomic_load(&cache->num) >= cache->max_entries)) {
+		session_cache_entry_free(cache, shard, shard->head);
+		TLS_STATS_INC(cache_evictions);
+	}
+
+	if (!rbtree_insert(shard->tree, c)) {
+		pthread_mutex_unlock(&shard->mutex);
+		talloc_free(c);
+		return -1;
+	}
+
+	c->prev = shard->tail;
+	if (shard->tail) {
+		shard->tail->next = c;
+	} else {
+		shard->head = c;
+	}
+	shard->tail = c;
+	shard->num++;
+	atomic_fetch_add(&cache->num, 1);
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	TLS_STATS_INC(cache_inserts);
+
+	return 0;
+}
+
+/** Retrieve a session from the in-memory cache
+ *
+ * @param[in] cache to search.
+ * @param[in] id of the session.
+ * @param[in] id_len Length of the session ID.
+ * @return
+ *	- The deserialised session.
+ *	- NULL if the session wasn't found, or couldn't be deserialised.
+ */
+static SSL_SESSION *session_cache_find(tls_session_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	find, *c;
+	SSL_SESSION		*sess = NULL;
+	unsigned char const	*p;
+
+	if (id_len > sizeof(find.id)) return NULL;
+
+	memcpy(find.id, id, id_len);
+	find.id_len = id_len;
+
+	shard = session_cache_shard_lock(cache, id, id_len);
+
+	c = rbtree_finddata(shard->tree, &find);
+	if (c && (c->expires <= time(NULL))) {
+		session_cache_entry_free(cache, shard, c);
+		TLS_STATS_INC(cache_expired);
+		c = NULL;
+	}
+
+	if (c && c->data) {
+		p = c->data;	/* openssl will mutate p */
+		sess = d2i_SSL_SESSION(NULL, &p, c->len);
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (!sess) {
+		TLS_STATS_INC(cache_misses);
+		return NULL;
+	}
+	TLS_STATS_INC(cache_hits);
+
+	return sess;
+}
+
+/** Remove a session from the in-memory cache
+ *
+ * @param[in] cache to remove the session from.
+ * @param[in] id of the session.
+ * @param[in] id_len Length of the session ID.
+ */
+static void session_cache_delete(tls_session_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	find, *c;
+
+	if (id_len > sizeof(find.id)) return;
+
+	memcpy(find.id, id, id_len);
+	find.id_len = id_len;
+
+	shard = session_cache_shard_lock(cache, id, id_len);
+
+	c = rbtree_finddata(shard->tree, &find);
+	if (c) session_cache_entry_free(cache, shard, c);
+
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Check whether a session is in the in-memory cache
+ *
+ * @param[in] cache to search.
+ * @param[in] id of the session.
+ * @param[in] id_len Length of the session ID.
+ * @return true if the session was found, and hasn't expired.
+ */
+static bool session_cache_exists(tls_session_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	find, *c;
+	bool			found;
+
+	if (id_len > sizeof(find.id)) return false;
+
+	memcpy(find.id, id, id_len);
+	find.id_len = id_len;
+
+	shard = session_cache_shard_lock(cache, id, id_len);
+
+	c = rbtree_finddata(shard->tree, &find);
+	found = (c && (c->expires > time(NULL)));
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	return found;
+}
+
+/** A key used to protect session tickets
+ *
+ */
+typedef struct tls_ticket_key {
+	uint8_t			name[16];	//!< Sent in the ticket, so we know which key to decrypt it with.
+	uint8_t			aes_key[32];	//!< Key for encrypting the ticket.
+	uint8_t			hmac_key[32];	//!< Key for authenticating the ticket.
+	time_t			created;	//!< When the key was created.  0 if the key isn't valid.
+} tls_ticket_key_t;
+
+/** Keys used to protect session tickets
+ *
+ * New tickets are issued with the current key, which is replaced every
+ * ticket_key_lifetime seconds.  Tickets issued with the previous key
+ * are still accepted, and are replaced with ones using the current key.
+ */
+struct tls_ticket_keys {
+	uint32_t		lifetime;	//!< How long a key is used to issue tickets.
+	tls_ticket_key_t	current;	//!< Key for issuing new tickets.
+	tls_ticket_key_t	previous;	//!< Key tickets were issued with before the last rotation.
+	pthread_mutex_t		mutex;		//!< Protects the keys.
+};
+
+static int _ticket_keys_free(tls_ticket_keys_t *keys)
+{
+	pthread_mutex_destroy(&keys->mutex);
+	memset(&keys->current, 0, sizeof(keys->current));
+	memset(&keys->previous, 0, sizeof(keys->previous));
+
+	return 0;
+}
+
+/** Create a new ticket key
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if we couldn't get enough random data.
+ */
+static int ticket_key_generate(tls_ticket_key_t *key, time_t now)
+{
+	if ((RAND_bytes(key->name, sizeof(key->name)) != 1) ||
+	    (RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1) ||
+	    (RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)) {
+		key->created = 0;
+		return -1;
+	}
+	key->created = now;
+
+	return 0;
+}
+
+/** Replace the ticket keys if they are too old
+ *
+ * @note The mutex must be held.
+ */
+static void ticket_keys_rotate(tls_ticket_keys_t *keys, time_t now)
+{
+	if (keys->current.created && ((now - keys->current.created) < (time_t)keys->lifetime)) return;
+
+	/*
+	 *	Tickets issued with the previous key must have
+	 *	been issued less than two lifetimes ago.
+	 */
+	if (keys->current.created && ((now - keys->current.created) < (time_t)(keys->lifetime * 2))) {
+		keys->previous = keys->current;
+	} else {
+		memset(&keys->previous, 0, sizeof(keys->previous));
+	}
+
+	if (ticket_key_generate(&keys->current, now) < 0) {
+		ERROR("Failed generating session ticket key: %s", ERR_error_string(ERR_get_error(), NULL));
+	}
+}
+
+/** Allocate the session ticket keys
+ *
+ * @param[in] ctx to allocate the keys in.
+ * @param[in] conf containing the ticket settings.
+ * @return
+ *	- The new keys.
+ *	- NULL on error.
+ */
+static tls_ticket_keys_t *ticket_keys_alloc(TALLOC_CTX *ctx, fr_tls_server_conf_t const *conf)
+{
+	tls_ticket_keys_t *keys;
+
+	keys = talloc_zero(ctx, tls_ticket_keys_t);
+	if (!keys) return NULL;
+
+	keys->lifetime = conf->ticket_key_lifetime;
+	if (ticket_key_generate(&keys->current, time(NULL)) < 0) {
+		ERROR("Failed generating session ticket key: %s", ERR_error_string(ERR_get_error(), NULL));
+		talloc_free(keys);
+		return NULL;
+	}
+
+	pthread_mutex_init(&keys->mutex, NULL);
+	talloc_set_destructor(keys, _ticket_keys_free);
+
+	return keys;
+}
+
+/** Set up the cipher and HMAC contexts for encrypting or decrypting a session ticket
+ *
+ * @param[in] ssl session state.
+ * @param[in,out] key_name Name of the key.  Written when encrypting, read when decrypting.
+ * @param[in,out] iv Initialisation vector.  Written when encrypting, read when decrypting.
+ * @param[in] ectx Cipher context to initialise.
+ * @param[in] hctx HMAC context to initialise.
+ * @param[in] enc 1 if a ticket is being issued, 0 if one is being decrypted.
+ * @return
+ *	- 2 if the ticket was decrypted with the previous key, and should be replaced.
+ *	- 1 on success.
+ *	- 0 if the ticket was encrypted with a key we no longer have.
+ *	- -1 on error.
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+			 EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	fr_tls_server_conf_t	*conf;
+	tls_ticket_keys_t	*keys;
+	tls_ticket_key_t	key;
+	int			rcode = 1;
+
+	conf = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	keys = conf->ticket_keys;
+
+	pthread_mutex_lock(&keys->mutex);
+	ticket_keys_rotate(keys, time(NULL));
+
+	if (enc) {
+		key = keys->current;
+	} else if (keys->current.created && (memcmp(key_name, keys->current.name, sizeof(keys->current.name)) == 0)) {
+		key = keys->current;
+	} else if (keys->previous.created && (memcmp(key_name, keys->previous.name, sizeof(keys->previous.name)) == 0)) {
+		key = keys->previous;
+		rcode = 2;
+	} else {
+		key.created = 0;
+	}
+	pthread_mutex_unlock(&keys->mutex);
+
+	if (!key.created) {
+		if (!enc) TLS_STATS_INC(tickets_rejected);
+		return enc ? -1 : 0;
+	}
+
+	if (enc) {
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if ((RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) ||
+		    (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) ||
+		    (HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1)) {
+			rcode = -1;
+		} else {
+			TLS_STATS_INC(tickets_issued);
+		}
+	} else {
+		if ((HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1) ||
+		    (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)) {
+			rcode = -1;
+		} else {
+			tls_session_t *session;
+
+			/*
+			 *	Remember this, so tls_success() can check
+			 *	the session completed authentication.
+			 */
+			session = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION);
+			if (session) session->ticket_decrypted = true;
+
+			TLS_STATS_INC(tickets_accepted);
+		}
+	}
+
+	memset(&key, 0, sizeof(key));
+
+	return rcode;
+}
+
+/** Create an identifier for a session which may be resumed from a ticket
+ *
+ * Tickets are issued at the end of the TLS handshake, before any inner
+ * authentication has been done, and can't be revoked.  So we record the
+ * sessions which completed authentication, and only allow those to be
+ * resumed from a ticket.
+ *
+ * The session ID is chosen by the client when it resumes from a ticket,
+ * so we use a digest of the master secret, which stays the same for as
+ * long as the session can be resumed.
+ *
+ * @param[out] out Where to write the identifier.
+ * @param[in] outlen Length of out.
+ * @param[in] sess to create the identifier for.
+ * @return
+ *	- The length of the identifier.
+ *	- -1 on error.
+ */
+static ssize_t ticket_session_id(uint8_t *out, size_t outlen, SSL_SESSION *sess)
+{
+	uint8_t		master_key[SSL_MAX_MASTER_KEY_LENGTH];
+	size_t		len;
+	unsigned int	digest_len;
+	int		ret;
+
+	if (outlen < (size_t)EVP_MD_size(EVP_sha256())) return -1;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	len = SSL_SESSION_get_master_key(sess, master_key, sizeof(master_key));
+#else
+	len = sess->master_key_length;
+	if (len > sizeof(master_key)) return -1;
+	memcpy(master_key, sess->master_key, len);
+#endif
+	if (!len) return -1;
+
+	ret = EVP_Digest(master_key, len, out, &digest_len, EVP_sha256(), NULL);
+	memset(master_key, 0, sizeof(master_key));
+	if (ret != 1) return -1;
+
+	return (ssize_t)digest_len;
+}
+
 /** Add attributes identifying the TLS session to be acted upon, and the action to be performed
  *
  * Adds the following attributes to the request:
@@ -1399,10 +2044,6 @@ static int cache_write_session(SSL *ssl, SSL_SESSION *sess)
 		REDEBUG("Session ID buffer to small");
 		return 0;
 	}
-	if (cache_key_add(request, (uint8_t *) buffer, (size_t)slen, CACHE_ACTION_SESSION_WRITE) < 0) {
-		RWDEBUG("Failed adding session key to the request");
-		return 0;
-	}
 
 	/* find out what length data we need */
 	len = i2d_SSL_SESSION(sess, NULL);
@@ -1427,6 +2068,21 @@ static int cache_write_session(SSL *ssl, SSL_SESSION *sess)
 		goto error;
 	}
 
+	if (conf->session_cache) {
+		if (session_cache_insert(conf->session_cache, buffer, (size_t)slen, data, len) < 0) {
+			RWDEBUG("Failed storing session data in memory");
+		} else {
+			RDEBUG2("Stored %zu bytes of session data in memory", len);
+		}
+	}
+
+	if (!conf->session_cache_server) goto error;
+
+	if (cache_key_add(request, (uint8_t *) buffer, (size_t)slen, CACHE_ACTION_SESSION_WRITE) < 0) {
+		RWDEBUG("Failed adding session key to the request");
+		goto error;
+	}
+
 	/*
 	 *	Put the SSL data into an attribute.
 	 */
@@ -1488,13 +2144,31 @@ static SSL_SESSION *cache_read_session(SSL *ssl, unsigned char *key, int key_len
 	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
 	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 
+	*copy = 0;
+
+	/*
+	 *	Sessions we created ourselves are usually still
+	 *	in memory, so we don't need to ask the virtual
+	 *	server for them.
+	 */
+	if (conf->session_cache) {
+		sess = session_cache_find(conf->session_cache, key, key_len);
+		if (sess) {
+			RDEBUG2("Found session in memory");
+			return sess;
+		}
+	}
+
+	if (!conf->session_cache_server) {
+		RWDEBUG("No cached session found");
+		return NULL;
+	}
+
 	if (cache_key_add(request, key, key_len, CACHE_ACTION_SESSION_READ) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		return NULL;
 	}
 
-	*copy = 0;
-
 	/*
 	 *	Call the virtual server to read the session
 	 */
@@ -1546,6 +2220,16 @@ static void cache_delete_session(SSL_CTX *ctx, SSL_SESSION *sess)
 
 	conf = SSL_CTX_get_app_data(ctx);
 
+	slen = tls_session_id(buffer, sizeof(buffer), sess);
+	if (slen < 0) {
+		WARN("Session ID buffer too small");
+		return;
+	}
+
+	if (conf->session_cache) session_cache_delete(conf->session_cache, buffer, (size_t)slen);
+
+	if (!conf->session_cache_server) return;
+
 	/*
 	 *	We need a fake request for the virtual server, but we
 	 *	don't have a parent request to base it on.  So just
@@ -1555,19 +2239,13 @@ static void cache_delete_session(SSL_CTX *ctx, SSL_SESSION *sess)
 	request->packet = fr_radius_alloc(request, false);
 	request->reply = fr_radius_alloc(request, false);
 
-	slen = tls_session_id(buffer, sizeof(buffer), sess);
-	if (slen < 0) {
-		RWDEBUG("Session ID buffer too small");
+	if (cache_key_add(request, buffer, (size_t)slen, CACHE_ACTION_SESSION_DELETE) < 0) {
+		RWDEBUG("Failed adding session key to the request");
 	error:
 		talloc_free(request);
 		return;
 	}
 
-	if (cache_key_add(request, buffer, (size_t)slen, CACHE_ACTION_SESSION_DELETE) < 0) {
-		RWDEBUG("Failed adding session key to the request");
-		goto error;
-	}
-
 	/*
 	 *	Call the virtual server to delete the session
 	 */
@@ -3130,7 +3808,7 @@ post_ca:
 	}
 
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET;
+	if (client || !conf->session_tickets) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	if (!conf->disable_single_dh_use) {
@@ -3195,13 +3873,23 @@ post_ca:
 	/*
 	 *	Callbacks, etc. for session resumption.
 	 */
-	if (conf->session_cache_server) {
+	if (conf->session_cache || conf->session_cache_server) {
 		SSL_CTX_sess_set_new_cb(ctx, cache_write_session);
 		SSL_CTX_sess_set_get_cb(ctx, cache_read_session);
 		SSL_CTX_sess_set_remove_cb(ctx, cache_delete_session);
 		SSL_CTX_set_quiet_shutdown(ctx, 1);
 	}
 
+	/*
+	 *	Tickets contain the whole session, encrypted with
+	 *	a key only we know, so resuming them doesn't need
+	 *	a cache at all.
+	 */
+	if (!client && conf->session_tickets) {
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+		SSL_CTX_set_quiet_shutdown(ctx, 1);
+	}
+
 	/*
 	 *	Check the certificates for revocation.
 	 */
@@ -3257,9 +3945,15 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	if (conf->session_cache_server) {
+	if (conf->session_cache || conf->session_cache_server || (!client && conf->session_tickets)) {
 		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
 
+		/*
+		 *	OpenSSL won't resume sessions older than this,
+		 *	and tells clients how long they can keep tickets.
+		 */
+		SSL_CTX_set_timeout(ctx, conf->session_timeout);
+
 		/*
 		 *	This sets the context sessions can be resumed in.
 		 *	This is to prevent sessions being created by one application
@@ -3370,7 +4064,38 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 	/*
 	 *	Setup session caching
 	 */
-	if (conf->session_cache_server) {
+	if (conf->session_cache_shards < 1) conf->session_cache_shards = 1;
+	if (conf->session_cache_shards > 256) conf->session_cache_shards = 256;
+
+	if (conf->session_cache_enable) {
+		conf->session_cache = session_cache_alloc(conf, conf);
+		if (!conf->session_cache) {
+			ERROR("Failed allocating TLS session cache");
+			goto error;
+		}
+	}
+
+	if (conf->session_tickets) {
+		if (conf->ticket_key_lifetime < 60) conf->ticket_key_lifetime = 60;
+
+		conf->ticket_keys = ticket_keys_alloc(conf, conf);
+		if (!conf->ticket_keys) goto error;
+
+		conf->ticket_sessions = session_cache_alloc(conf, conf);
+		if (!conf->ticket_sessions) {
+			ERROR("Failed allocating TLS ticket session cache");
+			goto error;
+		}
+
+		/*
+		 *	Evicting an entry would make the client fail
+		 *	authentication, and the entries are small, so
+		 *	they're only removed when they expire.
+		 */
+		conf->ticket_sessions->max_entries = 0;
+	}
+
+	if (conf->session_cache_enable || conf->session_cache_server || conf->session_tickets) {
 		/*
 		 *	Create a unique context Id per EAP-TLS configuration.
 		 */
@@ -3506,6 +4231,22 @@ fr_tls_server_conf_t *tls_client_conf_parse(CONF_SECTION *cs)
 	return conf;
 }
 
+/** Stop a session being resumed from a ticket
+ *
+ */
+static void ticket_session_revoke(fr_tls_server_conf_t *conf, tls_session_t *session)
+{
+	uint8_t	id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	ssize_t	slen;
+
+	if (!conf->ticket_sessions) return;
+
+	slen = ticket_session_id(id, sizeof(id), SSL_get_session(session->ssl));
+	if (slen < 0) return;
+
+	session_cache_delete(conf->ticket_sessions, id, (size_t)slen);
+}
+
 /** Sets up TLS session so that it can later be resumed
  *
  */
@@ -3536,6 +4277,7 @@ int tls_success(tls_session_t *session, REQUEST *request)
 	    (((vp = fr_pair_find_by_num(request->config, 0, PW_ALLOW_SESSION_RESUMPTION, TAG_ANY)) != NULL) &&
 	     (vp->vp_integer == 0))) {
 		SSL_CTX_remove_session(session->ctx, session->ssl->session);
+		ticket_session_revoke(conf, session);
 		session->allow_session_resumption = false;
 
 		/*
@@ -3552,10 +4294,39 @@ int tls_success(tls_session_t *session, REQUEST *request)
 	 *	user data in the cache.
 	 */
 	} else if (SSL_session_reused(session->ssl)) {
+		/*
+		 *	The ticket was issued before any inner
+		 *	authentication was done.  Only allow it
+		 *	if that authentication later succeeded.
+		 */
+		if (session->ticket_decrypted && conf->ticket_sessions) {
+			uint8_t	id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+			ssize_t	slen;
+
+			slen = ticket_session_id(id, sizeof(id), SSL_get_session(session->ssl));
+			if ((slen < 0) || !session_cache_exists(conf->ticket_sessions, id, (size_t)slen)) {
+				REDEBUG("Session ticket is not for a session which completed authentication");
+				return -1;
+			}
+		}
+
 		/*
 		 *	Mark the request as resumed.
 		 */
 		pair_make_request("EAP-Session-Resumed", "1", T_OP_SET);
+
+	/*
+	 *	A full handshake, and authentication succeeded, so
+	 *	the client may now use its ticket.
+	 */
+	} else if (conf->ticket_sessions) {
+		uint8_t	id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+		ssize_t	slen;
+
+		slen = ticket_session_id(id, sizeof(id), SSL_get_session(session->ssl));
+		if ((slen < 0) || (session_cache_insert(conf->ticket_sessions, id, (size_t)slen, NULL, 0) < 0)) {
+			RWDEBUG("Failed recording session, the client will not be able to resume it from a ticket");
+		}
 	}
 
 	return 0;
@@ -3564,10 +4335,18 @@ int tls_success(tls_session_t *session, REQUEST *request)
 
 void tls_fail(tls_session_t *session)
 {
+	fr_tls_server_conf_t *conf;
+
 	/*
 	 *	Force the session to NOT be cached.
 	 */
 	SSL_CTX_remove_session(session->ctx, session->ssl->session);
+
+	/*
+	 *	Nor resumed from a ticket.
+	 */
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF);
+	if (conf) ticket_session_revoke(conf, session);
 }
 
 fr_tls_status_t tls_application_data(tls_session_t *session, REQUEST *request)
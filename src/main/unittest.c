@@ -66,6 +66,31 @@ void listen_free(UNUSED rad_listen_t **head)
 	/* do nothing */
 }
 
+static pthread_mutex_t resume_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resume_cond = PTHREAD_COND_INITIALIZER;
+static bool resumed = false;
+
+/*
+ *	Called by modcall_signal() when the request is parked.  The
+ *	main thread plays the part of the worker thread which picks
+ *	it up again.
+ */
+void request_resume(UNUSED REQUEST *request)
+{
+	pthread_mutex_lock(&resume_mutex);
+	resumed = true;
+	pthread_cond_signal(&resume_cond);
+	pthread_mutex_unlock(&resume_mutex);
+}
+
+static void request_wait_resume(void)
+{
+	pthread_mutex_lock(&resume_mutex);
+	while (!resumed) pthread_cond_wait(&resume_cond, &resume_mutex);
+	resumed = false;
+	pthread_mutex_unlock(&resume_mutex);
+}
+
 
 static rad_listen_t *listen_alloc(void *ctx)
 {
@@ -530,6 +555,104 @@ static ssize_t xlat_poke(char **out, size_t outlen,
 }
 
 
+/*
+ *	Time "count" calls to radius_axlat() for a format string.  First
+ *	with a copy which is tokenized on every call, as for strings built
+ *	at runtime.  Then with a copy registered with xlat_compiled_add(),
+ *	as for module configuration items.
+ */
+static bool do_xlat_bench(REQUEST *request, char const *input, char *output, size_t outlen)
+{
+	int		i, count;
+	ssize_t		slen;
+	char		*p, *out, *fmt, *tokens;
+	char const	*error = NULL;
+	xlat_exp_t	*head;
+	struct timeval	start, end;
+	double		tokenized, compiled;
+	log_lvl_t	lvl = request->log.lvl;
+	int		debug_lvl = rad_debug_lvl;
+
+	count = strtol(input, &p, 10);
+	if ((count <= 0) || (*p != ' ')) {
+		snprintf(output, outlen, "ERROR 'bench' needs a count and a format string");
+		return true;
+	}
+	p++;
+
+	/*
+	 *	Don't time the debug output.
+	 */
+	request->log.lvl = L_DBG_LVL_OFF;
+	rad_debug_lvl = 0;
+
+	fmt = talloc_typed_strdup(NULL, p);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		out = NULL;
+		if (radius_axlat(&out, request, fmt, NULL, NULL) < 0) {
+			snprintf(output, outlen, "ERROR expanding xlat: %s", fr_strerror());
+			talloc_free(fmt);
+			request->log.lvl = lvl;
+	rad_debug_lvl = debug_lvl;
+			return true;
+		}
+		if (i < (count - 1)) talloc_free(out);
+	}
+	gettimeofday(&end, NULL);
+	tokenized = (end.tv_sec - start.tv_sec) + ((end.tv_usec - start.tv_usec) / 1000000.0);
+	strlcpy(output, out, outlen);
+	talloc_free(out);
+	talloc_free(fmt);
+
+	fmt = talloc_typed_strdup(NULL, p);
+	tokens = talloc_typed_strdup(NULL, p);
+	slen = xlat_tokenize(tokens, tokens, &head, &error);
+	if ((slen <= 0) || (xlat_compiled_add(fmt, tokens, head) < 0)) {
+		snprintf(output, outlen, "ERROR failed registering format string");
+		talloc_free(tokens);
+		talloc_free(fmt);
+		request->log.lvl = lvl;
+	rad_debug_lvl = debug_lvl;
+		return true;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		out = NULL;
+		if (radius_axlat(&out, request, fmt, NULL, NULL) < 0) {
+			snprintf(output, outlen, "ERROR expanding xlat: %s", fr_strerror());
+			talloc_free(fmt);
+			request->log.lvl = lvl;
+	rad_debug_lvl = debug_lvl;
+			return true;
+		}
+		if (i < (count - 1)) talloc_free(out);
+	}
+	gettimeofday(&end, NULL);
+	compiled = (end.tv_sec - start.tv_sec) + ((end.tv_usec - start.tv_usec) / 1000000.0);
+	request->log.lvl = lvl;
+	rad_debug_lvl = debug_lvl;
+
+	/*
+	 *	Both ways must give the same answer.
+	 */
+	if (strcmp(output, out) != 0) {
+		fprintf(stderr, "Pre-parsed tree expands to \"%s\", not \"%s\"\n", out, output);
+		talloc_free(out);
+		talloc_free(fmt);	/* also frees the tree */
+		return false;
+	}
+	talloc_free(out);
+	talloc_free(fmt);		/* also frees the tree */
+
+	printf("tokenized\t%d calls in %.3fs\t%.2f us/call\n", count, tokenized, (tokenized * 1000000.0) / count);
+	printf("pre-parsed\t%d calls in %.3fs\t%.2f us/call\n", count, compiled, (compiled * 1000000.0) / count);
+	fflush(stdout);
+
+	return true;
+}
+
 /*
  *	Read a file compose of xlat's and expected results
  */
@@ -611,6 +734,18 @@ static bool do_xlats(char const *filename, FILE *fp)
 			continue;
 		}
 
+		/*
+		 *	Look for "bench"
+		 */
+		if (strncmp(input, "bench ", 6) == 0) {
+			if (!do_xlat_bench(request, input + 6, output, sizeof(output))) {
+				fprintf(stderr, "Failed at line %d of %s\n", lineno, filename);
+				TALLOC_FREE(request);
+				return false;
+			}
+			continue;
+		}
+
 		/*
 		 *	Look for "data".
 		 */
@@ -919,7 +1054,15 @@ int main(int argc, char *argv[])
 		fclose(fp);
 	}
 
-	rad_virtual_server(request);
+	/*
+	 *	Run the request the way a worker thread does, giving
+	 *	it up whenever a module waits for I/O, so that parking
+	 *	and resuming requests is tested, too.
+	 */
+	request->can_park = true;
+	while ((rad_virtual_server(request) == RLM_MODULE_YIELD) && request->yield) {
+		if (modcall_park(request)) request_wait_resume();
+	}
 
 	if (!output_file || (strcmp(output_file, "-") == 0)) {
 		fp = stdout;
@@ -32,6 +32,8 @@ RCSID("$Id$")
 #include <freeradius-devel/base64.h>
 
 #include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 typedef struct xlat_t {
 	char			name[FR_MAX_STRING_LEN];	//!< Name of the xlat expansion.
@@ -78,6 +80,8 @@ typedef struct xlat_out {
 
 static rbtree_t *xlat_root = NULL;
 
+static void xlat_compiled_table_free(void);
+
 #ifdef WITH_UNLANG
 static char const * const xlat_foreach_names[] = {"Foreach-Variable-0",
 						  "Foreach-Variable-1",
@@ -1159,6 +1163,7 @@ ssize_t xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt)
  */
 void xlat_free(void)
 {
+	xlat_compiled_table_free();
 	TALLOC_FREE(xlat_root);
 }
 
@@ -1862,6 +1867,237 @@ static ssize_t xlat_tokenize_request(REQUEST *request, char const *fmt, xlat_exp
 	return slen;
 }
 
+/** A format string from the configuration, and its xlat tree
+ *
+ * The entry is a talloc child of the format string, so it's removed
+ * when the module owning the string frees it.
+ */
+typedef struct xlat_compiled {
+	char const	*fmt;		//!< Format string passed to radius_xlat() and radius_axlat().
+	xlat_exp_t	*head;		//!< Its xlat tree.
+} xlat_compiled_t;
+
+/** Open addressed hash table of compiled format strings, keyed by address
+ *
+ * Every call to #xlat_expand looks the format string up, so readers
+ * don't lock.  Entries are only added and removed when configuration is
+ * parsed or freed.  Those writers hold #xlat_compiled_mutex, mark removed
+ * slots with #XLAT_COMPILED_DELETED rather than emptying them, and replace
+ * the whole table when it fills up.  Replaced tables are kept until
+ * #xlat_free, as a reader may still be searching them.
+ */
+typedef struct xlat_compiled_table xlat_compiled_table_t;
+struct xlat_compiled_table {
+	xlat_compiled_table_t		*old;		//!< Table this one replaced.
+	uint32_t			size;		//!< Number of slots, a power of 2.
+	uint32_t			used;		//!< Slots which aren't empty, including deleted ones.
+	uint32_t			num;		//!< Slots holding an entry.
+	_Atomic(xlat_compiled_t *)	slots[];	//!< Entries.
+};
+
+static _Atomic(xlat_compiled_table_t *) xlat_compiled_table;
+static pthread_mutex_t xlat_compiled_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static xlat_compiled_t xlat_compiled_deleted;
+#define XLAT_COMPILED_DELETED (&xlat_compiled_deleted)
+
+#define XLAT_COMPILED_MIN_SIZE	64
+
+static uint32_t xlat_compiled_hash(char const *fmt)
+{
+	return fr_hash(&fmt, sizeof(fmt));
+}
+
+/** Add an entry to a table which isn't full
+ *
+ * @note Must be called with #xlat_compiled_mutex held.
+ */
+static void xlat_compiled_table_insert(xlat_compiled_table_t *table, xlat_compiled_t *compiled)
+{
+	uint32_t		i, mask = table->size - 1;
+	xlat_compiled_t		*slot;
+
+	for (i = xlat_compiled_hash(compiled->fmt) & mask; ; i = (i + 1) & mask) {
+		slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+		if (!slot) {
+			table->used++;
+			break;
+		}
+		if (slot == XLAT_COMPILED_DELETED) break;
+	}
+
+	table->num++;
+	atomic_store_explicit(&table->slots[i], compiled, memory_order_release);
+}
+
+/** Replace the table with a larger one, dropping deleted slots
+ *
+ * @note Must be called with #xlat_compiled_mutex held.
+ */
+static int xlat_compiled_table_grow(xlat_compiled_table_t *table)
+{
+	xlat_compiled_table_t	*new;
+	xlat_compiled_t		*slot;
+	uint32_t		i, size = XLAT_COMPILED_MIN_SIZE;
+
+	while (table && (size < (table->num * 4))) size <<= 1;
+
+	new = talloc_zero_size(NULL, sizeof(*new) + (size * sizeof(new->slots[0])));
+	if (!new) return -1;
+	talloc_set_name_const(new, "xlat_compiled_table_t");
+
+	new->size = size;
+	new->old = table;
+
+	if (table) {
+		for (i = 0; i < table->size; i++) {
+			slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+			if (slot && (slot != XLAT_COMPILED_DELETED)) xlat_compiled_table_insert(new, slot);
+		}
+	}
+
+	atomic_store_explicit(&xlat_compiled_table, new, memory_order_release);
+
+	return 0;
+}
+
+/** Free the table, and all the tables it replaced
+ *
+ */
+static void xlat_compiled_table_free(void)
+{
+	xlat_compiled_table_t *table, *old;
+
+	pthread_mutex_lock(&xlat_compiled_mutex);
+	table = atomic_exchange(&xlat_compiled_table, NULL);
+	pthread_mutex_unlock(&xlat_compiled_mutex);
+
+	for (; table; table = old) {
+		old = table->old;
+		talloc_free(table);
+	}
+}
+
+static int _xlat_compiled_free(xlat_compiled_t *compiled)
+{
+	xlat_compiled_table_t	*table;
+	uint32_t		i, mask;
+
+	pthread_mutex_lock(&xlat_compiled_mutex);
+	table = atomic_load_explicit(&xlat_compiled_table, memory_order_relaxed);
+	if (!table) goto done;
+
+	mask = table->size - 1;
+	for (i = xlat_compiled_hash(compiled->fmt) & mask; ; i = (i + 1) & mask) {
+		xlat_compiled_t *slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+
+		if (!slot) break;
+		if (slot == compiled) {
+			atomic_store_explicit(&table->slots[i], XLAT_COMPILED_DELETED, memory_order_release);
+			table->num--;
+			break;
+		}
+	}
+
+done:
+	pthread_mutex_unlock(&xlat_compiled_mutex);
+
+	return 0;
+}
+
+/** Find the entry for a format string in a table
+ *
+ * @note May be called without #xlat_compiled_mutex held.
+ */
+static xlat_compiled_t *xlat_compiled_table_find(xlat_compiled_table_t *table, char const *fmt)
+{
+	uint32_t		i, mask = table->size - 1;
+	xlat_compiled_t		*slot;
+
+	/*
+	 *	Tables are never more than half full, so there's
+	 *	always an empty slot to stop at.
+	 */
+	for (i = xlat_compiled_hash(fmt) & mask; ; i = (i + 1) & mask) {
+		slot = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+		if (!slot) return NULL;
+		if ((slot != XLAT_COMPILED_DELETED) && (slot->fmt == fmt)) return slot;
+	}
+}
+
+/** Associate a format string with its xlat tree
+ *
+ * Module configuration items of type #PW_TYPE_XLAT are tokenized when
+ * the configuration is parsed.  Keeping the tree means that when the
+ * module expands the string with #radius_xlat or #radius_axlat, the
+ * string doesn't have to be tokenized again for every request.
+ *
+ * The string is found by its address, not by its contents, so strings
+ * built at runtime never match.
+ *
+ * @param[in] fmt the format string, as the module will pass it to #radius_xlat.
+ *	Must have been allocated with talloc, and must not be modified.
+ * @param[in] tokens the buffer fmt was tokenized from.  Will be freed with the tree.
+ * @param[in] head the xlat tree.  Will be freed with fmt.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int xlat_compiled_add(char const *fmt, char *tokens, xlat_exp_t *head)
+{
+	xlat_compiled_table_t	*table;
+	xlat_compiled_t		*compiled;
+
+	compiled = talloc_zero(fmt, xlat_compiled_t);
+	if (!compiled) return -1;
+
+	compiled->fmt = fmt;
+
+	pthread_mutex_lock(&xlat_compiled_mutex);
+	table = atomic_load_explicit(&xlat_compiled_table, memory_order_relaxed);
+	if (table && xlat_compiled_table_find(table, fmt)) {
+	error:
+		pthread_mutex_unlock(&xlat_compiled_mutex);
+		talloc_free(compiled);
+		return -1;
+	}
+
+	if (!table || (((table->used + 1) * 2) > table->size)) {
+		if (xlat_compiled_table_grow(table) < 0) goto error;
+		table = atomic_load_explicit(&xlat_compiled_table, memory_order_relaxed);
+	}
+
+	compiled->head = talloc_steal(compiled, head);
+	(void) talloc_steal(head, tokens);
+
+	xlat_compiled_table_insert(table, compiled);
+	talloc_set_destructor(compiled, _xlat_compiled_free);
+	pthread_mutex_unlock(&xlat_compiled_mutex);
+
+	return 0;
+}
+
+/** Find the xlat tree for a format string from the configuration
+ *
+ * @param[in] fmt the format string.
+ * @return
+ *	- The xlat tree.
+ *	- NULL if the string wasn't added with #xlat_compiled_add.
+ */
+static xlat_exp_t const *xlat_compiled_find(char const *fmt)
+{
+	xlat_compiled_table_t	*table;
+	xlat_compiled_t		*compiled;
+
+	table = atomic_load_explicit(&xlat_compiled_table, memory_order_acquire);
+	if (!table) return NULL;
+
+	compiled = xlat_compiled_table_find(table, fmt);
+	if (!compiled) return NULL;
+
+	return compiled->head;
+}
+
 
 static char *xlat_getvp(TALLOC_CTX *ctx, REQUEST *request, vp_tmpl_t const *vpt,
 			bool escape, bool return_null)
@@ -2572,10 +2808,30 @@ static ssize_t xlat_expand(char **out, size_t outlen, REQUEST *request, char con
 {
 	ssize_t len;
 	xlat_exp_t *node;
+	xlat_exp_t const *compiled;
 
 	RDEBUG2("EXPAND %s", fmt);
 	RINDENT();
 
+	/*
+	 *	Format strings from the configuration were
+	 *	tokenized when it was parsed.
+	 */
+	compiled = xlat_compiled_find(fmt);
+	if (compiled) {
+		if (RDEBUG_ENABLED3) {
+			RDEBUG3("Using pre-parsed xlat tree:");
+			xlat_tokenize_debug(request, compiled);
+		}
+
+		len = xlat_expand_struct(out, outlen, request, compiled, escape, escape_ctx);
+
+		REXDENT();
+		RDEBUG2("--> %s", *out);
+
+		return len;
+	}
+
 	/*
 	 *	Give better errors than the old code.
 	 */
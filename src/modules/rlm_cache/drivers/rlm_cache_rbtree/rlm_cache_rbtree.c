@@ -19,24 +19,85 @@
  * @file rlm_cache_rbtree.c
  * @brief Simple rbtree based cache.
  *
+ * The cache is split into shards, each with its own rbtree, expiry heap and
+ * lock.  The shard is selected from a hash of the key, so requests for
+ * different keys rarely contend with each other.
+ *
+ * Lookups only take a read lock on the shard.  rlm_cache writes to the entries
+ * it's given (hit counts and TTLs), so lookups return a copy of the entry,
+ * private to the handle, which points to the maps of the shared entry.  The
+ * maps are never modified once the entry has been inserted, and the entry
+ * can't be freed whilst the read lock is held.
+ *
+ * Inserts, expiry and TTL updates take the write lock.  If max_entries is
+ * set, each shard holds at most max_entries / shards entries, and when a
+ * shard is full an entry is evicted using the CLOCK algorithm.  Hits set
+ * a flag on the entry, which can be done with the read lock held.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
+#include <stdatomic.h>
 #include "../../rlm_cache.h"
 
-typedef struct rlm_cache_rbtree {
+typedef struct rlm_cache_rbtree_entry rlm_cache_rbtree_entry_t;
+
+/** A portion of the cache, with its own lock
+ *
+ */
+typedef struct rlm_cache_rbtree_shard {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
+	rlm_cache_rbtree_entry_t *hand;		//!< Next entry the CLOCK algorithm will look at
+						//!< when evicting entries.
+
+	atomic_uint_fast32_t	num;		//!< Number of entries in this shard.
 
-	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
+	atomic_uint_fast64_t	hits;		//!< Number of lookups which found an entry.
+	atomic_uint_fast64_t	misses;		//!< Number of lookups which didn't find an entry.
+	atomic_uint_fast64_t	inserts;	//!< Number of entries added.
+	atomic_uint_fast64_t	expired;	//!< Number of entries removed because their TTL was reached,
+						//!< or because they were expired explicitly.
+	atomic_uint_fast64_t	evictions;	//!< Number of entries removed to make room for new ones.
+
+	pthread_rwlock_t	lock;		//!< Protect the tree from multiple readers/writers.
+	bool			initialised;	//!< Whether the lock was initialised.
+} rlm_cache_rbtree_shard_t;
+
+typedef struct rlm_cache_rbtree {
+	uint32_t		num_shards;	//!< Number of shards.
+	uint32_t		max_entries;	//!< Maximum number of entries per shard.  0 means no limit.
+	rlm_cache_rbtree_shard_t *shards;	//!< Array of shards.
 } rlm_cache_rbtree_t;
 
-typedef struct rlm_cache_rbtree_entry {
+struct rlm_cache_rbtree_entry {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 	size_t			offset;		//!< Offset used for heap.
-} rlm_cache_rbtree_entry_t;
+
+	atomic_llong		hits;		//!< Number of times the entry has been retrieved.
+						//!< fields.hits is not updated once the entry is inserted.
+	atomic_bool		referenced;	//!< Entry has been retrieved since the CLOCK hand
+						//!< last passed it.
+
+	rlm_cache_rbtree_entry_t *prev;		//!< Previous entry in the CLOCK ring.
+	rlm_cache_rbtree_entry_t *next;		//!< Next entry in the CLOCK ring.
+};
+
+/** A shard we hold a lock on, and a copy of the entry we last found
+ *
+ */
+typedef struct rlm_cache_rbtree_handle {
+	rlm_cache_rbtree_shard_t *shard;	//!< Shard we hold a lock on.  NULL if no lock is held.
+	bool			write;		//!< Whether we hold the write lock.
+	rlm_cache_entry_t	copy;		//!< Copy of the entry returned by find.
+} rlm_cache_rbtree_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_rbtree_t, num_shards), .dflt = "16" },
+	CONF_PARSER_TERMINATOR
+};
 
 /** Compare two entries by key
  *
@@ -88,13 +149,21 @@ static int _cache_entry_free(UNUSED void *ctx, void *data)
  */
 static int _mod_detach(rlm_cache_rbtree_t *driver)
 {
-	if (driver->heap) fr_heap_delete(driver->heap);
-	if (driver->cache) {
-		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
-		rbtree_free(driver->cache);
-	}
+	uint32_t i;
 
-	pthread_mutex_destroy(&driver->mutex);
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rbtree_shard_t *shard = &driver->shards[i];
+
+		if (shard->heap) fr_heap_delete(shard->heap);
+		if (shard->cache) {
+			rbtree_walk(shard->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
+			rbtree_free(shard->cache);
+		}
+
+		if (shard->initialised) pthread_rwlock_destroy(&shard->lock);
+	}
 
 	return 0;
 }
@@ -103,34 +172,61 @@ static int _mod_detach(rlm_cache_rbtree_t *driver)
  *
  * @copydetails cache_instantiate_t
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+static int mod_instantiate(CONF_SECTION *conf, rlm_cache_config_t const *config, void *driver_inst)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
+	rlm_cache_rbtree_t	*driver = driver_inst;
+	uint32_t		i;
+	int			ret;
 
 	talloc_set_destructor(driver, _mod_detach);
 
+	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
 	/*
-	 *	The cache.
+	 *	Every shard must be able to hold at least one
+	 *	entry, without the total exceeding max_entries.
 	 */
-	driver->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
-	if (!driver->cache) {
-		ERROR("Failed to create cache");
-		return -1;
+	if (config->max_entries > 0) {
+		if (driver->num_shards > config->max_entries) driver->num_shards = config->max_entries;
+		driver->max_entries = config->max_entries / driver->num_shards;
 	}
-	fr_talloc_link_ctx(driver, driver->cache);
 
-	/*
-	 *	The heap of entries to expire.
-	 */
-	driver->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_rbtree_entry_t, offset));
-	if (!driver->heap) {
-		ERROR("Failed to create heap for the cache");
+	driver->shards = talloc_zero_array(driver, rlm_cache_rbtree_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
 		return -1;
 	}
 
-	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
-		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
-		return -1;
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rbtree_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_rbtree_entry_t, offset));
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		ret = pthread_rwlock_init(&shard->lock, NULL);
+		if (ret != 0) {
+			ERROR("Failed initializing lock: %s", fr_syserror(ret));
+			return -1;
+		}
+		shard->initialised = true;
 	}
 
 	return 0;
@@ -156,143 +252,277 @@ static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *con
 	return (rlm_cache_entry_t *)c;
 }
 
-/** Locate a cache entry
+/** Lock the shard a key belongs to
+ *
+ * A handle only ever holds one lock.  If it holds the read lock, and the write
+ * lock is needed, the read lock is released first, so any entries found with
+ * the read lock held may have been freed by the time this function returns.
+ *
+ * @param[in] driver instance.
+ * @param[in] handle to record the lock in.
+ * @param[in] key to find the shard for.
+ * @param[in] key_len the length of the key.
+ * @param[in] write whether the write lock is needed.
+ * @return the locked shard.
+ */
+static rlm_cache_rbtree_shard_t *cache_shard_lock(rlm_cache_rbtree_t *driver, rlm_cache_rbtree_handle_t *handle,
+						  uint8_t const *key, size_t key_len, bool write)
+{
+	rlm_cache_rbtree_shard_t *shard;
+
+	shard = &driver->shards[fr_hash(key, key_len) % driver->num_shards];
+	if ((handle->shard == shard) && (handle->write || !write)) return shard;
+
+	if (handle->shard) pthread_rwlock_unlock(&handle->shard->lock);
+
+	if (write) {
+		pthread_rwlock_wrlock(&shard->lock);
+	} else {
+		pthread_rwlock_rdlock(&shard->lock);
+	}
+	handle->shard = shard;
+	handle->write = write;
+
+	return shard;
+}
+
+/** Remove an entry from a shard, and free it
  *
- * @note handle not used except for sanity checks.
+ * Write lock must be held.
+ */
+static void cache_entry_remove(rlm_cache_rbtree_shard_t *shard, rlm_cache_rbtree_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	rbtree_deletebydata(shard->cache, c);
+
+	if (c->next == c) {
+		shard->hand = NULL;
+	} else {
+		if (shard->hand == c) shard->hand = c->next;
+		c->prev->next = c->next;
+		c->next->prev = c->prev;
+	}
+	atomic_fetch_sub_explicit(&shard->num, 1, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
+/** Evict entries until there's space for a new one
+ *
+ * Entries which have been retrieved since the hand last passed them get a
+ * second chance.  Write lock must be held.
+ */
+static void cache_entry_evict(rlm_cache_rbtree_t *driver, rlm_cache_rbtree_shard_t *shard, REQUEST *request)
+{
+	rlm_cache_rbtree_entry_t *c;
+
+	while (atomic_load_explicit(&shard->num, memory_order_relaxed) >= driver->max_entries) {
+		c = shard->hand;
+		if (!rad_cond_assert(c)) return;
+
+		if (atomic_load_explicit(&c->referenced, memory_order_relaxed)) {
+			atomic_store_explicit(&c->referenced, false, memory_order_relaxed);
+			shard->hand = c->next;
+			continue;
+		}
+
+		if (RDEBUG_ENABLED3) {
+			char *p;
+
+			p = fr_asprint(request, (char const *)c->fields.key, c->fields.key_len, '"');
+			RDEBUG3("Evicting entry for \"%s\"", p);
+			talloc_free(p);
+		}
+
+		cache_entry_remove(shard, c);
+		atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+	}
+}
+
+/** Locate a cache entry
  *
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 				       UNUSED rlm_cache_config_t const *config, void *driver_inst,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+				       UNUSED REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
+	rlm_cache_rbtree_t		*driver = driver_inst;
+	rlm_cache_rbtree_handle_t	*h = handle;
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_rbtree_entry_t	*c;
+	rlm_cache_entry_t		my_c;
 
-	rlm_cache_entry_t *c, my_c;
-
-	/*
-	 *	Clear out old entries
-	 */
-	c = fr_heap_peek(driver->heap);
-	if (c && (c->expires < request->timestamp.tv_sec)) {
-		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
-		talloc_free(c);
-	}
+	shard = cache_shard_lock(driver, h, key, key_len, false);
 
 	/*
 	 *	Is there an entry for this key?
 	 */
 	my_c.key = key;
 	my_c.key_len = key_len;
-	c = rbtree_finddata(driver->cache, &my_c);
+	c = rbtree_finddata(shard->cache, &my_c);
 	if (!c) {
+		atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
 		*out = NULL;
 		return CACHE_MISS;
 	}
-	*out = c;
+	atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+
+	/*
+	 *	Only write to the flag if it changes, so hits
+	 *	on popular entries don't bounce cache lines
+	 *	between CPUs.
+	 */
+	if (!atomic_load_explicit(&c->referenced, memory_order_relaxed)) {
+		atomic_store_explicit(&c->referenced, true, memory_order_relaxed);
+	}
+
+	/*
+	 *	The key is the caller's, so it's still valid
+	 *	if we later have to give up the read lock.
+	 */
+	h->copy = c->fields;
+	h->copy.key = key;
+	h->copy.hits = atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
+	*out = &h->copy;
 
 	return CACHE_OK;
 }
 
 /** Free an entry and remove it from the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_expire_t
  */
 static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *driver_inst,
-					 UNUSED REQUEST *request, UNUSED void *handle,
+					 REQUEST *request, void *handle,
 					 uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
-	rlm_cache_entry_t *c, my_c;
+	rlm_cache_rbtree_t		*driver = driver_inst;
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_rbtree_entry_t	*c;
+	rlm_cache_entry_t		my_c;
 
 	if (!request) return CACHE_ERROR;
 
+	shard = cache_shard_lock(driver, handle, key, key_len, true);
+
 	my_c.key = key;
 	my_c.key_len = key_len;
-	c = rbtree_finddata(driver->cache, &my_c);
+	c = rbtree_finddata(shard->cache, &my_c);
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
-	talloc_free(c);
+	cache_entry_remove(shard, c);
+	atomic_fetch_add_explicit(&shard->expired, 1, memory_order_relaxed);
 
 	return CACHE_OK;
 }
 
 /** Insert a new entry into the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *driver_inst,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
 					 REQUEST *request, void *handle,
 					 rlm_cache_entry_t const *c)
 {
-	cache_status_t status;
-
-	rlm_cache_rbtree_t *driver = driver_inst;
-	rlm_cache_entry_t *my_c;
-
-	rad_assert(handle == request);
+	rlm_cache_rbtree_t		*driver = driver_inst;
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_rbtree_entry_t	*my_c, *old;
 
 	if (!request) return CACHE_ERROR;
 
 	memcpy(&my_c, &c, sizeof(my_c));
 
+	shard = cache_shard_lock(driver, handle, c->key, c->key_len, true);
+
+	/*
+	 *	Clear out old entries
+	 */
+	while ((old = fr_heap_peek(shard->heap)) && (old->fields.expires < request->timestamp.tv_sec)) {
+		cache_entry_remove(shard, old);
+		atomic_fetch_add_explicit(&shard->expired, 1, memory_order_relaxed);
+	}
+
 	/*
 	 *	Allow overwriting
 	 */
-	if (!rbtree_insert(driver->cache, my_c)) {
-		status = cache_entry_expire(config, driver_inst, request, handle, c->key, c->key_len);
-		if ((status != CACHE_OK) && !rad_cond_assert(0)) return CACHE_ERROR;
+	old = rbtree_finddata(shard->cache, my_c);
+	if (old) {
+		cache_entry_remove(shard, old);
+	} else if (driver->max_entries > 0) {
+		cache_entry_evict(driver, shard, request);
+	}
 
-		if (!rbtree_insert(driver->cache, my_c)) {
-			RERROR("Failed adding entry");
+	if (!rbtree_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
 
-			return CACHE_ERROR;
-		}
+		return CACHE_ERROR;
 	}
 
-	if (!fr_heap_insert(driver->heap, my_c)) {
-		rbtree_deletebydata(driver->cache, my_c);
+	if (!fr_heap_insert(shard->heap, my_c)) {
+		rbtree_deletebydata(shard->cache, my_c);
 		RERROR("Failed adding entry to expiry heap");
 
 		return CACHE_ERROR;
 	}
 
+	atomic_init(&my_c->hits, my_c->fields.hits);
+
+	/*
+	 *	New entries go behind the hand, so they're
+	 *	the last to be considered for eviction.
+	 */
+	if (!shard->hand) {
+		my_c->prev = my_c->next = my_c;
+		shard->hand = my_c;
+	} else {
+		my_c->next = shard->hand;
+		my_c->prev = shard->hand->prev;
+		my_c->prev->next = my_c;
+		shard->hand->prev = my_c;
+	}
+	atomic_fetch_add_explicit(&shard->num, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&shard->inserts, 1, memory_order_relaxed);
+
 	return CACHE_OK;
 }
 
 /** Update the TTL of an entry
  *
- * @note handle not used except for sanity checks.
+ * c is the copy returned by find, so the entry is looked up again by key,
+ * in case it was removed whilst we didn't hold the write lock.
  *
  * @copydetails cache_entry_set_ttl_t
  */
 static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *driver_inst,
-					  REQUEST *request, UNUSED void *handle,
+					  REQUEST *request, void *handle,
 					  rlm_cache_entry_t *c)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
-	int ret;
+	rlm_cache_rbtree_t		*driver = driver_inst;
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_rbtree_entry_t	*my_c;
+	int				ret;
 
 #ifdef NDEBUG
 	if (!request) return CACHE_ERROR;
 #endif
 
-	ret = fr_heap_extract(driver->heap, c);
+	shard = cache_shard_lock(driver, handle, c->key, c->key_len, true);
+
+	my_c = rbtree_finddata(shard->cache, c);
+	if (!my_c) return CACHE_MISS;
+
+	ret = fr_heap_extract(shard->heap, my_c);
 	rad_assert(ret == 1);
 	if (ret != 1) {					/* Need this check if we're not building with asserts */
 		RERROR("Entry not in heap");
 		return CACHE_ERROR;
 	}
 
-	if (!fr_heap_insert(driver->heap, c)) {
-		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+	my_c->fields.expires = c->expires;
+
+	if (!fr_heap_insert(shard->heap, my_c)) {
+		cache_entry_remove(shard, my_c);	/* make sure we don't leak entries... */
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
@@ -301,54 +531,82 @@ static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *confi
 
 /** Return the number of entries in the cache
  *
- * @note handle not used except for sanity checks.
+ * The count is approximate, as the other shards aren't locked.
  *
  * @copydetails cache_entry_count_t
  */
 static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *driver_inst,
 				  REQUEST *request, UNUSED void *handle)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
+	rlm_cache_rbtree_t	*driver = driver_inst;
+	uint32_t		i, count = 0;
 
 	if (!request) return CACHE_ERROR;
 
-	return rbtree_num_elements(driver->cache);
+	for (i = 0; i < driver->num_shards; i++) {
+		count += atomic_load_explicit(&driver->shards[i].num, memory_order_relaxed);
+	}
+
+	return count;
 }
 
-/** Lock the rbtree
+/** Return statistics for all shards
  *
- * @note handle not used except for sanity checks.
+ * @copydetails cache_stats_t
+ */
+static void cache_stats(rlm_cache_stats_t *out, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+{
+	rlm_cache_rbtree_t	*driver = driver_inst;
+	uint32_t		i;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rbtree_shard_t *shard = &driver->shards[i];
+
+		out->entries += atomic_load_explicit(&shard->num, memory_order_relaxed);
+		out->hits += atomic_load_explicit(&shard->hits, memory_order_relaxed);
+		out->misses += atomic_load_explicit(&shard->misses, memory_order_relaxed);
+		out->inserts += atomic_load_explicit(&shard->inserts, memory_order_relaxed);
+		out->expired += atomic_load_explicit(&shard->expired, memory_order_relaxed);
+		out->evictions += atomic_load_explicit(&shard->evictions, memory_order_relaxed);
+	}
+}
+
+/** Allocate a handle to record which shard is locked
+ *
+ * Shards are locked by the first operation that needs them.
  *
  * @copydetails cache_acquire_t
  */
-static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *driver_inst,
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
 			 REQUEST *request)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
+	rlm_cache_rbtree_handle_t *h;
 
-	pthread_mutex_lock(&driver->mutex);
+	h = talloc_zero(request, rlm_cache_rbtree_handle_t);
+	if (!h) return -1;
 
-	*handle = request;		/* handle is unused, this is just for sanity checking */
-
-	RDEBUG3("Mutex acquired");
+	*handle = h;
 
 	return 0;
 }
 
-/** Release an entry unlocking any mutexes
- *
- * @note handle not used except for sanity checks.
+/** Release the lock on any shard we used
  *
  * @copydetails cache_release_t
  */
-static void cache_release(UNUSED rlm_cache_config_t const *config, void *driver_inst, REQUEST *request,
-			  UNUSED rlm_cache_handle_t *handle)
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst, REQUEST *request,
+			  rlm_cache_handle_t *handle)
 {
-	rlm_cache_rbtree_t *driver = driver_inst;
+	rlm_cache_rbtree_handle_t *h = handle;
 
-	pthread_mutex_unlock(&driver->mutex);
+	if (h->shard) {
+		pthread_rwlock_unlock(&h->shard->lock);
+		RDEBUG3("%s lock released", h->write ? "Write" : "Read");
+	}
 
-	RDEBUG3("Mutex released");
+	talloc_free(h);
 }
 
 extern cache_driver_t rlm_cache_rbtree;
@@ -363,6 +621,7 @@ cache_driver_t rlm_cache_rbtree = {
 	.expire		= cache_entry_expire,
 	.set_ttl	= cache_entry_set_ttl,
 	.count		= cache_entry_count,
+	.stats		= cache_stats,
 
 	.acquire	= cache_acquire,
 	.release	= cache_release,
@@ -27,6 +27,7 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
@@ -103,11 +104,9 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	rlm_cache_redis_t		*driver = driver_inst;
 	size_t				i;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_conn_t			*conn;
-	fr_redis_rcode_t		status;
 	redisReply			*reply = NULL;
-	int				s_ret;
+	char const			*argv[] = { "LRANGE", (char const *)key, "0", "-1" };
+	size_t				argv_len[] = { 6, key_len, 1, 2 };
 
 	vp_map_t			*head = NULL, **last = &head;
 #ifdef HAVE_TALLOC_POOLED_OBJECT
@@ -115,24 +114,19 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 #endif
 	rlm_cache_entry_t		*c;
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
-		/*
-		 *	Grab all the data for this hash, should return an array
-		 *	of alternating keys/values which we then convert into maps.
-		 */
-		if (RDEBUG_ENABLED3) {
-			char *p;
+	/*
+	 *	Grab all the data for this hash, should return an array
+	 *	of alternating keys/values which we then convert into maps.
+	 */
+	if (RDEBUG_ENABLED3) {
+		char *p;
 
-			p = fr_asprint(NULL, (char const *)key, key_len, '"');
-			RDEBUG3("LRANGE %s 0 -1", key);
-			talloc_free(p);
-		}
-		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
-		status = fr_redis_command_status(conn, reply);
+		p = fr_asprint(NULL, (char const *)key, key_len, '"');
+		RDEBUG3("LRANGE %s 0 -1", key);
+		talloc_free(p);
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+	if (fr_redis_cluster_command(driver->cluster, request, key, key_len,
+				     sizeof(argv) / sizeof(*argv), argv, argv_len, &reply) != REDIS_RCODE_SUCCESS) {
 		char *p;
 
 		p = fr_asprint(NULL, (char const *)key, key_len, '"');
@@ -159,6 +153,26 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_MISS;
 	}
 
+	/*
+	 *	Entries in the binary format are a single element
+	 */
+	if ((reply->elements == 1) && (reply->element[0]->type == REDIS_REPLY_STRING)) {
+		c = talloc_zero(NULL, rlm_cache_entry_t);
+		if (cache_deserialize_binary(c, (uint8_t const *)reply->element[0]->str,
+					     reply->element[0]->len) < 0) {
+			REDEBUG("%s", fr_strerror());
+			talloc_free(c);
+			goto error;
+		}
+		fr_redis_reply_free(reply);
+
+		c->key = talloc_memdup(c, key, key_len);
+		c->key_len = key_len;
+		*out = c;
+
+		return CACHE_OK;
+	}
+
 	if (reply->elements % 3) {
 		REDEBUG("Invalid number of reply elements (%zu).  "
 			"Reply must contain triplets of keys operators and values",
@@ -238,7 +252,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *driver_inst,
 					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_redis_t	*driver = driver_inst;
@@ -264,6 +278,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 
 	char			*p;
 	int			cnt;
+	size_t			argc;
 
 	vp_tmpl_t		expires_value;
 	vp_map_t		expires = {
@@ -310,8 +325,15 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	pool = talloc_pool(request, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
-	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
+	/*
+	 *	The binary format is stored as a list with a
+	 *	single element, so entries in either format
+	 *	can be retrieved with LRANGE.
+	 */
+	argc = (config->format == CACHE_FORMAT_BINARY) ? 3 : (cnt * 3) + 2;	/* pair = 3 + cmd + key */
+
+	argv_p = argv = talloc_array(pool, char const *, argc);
+	argv_len_p = argv_len = talloc_array(pool, size_t, argc);
 
 	*argv_p++ = command;
 	*argv_len_p++ = sizeof(command) - 1;
@@ -319,17 +341,28 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	*argv_p++ = (char const *)c->key;
 	*argv_len_p++ = c->key_len;
 
-	/*
-	 *	Add the maps to the command string in reverse order
-	 */
-	for (map = &created; map; map = map->next) {
-		if (fr_redis_tuple_from_map(pool, argv_p, argv_len_p, map) < 0) {
-			REDEBUG("Failed encoding map as Redis K/V pair");
+	if (config->format == CACHE_FORMAT_BINARY) {
+		uint8_t *blob;
+
+		if (cache_serialize_binary(pool, &blob, argv_len_p, c) < 0) {
+			REDEBUG("Failed serializing entry: %s", fr_strerror());
 			talloc_free(pool);
 			return CACHE_ERROR;
 		}
-		argv_p += 3;
-		argv_len_p += 3;
+		*argv_p = (char const *)blob;
+	} else {
+		/*
+		 *	Add the maps to the command string in reverse order
+		 */
+		for (map = &created; map; map = map->next) {
+			if (fr_redis_tuple_from_map(pool, argv_p, argv_len_p, map) < 0) {
+				REDEBUG("Failed encoding map as Redis K/V pair");
+				talloc_free(pool);
+				return CACHE_ERROR;
+			}
+			argv_p += 3;
+			argv_len_p += 3;
+		}
 	}
 
 	RDEBUG3("Pipelining commands");
@@ -424,20 +457,12 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 					 REQUEST *request, UNUSED void *handle,  uint8_t const *key, size_t key_len)
 {
 	rlm_cache_redis_t		*driver = driver_inst;
-	fr_redis_cluster_state_t	state;
-	fr_redis_conn_t			*conn;
-	fr_redis_rcode_t			status;
 	redisReply			*reply = NULL;
-	int				s_ret;
+	char const			*argv[] = { "DEL", (char const *)key };
+	size_t				argv_len[] = { 3, key_len };
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
-	     	reply = redisCommand(conn->handle, "DEL %b", key, key_len);
-	     	status = fr_redis_command_status(conn, reply);
-	}
-
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+	if (fr_redis_cluster_command(driver->cluster, request, key, key_len,
+				     sizeof(argv) / sizeof(*argv), argv, argv_len, &reply) != REDIS_RCODE_SUCCESS) {
 		RERROR("Failed expiring entry");
 	error:
 		fr_redis_reply_free(reply);
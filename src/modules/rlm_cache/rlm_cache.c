@@ -52,9 +52,16 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", PW_TYPE_SIGNED, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", PW_TYPE_BOOLEAN, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", PW_TYPE_STRING, rlm_cache_config_t, format_name), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
+static const FR_NAME_NUMBER cache_format_table[] = {
+	{ "text",	CACHE_FORMAT_TEXT },
+	{ "binary",	CACHE_FORMAT_BINARY },
+	{ NULL, 0 }
+};
+
 /** Get exclusive use of a handle to access the cache
  *
  */
@@ -235,7 +242,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -303,7 +310,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
@@ -813,14 +820,16 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 
 	if (cache_acquire(&handle, mod_inst, request) < 0) return -1;
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		cache_release(mod_inst, request, &handle);
 		return 0;
 
 	default:
+		cache_release(mod_inst, request, &handle);
 		return -1;
 	}
 
@@ -835,17 +844,56 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 		break;
 	}
 
-	/*
-	 *	Check if we found a matching map
-	 */
-	if (!map) return 0;
-
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
 
 	return ret;
 }
 
+/** Retrieve the hit, miss and eviction counters of the cache
+ *
+ * Example:
+@verbatim
+"%{cache_stats:hits}" == "12"
+@endverbatim
+ *
+ * The counter names are entries, hits, misses, inserts, expired and evictions.
+ */
+static ssize_t cache_stats_xlat(char **out, size_t outlen,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_t const	*inst = mod_inst;
+	rlm_cache_stats_t	stats;
+	uint64_t		value;
+
+	if (!inst->driver->stats) {
+		REDEBUG("Driver %s does not provide statistics", inst->driver->name);
+		return -1;
+	}
+
+	inst->driver->stats(&stats, &inst->config, inst->driver_inst);
+
+	if (strcmp(fmt, "entries") == 0) {
+		value = stats.entries;
+	} else if (strcmp(fmt, "hits") == 0) {
+		value = stats.hits;
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = stats.misses;
+	} else if (strcmp(fmt, "inserts") == 0) {
+		value = stats.inserts;
+	} else if (strcmp(fmt, "expired") == 0) {
+		value = stats.expired;
+	} else if (strcmp(fmt, "evictions") == 0) {
+		value = stats.evictions;
+	} else {
+		REDEBUG("Unknown counter \"%s\"", fmt);
+		return -1;
+	}
+
+	return snprintf(*out, outlen, "%" PRIu64, value);
+}
+
 /** Free any memory allocated under the instance
  *
  */
@@ -879,7 +927,8 @@ static int mod_detach(void *instance)
  */
 static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 {
-	rlm_cache_t *inst = instance;
+	rlm_cache_t	*inst = instance;
+	char		*name;
 
 	inst->cs = conf;
 
@@ -891,6 +940,13 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	 */
 	xlat_register(inst, inst->config.name, cache_xlat, NULL, NULL, 0, 0);
 
+	/*
+	 *	And the one for the counters
+	 */
+	name = talloc_asprintf(inst, "%s_stats", inst->config.name);
+	xlat_register(inst, name, cache_stats_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	talloc_free(name);
+
 	return 0;
 }
 
@@ -901,6 +957,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_cache_t	*inst = instance;
 	CONF_SECTION	*update;
+	int		format;
 
 	inst->cs = conf;
 
@@ -933,6 +990,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	DEBUG2("Driver %s loaded and linked", inst->driver->name);
 
+	format = fr_str2int(cache_format_table, inst->config.format_name, -1);
+	if (format < 0) {
+		cf_log_err_cs(conf, "Invalid 'format' value \"%s\", expected 'text' or 'binary'",
+			      inst->config.format_name);
+		return -1;
+	}
+	inst->config.format = format;
+
 	/*
 	 *	Non optional fields and callbacks
 	 */
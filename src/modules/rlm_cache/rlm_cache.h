@@ -39,6 +39,14 @@ typedef enum {
 	CACHE_MISS	= 1				//!< Cache entry notfound
 } cache_status_t;
 
+/** How drivers which store entries outside of the server should serialize them
+ *
+ */
+typedef enum {
+	CACHE_FORMAT_TEXT = 0,				//!< One "attr op value" line per map.
+	CACHE_FORMAT_BINARY				//!< Attribute numbers and values in network byte order.
+} cache_format_t;
+
 /** Configuration for the rlm_cache module
  *
  * This is separate from the #rlm_cache_t struct, to limit driver's visibility of
@@ -52,6 +60,8 @@ typedef struct rlm_cache_config_t {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+	char const		*format_name;		//!< Serialization format name.
+	cache_format_t		format;			//!< Serialization format.
 } rlm_cache_config_t;
 
 /*
@@ -73,6 +83,18 @@ typedef struct rlm_cache_t {
 	CONF_SECTION		*cs;
 } rlm_cache_t;
 
+/** Statistics gathered by a driver
+ *
+ */
+typedef struct rlm_cache_stats_t {
+	uint64_t		entries;		//!< Number of entries currently in the cache.
+	uint64_t		hits;			//!< Number of lookups which found an entry.
+	uint64_t		misses;			//!< Number of lookups which didn't find an entry.
+	uint64_t		inserts;		//!< Number of entries added.
+	uint64_t		expired;		//!< Number of entries removed because they expired.
+	uint64_t		evictions;		//!< Number of entries removed to make room for new ones.
+} rlm_cache_stats_t;
+
 typedef struct rlm_cache_entry_t {
 	uint8_t const		*key;			//!< Key used to identify entry.
 	size_t			key_len;		//!< Length of key data.
@@ -231,6 +253,16 @@ typedef cache_status_t	(*cache_entry_set_ttl_t)(rlm_cache_config_t const *config
 typedef uint32_t	(*cache_entry_count_t)(rlm_cache_config_t const *config, void *driver_inst,
 					       REQUEST *request, void *handle);
 
+/** Get statistics for the cache
+ *
+ * @note This callback is optional.  If it's not provided, the stats xlat will fail.
+ *
+ * @param[out] out Where to write the statistics.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] driver_inst Driver specific instance data.
+ */
+typedef void		(*cache_stats_t)(rlm_cache_stats_t *out, rlm_cache_config_t const *config, void *driver_inst);
+
 /** Acquire a handle to access the cache
  *
  * @note This callback is optional. If it's not provided the handle argument to other callbacks
@@ -288,6 +320,7 @@ struct cache_driver {
 	cache_entry_set_ttl_t		set_ttl;		//!< (Optional) Update the TTL of an entry.
 	cache_entry_count_t		count;			//!< (Optional) Number of entries currently in
 								//!< the cache.
+	cache_stats_t			stats;			//!< (Optional) Hit, miss and eviction counters.
 
 	cache_acquire_t			acquire;		//!< (optional) Acquire exclusive access to a resource
 								//!< used to retrieve the cache entry.
@@ -19,12 +19,19 @@
  * @file serialize.c
  * @brief Serialize and deserialise cache entries.
  *
+ * Entries may be serialized as text, one "attr op value" line per map, or in
+ * a compact binary format.  The binary format identifies attributes by number,
+ * and stores values in network byte order, so nothing needs to be parsed when
+ * the entry is read back.
+ *
  * @author Arran Cudbard-Bell
  * @copyright 2014 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
  * @copyright 2014 The FreeRADIUS server project
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/rad_assert.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
@@ -173,3 +180,703 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	return 0;
 }
+
+/*
+ *	Binary format:
+ *
+ *	'F' 'R' 'C' version		Header.
+ *	created (8) expires (8)		Big endian.
+ *	count (2)			Number of maps.
+ *
+ *	Then for each map:
+ *
+ *	list (1) tag (1) op (1) ref (1)
+ *	vendor (4) attr (4)		If ref is CACHE_REF_NUM or CACHE_REF_UNKNOWN.
+ *	len (1) name (len)		If ref is CACHE_REF_NAME.
+ *	type (1) len (4) value (len)	Integers in network byte order.
+ */
+#define CACHE_BINARY_VERSION	1
+#define CACHE_BINARY_HDR_LEN	(4 + 8 + 8 + 2)
+#define CACHE_BINARY_MAP_LEN	(4 + 1 + 4)	/* Excluding the attribute reference and value */
+
+typedef enum {
+	CACHE_REF_NUM = 0,				//!< Attribute in the dictionary, by vendor and number.
+	CACHE_REF_UNKNOWN,				//!< Unknown attribute, by vendor and number.
+	CACHE_REF_NAME					//!< Attribute in the dictionary, by name.
+} cache_ref_t;
+
+static uint8_t const cache_binary_hdr[] = { 'F', 'R', 'C', CACHE_BINARY_VERSION };
+
+static uint8_t *cache_put_uint32(uint8_t *p, uint32_t num)
+{
+	p[0] = (num >> 24) & 0xff;
+	p[1] = (num >> 16) & 0xff;
+	p[2] = (num >> 8) & 0xff;
+	p[3] = num & 0xff;
+
+	return p + 4;
+}
+
+static uint8_t *cache_put_uint64(uint8_t *p, uint64_t num)
+{
+	p = cache_put_uint32(p, num >> 32);
+
+	return cache_put_uint32(p, num & 0xffffffff);
+}
+
+static uint32_t cache_get_uint32(uint8_t const *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t cache_get_uint64(uint8_t const *p)
+{
+	return ((uint64_t)cache_get_uint32(p) << 32) | cache_get_uint32(p + 4);
+}
+
+/** Decide how an attribute should be referenced
+ *
+ */
+static cache_ref_t cache_attr_ref(fr_dict_attr_t const *da)
+{
+	if (da->flags.is_unknown) return CACHE_REF_UNKNOWN;
+
+	/*
+	 *	Attributes nested in TLVs etc. can't be found by
+	 *	vendor and number alone.
+	 */
+	if (fr_dict_attr_by_num(NULL, da->vendor, da->attr) != da) return CACHE_REF_NAME;
+
+	return CACHE_REF_NUM;
+}
+
+/** Return the length of a value in the binary format
+ *
+ * @return
+ *	- Length of the value.
+ *	- -1 if values of this type can't be serialized.
+ */
+static ssize_t cache_value_len(PW_TYPE type, value_data_t const *value)
+{
+	switch (type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_ABINARY:
+		return value->length;
+
+	case PW_TYPE_BYTE:
+	case PW_TYPE_BOOLEAN:
+		return 1;
+
+	case PW_TYPE_SHORT:
+		return 2;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_IPV4_ADDR:
+		return 4;
+
+	case PW_TYPE_IPV4_PREFIX:
+		return sizeof(value->ipv4prefix);
+
+	case PW_TYPE_ETHERNET:
+		return sizeof(value->ether);
+
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_IFID:
+	case PW_TYPE_DECIMAL:
+		return 8;
+
+	case PW_TYPE_IPV6_ADDR:
+		return sizeof(value->ipv6addr);
+
+	case PW_TYPE_IPV6_PREFIX:
+		return sizeof(value->ipv6prefix);
+
+	default:
+		fr_strerror_printf("Can't serialize values of type %s", fr_int2str(dict_attr_types, type, "<INVALID>"));
+		return -1;
+	}
+}
+
+/** Write a value in network byte order
+ *
+ */
+static uint8_t *cache_value_put(uint8_t *p, PW_TYPE type, value_data_t const *value, size_t len)
+{
+	uint64_t num;
+
+	switch (type) {
+	case PW_TYPE_STRING:
+		memcpy(p, value->strvalue, len);
+		break;
+
+	case PW_TYPE_OCTETS:
+		memcpy(p, value->octets, len);
+		break;
+
+	case PW_TYPE_BYTE:
+		*p = value->byte;
+		break;
+
+	case PW_TYPE_BOOLEAN:
+		*p = value->boolean;
+		break;
+
+	case PW_TYPE_SHORT:
+		p[0] = value->ushort >> 8;
+		p[1] = value->ushort & 0xff;
+		break;
+
+	case PW_TYPE_INTEGER:
+		cache_put_uint32(p, value->integer);
+		break;
+
+	case PW_TYPE_DATE:
+		cache_put_uint32(p, value->date);
+		break;
+
+	case PW_TYPE_SIGNED:
+		cache_put_uint32(p, (uint32_t)value->sinteger);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		cache_put_uint64(p, value->integer64);
+		break;
+
+	case PW_TYPE_DECIMAL:
+		memcpy(&num, &value->decimal, sizeof(num));
+		cache_put_uint64(p, num);
+		break;
+
+	/*
+	 *	Already in network byte order, or byte arrays.
+	 */
+	default:
+		memcpy(p, value, len);
+		break;
+	}
+
+	return p + len;
+}
+
+/** Read a value written by #cache_value_put
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_value_get(TALLOC_CTX *ctx, value_data_t *value, PW_TYPE type, uint8_t const *p, size_t len)
+{
+	uint64_t	num;
+	ssize_t		expected;
+
+	memset(value, 0, sizeof(*value));
+
+	switch (type) {
+	case PW_TYPE_STRING:
+		value->strvalue = talloc_bstrndup(ctx, (char const *)p, len);
+		if (!value->strvalue) return -1;
+		value->length = len;
+		return 0;
+
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_ABINARY:
+		if (type == PW_TYPE_ABINARY) {
+			if (len > sizeof(value->filter)) goto bad_length;
+			memcpy(value->filter, p, len);
+			value->length = len;
+			return 0;
+		}
+		value->octets = talloc_memdup(ctx, p, len);
+		if (!value->octets) return -1;
+		talloc_set_type(value->octets, uint8_t);
+		value->length = len;
+		return 0;
+
+	default:
+		break;
+	}
+
+	expected = cache_value_len(type, value);
+	if (expected < 0) return -1;
+	if ((size_t)expected != len) {
+	bad_length:
+		fr_strerror_printf("Invalid length %zu for value of type %s", len,
+				   fr_int2str(dict_attr_types, type, "<INVALID>"));
+		return -1;
+	}
+	value->length = len;
+
+	switch (type) {
+	case PW_TYPE_BYTE:
+		value->byte = *p;
+		break;
+
+	case PW_TYPE_BOOLEAN:
+		value->boolean = (*p != 0);
+		break;
+
+	case PW_TYPE_SHORT:
+		value->ushort = (p[0] << 8) | p[1];
+		break;
+
+	case PW_TYPE_INTEGER:
+		value->integer = cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_DATE:
+		value->date = cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_SIGNED:
+		value->sinteger = (int32_t)cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		value->integer64 = cache_get_uint64(p);
+		break;
+
+	case PW_TYPE_DECIMAL:
+		num = cache_get_uint64(p);
+		memcpy(&value->decimal, &num, sizeof(value->decimal));
+		break;
+
+	default:
+		memcpy(value, p, len);
+		break;
+	}
+
+	return 0;
+}
+
+/** Serialize a cache entry in the binary format
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param outlen Where to write the length of the serialized cache entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	vp_map_t const	*map;
+	size_t		len = CACHE_BINARY_HDR_LEN;
+	ssize_t		vlen;
+	int		count = 0;
+	uint8_t		*buff, *p;
+
+	/*
+	 *	Work out how much space we need, so the
+	 *	entry is written with one allocation.
+	 */
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const *da = map->lhs->tmpl_da;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) {
+			fr_strerror_printf("Can't serialize map, expected attribute and data");
+			return -1;
+		}
+
+		vlen = cache_value_len(map->rhs->tmpl_data_type, &map->rhs->tmpl_data_value);
+		if (vlen < 0) return -1;
+
+		len += CACHE_BINARY_MAP_LEN + vlen;
+		len += (cache_attr_ref(da) == CACHE_REF_NAME) ? 1 + strlen(da->name) : 8;
+
+		if (++count > UINT16_MAX) {
+			fr_strerror_printf("Too many maps to serialize");
+			return -1;
+		}
+	}
+
+	buff = p = talloc_array(ctx, uint8_t, len);
+	if (!buff) return -1;
+
+	memcpy(p, cache_binary_hdr, sizeof(cache_binary_hdr));
+	p += sizeof(cache_binary_hdr);
+	p = cache_put_uint64(p, (uint64_t)c->created);
+	p = cache_put_uint64(p, (uint64_t)c->expires);
+	*p++ = count >> 8;
+	*p++ = count & 0xff;
+
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		cache_ref_t		ref = cache_attr_ref(da);
+
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t)map->lhs->tmpl_tag;
+		*p++ = map->op;
+		*p++ = ref;
+
+		if (ref == CACHE_REF_NAME) {
+			size_t name_len = strlen(da->name);
+
+			*p++ = name_len;
+			memcpy(p, da->name, name_len);
+			p += name_len;
+		} else {
+			p = cache_put_uint32(p, da->vendor);
+			p = cache_put_uint32(p, da->attr);
+		}
+
+		vlen = cache_value_len(map->rhs->tmpl_data_type, &map->rhs->tmpl_data_value);
+		*p++ = map->rhs->tmpl_data_type;
+		p = cache_put_uint32(p, vlen);
+		p = cache_value_put(p, map->rhs->tmpl_data_type, &map->rhs->tmpl_data_value, vlen);
+	}
+	rad_assert((size_t)(p - buff) == len);
+
+	*out = buff;
+	*outlen = len;
+
+	return 0;
+}
+
+/** Converts an entry in the binary format back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of the data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t		**last = &c->maps;
+	uint8_t const		*p = in, *end = in + inlen;
+	int			count, i;
+
+	if ((inlen < CACHE_BINARY_HDR_LEN) || (memcmp(in, cache_binary_hdr, 3) != 0)) {
+		fr_strerror_printf("Not a binary cache entry");
+		return -1;
+	}
+
+	if (in[3] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary cache entry version %u", in[3]);
+		return -1;
+	}
+	p += sizeof(cache_binary_hdr);
+
+	c->created = cache_get_uint64(p);
+	p += 8;
+	c->expires = cache_get_uint64(p);
+	p += 8;
+	count = (p[0] << 8) | p[1];
+	p += 2;
+
+	for (i = 0; i < count; i++) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		PW_TYPE			type;
+		size_t			len;
+		uint8_t			list, op, ref;
+		int8_t			tag;
+
+		if ((end - p) < 4) goto truncated;
+
+		list = *p++;
+		tag = (int8_t)*p++;
+		op = *p++;
+		ref = *p++;
+
+		if ((list == PAIR_LIST_UNKNOWN) || !fr_int2str(pair_lists, list, NULL) ||
+		    (op == T_INVALID) || (op >= T_TOKEN_LAST)) {
+			fr_strerror_printf("Invalid map in binary cache entry");
+			return -1;
+		}
+
+		map = talloc_zero(c, vp_map_t);
+		if (!map) return -1;
+
+		map->op = op;
+		map->lhs = talloc(map, vp_tmpl_t);
+		map->rhs = talloc(map, vp_tmpl_t);
+		if (!map->lhs || !map->rhs) {
+		error:
+			talloc_free(map);
+			return -1;
+		}
+
+		switch (ref) {
+		case CACHE_REF_NUM:
+		case CACHE_REF_UNKNOWN:
+		{
+			unsigned int vendor, attr;
+
+			if ((end - p) < 8) goto truncated_map;
+			vendor = cache_get_uint32(p);
+			attr = cache_get_uint32(p + 4);
+			p += 8;
+
+			if (ref == CACHE_REF_NUM) {
+				da = fr_dict_attr_by_num(NULL, vendor, attr);
+				if (!da) {
+					fr_strerror_printf("Unknown attribute %u (vendor %u) in binary cache entry.  "
+							   "Check local dictionaries", attr, vendor);
+					goto error;
+				}
+				tmpl_from_da(map->lhs, da, tag, NUM_ANY, REQUEST_CURRENT, list);
+				break;
+			}
+
+			/*
+			 *	Unknown attributes live in the template's
+			 *	own buffer, as if they'd been parsed.
+			 */
+			tmpl_from_da(map->lhs, fr_dict_root(fr_dict_internal), TAG_ANY, NUM_ANY, REQUEST_CURRENT, list);
+			fr_dict_unknown_from_fields((fr_dict_attr_t *)&map->lhs->tmpl_unknown,
+						    fr_dict_root(fr_dict_internal), vendor, attr);
+			da = map->lhs->tmpl_da = (fr_dict_attr_t *)&map->lhs->tmpl_unknown;
+		}
+			break;
+
+		case CACHE_REF_NAME:
+		{
+			char name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+
+			if ((end - p) < 1) goto truncated_map;
+			len = *p++;
+			if ((size_t)(end - p) < len) goto truncated_map;
+			if (len > FR_DICT_ATTR_MAX_NAME_LEN) {
+				fr_strerror_printf("Invalid attribute name in binary cache entry");
+				goto error;
+			}
+			memcpy(name, p, len);
+			name[len] = '\0';
+			p += len;
+
+			da = fr_dict_attr_by_name(NULL, name);
+			if (!da) {
+				fr_strerror_printf("Unknown attribute \"%s\" in binary cache entry.  "
+						   "Check local dictionaries", name);
+				goto error;
+			}
+			tmpl_from_da(map->lhs, da, tag, NUM_ANY, REQUEST_CURRENT, list);
+		}
+			break;
+
+		default:
+			fr_strerror_printf("Invalid attribute reference in binary cache entry");
+			goto error;
+		}
+
+		if ((end - p) < 5) goto truncated_map;
+		type = *p++;
+		len = cache_get_uint32(p);
+		p += 4;
+		if ((size_t)(end - p) < len) goto truncated_map;
+
+		if (type != da->type) {
+			fr_strerror_printf("Attribute \"%s\" is of type %s, but cached value is of type %s.  "
+					   "Check local dictionaries", da->name,
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, type, "<INVALID>"));
+			goto error;
+		}
+
+		tmpl_init(map->rhs, TMPL_TYPE_DATA, "<binary>", -1,
+			  (type == PW_TYPE_STRING) ? T_DOUBLE_QUOTED_STRING : T_BARE_WORD);
+		map->rhs->tmpl_data_type = type;
+		if (cache_value_get(map->rhs, &map->rhs->tmpl_data_value, type, p, len) < 0) goto error;
+		p += len;
+
+		*last = map;
+		last = &(*last)->next;
+		continue;
+
+	truncated_map:
+		talloc_free(map);
+	truncated:
+		fr_strerror_printf("Binary cache entry is truncated");
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef TESTING
+/*
+ *  Round trip entries through both formats, and time them.
+ *
+ *  cc -O2 -DTESTING -I../../include -I. serialize.c -o serialize \
+ *	-lfreeradius-server -lfreeradius-radius -ltalloc
+ *
+ *  ./serialize <dict dir> [<iterations>]
+ */
+#include <sys/time.h>
+
+static char const *test_entry =
+	"&Cache-Expires = 1500000000\n"
+	"&Cache-Created = 1400000000\n"
+	"&reply:Reply-Message := 'Hello'\n"
+	"&reply:Framed-IP-Address := 192.0.2.1\n"
+	"&reply:Framed-IPv6-Prefix := 2001:db8::/32\n"
+	"&reply:Session-Timeout := 3600\n"
+	"&reply:Tunnel-Type:1 := VLAN\n"
+	"&reply:Tunnel-Medium-Type:1 := IEEE-802\n"
+	"&reply:Tunnel-Private-Group-Id:1 := '100'\n"
+	"&reply:Cisco-AVPair += 'ip:addr-pool'\n"
+	"&control:Tmp-Integer-0 := 42\n"
+	"&control:Tmp-String-0 += 'foo'\n";
+
+/*
+ *	The text format prints values without quotes, so it can't
+ *	read back octets, or strings containing spaces or '='.
+ *	These are only round tripped as binary.
+ */
+static char const *test_entry_binary =
+	"&reply:Reply-Message := 'Hello, world'\n"
+	"&reply:Cisco-AVPair += 'ip:dns-servers=192.0.2.53 192.0.2.54'\n"
+	"&reply:Class := '0x0102030405060708090a0b0c0d0e0f'\n"
+	"&reply:Attr-26.65535.1 := '0xdeadbeef'\n"
+	"&session-state:Tmp-Octets-0 := '0x00ff00ff'\n";
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) + ((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static rlm_cache_entry_t *test_text(rlm_cache_entry_t const *c, size_t *len)
+{
+	rlm_cache_entry_t	*new;
+	char			*text;
+
+	new = talloc_zero(NULL, rlm_cache_entry_t);
+	if (cache_serialize(new, &text, c) < 0) {
+		talloc_free(new);
+		return NULL;
+	}
+	*len = talloc_array_length(text) - 1;
+
+	if (cache_deserialize(new, text, *len) < 0) {
+		talloc_free(new);
+		return NULL;
+	}
+
+	return new;
+}
+
+static rlm_cache_entry_t *test_binary(rlm_cache_entry_t const *c, size_t *len)
+{
+	rlm_cache_entry_t	*new;
+	uint8_t			*data;
+
+	new = talloc_zero(NULL, rlm_cache_entry_t);
+	if ((cache_serialize_binary(new, &data, len, c) < 0) ||
+	    (cache_deserialize_binary(new, data, *len) < 0)) {
+		talloc_free(new);
+		return NULL;
+	}
+
+	return new;
+}
+
+static rlm_cache_entry_t *test_entry_alloc(char const *in)
+{
+	rlm_cache_entry_t	*c;
+	char			*text;
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	text = talloc_strdup(c, in);
+	if (cache_deserialize(c, text, -1) < 0) {
+		fr_perror("serialize");
+		fr_exit(1);
+	}
+
+	return c;
+}
+
+/*
+ *	The entry must print the same after a round trip
+ */
+static void test_round_trip(char const *name, rlm_cache_entry_t *(*round_trip)(rlm_cache_entry_t const *, size_t *),
+			    rlm_cache_entry_t const *c)
+{
+	rlm_cache_entry_t	*new;
+	char			*expected, *text;
+	size_t			len;
+
+	if (cache_serialize(NULL, &expected, c) < 0) {
+		fr_perror("%s", name);
+		fr_exit(1);
+	}
+
+	new = round_trip(c, &len);
+	if (!new || (cache_serialize(new, &text, new) < 0)) {
+		fr_perror("%s", name);
+		fr_exit(1);
+	}
+
+	if (strcmp(text, expected) != 0) {
+		fprintf(stderr, "%s: round trip mismatch\nexpected:\n%sgot:\n%s", name, expected, text);
+		fr_exit(1);
+	}
+	talloc_free(new);
+	talloc_free(expected);
+}
+
+static void test_format(char const *name, rlm_cache_entry_t *(*round_trip)(rlm_cache_entry_t const *, size_t *),
+			rlm_cache_entry_t const *c, int iterations)
+{
+	rlm_cache_entry_t	*new;
+	size_t			len = 0;
+	struct timeval		start;
+	double			secs;
+	int			i;
+
+	test_round_trip(name, round_trip, c);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++) {
+		new = round_trip(c, &len);
+		if (!new) {
+			fr_perror("%s", name);
+			fr_exit(1);
+		}
+		talloc_free(new);
+	}
+	secs = elapsed(&start);
+
+	printf("%s\t%zu bytes\t%.3fs\t%.0f entries/s\n", name, len, secs, iterations / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	fr_dict_t		*dict = NULL;
+	rlm_cache_entry_t	*c;
+	int			iterations = 100000;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: serialize <dict dir> [<iterations>]\n");
+		fr_exit(1);
+	}
+	if (argc > 2) iterations = atoi(argv[2]);
+
+	if (fr_dict_init(NULL, &dict, argv[1], RADIUS_DICTIONARY, "radius") < 0) {
+		fr_perror("serialize");
+		fr_exit(1);
+	}
+
+	c = test_entry_alloc(test_entry);
+	test_format("text", test_text, c, iterations);
+	test_format("binary", test_binary, c, iterations);
+	talloc_free(c);
+
+	c = test_entry_alloc(test_entry_binary);
+	test_round_trip("binary", test_binary, c);
+	talloc_free(c);
+
+	talloc_free(dict);
+
+	return 0;
+}
+#endif
@@ -30,40 +30,78 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** DEFAULT entries which have the same equality check item
+ *
+ */
+typedef struct files_index_entry {
+	VALUE_PAIR const	*vp;			//!< Check item used as the key.
+	int			*pos;			//!< Positions of the entries in the DEFAULT
+							//!< list, in file order.
+	int			num;			//!< Number of entries using this key.
+	int			count;			//!< Number of entries which could use this key.
+} files_index_entry_t;
+
+/** The entries read from one "users" file
+ *
+ * DEFAULT entries are also indexed by one of their equality check items,
+ * so that only the entries which could match a request need to be checked.
+ */
+typedef struct files_users {
+	rbtree_t		*tree;			//!< Entries, keyed by name.
+
+	PAIR_LIST const		**defaults;		//!< DEFAULT entries, in file order.
+	int			num_defaults;
+
+	rbtree_t		*index;			//!< #files_index_entry_t, keyed by check item.
+	fr_dict_attr_t const	**index_da;		//!< Attributes used as keys.
+	int			num_index_da;
+
+	int			*unindexed;		//!< Positions of DEFAULT entries without a key.
+	int			num_unindexed;
+} files_users_t;
+
+/** Position in one list of candidate DEFAULT entries
+ *
+ */
+typedef struct files_index_cursor {
+	int const		*pos;
+	int			num;
+} files_index_cursor_t;
+
 typedef struct rlm_files_t {
 	char const *compat_mode;
 
 	char const *key;
 
 	char const *filename;
-	rbtree_t *common;
+	files_users_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	files_users_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	files_users_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	files_users_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	files_users_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	files_users_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	files_users_t *postauth_users;
 } rlm_files_t;
 
 
@@ -100,16 +138,285 @@ static int pairlist_cmp(void const *a, void const *b)
 		      ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree, char const *compat_mode_str)
+static int index_cmp(void const *one, void const *two)
+{
+	VALUE_PAIR const *a = ((files_index_entry_t const *) one)->vp;
+	VALUE_PAIR const *b = ((files_index_entry_t const *) two)->vp;
+	int ret;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	switch (a->da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		ret = memcmp(a->vp_octets, b->vp_octets, (a->vp_length < b->vp_length) ? a->vp_length : b->vp_length);
+		if (ret != 0) return ret;
+
+		return (a->vp_length > b->vp_length) - (a->vp_length < b->vp_length);
+
+	default:
+		return value_data_cmp(a->da->type, &a->data, b->da->type, &b->data);
+	}
+}
+
+/** Whether a check item can be used to find the entries it's in
+ *
+ * The check item must be an equality comparison, which paircompare() does
+ * using radius_compare_vps(), so that an entry can only match a request
+ * if the request contains an attribute with the same value.
+ */
+static bool index_key_valid(VALUE_PAIR const *vp)
+{
+	if ((vp->op != T_OP_CMP_EQ) && (vp->op != T_OP_EQ)) return false;
+	if (vp->type != VT_DATA) return false;
+	if (vp->da->flags.has_tag) return false;
+
+	/*
+	 *	Skipped, or treated specially, by paircompare()
+	 */
+	if (!vp->da->vendor) switch (vp->da->attr) {
+	case PW_CRYPT_PASSWORD:
+	case PW_AUTH_TYPE:
+	case PW_AUTZ_TYPE:
+	case PW_ACCT_TYPE:
+	case PW_SESSION_TYPE:
+	case PW_STRIP_USER_NAME:
+	case PW_USER_PASSWORD:
+		return false;
+
+	default:
+		break;
+	}
+
+	switch (vp->da->type) {
+	/*
+	 *	radius_compare_vps() uses strcmp()
+	 */
+	case PW_TYPE_STRING:
+		if (strlen(vp->vp_strvalue) != vp->vp_length) return false;
+		break;
+
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_DATE:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IFID:
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/** Return the next check item which can be used as a key
+ *
+ * Check items after a regular expression aren't used, as the regular
+ * expression may set capture groups even if the entry doesn't match.
+ */
+static VALUE_PAIR const *index_key_next(vp_cursor_t *cursor)
+{
+	VALUE_PAIR *vp;
+
+	for (vp = fr_cursor_current(cursor); vp; vp = fr_cursor_next(cursor)) {
+		if ((vp->op == T_OP_REG_EQ) || (vp->op == T_OP_REG_NE)) return NULL;
+
+		if (index_key_valid(vp)) {
+			fr_cursor_next(cursor);
+			return vp;
+		}
+	}
+
+	return NULL;
+}
+
+/** Index the DEFAULT entries by one of their equality check items
+ *
+ * Each entry is indexed by the check item which is shared with the fewest
+ * other entries.  Entries without a suitable check item are checked for
+ * every request.
+ */
+static int files_index_build(files_users_t *users, PAIR_LIST *default_list)
+{
+	PAIR_LIST		*pl;
+	VALUE_PAIR const	*vp;
+	vp_cursor_t		cursor;
+	files_index_entry_t	*entry, *best, find;
+	int			i, j;
+
+	users->index = rbtree_create(users, index_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!users->index) return -1;
+
+	/*
+	 *	Count the entries each key could be used for.
+	 */
+	for (pl = default_list; pl; pl = pl->next) {
+		users->num_defaults++;
+
+		fr_cursor_init(&cursor, &pl->check);
+		while ((vp = index_key_next(&cursor))) {
+			find.vp = vp;
+			entry = rbtree_finddata(users->index, &find);
+			if (!entry) {
+				entry = talloc_zero(users, files_index_entry_t);
+				if (!entry) return -1;
+
+				entry->vp = vp;
+				if (!rbtree_insert(users->index, entry)) return -1;
+			}
+			entry->count++;
+		}
+	}
+
+	users->defaults = talloc_array(users, PAIR_LIST const *, users->num_defaults);
+	users->unindexed = talloc_array(users, int, users->num_defaults);
+	if (!users->defaults || !users->unindexed) return -1;
+
+	for (pl = default_list, i = 0; pl; pl = pl->next, i++) {
+		users->defaults[i] = pl;
+
+		best = NULL;
+		fr_cursor_init(&cursor, &pl->check);
+		while ((vp = index_key_next(&cursor))) {
+			find.vp = vp;
+			entry = rbtree_finddata(users->index, &find);
+			if (!best || (entry->count < best->count)) best = entry;
+		}
+
+		if (!best) {
+			users->unindexed[users->num_unindexed++] = i;
+			continue;
+		}
+
+		if (!best->pos) {
+			best->pos = talloc_array(users, int, best->count);
+			if (!best->pos) return -1;
+		}
+		best->pos[best->num++] = i;
+
+		for (j = 0; j < users->num_index_da; j++) {
+			if (users->index_da[j] == best->vp->da) break;
+		}
+		if (j == users->num_index_da) {
+			users->index_da = talloc_realloc(users, users->index_da, fr_dict_attr_t const *, j + 1);
+			if (!users->index_da) return -1;
+
+			users->index_da[users->num_index_da++] = best->vp->da;
+		}
+	}
+
+	return 0;
+}
+
+/** Find the DEFAULT entries which could match a request
+ *
+ * @param[out] out Where to write the lists of candidate entries.
+ * @param[in] request The current request.
+ * @param[in] users to search.
+ * @param[in] vps to look up, usually the attributes of the request packet.
+ * @return
+ *	- Number of lists of candidate entries.
+ *	- -1 if the index can't be used, and all DEFAULT entries must be checked.
+ */
+static int files_index_find(files_index_cursor_t **out, REQUEST *request, files_users_t const *users,
+			    VALUE_PAIR *vps)
+{
+	files_index_cursor_t	*ic;
+	files_index_entry_t	*entry, find;
+	VALUE_PAIR		*vp, key;
+	vp_cursor_t		cursor;
+	int			i, num = 0;
+
+	/*
+	 *	Modules register comparison functions when they're
+	 *	instantiated, which may be after we are.
+	 */
+	for (i = 0; i < users->num_index_da; i++) {
+		if (radius_find_compare(users->index_da[i])) return -1;
+	}
+
+	for (vp = fr_cursor_init(&cursor, &vps); vp; vp = fr_cursor_next(&cursor)) num++;
+
+	ic = talloc_array(request, files_index_cursor_t, num + 1);
+	if (!ic) return -1;
+
+	num = 0;
+	if (users->num_unindexed) {
+		ic[num].pos = users->unindexed;
+		ic[num].num = users->num_unindexed;
+		num++;
+	}
+
+	find.vp = &key;
+	for (vp = fr_cursor_init(&cursor, &vps); vp; vp = fr_cursor_next(&cursor)) {
+		for (i = 0; i < users->num_index_da; i++) {
+			if (users->index_da[i] == vp->da) break;
+		}
+		if (i == users->num_index_da) continue;
+
+		key = *vp;
+		if (vp->da->type == PW_TYPE_STRING) key.vp_length = strlen(vp->vp_strvalue);
+
+		entry = rbtree_finddata(users->index, &find);
+		if (!entry || !entry->num) continue;
+
+		/*
+		 *	The request may contain the same value twice.
+		 */
+		for (i = 0; i < num; i++) {
+			if (ic[i].pos == entry->pos) break;
+		}
+		if (i < num) continue;
+
+		ic[num].pos = entry->pos;
+		ic[num].num = entry->num;
+		num++;
+	}
+
+	*out = ic;
+
+	return num;
+}
+
+/** Return the next candidate DEFAULT entry, in file order
+ *
+ */
+static PAIR_LIST const *files_index_next(files_users_t const *users, files_index_cursor_t *ic, int num)
+{
+	files_index_cursor_t	*next = NULL;
+	int			i;
+
+	for (i = 0; i < num; i++) {
+		if (!ic[i].num) continue;
+
+		if (!next || (ic[i].pos[0] < next->pos[0])) next = &ic[i];
+	}
+
+	if (!next) return NULL;
+
+	next->num--;
+	return users->defaults[*(next->pos++)];
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, files_users_t **pusers, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
 	PAIR_LIST *user_list, *default_list, **default_tail;
 	rbtree_t *tree;
+	files_users_t *out;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pusers = NULL;
 		return 0;
 	}
 
@@ -235,11 +542,19 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
+	out = talloc_zero(ctx, files_users_t);
+	if (!out) {
+		pairlist_free(&users);
+		return -1;
+	}
+
+	tree = rbtree_create(out, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
 	if (!tree) {
 		pairlist_free(&users);
+		talloc_free(out);
 		return -1;
 	}
+	out->tree = tree;
 
 	default_list = NULL;
 	default_tail = &default_list;
@@ -271,7 +586,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 				error:
 					pairlist_free(&entry);
 					pairlist_free(&next);
-					rbtree_free(tree);
+					talloc_free(out);
 					return -1;
 				}
 
@@ -307,7 +622,17 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	*ptree = tree;
+	if (default_list) {
+		if (files_index_build(out, default_list) < 0) {
+			talloc_free(out);
+			return -1;
+		}
+
+		DEBUG("%s: Indexed %i of %i DEFAULT entries", filename,
+		      out->num_defaults - out->num_unindexed, out->num_defaults);
+	}
+
+	*pusers = out;
 
 	return 0;
 }
@@ -342,7 +667,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, files_users_t *users,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name, *match;
@@ -352,6 +677,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	files_index_cursor_t *ic = NULL;
+	int		num_ic = -1;
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -369,12 +696,20 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!users) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = rbtree_finddata(users->tree, &my_pl);
 	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	default_pl = rbtree_finddata(users->tree, &my_pl);
+
+	/*
+	 *	Only check the DEFAULT entries which could match.
+	 */
+	if (default_pl) {
+		num_ic = files_index_find(&ic, request, users, request_packet->vps);
+		if (num_ic >= 0) default_pl = files_index_next(users, ic, num_ic);
+	}
 
 	/*
 	 *	Find the entry for the user.
@@ -396,7 +731,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = (num_ic >= 0) ? files_index_next(users, ic, num_ic) : default_pl->next;
 
 		} else if (user_pl->lineno < default_pl->lineno) {
 			pl = user_pl;
@@ -406,7 +741,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = (num_ic >= 0) ? files_index_next(users, ic, num_ic) : default_pl->next;
 		}
 
 		check_tmp = fr_pair_list_copy(request, pl->check);
@@ -438,6 +773,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		}
 	}
 
+	talloc_free(ic);
+
 	/*
 	 *	Remove server internal parameters.
 	 */
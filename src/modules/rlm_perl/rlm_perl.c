@@ -78,6 +78,7 @@ typedef struct rlm_perl_t {
 	PerlInterpreter	*perl;
 	bool		perl_parsed;
 	pthread_key_t	*thread_key;
+	bool		tied_hashes;	//!< Tie the %RAD_* hashes to the request, instead of copying.
 
 #ifdef USE_ITHREADS
 	pthread_mutex_t	clone_mutex;
@@ -114,6 +115,8 @@ static const CONF_PARSER module_config[] = {
 #endif
 	{ FR_CONF_OFFSET("perl_flags", PW_TYPE_STRING, rlm_perl_t, perl_flags) },
 
+	{ FR_CONF_OFFSET("tied_hashes", PW_TYPE_BOOLEAN, rlm_perl_t, tied_hashes), .dflt = "no" },
+
 	{ FR_CONF_OFFSET("func_start_accounting", PW_TYPE_STRING, rlm_perl_t, func_start_accounting) },
 
 	{ FR_CONF_OFFSET("func_stop_accounting", PW_TYPE_STRING, rlm_perl_t, func_stop_accounting) },
@@ -306,9 +309,25 @@ static void xs_init(pTHX)
 	newXS("radiusd::radlog",XS_radiusd_radlog, "rlm_perl");
 }
 
+static void perl_tied_request_set(pTHX_ REQUEST *request);
+static void perl_tie_hashes(pTHX);
+
 /*
  *	The xlat function
  */
+/*
+ *	Update the cached copies of User-Name and User-Password, which
+ *	the script may have changed or freed.
+ */
+static void perl_request_cache_update(REQUEST *request)
+{
+	request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+	request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+	if (!request->password)
+		request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD,
+							TAG_ANY);
+}
+
 static ssize_t perl_xlat(char **out, size_t outlen,
 			 void const *mod_inst, UNUSED void const *xlat_inst,
 			 REQUEST *request, char const *fmt)
@@ -370,8 +389,20 @@ static ssize_t perl_xlat(char **out, size_t outlen,
 
 		PUTBACK;
 
+		if (inst->tied_hashes) perl_tied_request_set(aTHX_ request);
+
 		count = call_pv(inst->func_xlat, G_SCALAR | G_EVAL);
 
+		/*
+		 *	The tied %RAD_REQUEST hash writes straight to the
+		 *	request, so the function may have replaced
+		 *	User-Name or User-Password.
+		 */
+		if (inst->tied_hashes) {
+			perl_tied_request_set(aTHX_ NULL);
+			perl_request_cache_update(request);
+		}
+
 		SPAGAIN;
 		if (SvTRUE(ERRSV)) {
 			REDEBUG("Exit %s", SvPV(ERRSV,n_a));
@@ -573,6 +604,8 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		perl_parse_config(cs, 0, inst->rad_perlconf_hv);
 	}
 
+	if (inst->tied_hashes) perl_tie_hashes(aTHX);
+
 	inst->perl_parsed = true;
 	perl_run(inst->perl);
 
@@ -782,6 +815,408 @@ static int get_hv_content(TALLOC_CTX *ctx, REQUEST *request, HV *my_hv, VALUE_PA
 	return ret;
 }
 
+/*
+ *	The hashes which hold the attribute lists.
+ */
+static const struct {
+	char const	*hash_name;
+	pair_lists_t	list;
+	char const	*list_name;
+} perl_lists[] = {
+	{ "RAD_REQUEST",		PAIR_LIST_REQUEST,		"request" },
+	{ "RAD_REPLY",			PAIR_LIST_REPLY,		"reply" },
+	{ "RAD_CONFIG",			PAIR_LIST_CONTROL,		"control" },
+	{ "RAD_STATE",			PAIR_LIST_STATE,		"session-state" },
+#ifdef WITH_PROXY
+	{ "RAD_REQUEST_PROXY",		PAIR_LIST_PROXY_REQUEST,	"proxy-request" },
+	{ "RAD_REQUEST_PROXY_REPLY",	PAIR_LIST_PROXY_REPLY,		"proxy-reply" },
+#endif
+	{ NULL, PAIR_LIST_UNKNOWN, NULL }
+};
+
+/*
+ *	Where the tied hashes find the current request.  It's kept
+ *	in PL_modglobal, so each cloned interpreter has its own, and
+ *	scripts can't change it.
+ */
+#define PERL_TIED_REQUEST "rlm_perl::request"
+
+static void perl_tied_request_set(pTHX_ REQUEST *request)
+{
+	SV *sv = *hv_fetchs(PL_modglobal, PERL_TIED_REQUEST, 1);
+
+	if (request) {
+		sv_setiv(sv, PTR2IV(request));
+	} else {
+		sv_setsv(sv, &PL_sv_undef);
+	}
+}
+
+/*
+ *	Resolve the tied hash object to the attribute list of the
+ *	current request.  Returns NULL if the list isn't available,
+ *	e.g. there's no proxied request.
+ */
+static VALUE_PAIR **perl_tied_list(pTHX_ SV *self, REQUEST **request, int *idx)
+{
+	SV **svp;
+
+	svp = hv_fetchs(PL_modglobal, PERL_TIED_REQUEST, 0);
+	if (!svp || !SvIOK(*svp)) croak("Attribute lists may only be used while processing a request");
+	*request = INT2PTR(REQUEST *, SvIV(*svp));
+
+	if (!SvROK(self)) croak("Not a radiusd::list object");
+	*idx = SvIV(SvRV(self));
+	if ((*idx < 0) || (*idx >= (int)(sizeof(perl_lists) / sizeof(*perl_lists)) - 1)) {
+		croak("Invalid radiusd::list object");
+	}
+
+	return radius_list(*request, perl_lists[*idx].list);
+}
+
+/*
+ *	The hash key of an attribute, as used by perl_store_vps().
+ */
+static char const *perl_vp_key(VALUE_PAIR const *vp, char *buffer, size_t bufsize)
+{
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		snprintf(buffer, bufsize, "%s:%d", vp->da->name, vp->tag);
+		return buffer;
+	}
+
+	return vp->da->name;
+}
+
+/*
+ *	Find the attribute, and tag, a hash key refers to.
+ *	Returns NULL if the key isn't the name of an attribute
+ *	in the dictionary.
+ */
+static fr_dict_attr_t const *perl_key_attr(char const *key, int8_t *tag)
+{
+	char const	*p;
+	char		*q;
+	char		buffer[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+	long		num;
+
+	*tag = TAG_ANY;
+
+	p = strchr(key, ':');
+	if (!p) return fr_dict_attr_by_name(NULL, key);
+
+	num = strtol(p + 1, &q, 10);
+	if ((q == p + 1) || *q || !TAG_VALID_ZERO(num)) return NULL;
+	if ((size_t)(p - key) >= sizeof(buffer)) return NULL;
+
+	strlcpy(buffer, key, (p - key) + 1);
+	*tag = num;
+
+	return fr_dict_attr_by_name(NULL, buffer);
+}
+
+static bool perl_key_match(VALUE_PAIR const *vp, fr_dict_attr_t const *da, int8_t tag, char const *key)
+{
+	/*
+	 *	Unknown attributes aren't in the dictionary,
+	 *	so they can only be found by name.
+	 */
+	if (!da) return (vp->da->flags.is_unknown && (strcmp(vp->da->name, key) == 0));
+
+	return ((vp->da == da) && (!da->flags.has_tag || TAG_EQ(tag, vp->tag)));
+}
+
+static SV *perl_vp_to_sv(pTHX_ VALUE_PAIR const *vp)
+{
+	char	buffer[1024];
+	size_t	len;
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		return newSVpvn(vp->vp_strvalue, vp->vp_length);
+
+	case PW_TYPE_OCTETS:
+		return newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+
+	default:
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, 0);
+		return newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
+	}
+}
+
+/*
+ *	The value of a key, as perl_store_vps() would set it.  A scalar
+ *	if there's one attribute, an array ref if there's more than one.
+ */
+static SV *perl_tied_fetch(pTHX_ VALUE_PAIR *vps, char const *key)
+{
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	VALUE_PAIR		*vp, *first = NULL;
+	AV			*av = NULL;
+
+	da = perl_key_attr(key, &tag);
+
+	for (vp = vps; vp; vp = vp->next) {
+		if (!perl_key_match(vp, da, tag, key)) continue;
+
+		if (!first) {
+			first = vp;
+			continue;
+		}
+
+		if (!av) {
+			av = newAV();
+			av_push(av, perl_vp_to_sv(aTHX_ first));
+		}
+		av_push(av, perl_vp_to_sv(aTHX_ vp));
+	}
+
+	if (av) return newRV_noinc((SV *)av);
+	if (first) return perl_vp_to_sv(aTHX_ first);
+
+	return NULL;
+}
+
+static void perl_tied_delete(VALUE_PAIR **vps, char const *key)
+{
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	VALUE_PAIR		*vp, *next, **last = vps;
+
+	da = perl_key_attr(key, &tag);
+
+	for (vp = *vps; vp; vp = next) {
+		next = vp->next;
+		if (perl_key_match(vp, da, tag, key)) {
+			*last = next;
+			talloc_free(vp);
+		} else {
+			last = &vp->next;
+		}
+	}
+}
+
+/*
+ *	Methods of the radiusd::list class, which the %RAD_* hashes
+ *	are tied to.  Attributes are converted when they're used,
+ *	instead of the whole list being copied for each call.
+ */
+static XS(XS_radiusd_list_FETCH)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	SV		*sv;
+	int		idx;
+
+	if (items != 2) croak("Usage: radiusd::list::FETCH(list, key)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps) XSRETURN_UNDEF;
+
+	sv = perl_tied_fetch(aTHX_ *vps, SvPV_nolen(ST(1)));
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_STORE)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	TALLOC_CTX	*ctx;
+	char		*key;
+	SV		*value;
+	int		idx;
+
+	if (items != 3) croak("Usage: radiusd::list::STORE(list, key, value)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps) XSRETURN_EMPTY;
+	ctx = radius_list_ctx(request, perl_lists[idx].list);
+
+	key = SvPV_nolen(ST(1));
+	value = ST(2);
+
+	perl_tied_delete(vps, key);
+
+	if (SvROK(value) && (SvTYPE(SvRV(value)) == SVt_PVAV)) {
+		AV	*av = (AV *)SvRV(value);
+		I32	i, len;
+		SV	**av_sv;
+
+		len = av_len(av);
+		for (i = 0; i <= len; i++) {
+			av_sv = av_fetch(av, i, 0);
+			if (!av_sv) continue;
+			(void) pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD,
+					  perl_lists[idx].hash_name, perl_lists[idx].list_name);
+		}
+	} else {
+		(void) pairadd_sv(ctx, request, vps, key, value, T_OP_EQ,
+				  perl_lists[idx].hash_name, perl_lists[idx].list_name);
+	}
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_list_DELETE)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	SV		*sv;
+	char const	*key;
+	int		idx;
+
+	if (items != 2) croak("Usage: radiusd::list::DELETE(list, key)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps) XSRETURN_UNDEF;
+
+	key = SvPV_nolen(ST(1));
+	sv = perl_tied_fetch(aTHX_ *vps, key);
+	if (!sv) XSRETURN_UNDEF;
+
+	perl_tied_delete(vps, key);
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_EXISTS)
+{
+	dXSARGS;
+	REQUEST			*request;
+	VALUE_PAIR		**vps, *vp;
+	fr_dict_attr_t const	*da;
+	char const		*key;
+	int8_t			tag;
+	int			idx;
+
+	if (items != 2) croak("Usage: radiusd::list::EXISTS(list, key)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps) XSRETURN_NO;
+
+	key = SvPV_nolen(ST(1));
+	da = perl_key_attr(key, &tag);
+
+	for (vp = *vps; vp; vp = vp->next) {
+		if (perl_key_match(vp, da, tag, key)) XSRETURN_YES;
+	}
+
+	XSRETURN_NO;
+}
+
+static XS(XS_radiusd_list_CLEAR)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	int		idx;
+
+	if (items != 1) croak("Usage: radiusd::list::CLEAR(list)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (vps) fr_pair_list_free(vps);
+
+	XSRETURN_EMPTY;
+}
+
+/*
+ *	The list is sorted when iteration starts, as perl_store_vps()
+ *	does, so all the attributes with the same key are next to
+ *	each other.
+ */
+static XS(XS_radiusd_list_FIRSTKEY)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	char const	*key;
+	char		buffer[FR_DICT_ATTR_MAX_NAME_LEN + 8];
+	int		idx;
+
+	if (items != 1) croak("Usage: radiusd::list::FIRSTKEY(list)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps || !*vps) XSRETURN_UNDEF;
+
+	fr_pair_list_sort(vps, fr_pair_cmp_by_da_tag);
+
+	key = perl_vp_key(*vps, buffer, sizeof(buffer));
+	ST(0) = sv_2mortal(newSVpv(key, 0));
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_NEXTKEY)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps, *vp;
+	char const	*last, *key;
+	char		buffer[FR_DICT_ATTR_MAX_NAME_LEN + 8];
+	bool		found = false;
+	int		idx;
+
+	if (items != 2) croak("Usage: radiusd::list::NEXTKEY(list, lastkey)");
+
+	vps = perl_tied_list(aTHX_ ST(0), &request, &idx);
+	if (!vps) XSRETURN_UNDEF;
+
+	last = SvPV_nolen(ST(1));
+
+	for (vp = *vps; vp; vp = vp->next) {
+		key = perl_vp_key(vp, buffer, sizeof(buffer));
+		if (strcmp(key, last) == 0) {
+			found = true;
+			continue;
+		}
+		if (!found) continue;
+
+		ST(0) = sv_2mortal(newSVpv(key, 0));
+		XSRETURN(1);
+	}
+
+	XSRETURN_UNDEF;
+}
+
+/*
+ *	Tie the %RAD_* hashes to radiusd::list objects.  Interpreters
+ *	cloned from this one inherit the ties.
+ */
+static void perl_tie_hashes(pTHX)
+{
+	char const	*file = __FILE__;
+	HV		*stash;
+	int		i;
+
+	newXS("radiusd::list::FETCH", XS_radiusd_list_FETCH, file);
+	newXS("radiusd::list::STORE", XS_radiusd_list_STORE, file);
+	newXS("radiusd::list::DELETE", XS_radiusd_list_DELETE, file);
+	newXS("radiusd::list::EXISTS", XS_radiusd_list_EXISTS, file);
+	newXS("radiusd::list::CLEAR", XS_radiusd_list_CLEAR, file);
+	newXS("radiusd::list::FIRSTKEY", XS_radiusd_list_FIRSTKEY, file);
+	newXS("radiusd::list::NEXTKEY", XS_radiusd_list_NEXTKEY, file);
+
+	stash = gv_stashpvs("radiusd::list", GV_ADD);
+
+	for (i = 0; perl_lists[i].hash_name; i++) {
+		HV	*hv;
+		SV	*obj;
+
+		hv = get_hv(perl_lists[i].hash_name, GV_ADD);
+		hv_clear(hv);
+
+		obj = sv_bless(newRV_noinc(newSViv(i)), stash);
+		sv_magic((SV *)hv, obj, PERL_MAGIC_tied, NULL, 0);
+		SvREFCNT_dec(obj);
+	}
+}
+
 /*
  * 	Call the function_name inside the module
  * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
@@ -795,13 +1230,13 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	int		exitstatus=0, count;
 	STRLEN		n_a;
 
-	HV		*rad_reply_hv;
-	HV		*rad_config_hv;
-	HV		*rad_request_hv;
-	HV		*rad_state_hv;
+	HV		*rad_reply_hv = NULL;
+	HV		*rad_config_hv = NULL;
+	HV		*rad_request_hv = NULL;
+	HV		*rad_state_hv = NULL;
 #ifdef WITH_PROXY
-	HV		*rad_request_proxy_hv;
-	HV		*rad_request_proxy_reply_hv;
+	HV		*rad_request_proxy_hv = NULL;
+	HV		*rad_request_proxy_reply_hv = NULL;
 #endif
 
 	/*
@@ -832,6 +1267,11 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		ENTER;
 		SAVETMPS;
 
+		if (inst->tied_hashes) {
+			perl_tied_request_set(aTHX_ request);
+			goto call;
+		}
+
 		rad_reply_hv = get_hv("RAD_REPLY", 1);
 		rad_config_hv = get_hv("RAD_CONFIG", 1);
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
@@ -861,6 +1301,7 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		}
 #endif
 
+	call:
 		PUSHMARK(SP);
 		/*
 		 * This way %RAD_xx can be pushed onto stack as sub parameters.
@@ -892,20 +1333,16 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		FREETMPS;
 		LEAVE;
 
+		if (inst->tied_hashes) {
+			perl_tied_request_set(aTHX_ NULL);
+			goto update;
+		}
+
 		vp = NULL;
 		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
 			fr_pair_list_free(&request->packet->vps);
 			request->packet->vps = vp;
 			vp = NULL;
-
-			/*
-			 *	Update cached copies
-			 */
-			request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
-			request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
-			if (!request->password)
-				request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD,
-									TAG_ANY);
 		}
 
 		if ((get_hv_content(request->reply, request, rad_reply_hv, &vp, "RAD_REPLY", "reply")) == 0) {
@@ -944,6 +1381,8 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		}
 #endif
 
+	update:
+		perl_request_cache_update(request);
 	}
 	return exitstatus;
 }
@@ -51,11 +51,36 @@ struct py_function_def {
 	char const	*function_name;
 };
 
-typedef struct rlm_python_t {
+typedef struct rlm_python_t rlm_python_t;
+
+#ifdef HAVE_PTHREAD_H
+/** Python thread state of a single server thread
+ *
+ */
+typedef struct python_thread_t python_thread_t;
+struct python_thread_t {
+	rlm_python_t	*inst;		//!< Instance the thread state was created for.
+	PyThreadState	*state;		//!< Thread state in the main interpreter.
+
+	python_thread_t	*prev;
+	python_thread_t	*next;
+};
+#endif
+
+struct rlm_python_t {
 	void		*libpython;
 	PyThreadState	*main_thread_state;
 	char const	*python_path;
 
+	rbtree_t	*attr_names;	//!< Interned attribute names.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_key_t	thread_key;	//!< Thread state of the current thread.
+	bool		thread_key_created;
+	pthread_mutex_t	mutex;		//!< Protects the list of thread states.
+	python_thread_t	*threads;	//!< All thread states, so they can be freed on detach.
+#endif
+
 	struct py_function_def
 	instantiate,
 	authorize,
@@ -73,7 +98,15 @@ typedef struct rlm_python_t {
 	detach;
 
 	PyObject *pythonconf_dict;
-} rlm_python_t;
+};
+
+/** Python string for an attribute name
+ *
+ */
+typedef struct python_attr_name_t {
+	fr_dict_attr_t const	*da;		//!< Attribute.
+	PyObject		*name;		//!< Interned name of the attribute.
+} python_attr_name_t;
 
 /*
  *	A mapping of configuration file names to internal variables.
@@ -132,11 +165,6 @@ static struct {
 	{ NULL, 0 },
 };
 
-/*
- *	This allows us to initialise PyThreadState on a per thread basis
- */
-fr_thread_local_setup(PyThreadState *, local_thread_state)	/* macro */
-
 
 /*
  *	Let assume that radiusd module is only one since we have only
@@ -395,6 +423,75 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 }
 
 
+static int mod_attr_name_cmp(void const *one, void const *two)
+{
+	python_attr_name_t const *a = one, *b = two;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	return 0;
+}
+
+/*
+ *	Must be called with the GIL held.
+ */
+static void mod_attr_name_free(void *data)
+{
+	python_attr_name_t *entry = data;
+
+	Py_DECREF(entry->name);
+	talloc_free(entry);
+}
+
+static rbtree_t *mod_attr_names_alloc(TALLOC_CTX *ctx)
+{
+	return rbtree_create(ctx, mod_attr_name_cmp, mod_attr_name_free, 0);
+}
+
+/** Get the Python string for an attribute name
+ *
+ * Names are interned the first time they're used, so converting
+ * a request doesn't allocate a new string for each attribute.
+ *
+ * @param[in] tree of interned names.
+ * @param[in] da to get the name of.
+ * @return a new reference to the name, or NULL on error.
+ */
+static PyObject *mod_attr_name(rbtree_t *tree, fr_dict_attr_t const *da)
+{
+	python_attr_name_t	find, *found;
+
+	/*
+	 *	Unknown attributes are freed with the pair,
+	 *	so their address may be reused.
+	 */
+	if (!tree || da->flags.is_unknown) return PyString_FromString(da->name);
+
+	find.da = da;
+	found = rbtree_finddata(tree, &find);
+	if (!found) {
+		found = talloc(tree, python_attr_name_t);
+		if (!found) return NULL;
+
+		found->da = da;
+		found->name = PyString_InternFromString(da->name);
+		if (!found->name) {
+			talloc_free(found);
+			return NULL;
+		}
+
+		if (!rbtree_insert(tree, found)) {
+			Py_DECREF(found->name);
+			talloc_free(found);
+			return NULL;
+		}
+	}
+
+	Py_INCREF(found->name);
+	return found->name;
+}
+
 /*
  *	This is the core Python function that the others wrap around.
  *	Pass the value-pair print strings in a tuple.
@@ -402,7 +499,7 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
  *	FIXME: We're not checking the errors. If we have errors, what
  *	do we do?
  */
-static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp)
+static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp, rbtree_t *attr_names)
 {
 	PyObject *pStr = NULL;
 	char buf[1024];
@@ -412,7 +509,7 @@ static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp)
 	if (vp->da->flags.has_tag)
 		pStr = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
 	else
-		pStr = PyString_FromString(vp->da->name);
+		pStr = mod_attr_name(attr_names, vp->da);
 
 	if (!pStr)
 		goto failed;
@@ -431,20 +528,11 @@ failed:
 	return -1;
 }
 
-/** Cleanup any thread local storage on pthread_exit()
+/*
+ *	Convert the request, call the function, and process the result.
+ *	Must be called with the GIL held.
  */
-static void do_python_cleanup(void *arg)
-{
-	PyThreadState	*my_thread_state = arg;
-
-	PyEval_AcquireLock();
-	PyThreadState_Swap(NULL);	/* Not entirely sure this is needed */
-	PyThreadState_Clear(my_thread_state);
-	PyThreadState_Delete(my_thread_state);
-	PyEval_ReleaseLock();
-}
-
-static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFunc, char const *funcname, bool worker)
+static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char const *funcname, rbtree_t *attr_names)
 {
 	vp_cursor_t	cursor;
 	VALUE_PAIR      *vp;
@@ -453,39 +541,6 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 	int		tuplelen;
 	int		ret;
 
-	PyGILState_STATE gstate;
-	PyThreadState	*prev_thread_state = NULL;	/* -Wuninitialized */
-	memset(&gstate, 0, sizeof(gstate));		/* -Wuninitialized */
-
-	/* Return with "OK, continue" if the function is not defined. */
-	if (!pFunc) return RLM_MODULE_NOOP;
-
-	gstate = PyGILState_Ensure();
-	if (worker) {
-		PyThreadState *my_thread_state;
-		my_thread_state = fr_thread_local_init(local_thread_state, do_python_cleanup);
-		if (!my_thread_state) {
-			my_thread_state = PyThreadState_New(inst->main_thread_state->interp);
-			RDEBUG3("Initialised new thread state %p", my_thread_state);
-			if (!my_thread_state) {
-				REDEBUG("Failed initialising local PyThreadState on first run");
-				PyGILState_Release(gstate);
-				return RLM_MODULE_FAIL;
-			}
-
-			ret = fr_thread_local_set(local_thread_state, my_thread_state);
-			if (ret != 0) {
-				REDEBUG("Failed storing PyThreadState in TLS: %s", fr_syserror(ret));
-				PyThreadState_Clear(my_thread_state);
-				PyThreadState_Delete(my_thread_state);
-				PyGILState_Release(gstate);
-				return RLM_MODULE_FAIL;
-			}
-		}
-		RDEBUG3("Using thread state %p", my_thread_state);
-		prev_thread_state = PyThreadState_Swap(my_thread_state);	/* Swap in our local thread state */
-	}
-
 	/* Default return value is "OK, continue" */
 	ret = RLM_MODULE_OK;
 
@@ -527,7 +582,7 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 				goto finish;
 			}
 
-			if (mod_populate_vptuple(pPair, vp) == 0) {
+			if (mod_populate_vptuple(pPair, vp, attr_names) == 0) {
 				/* Put the tuple inside the container */
 				PyTuple_SET_ITEM(pArgs, i, pPair);
 			} else {
@@ -604,8 +659,41 @@ finish:
 	Py_XDECREF(pArgs);
 	Py_XDECREF(pRet);
 
-	if (worker) PyThreadState_Swap(prev_thread_state);
-	PyGILState_Release(gstate);
+	return ret;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+static python_thread_t *mod_thread_get(rlm_python_t *inst, REQUEST *request);
+#endif
+
+static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFunc, char const *funcname, bool worker)
+{
+	int		ret;
+
+	/* Return with "OK, continue" if the function is not defined. */
+	if (!pFunc) return RLM_MODULE_NOOP;
+
+#ifdef HAVE_PTHREAD_H
+	if (worker) {
+		python_thread_t	*thread;
+
+		thread = mod_thread_get(inst, request);
+		if (!thread) return RLM_MODULE_FAIL;
+
+		PyEval_AcquireThread(thread->state);
+		ret = do_python_single(request, pFunc, funcname, inst->attr_names);
+		PyEval_ReleaseThread(thread->state);
+
+		return ret;
+	}
+#else
+	UNUSED_VAR(worker);
+#endif
+
+	Pyx_BLOCK_THREADS
+	ret = do_python_single(request, pFunc, funcname, inst->attr_names);
+	Pyx_UNBLOCK_THREADS
 
 	return ret;
 }
@@ -756,6 +844,88 @@ static void python_parse_config(CONF_SECTION *cs, int lvl, PyObject *dict)
 	DEBUG("%*s}", indent_section, " ");
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Free a thread state.
+ *	Must be called without the GIL held.
+ */
+static void mod_thread_free(python_thread_t *thread)
+{
+	PyEval_AcquireLock();
+	PyThreadState_Clear(thread->state);
+	PyThreadState_Delete(thread->state);
+	PyEval_ReleaseLock();
+
+	talloc_free(thread);
+}
+
+/*
+ *	Called when a thread exits.
+ */
+static void _mod_thread_exit(void *arg)
+{
+	python_thread_t	*thread = arg;
+	rlm_python_t	*inst = thread->inst;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (thread->prev) thread->prev->next = thread->next;
+	if (thread->next) thread->next->prev = thread->prev;
+	if (inst->threads == thread) inst->threads = thread->next;
+	pthread_mutex_unlock(&inst->mutex);
+
+	mod_thread_free(thread);
+}
+
+/** Get the Python thread state for the current thread, creating it if needed
+ *
+ * @param[in] inst rlm_python instance.
+ * @param[in] request The current request.
+ * @return the thread state, or NULL on error.
+ */
+static python_thread_t *mod_thread_get(rlm_python_t *inst, REQUEST *request)
+{
+	python_thread_t	*thread;
+	int		ret;
+
+	thread = pthread_getspecific(inst->thread_key);
+	if (thread) return thread;
+
+	/*
+	 *	Not parented by the instance, as other threads
+	 *	may be allocating their own.
+	 */
+	thread = talloc_zero(NULL, python_thread_t);
+	if (!thread) return NULL;
+
+	thread->inst = inst;
+
+	PyEval_AcquireLock();
+	thread->state = PyThreadState_New(inst->main_thread_state->interp);
+	PyEval_ReleaseLock();
+	if (!thread->state) {
+		REDEBUG("Failed initialising thread state");
+		talloc_free(thread);
+		return NULL;
+	}
+	RDEBUG3("Initialised new thread state %p", thread->state);
+
+	ret = pthread_setspecific(inst->thread_key, thread);
+	if (ret != 0) {
+		REDEBUG("Failed storing thread state in TLS: %s", fr_syserror(ret));
+		mod_thread_free(thread);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	thread->next = inst->threads;
+	if (inst->threads) inst->threads->prev = thread;
+	inst->threads = thread;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return thread;
+}
+#endif
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -786,6 +956,23 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	inst->attr_names = mod_attr_names_alloc(inst);
+	if (!inst->attr_names) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	{
+		int ret;
+
+		ret = pthread_key_create(&inst->thread_key, _mod_thread_exit);
+		if (ret != 0) {
+			ERROR("Failed creating thread key: %s", fr_syserror(ret));
+			return -1;
+		}
+		pthread_mutex_init(&inst->mutex, NULL);
+		inst->thread_key_created = true;
+	}
+#endif
+
 #define A(x) if (mod_load_function(&inst->x) < 0) goto failed
 
 	A(instantiate);
@@ -823,11 +1010,36 @@ static int mod_detach(void *instance)
 	rlm_python_t *inst = instance;
 	int	     ret;
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->thread_key_created) {
+		python_thread_t *thread, *next;
+
+		pthread_key_delete(inst->thread_key);
+
+		pthread_mutex_lock(&inst->mutex);
+		thread = inst->threads;
+		inst->threads = NULL;
+		pthread_mutex_unlock(&inst->mutex);
+
+		for (; thread; thread = next) {
+			next = thread->next;
+			mod_thread_free(thread);
+		}
+		pthread_mutex_destroy(&inst->mutex);
+	}
+#endif
+
 	/*
 	 *	Master should still have no thread state
 	 */
 	ret = do_python(inst, NULL, inst->detach.function, "detach", false);
 
+	if (inst->attr_names) {
+		Pyx_BLOCK_THREADS
+		rbtree_free(inst->attr_names);
+		Pyx_UNBLOCK_THREADS
+	}
+
 	Py_DecRef(inst->pythonconf_dict);
 
 	mod_instance_clear(inst);
@@ -69,6 +69,11 @@
  *
  * See #fr_redis_cluster_state_init for example code.
  *
+ * Commands which consist of a single Redis command can instead be issued with
+ * #fr_redis_cluster_command.  If max_pipelined is greater than 1, commands from
+ * concurrent requests for the same node are sent as a single pipeline over one
+ * connection.  See #fr_redis_cluster_command for details.
+ *
  * Structures
  * ----------
  *
@@ -199,6 +204,25 @@ typedef struct cluster_nodes_live {
 	uint8_t skip;
 } cluster_nodes_live_t;
 
+/** A command waiting to be pipelined to a cluster node
+ *
+ * Allocated on the stack of the thread which wants the command sent.
+ */
+typedef struct cluster_batch_cmd cluster_batch_cmd_t;
+struct cluster_batch_cmd {
+	int			argc;			//!< Number of arguments.
+	char const		**argv;			//!< Command arguments.
+	size_t const		*argv_len;		//!< Argument lengths (may be NULL).
+
+	redisReply		*reply;			//!< Reply to the command.
+	fr_redis_rcode_t	status;			//!< Status of the reply.
+	char			error[128];		//!< Error if there was no reply.
+
+	bool			done;			//!< Whether the command has been sent and
+							//!< its reply received.
+	cluster_batch_cmd_t	*next;			//!< Next command in the queue.
+};
+
 /** A Redis cluster node
  *
  * Passed as opaque data to pools which open connection to nodes.
@@ -220,6 +244,12 @@ typedef struct fr_redis_cluster_node {
 	bool			is_master;		//!< Whether this node is a master.
 							//!< This is needed for commands like 'KEYS', which
 							//!< we need to issue to every master in the cluster.
+
+	pthread_mutex_t		batch_mutex;		//!< Protects the batch queue.
+	pthread_cond_t		batch_cond;		//!< Signalled when a batch has been sent.
+	cluster_batch_cmd_t	*batch_head;		//!< Commands waiting to be sent.
+	cluster_batch_cmd_t	*batch_tail;		//!< Last command waiting to be sent.
+	bool			batch_sending;		//!< Whether a thread is sending a batch.
 } cluster_node_t;
 
 /** Indexes in the cluster_node_t array for a single key slot
@@ -1944,6 +1974,251 @@ try_again:
 	return REDIS_RCODE_TRY_AGAIN;
 }
 
+/** Send a batch of commands to a node in a single pipeline
+ *
+ * All commands are written before any replies are read, so the batch
+ * costs one round trip, instead of one per command.  The status of
+ * each reply is recorded separately, so redirects can be followed for
+ * individual commands.
+ *
+ * @param[in] request The request sending the batch.  Used for logging.
+ * @param[in] cluster the node belongs to.
+ * @param[in] node to send the commands to.
+ * @param[in] batch list of commands.
+ * @param[in] num number of commands in the batch.
+ */
+static void cluster_batch_send(REQUEST *request, fr_redis_cluster_t *cluster, cluster_node_t *node,
+			       cluster_batch_cmd_t *batch, uint32_t num)
+{
+	fr_redis_conn_t		*conn;
+	cluster_batch_cmd_t	*cmd;
+
+	conn = fr_connection_get(node->pool, request);
+	if (!conn) {
+		RDEBUG2("[%i] No connections available", node->id);
+		cluster->remap_needed = true;
+
+		for (cmd = batch; cmd; cmd = cmd->next) {
+			cmd->status = REDIS_RCODE_RECONNECT;
+			strlcpy(cmd->error, "No connections available", sizeof(cmd->error));
+		}
+		return;
+	}
+
+	RDEBUG2("[%i] >>> Sending %u pipelined command(s) to %s:%i", node->id, num, node->name, node->addr.port);
+
+	for (cmd = batch; cmd; cmd = cmd->next) {
+		if (redisAppendCommandArgv(conn->handle, cmd->argc, cmd->argv, cmd->argv_len) != REDIS_OK) {
+			cmd->status = REDIS_RCODE_ERROR;
+			strlcpy(cmd->error, "Failed formatting command", sizeof(cmd->error));
+		}
+	}
+
+	/*
+	 *	If the connection fails, hiredis returns an error
+	 *	for all the remaining replies, and they're marked
+	 *	as needing a reconnect.
+	 */
+	for (cmd = batch; cmd; cmd = cmd->next) {
+		if (cmd->status == REDIS_RCODE_ERROR) continue;
+
+		cmd->reply = NULL;	/* redisGetReply doesn't NULLify reply on error */
+		(void) redisGetReply(conn->handle, (void **)&cmd->reply);
+		cmd->status = fr_redis_command_status(conn, cmd->reply);
+		if (!cmd->reply) strlcpy(cmd->error, fr_strerror(), sizeof(cmd->error));
+	}
+
+	if (conn->handle->err) {
+		RDEBUG2("[%i] Connection no longer viable, closing it", node->id);
+		fr_connection_close(node->pool, conn);
+		return;
+	}
+
+	if (cluster->remap_needed && (cluster_remap(request, cluster, conn) != CLUSTER_OP_SUCCESS)) {
+		RDEBUG2("%s", fr_strerror());
+	}
+	fr_connection_release(node->pool, request, conn);
+}
+
+/** Issue a command against the cluster, pipelining it with commands from other requests
+ *
+ * Equivalent to running the command in a loop with #fr_redis_cluster_state_init and
+ * #fr_redis_cluster_state_next, but if max_pipelined is greater than 1, commands from
+ * all the requests sending commands to the same node are aggregated.
+ *
+ * The first thread to queue a command for a node sends it, along with any other
+ * commands queued for that node, as one pipeline, using a single connection.
+ * Commands queued while the pipeline is in flight are sent in the next one, by one
+ * of the threads waiting for them.  When there's no contention this is no slower than
+ * sending the command directly, and under load a node receives one pipeline per round
+ * trip, instead of one command per connection per round trip.
+ *
+ * Commands which receive a -MOVED, -ASK or -TRYAGAIN reply, or which failed because
+ * the connection failed, are retried individually by the thread that queued them,
+ * using the normal redirect and reconnect logic.
+ *
+ * Commands are always sent to the master for the key slot.
+ *
+ @code{.c}
+    char const	*argv[] = { "LPUSH", key, value };
+    redisReply	*reply = NULL;
+
+    if (fr_redis_cluster_command(cluster, request, (uint8_t const *)key, strlen(key),
+				 3, argv, NULL, &reply) != REDIS_RCODE_SUCCESS) {
+	fr_redis_reply_free(reply);
+	// Error
+    }
+    // Success
+    fr_redis_reply_free(reply);
+ @endcode
+ *
+ * @param[in] cluster to send the command to.
+ * @param[in] request The current request.
+ * @param[in] key to resolve to a cluster node. If key is NULL or key_len is 0 a random
+ *	slot will be chosen.
+ * @param[in] key_len Length of the key.
+ * @param[in] argc Number of arguments.
+ * @param[in] argv Command arguments.  Must remain valid until the function returns.
+ * @param[in] argv_len Length of each argument, or NULL if the arguments are \0 terminated.
+ * @param[out] out Where to write the reply.  Must be freed by the caller, irrespective
+ *	of the return code.
+ * @return
+ *	- REDIS_RCODE_SUCCESS - on success.
+ *	- REDIS_RCODE_ERROR - on failure or command error.
+ *	- REDIS_RCODE_RECONNECT - when no additional connections available.
+ */
+fr_redis_rcode_t fr_redis_cluster_command(fr_redis_cluster_t *cluster, REQUEST *request,
+					  uint8_t const *key, size_t key_len,
+					  int argc, char const **argv, size_t const *argv_len,
+					  redisReply **out)
+{
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn = NULL;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+
+	cluster_node_t			*node;
+	cluster_batch_cmd_t		cmd;
+
+	*out = NULL;
+
+	if ((cluster->conf->max_pipelined <= 1) || (rbtree_num_elements(cluster->used_nodes) == 0)) {
+		goto per_command;
+	}
+
+	node = &cluster->node[cluster_slot_by_key(cluster, request, key, key_len)->master];
+	if (!node->pool) goto per_command;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.argc = argc;
+	cmd.argv = argv;
+	cmd.argv_len = argv_len;
+
+	pthread_mutex_lock(&node->batch_mutex);
+	if (node->batch_tail) {
+		node->batch_tail->next = &cmd;
+	} else {
+		node->batch_head = &cmd;
+	}
+	node->batch_tail = &cmd;
+
+	while (!cmd.done) {
+		cluster_batch_cmd_t	*batch, *p, *next;
+		uint32_t		num;
+
+		/*
+		 *	Another thread is sending a pipeline to this
+		 *	node.  Our command will either be in it, or
+		 *	we'll send the next one.
+		 */
+		if (node->batch_sending) {
+			pthread_cond_wait(&node->batch_cond, &node->batch_mutex);
+			continue;
+		}
+
+		batch = node->batch_head;
+		for (p = batch, num = 1; p->next && (num < cluster->conf->max_pipelined); p = p->next, num++);
+		node->batch_head = p->next;
+		if (!node->batch_head) node->batch_tail = NULL;
+		p->next = NULL;
+		node->batch_sending = true;
+		pthread_mutex_unlock(&node->batch_mutex);
+
+		cluster_batch_send(request, cluster, node, batch, num);
+
+		pthread_mutex_lock(&node->batch_mutex);
+		for (p = batch; p; p = next) {
+			next = p->next;
+			p->done = true;
+		}
+		node->batch_sending = false;
+		pthread_cond_broadcast(&node->batch_cond);
+	}
+	pthread_mutex_unlock(&node->batch_mutex);
+
+	reply = cmd.reply;
+	switch (cmd.status) {
+	case REDIS_RCODE_SUCCESS:
+		if (reply) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+		RDEBUG2("[%i] <<< Returned: %s", node->id, fr_int2str(redis_rcodes, cmd.status, "<UNKNOWN>"));
+		*out = reply;
+		return REDIS_RCODE_SUCCESS;
+
+	case REDIS_RCODE_NO_SCRIPT:
+	case REDIS_RCODE_ERROR:
+		if (reply) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+		RDEBUG2("[%i] <<< Returned: %s", node->id, fr_int2str(redis_rcodes, cmd.status, "<UNKNOWN>"));
+		REDEBUG("[%i] Command failed: %s", node->id,
+			(reply && (reply->type == REDIS_REPLY_ERROR)) ? reply->str : cmd.error);
+		*out = reply;
+		return REDIS_RCODE_ERROR;
+
+	/*
+	 *	Follow the redirect, or retry the command, using
+	 *	the same logic as for unpipelined commands.
+	 */
+	case REDIS_RCODE_MOVE:
+	case REDIS_RCODE_ASK:
+	case REDIS_RCODE_TRY_AGAIN:
+		conn = fr_connection_get(node->pool, request);
+		if (!conn) break;
+
+		memset(&state, 0, sizeof(state));
+		state.node = node;
+		state.key = key;
+		state.key_len = key_len;
+
+		status = cmd.status;
+		s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &reply);
+		goto next;
+
+	/*
+	 *	Start again with a new connection.
+	 */
+	default:
+		RDEBUG2("[%i] <<< Returned: %s: %s", node->id,
+			fr_int2str(redis_rcodes, cmd.status, "<UNKNOWN>"), cmd.error);
+		break;
+	}
+	fr_redis_reply_free(reply);
+	reply = NULL;
+
+per_command:
+	s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
+
+next:
+	while (s_ret == REDIS_RCODE_TRY_AGAIN) {
+		reply = redisCommandArgv(conn->handle, argc, argv, argv_len);
+		status = fr_redis_command_status(conn, reply);
+
+		s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &reply);
+	}
+	*out = reply;
+
+	return s_ret;
+}
+
 /** Get the pool associated with a node in the cluster
  *
  * @note This is used for testing only.  It's not ifdef'd out because
@@ -2094,6 +2369,12 @@ ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_addr_t *ou
  */
 static int _fr_redis_cluster_free(fr_redis_cluster_t *cluster)
 {
+	uint8_t i;
+
+	for (i = 0; i < (cluster->conf->max_nodes + 1); i++) {
+		pthread_mutex_destroy(&cluster->node[i].batch_mutex);
+		pthread_cond_destroy(&cluster->node[i].batch_cond);
+	}
 	pthread_mutex_destroy(&cluster->mutex);
 
 	return 0;
@@ -2260,6 +2541,12 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 		return NULL;
 	}
 
+	if (conf->max_pipelined > 1024) {
+		ERROR("%s: Maximum number of pipelined commands allowed is 1024", cluster->log_prefix);
+		talloc_free(cluster);
+		return NULL;
+	}
+
 	cp = cf_pair_find(module, "server");
 	if (!cp) {
 		ERROR("%s: No servers configured", cluster->log_prefix);
@@ -2298,6 +2585,10 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	cluster->conf = conf;
 
 	pthread_mutex_init(&cluster->mutex, NULL);
+	for (i = 0; i < (cluster->conf->max_nodes + 1); i++) {
+		pthread_mutex_init(&cluster->node[i].batch_mutex, NULL);
+		pthread_cond_init(&cluster->node[i].batch_cond, NULL);
+	}
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
 	/*
@@ -2457,3 +2748,149 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	return cluster;
 }
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -DTESTING -I ../.. -I ../../include cluster.c redis.c crc16.c -o cluster_bench \
+ *	-lfreeradius-server -lfreeradius-radius -lhiredis -ltalloc -lpthread
+ *
+ *  ./cluster_bench <host>[:<port>] [<threads> [<commands> [<max_pipelined>]]]
+ *
+ *  Time SET commands sent to a Redis cluster by concurrent threads with
+ *  fr_redis_cluster_command().  First with each command sent on its own
+ *  connection, then with up to max_pipelined commands for a node sent in
+ *  one pipeline.  Each thread has its own request, and keys are spread
+ *  over all the masters.
+ */
+#include <sys/time.h>
+
+static CONF_PARSER bench_config[] = {
+	REDIS_COMMON_CONFIG,
+	CONF_PARSER_TERMINATOR
+};
+
+typedef struct bench_thread {
+	pthread_t		thread;
+	fr_redis_cluster_t	*cluster;
+	int			id;
+	int			commands;
+	int			failed;
+} bench_thread_t;
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t	*t = arg;
+	REQUEST		*request;
+	char		key[32], value[32];
+	char const	*argv[] = { "SET", key, value };
+	redisReply	*reply;
+	int		i;
+
+	request = request_alloc(NULL);
+	if (!request) {
+		t->failed = t->commands;
+		return NULL;
+	}
+
+	for (i = 0; i < t->commands; i++) {
+		snprintf(key, sizeof(key), "bench-%i-%i", t->id, i);
+		snprintf(value, sizeof(value), "%i", i);
+
+		if (fr_redis_cluster_command(t->cluster, request, (uint8_t const *)key, strlen(key),
+					     3, argv, NULL, &reply) != REDIS_RCODE_SUCCESS) t->failed++;
+		fr_redis_reply_free(reply);
+	}
+	talloc_free(request);
+
+	return NULL;
+}
+
+static void bench(char const *name, fr_redis_cluster_t *cluster, int num_threads, int commands)
+{
+	bench_thread_t	*threads;
+	struct timeval	start, now;
+	double		t;
+	int		i, failed = 0;
+
+	threads = talloc_zero_array(NULL, bench_thread_t, num_threads);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_threads; i++) {
+		threads[i].cluster = cluster;
+		threads[i].id = i;
+		threads[i].commands = commands;
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "Failed creating thread: %s\n", fr_syserror(errno));
+			fr_exit(1);
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		failed += threads[i].failed;
+	}
+	gettimeofday(&now, NULL);
+	talloc_free(threads);
+
+	t = (now.tv_sec - start.tv_sec) + ((now.tv_usec - start.tv_usec) / 1000000.0);
+	printf("%s\t%i threads\t%i commands in %.3fs\t(%.0f/s)\t%i failed\n", name, num_threads,
+	       num_threads * commands, t, (num_threads * commands) / t, failed);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	CONF_SECTION		*cs, *pool_cs;
+	fr_redis_conf_t		conf;
+	fr_redis_cluster_t	*cluster;
+	int			num_threads = 16, commands = 10000;
+	uint32_t		max_pipelined = 32;
+	char			buffer[32];
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <host>[:<port>] [<threads> [<commands> [<max_pipelined>]]]\n", argv[0]);
+		fr_exit(1);
+	}
+	if (argc > 2) num_threads = atoi(argv[2]);
+	if (argc > 3) commands = atoi(argv[3]);
+	if (argc > 4) max_pipelined = atoi(argv[4]);
+
+	fr_debug_lvl = 0;
+	rad_debug_lvl = 0;
+
+	cs = cf_section_alloc(NULL, "redis", NULL);
+	cf_pair_add(cs, cf_pair_alloc(cs, "server", argv[1], T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+
+	/*
+	 *	Enough connections for every thread to send
+	 *	its own commands.
+	 */
+	pool_cs = cf_section_alloc(cs, "pool", NULL);
+	cf_section_add(cs, pool_cs);
+	snprintf(buffer, sizeof(buffer), "%i", num_threads);
+	cf_pair_add(pool_cs, cf_pair_alloc(pool_cs, "start", "0", T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+	cf_pair_add(pool_cs, cf_pair_alloc(pool_cs, "min", "0", T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+	cf_pair_add(pool_cs, cf_pair_alloc(pool_cs, "spare", "0", T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+	cf_pair_add(pool_cs, cf_pair_alloc(pool_cs, "max", buffer, T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+
+	memset(&conf, 0, sizeof(conf));
+	if (cf_section_parse(cs, &conf, bench_config) < 0) fr_exit(1);
+
+	cluster = fr_redis_cluster_alloc(cs, cs, &conf, false, "cluster_bench", NULL, NULL);
+	if (!cluster) fr_exit(1);
+
+	/*
+	 *	The cluster reads max_pipelined from our copy of
+	 *	the configuration for every command.
+	 */
+	conf.max_pipelined = 0;
+	bench("per-command", cluster, num_threads, commands);
+
+	conf.max_pipelined = max_pipelined;
+	snprintf(buffer, sizeof(buffer), "pipelined(%u)", max_pipelined);
+	bench(buffer, cluster, num_threads, commands);
+
+	talloc_free(cs);
+
+	fr_exit(0);
+}
+#endif
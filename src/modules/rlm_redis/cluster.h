@@ -75,6 +75,15 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 					     fr_redis_cluster_t *cluster, REQUEST *request,
 					     fr_redis_rcode_t status, redisReply **reply);
 
+/*
+ *	Issue a single command, pipelining it with commands from
+ *	other requests for the same node.
+ */
+fr_redis_rcode_t fr_redis_cluster_command(fr_redis_cluster_t *cluster, REQUEST *request,
+					  uint8_t const *key, size_t key_len,
+					  int argc, char const **argv, size_t const *argv_len,
+					  redisReply **out);
+
 /*
  *	Useful for running commands over every node, such as PING
  *	or KEYS.
@@ -99,6 +99,8 @@ typedef struct redis_common_conf {
 	uint32_t		max_alt;	//!< Maximum alternative nodes to try.
 	struct timeval		retry_delay;	//!< How long to wait when we received a -TRYAGAIN
 						//!< message.
+	uint32_t		max_pipelined;	//!< Maximum number of commands from different requests
+						//!< to send to a node in a single pipeline.
 } fr_redis_conf_t;
 
 #define REDIS_COMMON_CONFIG \
@@ -108,7 +110,8 @@ typedef struct redis_common_conf {
 	{ FR_CONF_OFFSET("password", PW_TYPE_STRING | PW_TYPE_SECRET, fr_redis_conf_t, password) }, \
 	{ FR_CONF_OFFSET("max_nodes", PW_TYPE_BYTE, fr_redis_conf_t, max_nodes), .dflt = "20" }, \
 	{ FR_CONF_OFFSET("max_alt", PW_TYPE_INTEGER, fr_redis_conf_t, max_alt), .dflt = "3" }, \
-	{ FR_CONF_OFFSET("max_redirects", PW_TYPE_INTEGER, fr_redis_conf_t, max_redirects), .dflt = "2" }
+	{ FR_CONF_OFFSET("max_redirects", PW_TYPE_INTEGER, fr_redis_conf_t, max_redirects), .dflt = "2" }, \
+	{ FR_CONF_OFFSET("max_pipelined", PW_TYPE_INTEGER, fr_redis_conf_t, max_pipelined), .dflt = "0" }
 
 void		fr_redis_version_print(void);
 
@@ -269,6 +269,28 @@ static ssize_t redis_xlat(char **out, size_t outlen,
 		key = (uint8_t const *)argv[1];
 	 	key_len = strlen((char const *)key);
 	}
+
+	/*
+	 *	Commands for the master can be pipelined with
+	 *	commands from other requests.
+	 */
+	if (!read_only) {
+		RDEBUG2("Executing command: %s", argv[0]);
+		if (argc > 1) {
+			RDEBUG2("With arguments");
+			RINDENT();
+			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
+			REXDENT();
+		}
+
+		if (fr_redis_cluster_command(inst->cluster, request, key, key_len, argc, argv, NULL, &reply) !=
+		    REDIS_RCODE_SUCCESS) {
+			ret = -1;
+			goto finish;
+		}
+		goto reply_check;
+	}
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
@@ -279,10 +301,7 @@ static ssize_t redis_xlat(char **out, size_t outlen,
 			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
 			REXDENT();
 		}
-		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-			status = fr_redis_command_status(conn, reply);
-		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
+		if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
 			state.close_conn = true;
 		}
 	}
@@ -291,6 +310,7 @@ static ssize_t redis_xlat(char **out, size_t outlen,
 		goto finish;
 	}
 
+reply_check:
 	if (!rad_cond_assert(reply)) {
 		ret = -1;
 		goto finish;
@@ -50,6 +50,10 @@ RCSID("$Id$")
 #include "cluster.h"
 #include "redis_ippool.h"
 
+#ifdef HAVE_PTHREAD_H
+typedef struct ippool_bulk ippool_bulk_t;
+#endif
+
 /** rlm_redis module instance
  *
  */
@@ -93,7 +97,21 @@ typedef struct rlm_redis_ippool {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	bool			bulk_enable;	//!< Whether leases are reserved in blocks, and
+						//!< allocated locally.
+	uint32_t		bulk_reserve;	//!< How many leases to reserve per script call.
+	uint32_t		bulk_reserve_time;	//!< How long reservations are held for.
+	uint32_t		bulk_commit_size;	//!< Maximum number of allocations written per
+							//!< script call.
+	struct timeval		bulk_commit_delay;	//!< Maximum time an allocation waits before
+							//!< it's written.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+#ifdef HAVE_PTHREAD_H
+	ippool_bulk_t		*bulk;		//!< Reserved leases, and allocations waiting to be
+						//!< written, if bulk allocation is enabled.
+#endif
 } rlm_redis_ippool_t;
 
 static CONF_PARSER redis_config[] = {
@@ -101,6 +119,15 @@ static CONF_PARSER redis_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER bulk_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, bulk_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("reserve", PW_TYPE_INTEGER, rlm_redis_ippool_t, bulk_reserve), .dflt = "100" },
+	{ FR_CONF_OFFSET("reserve_time", PW_TYPE_INTEGER, rlm_redis_ippool_t, bulk_reserve_time), .dflt = "30" },
+	{ FR_CONF_OFFSET("commit_size", PW_TYPE_INTEGER, rlm_redis_ippool_t, bulk_commit_size), .dflt = "100" },
+	{ FR_CONF_OFFSET("commit_delay", PW_TYPE_TIMEVAL, rlm_redis_ippool_t, bulk_commit_delay), .dflt = "0.1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_name", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_redis_ippool_t, pool_name) },
 
@@ -125,6 +152,8 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_POINTER("bulk", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) bulk_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -320,6 +349,181 @@ static char lua_release_cmd[] =
 	"}";										/* 21 */
 static char lua_release_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
+/** Lua script for reserving a block of free leases
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ * - ARGV[2] Reserve for (seconds).
+ * - ARGV[3] Maximum number of leases to reserve.
+ *
+ * Reserved leases are marked as in use until the reservation expires, but are
+ * not associated with a device.  If they're not committed before then, they
+ * become free again.
+ *
+ * Returns @verbatim array { <rcode>[, <reserved until>[, <ip>, <range>]...] } @endverbatim
+ * - IPPOOL_RCODE_SUCCESS leases reserved.
+ * - IPPOOL_RCODE_POOL_EMPTY no free leases.
+ */
+static char lua_reserve_cmd[] =
+	"local found" EOL										/* 1 */
+	"local ret" EOL											/* 2 */
+
+	"local pool_key" EOL										/* 3 */
+	"local reserved_until" EOL									/* 4 */
+
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 5 */
+	"reserved_until = ARGV[1] + ARGV[2]" EOL							/* 6 */
+
+	/*
+	 *	Get the IP addresses which expired the longest time ago.
+	 */
+	"found = redis.call('ZRANGEBYSCORE', pool_key, '-inf', '(' .. ARGV[1], 'LIMIT', 0, ARGV[3])" EOL	/* 7 */
+	"if #found == 0 then" EOL									/* 8 */
+	"  return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 9 */
+	"end" EOL											/* 10 */
+
+	"ret = { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", reserved_until }" EOL				/* 11 */
+	"for i = 1, #found do" EOL									/* 12 */
+	"  redis.call('ZADD', pool_key, 'XX', reserved_until, found[i])" EOL				/* 13 */
+	"  ret[#ret + 1] = found[i]" EOL								/* 14 */
+	"  ret[#ret + 1] = redis.call('HGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. found[i], 'range')" EOL	/* 15 */
+	"end" EOL											/* 16 */
+	"return ret" EOL;										/* 17 */
+static char lua_reserve_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
+/** Lua script for committing leases allocated from reservations
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ *
+ * Followed by six arguments for each lease:
+ * - IP address.
+ * - Time the reservation expires (as returned by the reservation script).
+ * - Time the lease was allocated (seconds since epoch).
+ * - Expires in (seconds, from the time it was allocated).
+ * - Device identifier.
+ * - Gateway identifier.
+ *
+ * If the device was previously bound to a different address, that address is
+ * released, as the device has been given a new one.  The device's lease is
+ * checked with #lua_device_cmd before a reserved lease is handed out, so this
+ * only happens if another server allocated to the device in the meantime.
+ *
+ * If the reservation was lost, and the address was allocated to another device,
+ * the lease is not committed.
+ *
+ * Returns @verbatim array { <rcode>[, <ip>]... } @endverbatim
+ * - IPPOOL_RCODE_SUCCESS followed by the addresses which could not be committed.
+ */
+static char lua_commit_cmd[] =
+	"local ret" EOL											/* 1 */
+	"local score" EOL										/* 2 */
+	"local exists" EOL										/* 3 */
+	"local expires_at" EOL										/* 4 */
+
+	"local pool_key" EOL										/* 5 */
+	"local address_key" EOL										/* 6 */
+	"local device_key" EOL										/* 7 */
+
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 8 */
+	"ret = { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) " }" EOL						/* 9 */
+	"for i = 2, #ARGV, 6 do" EOL									/* 10 */
+	"  address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ARGV[i]" EOL			/* 11 */
+	"  device_key = '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. ARGV[i + 4]" EOL			/* 12 */
+
+	/*
+	 *	The reservation is still held if the score hasn't
+	 *	changed, or if the address is already bound to the
+	 *	same device (the commit is being retried).
+	 */
+	"  score = redis.call('ZSCORE', pool_key, ARGV[i])" EOL						/* 13 */
+	"  if not score or ((tonumber(score) ~= tonumber(ARGV[i + 1])) and" EOL				/* 14 */
+	"     (redis.call('HGET', address_key, 'device') ~= ARGV[i + 4])) then" EOL			/* 15 */
+	"    ret[#ret + 1] = ARGV[i]" EOL								/* 16 */
+	"  else" EOL											/* 17 */
+
+	/*
+	 *	Release any address the device previously held
+	 */
+	"    exists = redis.call('GET', device_key)" EOL						/* 18 */
+	"    if exists and (exists ~= ARGV[i]) and" EOL							/* 19 */
+	"       (redis.call('HGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. exists, 'device') == ARGV[i + 4]) then" EOL	/* 20 */
+	"      redis.call('ZADD', pool_key, 'XX', ARGV[1] - 1, exists)" EOL				/* 21 */
+	"    end" EOL											/* 22 */
+
+	"    expires_at = ARGV[i + 2] + ARGV[i + 3]" EOL						/* 23 */
+	"    redis.call('ZADD', pool_key, 'XX', expires_at, ARGV[i])" EOL				/* 24 */
+	"    redis.call('HMSET', address_key, 'device', ARGV[i + 4], 'gateway', ARGV[i + 5])" EOL	/* 25 */
+	"    redis.call('HINCRBY', address_key, 'counter', 1)" EOL					/* 26 */
+	"    if expires_at > tonumber(ARGV[1]) then" EOL						/* 27 */
+	"      redis.call('SET', device_key, ARGV[i])" EOL						/* 28 */
+	"      redis.call('EXPIRE', device_key, expires_at - ARGV[1])" EOL				/* 29 */
+	"    end" EOL											/* 30 */
+	"  end" EOL											/* 31 */
+	"end" EOL											/* 32 */
+	"return ret" EOL;										/* 33 */
+static char lua_commit_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
+/** Lua script for returning unused reservations to the pool
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ *
+ * Followed by two arguments for each lease:
+ * - IP address.
+ * - Time the reservation expires (as returned by the reservation script).
+ *
+ * Addresses which are still reserved are marked as having expired at NOW() - 1.
+ *
+ * Returns @verbatim array { <rcode> } @endverbatim
+ * - IPPOOL_RCODE_SUCCESS reservations returned.
+ */
+static char lua_unreserve_cmd[] =
+	"local pool_key" EOL										/* 1 */
+
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 2 */
+	"for i = 2, #ARGV, 2 do" EOL									/* 3 */
+	"  if tonumber(redis.call('ZSCORE', pool_key, ARGV[i])) == tonumber(ARGV[i + 1]) then" EOL	/* 4 */
+	"    redis.call('ZADD', pool_key, 'XX', ARGV[1] - 1, ARGV[i])" EOL				/* 5 */
+	"  end" EOL											/* 6 */
+	"end" EOL											/* 7 */
+	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) " }" EOL;						/* 8 */
+static char lua_unreserve_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
+/** Lua script for finding the lease a device currently holds
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ * - ARGV[2] Device identifier.
+ *
+ * Uses the same checks as #lua_alloc_cmd, but doesn't allocate anything if
+ * the device has no lease.
+ *
+ * Returns @verbatim { <rcode>[, <ip>, <range>, <lease time>] } @endverbatim
+ * - IPPOOL_RCODE_SUCCESS the device has a lease.
+ * - IPPOOL_RCODE_NOT_FOUND the device has no lease.
+ */
+static char lua_device_cmd[] =
+	"local ip" EOL											/* 1 */
+	"local exists" EOL										/* 2 */
+	"local score" EOL										/* 3 */
+
+	"local pool_key" EOL										/* 4 */
+
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 5 */
+	"exists = redis.call('GET', '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. ARGV[2])" EOL		/* 6 */
+	"if exists then" EOL										/* 7 */
+	"  score = redis.call('ZSCORE', pool_key, exists)" EOL						/* 8 */
+	"  if score and (tonumber(score) > tonumber(ARGV[1])) then" EOL					/* 9 */
+	"    ip = redis.call('HMGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. exists, 'device', 'range')" EOL	/* 10 */
+	"    if ip and (ip[1] == ARGV[2]) then" EOL							/* 11 */
+	"      return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", exists, ip[2], tonumber(score) - ARGV[1] }" EOL	/* 12 */
+	"    end" EOL											/* 13 */
+	"  end" EOL											/* 14 */
+	"end" EOL											/* 15 */
+	"return { " STRINGIFY(_IPPOOL_RCODE_NOT_FOUND) " }" EOL;					/* 16 */
+static char lua_device_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
 /** Check the requisite number of slaves replicated the lease info
  *
  * @param request The current request.
@@ -402,7 +606,7 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+/** Execute a pre-formatted script command against Redis cluster
  *
  * Handles uploading the script to the server if required.
  *
@@ -418,15 +622,15 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @param[in] wait_timeout How long to wait for slaves.
  * @param[in] digest of script.
  * @param[in] script to upload.
- * @param[in] cmd EVALSHA command to execute.
- * @param[in] ... Arguments for the eval command.
+ * @param[in] cmd EVALSHA command to execute, in the Redis protocol format.
+ * @param[in] cmd_len Length of the command.
  * @return status of the command.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, uint32_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static fr_redis_rcode_t ippool_script_formatted(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+						uint8_t const *key, size_t key_len,
+						uint32_t wait_num, uint32_t wait_timeout,
+						char const digest[], char const *script,
+						char const *cmd, size_t cmd_len)
 {
 	fr_redis_conn_t			*conn;
 	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
@@ -436,21 +640,13 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	fr_redis_rcode_t		s_ret, status;
 	int				pipelined = 0;
 
-	va_list				ap;
-
 	*out = NULL;
 
-	va_start(ap, cmd);
-
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
 	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		pipelined = 1;
 		if (wait_num) {
 			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
@@ -468,9 +664,7 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	     	RDEBUG3("Loading script 0x%s", digest);
 		redisAppendCommand(conn->handle, "MULTI");
 		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		redisAppendCommand(conn->handle, "EXEC");
 		pipelined = 4;
 		if (wait_num) {
@@ -541,10 +735,204 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	}
 
 finish:
+	return s_ret;
+}
+
+/** Execute a script against Redis cluster
+ *
+ * @see ippool_script_formatted
+ *
+ * @param[out] out Where to write Redis reply object resulting from the command.
+ * @param[in] request The current request.
+ * @param[in] cluster configuration.
+ * @param[in] key to use to determine the cluster node.
+ * @param[in] key_len length of the key.
+ * @param[in] wait_num If > 0 wait until this many slaves have replicated the data
+ *	from the last command.
+ * @param[in] wait_timeout How long to wait for slaves.
+ * @param[in] digest of script.
+ * @param[in] script to upload.
+ * @param[in] cmd EVALSHA command to execute.
+ * @param[in] ... Arguments for the eval command.
+ * @return status of the command.
+ */
+static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+				      uint8_t const *key, size_t key_len,
+				      uint32_t wait_num, uint32_t wait_timeout,
+				      char const digest[], char const *script,
+				      char const *cmd, ...)
+{
+	char			*formatted;
+	int			len;
+	fr_redis_rcode_t	s_ret;
+	va_list			ap;
+
+	*out = NULL;
+
+	va_start(ap, cmd);
+	len = redisvFormatCommand(&formatted, cmd, ap);
 	va_end(ap);
+	if (len < 0) {
+		REDEBUG("Failed formatting script command");
+		return REDIS_RCODE_ERROR;
+	}
+
+	s_ret = ippool_script_formatted(out, request, cluster, key, key_len, wait_num, wait_timeout,
+					digest, script, formatted, (size_t)len);
+	free(formatted);
+
 	return s_ret;
 }
 
+/** Write an IP address returned by the server to the allocated_address_attr
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] ip element of the server's reply.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS on success.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t ippool_ip_to_request(rlm_redis_ippool_t *inst, REQUEST *request, redisReply const *ip)
+{
+	vp_tmpl_t ip_rhs = {
+		.type = TMPL_TYPE_DATA,
+		.tmpl_data_type = PW_TYPE_STRING
+	};
+	vp_map_t ip_map = {
+		.lhs = inst->allocated_address_attr,
+		.op = T_OP_SET,
+		.rhs = &ip_rhs
+	};
+
+	switch (ip->type) {
+	/*
+	 *	Destination attribute may not be IPv4, in which case
+	 *	we want to pre-convert the integer value to an IPv4
+	 *	address before casting it once more to the type of
+	 *	the destination attribute.
+	 */
+	case REDIS_REPLY_INTEGER:
+	{
+		if (ip_map.lhs->tmpl_da->type != PW_TYPE_IPV4_ADDR) {
+			value_data_t tmp;
+
+			memset(&tmp, 0, sizeof(tmp));
+
+			tmp.integer = ntohl((uint32_t)ip->integer);
+			tmp.length = sizeof(ip_map.rhs->tmpl_data_value.integer);
+
+			if (value_data_cast(NULL, &ip_map.rhs->tmpl_data_value, PW_TYPE_IPV4_ADDR,
+					    NULL, PW_TYPE_INTEGER, NULL, &tmp)) {
+				REDEBUG("Failed converting integer to IPv4 address: %s", fr_strerror());
+				return IPPOOL_RCODE_FAIL;
+			}
+		} else {
+			ip_map.rhs->tmpl_data_value.integer = ntohl((uint32_t)ip->integer);
+			ip_map.rhs->tmpl_data_length = sizeof(ip_map.rhs->tmpl_data_value.integer);
+			ip_map.rhs->tmpl_data_type = PW_TYPE_INTEGER;
+		}
+	}
+		goto do_ip_map;
+
+	case REDIS_REPLY_STRING:
+		ip_map.rhs->tmpl_data_value.strvalue = ip->str;
+		ip_map.rhs->tmpl_data_length = ip->len;
+		ip_map.rhs->tmpl_data_type = PW_TYPE_STRING;
+
+	do_ip_map:
+		if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+		break;
+
+	default:
+		REDEBUG("Server returned unexpected type \"%s\" for IP element",
+			fr_int2str(redis_reply_types, ip->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Write a range identifier returned by the server to the range_attr
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] range element of the server's reply.  May be nil if the address
+ *	has no range.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS on success.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t ippool_range_to_request(rlm_redis_ippool_t *inst, REQUEST *request, redisReply const *range)
+{
+	switch (range->type) {
+	/*
+	 *	Add range ID to request
+	 */
+	case REDIS_REPLY_STRING:
+	{
+		vp_tmpl_t range_rhs = {
+			.name = "",
+			.type = TMPL_TYPE_DATA,
+			.tmpl_data_type = PW_TYPE_STRING,
+			.quote = T_DOUBLE_QUOTED_STRING
+		};
+		vp_map_t range_map = {
+			.lhs = inst->range_attr,
+			.op = T_OP_SET,
+			.rhs = &range_rhs
+		};
+
+		range_map.rhs->tmpl_data_value.strvalue = range->str;
+		range_map.rhs->tmpl_data_length = range->len;
+		range_map.rhs->tmpl_data_type = PW_TYPE_STRING;
+		if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+	}
+		break;
+
+	case REDIS_REPLY_NIL:
+		break;
+
+	default:
+		REDEBUG("Server returned unexpected type \"%s\" for range element",
+			fr_int2str(redis_reply_types, range->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Write the remaining lease time to the expiry_attr
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] expires Seconds until the lease expires.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS on success.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t ippool_expiry_to_request(rlm_redis_ippool_t *inst, REQUEST *request, uint32_t expires)
+{
+	vp_tmpl_t expiry_rhs = {
+		.name = "",
+		.type = TMPL_TYPE_DATA,
+		.tmpl_data_type = PW_TYPE_STRING,
+		.quote = T_DOUBLE_QUOTED_STRING
+	};
+	vp_map_t expiry_map = {
+		.lhs = inst->expiry_attr,
+		.op = T_OP_SET,
+		.rhs = &expiry_rhs
+	};
+
+	expiry_map.rhs->tmpl_data_value.integer = expires;
+	expiry_map.rhs->tmpl_data_length = sizeof(expiry_map.rhs->tmpl_data_value.integer);
+	expiry_map.rhs->tmpl_data_type = PW_TYPE_INTEGER;
+	if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
 /** Allocate a new IP address from a pool
  *
  */
@@ -615,126 +1003,22 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t *inst, REQUEST *r
 	 *	Process IP address
 	 */
 	if (reply->elements > 1) {
-		vp_tmpl_t ip_rhs = {
-			.type = TMPL_TYPE_DATA,
-			.tmpl_data_type = PW_TYPE_STRING
-		};
-		vp_map_t ip_map = {
-			.lhs = inst->allocated_address_attr,
-			.op = T_OP_SET,
-			.rhs = &ip_rhs
-		};
-
-		switch (reply->element[1]->type) {
-		/*
-		 *	Destination attribute may not be IPv4, in which case
-		 *	we want to pre-convert the integer value to an IPv4
-		 *	address before casting it once more to the type of
-		 *	the destination attribute.
-		 */
-		case REDIS_REPLY_INTEGER:
-		{
-			if (ip_map.lhs->tmpl_da->type != PW_TYPE_IPV4_ADDR) {
-				value_data_t tmp;
-
-				memset(&tmp, 0, sizeof(tmp));
-
-				tmp.integer = ntohl((uint32_t)reply->element[1]->integer);
-				tmp.length = sizeof(ip_map.rhs->tmpl_data_value.integer);
-
-				if (value_data_cast(NULL, &ip_map.rhs->tmpl_data_value, PW_TYPE_IPV4_ADDR,
-						    NULL, PW_TYPE_INTEGER, NULL, &tmp)) {
-					REDEBUG("Failed converting integer to IPv4 address: %s", fr_strerror());
-					ret = IPPOOL_RCODE_FAIL;
-					goto finish;
-				}
-			} else {
-				ip_map.rhs->tmpl_data_value.integer = ntohl((uint32_t)reply->element[1]->integer);
-				ip_map.rhs->tmpl_data_length = sizeof(ip_map.rhs->tmpl_data_value.integer);
-				ip_map.rhs->tmpl_data_type = PW_TYPE_INTEGER;
-			}
-		}
-			goto do_ip_map;
-
-		case REDIS_REPLY_STRING:
-			ip_map.rhs->tmpl_data_value.strvalue = reply->element[1]->str;
-			ip_map.rhs->tmpl_data_length = reply->element[1]->len;
-			ip_map.rhs->tmpl_data_type = PW_TYPE_STRING;
-
-		do_ip_map:
-			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
-			break;
-
-		default:
-			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[1])",
-				fr_int2str(redis_reply_types, reply->element[1]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		ret = ippool_ip_to_request(inst, request, reply->element[1]);
+		if (ret < 0) goto finish;
 	}
 
 	/*
 	 *	Process Range identifier
 	 */
 	if (reply->elements > 2) {
-		switch (reply->element[2]->type) {
-		/*
-		 *	Add range ID to request
-		 */
-		case REDIS_REPLY_STRING:
-		{
-			vp_tmpl_t range_rhs = {
-				.name = "",
-				.type = TMPL_TYPE_DATA,
-				.tmpl_data_type = PW_TYPE_STRING,
-				.quote = T_DOUBLE_QUOTED_STRING
-			};
-			vp_map_t range_map = {
-				.lhs = inst->range_attr,
-				.op = T_OP_SET,
-				.rhs = &range_rhs
-			};
-
-			range_map.rhs->tmpl_data_value.strvalue = reply->element[2]->str;
-			range_map.rhs->tmpl_data_length = reply->element[2]->len;
-			range_map.rhs->tmpl_data_type = PW_TYPE_STRING;
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
-		}
-			break;
-
-		case REDIS_REPLY_NIL:
-			break;
-
-		default:
-			REDEBUG("Server returned unexpected type \"%s\" for range element (result[2])",
-				fr_int2str(redis_reply_types, reply->element[2]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		ret = ippool_range_to_request(inst, request, reply->element[2]);
+		if (ret < 0) goto finish;
 	}
 
 	/*
 	 *	Process Expiry time
 	 */
 	if (inst->expiry_attr && (reply->elements > 3)) {
-		vp_tmpl_t expiry_rhs = {
-			.name = "",
-			.type = TMPL_TYPE_DATA,
-			.tmpl_data_type = PW_TYPE_STRING,
-			.quote = T_DOUBLE_QUOTED_STRING
-		};
-		vp_map_t expiry_map = {
-			.lhs = inst->expiry_attr,
-			.op = T_OP_SET,
-			.rhs = &expiry_rhs
-		};
-
 		if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
 			REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
 				fr_int2str(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
@@ -742,13 +1026,8 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t *inst, REQUEST *r
 			goto finish;
 		}
 
-		expiry_map.rhs->tmpl_data_value.integer = reply->element[3]->integer;
-		expiry_map.rhs->tmpl_data_length = sizeof(expiry_map.rhs->tmpl_data_value.integer);
-		expiry_map.rhs->tmpl_data_type = PW_TYPE_INTEGER;
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		ret = ippool_expiry_to_request(inst, request, reply->element[3]->integer);
+		if (ret < 0) goto finish;
 	}
 finish:
 	fr_redis_reply_free(reply);
@@ -983,57 +1262,1227 @@ finish:
 	return ret;
 }
 
-/** Find the pool name we'll be allocating from
+#ifdef HAVE_PTHREAD_H
+/** Seconds before a reservation reverts, after which it's no longer handed out
  *
- * @param out Where to write the pool name.
- * @param outlen Size of the output buffer.
- * @param inst This instance of the rlm_redis_ippool module.
- * @param request The current request.
- * @return
- *	- < 0 on error.
- *	- 0 if no pool attribute exists, or the pool name is a zero length string.
- *	- > 0 on success (length of data written to out).
+ * Leases are only handed out in the first half of their reservation, so the
+ * allocation has at least reserve_time / 2 to be written, including retries,
+ * before the reservation reverts.
  */
-static inline ssize_t ippool_pool_name(uint8_t out[], size_t outlen, rlm_redis_ippool_t *inst, REQUEST *request)
-{
-	ssize_t slen;
-	uint8_t *out_p = out;
+#define IPPOOL_BULK_MARGIN(_inst) ((_inst)->bulk_reserve_time / 2)
 
-	slen = tmpl_expand(NULL, (char *)out_p, outlen - (out_p - out), request,
-			   inst->pool_name, NULL, NULL);
-	if (slen < 0) {
-		if (inst->pool_name->type == TMPL_TYPE_ATTR) {
-			RDEBUG2("Pool attribute not present in request.  Doing nothing");
-			return 0;
-		}
-		REDEBUG("Failed expanding pool name");
-		return -1;
-	}
-	if (slen == 0) {
-		RDEBUG2("Empty pool name.  Doing nothing");
-		return 0;
-	}
+/** Append a script argument to argv and argv_len
+ *
+ */
+#define IPPOOL_BULK_ARG(_str, _len) \
+do { \
+	argv[argc] = (char const *)(_str); \
+	argv_len[argc] = (_len); \
+	argc++; \
+} while (0)
+
+#define IPPOOL_BULK_ARG_STR(_str) \
+do { \
+	char const *_p = (_str); \
+	IPPOOL_BULK_ARG(_p, strlen(_p)); \
+} while (0)
+
+/** A reserved lease
+ *
+ * Starts on the pool's list of reserved leases.  Once allocated it's moved to
+ * the pool's device tree, so that the device is given the same lease if it
+ * asks again, and stays there until the lease expires.
+ */
+typedef struct ippool_bulk_lease ippool_bulk_lease_t;
+struct ippool_bulk_lease {
+	ippool_bulk_lease_t	*next;			//!< Next reserved lease.
+
+	redisReply		*ip;			//!< Address, as returned by the reservation script.
+	redisReply		*range;			//!< Range identifier, may be a nil reply.
+	time_t			reserved_until;		//!< When the reservation reverts, if the
+							//!< lease isn't committed.
+
+	uint8_t const		*device_id;		//!< Device the lease was allocated to.
+	size_t			device_id_len;		//!< Length of the device identifier.
+	time_t			expires_at;		//!< When the lease expires.
+};
 
-	if (is_truncated((size_t)slen, outlen)) {
-		REDEBUG("Pool name too long.  Expected %zu bytes, got %zu bytes", outlen, (size_t)slen);
-		return -1;
-	}
-	out_p += slen;
+/** A pool we've reserved leases from
+ *
+ */
+typedef struct ippool_bulk_pool {
+	uint8_t			name[IPPOOL_MAX_KEY_PREFIX_SIZE];	//!< Name of the pool.
+	size_t			name_len;		//!< Length of the pool name.
 
-	return out_p - out;
-}
+	ippool_bulk_lease_t	*free_head;		//!< Oldest reserved lease.
+	ippool_bulk_lease_t	*free_tail;		//!< Newest reserved lease.
+	uint32_t		num_free;		//!< Number of reserved leases.
+	bool			reserving;		//!< Whether a thread is reserving more leases.
 
-static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool_action_t action)
-{
-	uint8_t		key_prefix[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
-	uint8_t const	*device_id = NULL, *gateway_id = NULL;
-	size_t		key_prefix_len, device_id_len = 0, gateway_id_len = 0;
-	ssize_t		slen;
+	rbtree_t		*devices;		//!< Leases allocated locally, indexed by device.
+
+	uint32_t		num_commit;		//!< Number of allocations waiting to be written.
+	uint32_t		committing;		//!< Number of allocations being written.
+} ippool_bulk_pool_t;
+
+/** An allocation waiting to be written to the server
+ *
+ * Holds copies of everything, so that the lease can expire locally
+ * before the allocation is written.
+ */
+typedef struct ippool_bulk_commit ippool_bulk_commit_t;
+struct ippool_bulk_commit {
+	ippool_bulk_commit_t	*next;			//!< Next allocation in the queue.
+	ippool_bulk_pool_t	*pool;			//!< Pool the lease was allocated from.
+	struct timeval		queued;			//!< When the allocation was queued.
+
+	char			*ip;			//!< Address allocated.
+	time_t			reserved_until;		//!< When the reservation reverts.
+	time_t			allocated;		//!< When the lease was allocated.
+	uint32_t		expires;		//!< Lease time.
+
+	uint8_t			*device_id;		//!< Device the lease was allocated to.
+	size_t			device_id_len;		//!< Length of the device identifier.
+	uint8_t			*gateway_id;		//!< Gateway of the device.
+	size_t			gateway_id_len;		//!< Length of the gateway identifier.
+};
+
+struct ippool_bulk {
+	rlm_redis_ippool_t	*inst;			//!< Instance we're allocating for.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below, and all the pools.
+	pthread_cond_t		cond;			//!< Signalled when there are allocations to
+							//!< write, or we're stopping.
+	pthread_cond_t		done_cond;		//!< Signalled when a reservation or write completes.
+
+	rbtree_t		*pools;			//!< Pools we've reserved leases from.
+
+	ippool_bulk_commit_t	*commit_head;		//!< Oldest allocation waiting to be written.
+	ippool_bulk_commit_t	*commit_tail;		//!< Newest allocation waiting to be written.
+	uint32_t		num_commit;		//!< Number of allocations waiting to be written.
+	bool			commit_failed;		//!< The last write failed.  Reserved leases
+							//!< aren't handed out until a write succeeds.
+	bool			stop;			//!< Worker should exit once the queue is empty.
+
+	pthread_t		worker;			//!< Thread writing allocations.
+	bool			running;		//!< Whether the worker was started.
+};
+
+static int _ippool_bulk_lease_free(ippool_bulk_lease_t *lease)
+{
+	fr_redis_reply_free(lease->ip);
+	fr_redis_reply_free(lease->range);
+
+	return 0;
+}
+
+static void _ippool_bulk_lease_tree_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int ippool_bulk_lease_cmp(void const *a, void const *b)
+{
+	ippool_bulk_lease_t const	*my_a = a, *my_b = b;
+	int				ret;
+
+	ret = (my_a->device_id_len > my_b->device_id_len) - (my_a->device_id_len < my_b->device_id_len);
+	if (ret != 0) return ret;
+
+	return memcmp(my_a->device_id, my_b->device_id, my_a->device_id_len);
+}
+
+static int _ippool_bulk_pool_free(ippool_bulk_pool_t *pool)
+{
+	ippool_bulk_lease_t *lease, *next;
+
+	for (lease = pool->free_head; lease; lease = next) {
+		next = lease->next;
+		talloc_free(lease);
+	}
+	rbtree_free(pool->devices);
+
+	return 0;
+}
+
+static void _ippool_bulk_pool_tree_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int ippool_bulk_pool_cmp(void const *a, void const *b)
+{
+	ippool_bulk_pool_t const	*my_a = a, *my_b = b;
+	int				ret;
+
+	ret = (my_a->name_len > my_b->name_len) - (my_a->name_len < my_b->name_len);
+	if (ret != 0) return ret;
+
+	return memcmp(my_a->name, my_b->name, my_a->name_len);
+}
+
+/** Find the local state for a pool, optionally creating it
+ *
+ * @note Must be called with the bulk mutex held.
+ *
+ * @param[in] bulk allocation state.
+ * @param[in] key_prefix Name of the pool.
+ * @param[in] key_prefix_len Length of the pool name.
+ * @param[in] create the pool if it doesn't exist.
+ * @return the pool, or NULL if it doesn't exist, or couldn't be created.
+ */
+static ippool_bulk_pool_t *ippool_bulk_pool_find(ippool_bulk_t *bulk, uint8_t const *key_prefix, size_t key_prefix_len,
+						 bool create)
+{
+	ippool_bulk_pool_t	find, *pool;
+
+	rad_assert(key_prefix_len <= sizeof(find.name));
+
+	memcpy(find.name, key_prefix, key_prefix_len);
+	find.name_len = key_prefix_len;
+
+	pool = rbtree_finddata(bulk->pools, &find);
+	if (pool || !create) return pool;
+
+	pool = talloc_zero(bulk, ippool_bulk_pool_t);
+	if (!pool) return NULL;
+
+	memcpy(pool->name, key_prefix, key_prefix_len);
+	pool->name_len = key_prefix_len;
+
+	pool->devices = rbtree_create(NULL, ippool_bulk_lease_cmp, _ippool_bulk_lease_tree_free, 0);
+	if (!pool->devices) {
+		talloc_free(pool);
+		return NULL;
+	}
+	talloc_set_destructor(pool, _ippool_bulk_pool_free);
+
+	if (!rbtree_insert(bulk->pools, pool)) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/** Execute a script against Redis cluster, with arguments built at runtime
+ *
+ * @see ippool_script_formatted
+ *
+ * @param[out] out Where to write Redis reply object resulting from the command.
+ * @param[in] request The current request.
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] pool to run the script against.
+ * @param[in] digest of script.
+ * @param[in] script to upload.
+ * @param[in] argc Number of arguments, including the EVALSHA command.
+ * @param[in] argv Arguments.
+ * @param[in] argv_len Length of each argument.
+ * @return status of the command.
+ */
+static fr_redis_rcode_t ippool_script_argv(redisReply **out, REQUEST *request, rlm_redis_ippool_t *inst,
+					   ippool_bulk_pool_t *pool, char const digest[], char const *script,
+					   int argc, char const **argv, size_t const *argv_len)
+{
+	char			*formatted;
+	int			len;
+	fr_redis_rcode_t	s_ret;
+
+	*out = NULL;
+
+	len = redisFormatCommandArgv(&formatted, argc, argv, argv_len);
+	if (len < 0) {
+		REDEBUG("Failed formatting script command");
+		return REDIS_RCODE_ERROR;
+	}
+
+	s_ret = ippool_script_formatted(out, request, inst->cluster, pool->name, pool->name_len,
+					inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+					digest, script, formatted, (size_t)len);
+	free(formatted);
+
+	return s_ret;
+}
+
+/** Check the reply from one of the bulk scripts, and return its rcode
+ *
+ */
+static ippool_rcode_t ippool_bulk_reply_check(REQUEST *request, redisReply *reply)
+{
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		REDEBUG("Expected result to be array got \"%s\"",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	if (reply->elements == 0) {
+		REDEBUG("Got empty result array");
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
+			fr_int2str(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	return reply->element[0]->integer;
+}
+
+/** Reserve a block of leases from a pool
+ *
+ * @note Must be called without the bulk mutex held.
+ *
+ * @param[out] head Where to write the first reserved lease.
+ * @param[out] tail Where to write the last reserved lease.
+ * @param[out] num Where to write the number of leases reserved.
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] pool to reserve leases from.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS if one or more leases were reserved.
+ *	- IPPOOL_RCODE_POOL_EMPTY if there are no free leases.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t ippool_bulk_reserve(ippool_bulk_lease_t **head, ippool_bulk_lease_t **tail, uint32_t *num,
+					  rlm_redis_ippool_t *inst, REQUEST *request, ippool_bulk_pool_t *pool)
+{
+	struct timeval		now;
+	redisReply		*reply = NULL;
+	ippool_rcode_t		ret;
+	time_t			reserved_until;
+	size_t			i;
+
+	*head = *tail = NULL;
+	*num = 0;
+
+	gettimeofday(&now, NULL);
+
+	RDEBUG2("Reserving up to %u leases for %us", inst->bulk_reserve, inst->bulk_reserve_time);
+	if (ippool_script(&reply, request, inst->cluster, pool->name, pool->name_len,
+			  inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+			  lua_reserve_digest, lua_reserve_cmd,
+			  "EVALSHA %s 1 %b %u %u %u",
+			  lua_reserve_digest,
+			  pool->name, pool->name_len,
+			  (unsigned int)now.tv_sec, inst->bulk_reserve_time, inst->bulk_reserve) != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	ret = ippool_bulk_reply_check(request, reply);
+	if (ret < 0) goto finish;
+
+	if ((reply->elements < 2) || (reply->element[1]->type != REDIS_REPLY_INTEGER)) {
+		REDEBUG("Server returned unexpected result for reservation expiry (result[1])");
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+	reserved_until = reply->element[1]->integer;
+
+	for (i = 2; (i + 1) < reply->elements; i += 2) {
+		ippool_bulk_lease_t *lease;
+
+		if (reply->element[i]->type != REDIS_REPLY_STRING) {
+			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[%zu])",
+				fr_int2str(redis_reply_types, reply->element[i]->type, "<UNKNOWN>"), i);
+			continue;
+		}
+
+		lease = talloc_zero(NULL, ippool_bulk_lease_t);
+		if (!lease) break;
+
+		/*
+		 *	Steal the elements, this works because
+		 *	hiredis checks for NULL elements.
+		 */
+		lease->ip = reply->element[i];
+		lease->range = reply->element[i + 1];
+		reply->element[i] = reply->element[i + 1] = NULL;
+		lease->reserved_until = reserved_until;
+		talloc_set_destructor(lease, _ippool_bulk_lease_free);
+
+		if (*tail) {
+			(*tail)->next = lease;
+		} else {
+			*head = lease;
+		}
+		*tail = lease;
+		(*num)++;
+	}
+
+	if (!*num) {
+		ret = IPPOOL_RCODE_POOL_EMPTY;
+		goto finish;
+	}
+	RDEBUG2("Reserved %u leases", *num);
+
+finish:
+	fr_redis_reply_free(reply);
+
+	return ret;
+}
+
+/** Find the lease a device holds on the server
+ *
+ * Catches devices which were given a lease by another server, or by this
+ * server before it was restarted.
+ *
+ * @note Must be called without the bulk mutex held.
+ *
+ * @param[out] out Where to write the device's lease.
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] pool to search in.
+ * @param[in] device_id to find the lease for.
+ * @param[in] device_id_len Length of the device identifier.
+ * @param[in] now Wall time.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS if the device has a lease.
+ *	- IPPOOL_RCODE_NOT_FOUND if the device has no lease.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t ippool_bulk_device_find(ippool_bulk_lease_t **out,
+					      rlm_redis_ippool_t *inst, REQUEST *request, ippool_bulk_pool_t *pool,
+					      uint8_t const *device_id, size_t device_id_len, time_t now)
+{
+	redisReply		*reply = NULL;
+	ippool_bulk_lease_t	*lease;
+	ippool_rcode_t		ret;
+
+	*out = NULL;
+
+	/*
+	 *	Nothing is written, so there's nothing to wait
+	 *	for the slaves to replicate.
+	 */
+	if (ippool_script(&reply, request, inst->cluster, pool->name, pool->name_len,
+			  0, 0, lua_device_digest, lua_device_cmd,
+			  "EVALSHA %s 1 %b %u %b",
+			  lua_device_digest,
+			  pool->name, pool->name_len,
+			  (unsigned int)now, device_id, device_id_len) != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	ret = ippool_bulk_reply_check(request, reply);
+	if (ret != IPPOOL_RCODE_SUCCESS) goto finish;
+
+	if ((reply->elements < 4) ||
+	    (reply->element[1]->type != REDIS_REPLY_STRING) ||
+	    (reply->element[3]->type != REDIS_REPLY_INTEGER)) {
+		REDEBUG("Server returned unexpected result for device lease");
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	lease = talloc_zero(NULL, ippool_bulk_lease_t);
+	if (!lease) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	lease->ip = reply->element[1];
+	lease->range = reply->element[2];
+	reply->element[1] = reply->element[2] = NULL;
+	talloc_set_destructor(lease, _ippool_bulk_lease_free);
+
+	lease->device_id = talloc_memdup(lease, device_id, device_id_len);
+	lease->device_id_len = device_id_len;
+	lease->expires_at = now + reply->element[3]->integer;
+
+	*out = lease;
+
+finish:
+	fr_redis_reply_free(reply);
+
+	return ret;
+}
+
+/** Return unused reservations to the pool
+ *
+ * @note Must be called without the bulk mutex held.
+ */
+static void ippool_bulk_unreserve(rlm_redis_ippool_t *inst, REQUEST *request, ippool_bulk_pool_t *pool)
+{
+	TALLOC_CTX		*ctx;
+	ippool_bulk_lease_t	*lease;
+	char const		**argv;
+	size_t			*argv_len;
+	int			argc = 0;
+	redisReply		*reply = NULL;
+
+	if (!pool->num_free) return;
+
+	ctx = talloc_new(request);
+	argv = talloc_array(ctx, char const *, 5 + (pool->num_free * 2));
+	argv_len = talloc_array(ctx, size_t, 5 + (pool->num_free * 2));
+
+	IPPOOL_BULK_ARG_STR("EVALSHA");
+	IPPOOL_BULK_ARG_STR(lua_unreserve_digest);
+	IPPOOL_BULK_ARG_STR("1");
+	IPPOOL_BULK_ARG(pool->name, pool->name_len);
+	IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%u", (unsigned int)time(NULL)));
+
+	for (lease = pool->free_head; lease; lease = lease->next) {
+		IPPOOL_BULK_ARG(lease->ip->str, lease->ip->len);
+		IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%" PRIu64, (uint64_t)lease->reserved_until));
+	}
+
+	if ((ippool_script_argv(&reply, request, inst, pool, lua_unreserve_digest, lua_unreserve_cmd,
+				argc, argv, argv_len) != REDIS_RCODE_SUCCESS) ||
+	    (ippool_bulk_reply_check(request, reply) < 0)) {
+		RWDEBUG("Failed returning %u reserved leases, they will be freed in %us",
+			pool->num_free, inst->bulk_reserve_time);
+	} else {
+		RDEBUG2("Returned %u reserved leases", pool->num_free);
+	}
+
+	fr_redis_reply_free(reply);
+	talloc_free(ctx);
+}
+
+/** Forget the local record of a lease which could not be written
+ *
+ * @note Must be called without the bulk mutex held.
+ *
+ * @param[in] bulk allocation state.
+ * @param[in] commit which was rejected by the server.
+ */
+static void ippool_bulk_lease_forget(ippool_bulk_t *bulk, ippool_bulk_commit_t *commit)
+{
+	ippool_bulk_lease_t	*lease, find;
+
+	memset(&find, 0, sizeof(find));
+	find.device_id = commit->device_id;
+	find.device_id_len = commit->device_id_len;
+
+	pthread_mutex_lock(&bulk->mutex);
+	lease = rbtree_finddata(commit->pool->devices, &find);
+	if (lease && ((size_t)lease->ip->len == strlen(commit->ip)) &&
+	    (memcmp(lease->ip->str, commit->ip, lease->ip->len) == 0)) {
+		rbtree_deletebydata(commit->pool->devices, lease);
+	}
+	pthread_mutex_unlock(&bulk->mutex);
+}
+
+/** Write a batch of allocations from one pool
+ *
+ * @note Must be called without the bulk mutex held.
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] batch of allocations, all from the same pool.
+ * @param[in] num Number of allocations in the batch.
+ * @return
+ *	- 0 if the batch was written (some leases may have been lost).
+ *	- -1 if the batch should be retried.
+ */
+static int ippool_bulk_commit(rlm_redis_ippool_t *inst, REQUEST *request, ippool_bulk_commit_t *batch, uint32_t num)
+{
+	ippool_bulk_pool_t	*pool = batch->pool;
+	ippool_bulk_commit_t	*commit;
+	TALLOC_CTX		*ctx;
+	char const		**argv;
+	size_t			*argv_len;
+	int			argc = 0;
+	redisReply		*reply = NULL;
+	int			ret = -1;
+	size_t			i;
+
+	ctx = talloc_new(request);
+	argv = talloc_array(ctx, char const *, 5 + (num * 6));
+	argv_len = talloc_array(ctx, size_t, 5 + (num * 6));
+
+	IPPOOL_BULK_ARG_STR("EVALSHA");
+	IPPOOL_BULK_ARG_STR(lua_commit_digest);
+	IPPOOL_BULK_ARG_STR("1");
+	IPPOOL_BULK_ARG(pool->name, pool->name_len);
+	IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%u", (unsigned int)time(NULL)));
+
+	for (commit = batch; commit; commit = commit->next) {
+		IPPOOL_BULK_ARG_STR(commit->ip);
+		IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%" PRIu64, (uint64_t)commit->reserved_until));
+		IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%" PRIu64, (uint64_t)commit->allocated));
+		IPPOOL_BULK_ARG_STR(talloc_typed_asprintf(ctx, "%u", commit->expires));
+		IPPOOL_BULK_ARG(commit->device_id, commit->device_id_len);
+		IPPOOL_BULK_ARG(commit->gateway_id, commit->gateway_id_len);
+	}
+
+	RDEBUG2("Writing %u allocations", num);
+	if (ippool_script_argv(&reply, request, inst, pool, lua_commit_digest, lua_commit_cmd,
+			       argc, argv, argv_len) != REDIS_RCODE_SUCCESS) goto finish;
+
+	if (ippool_bulk_reply_check(request, reply) < 0) goto finish;
+
+	/*
+	 *	Anything else in the reply is a lease we handed out,
+	 *	but which was allocated to another device before we
+	 *	could write it.  Forget about it, so the device is
+	 *	given a new lease when it next asks.
+	 */
+	for (i = 1; i < reply->elements; i++) {
+		if (reply->element[i]->type != REDIS_REPLY_STRING) continue;
+
+		RERROR("Reservation for %s expired before the allocation was written.  "
+		       "It may have been allocated twice", reply->element[i]->str);
+
+		for (commit = batch; commit; commit = commit->next) {
+			if (strcmp(commit->ip, reply->element[i]->str) == 0) break;
+		}
+		if (commit) ippool_bulk_lease_forget(inst->bulk, commit);
+	}
+	ret = 0;
+
+finish:
+	fr_redis_reply_free(reply);
+	talloc_free(ctx);
+
+	return ret;
+}
+
+/** Remove up to commit_size allocations for a pool from the queue
+ *
+ * @note Must be called with the bulk mutex held.
+ *
+ * @param[out] out Where to write the first allocation.
+ * @param[in] bulk allocation state.
+ * @param[in] pool to remove allocations for.
+ * @return the number of allocations removed.
+ */
+static uint32_t ippool_bulk_dequeue(ippool_bulk_commit_t **out, ippool_bulk_t *bulk, ippool_bulk_pool_t *pool)
+{
+	ippool_bulk_commit_t	**p, *commit, **last = out;
+	uint32_t		num = 0;
+
+	*out = NULL;
+	bulk->commit_tail = NULL;
+
+	for (p = &bulk->commit_head; *p; ) {
+		commit = *p;
+
+		if ((commit->pool != pool) || (num >= bulk->inst->bulk_commit_size)) {
+			bulk->commit_tail = commit;
+			p = &commit->next;
+			continue;
+		}
+
+		*p = commit->next;
+		commit->next = NULL;
+		*last = commit;
+		last = &commit->next;
+		num++;
+	}
+
+	bulk->num_commit -= num;
+	pool->num_commit -= num;
+
+	return num;
+}
+
+/** Put a batch of allocations back at the head of the queue
+ *
+ * @note Must be called with the bulk mutex held.
+ */
+static void ippool_bulk_requeue(ippool_bulk_t *bulk, ippool_bulk_commit_t *batch, uint32_t num)
+{
+	ippool_bulk_commit_t *last;
+
+	for (last = batch; last->next; last = last->next);
+
+	last->next = bulk->commit_head;
+	bulk->commit_head = batch;
+	if (!bulk->commit_tail) bulk->commit_tail = last;
+
+	bulk->num_commit += num;
+	batch->pool->num_commit += num;
+}
+
+static void ippool_bulk_commit_free(ippool_bulk_commit_t *batch)
+{
+	ippool_bulk_commit_t *next;
+
+	while (batch) {
+		next = batch->next;
+		talloc_free(batch);
+		batch = next;
+	}
+}
+
+static int _ippool_bulk_lease_expired(void *ctx, void *data)
+{
+	time_t			now = *(time_t *)ctx;
+	ippool_bulk_lease_t	*lease = data;
+
+	return (lease->expires_at <= now) ? 2 : 0;
+}
+
+static int _ippool_bulk_pool_sweep(void *ctx, void *data)
+{
+	ippool_bulk_pool_t *pool = data;
+
+	rbtree_walk(pool->devices, RBTREE_DELETE_ORDER, _ippool_bulk_lease_expired, ctx);
+
+	return 0;
+}
+
+static void *ippool_bulk_worker(void *arg)
+{
+	ippool_bulk_t		*bulk = arg;
+	rlm_redis_ippool_t	*inst = bulk->inst;
+	time_t			next_sweep = 0;
+
+	pthread_mutex_lock(&bulk->mutex);
+	while (true) {
+		ippool_bulk_commit_t	*batch;
+		ippool_bulk_pool_t	*pool;
+		REQUEST			*request;
+		uint32_t		num;
+		int			ret;
+		struct timeval		now, when;
+		struct timespec		ts;
+
+		gettimeofday(&now, NULL);
+
+		/*
+		 *	Forget about leases which have expired, so
+		 *	the devices they were allocated to are
+		 *	given new ones.
+		 */
+		if (now.tv_sec >= next_sweep) {
+			rbtree_walk(bulk->pools, RBTREE_IN_ORDER, _ippool_bulk_pool_sweep, &now.tv_sec);
+			next_sweep = now.tv_sec + 1;
+		}
+
+		if (!bulk->commit_head) {
+			if (bulk->stop) break;
+
+			when.tv_sec = now.tv_sec + 1;
+			when.tv_usec = now.tv_usec;
+			goto wait;
+		}
+
+		/*
+		 *	Wait for a full batch, unless the oldest
+		 *	allocation has been waiting for long enough.
+		 */
+		if ((bulk->num_commit < inst->bulk_commit_size) && !bulk->stop) {
+			timeradd(&bulk->commit_head->queued, &inst->bulk_commit_delay, &when);
+			if (timercmp(&now, &when, <)) goto wait;
+		}
+
+		pool = bulk->commit_head->pool;
+		num = ippool_bulk_dequeue(&batch, bulk, pool);
+		pool->committing += num;
+		pthread_mutex_unlock(&bulk->mutex);
+
+		request = request_alloc(NULL);
+		ret = request ? ippool_bulk_commit(inst, request, batch, num) : -1;
+		talloc_free(request);
+
+		pthread_mutex_lock(&bulk->mutex);
+		pool->committing -= num;
+		bulk->commit_failed = (ret < 0);
+		pthread_cond_broadcast(&bulk->done_cond);
+
+		if (ret < 0) {
+			/*
+			 *	Put the batch back, and wait before
+			 *	trying again.  The commit script
+			 *	checks the reservations are still
+			 *	valid, so retrying late is safe.
+			 *
+			 *	Until the batch is written, new
+			 *	allocations go straight to the
+			 *	server, so we don't queue up more
+			 *	leases whose reservations may
+			 *	revert before they're written.
+			 */
+			if (!bulk->stop) {
+				ippool_bulk_requeue(bulk, batch, num);
+
+				gettimeofday(&now, NULL);
+				when.tv_sec = now.tv_sec + 1;
+				when.tv_usec = now.tv_usec;
+				goto wait;
+			}
+
+			ERROR("rlm_redis_ippool (%s): Failed writing %u allocations, discarding them",
+			      inst->name, num);
+		}
+		ippool_bulk_commit_free(batch);
+		continue;
+
+	wait:
+		ts.tv_sec = when.tv_sec;
+		ts.tv_nsec = when.tv_usec * 1000;
+		pthread_cond_timedwait(&bulk->cond, &bulk->mutex, &ts);
+	}
+	pthread_mutex_unlock(&bulk->mutex);
+
+	return NULL;
+}
+
+/** Start the worker thread which writes allocations
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_bulk_init(rlm_redis_ippool_t *inst)
+{
+	ippool_bulk_t	*bulk;
+	int		rcode;
+
+	bulk = talloc_zero(inst, ippool_bulk_t);
+	if (!bulk) return -1;
+
+	bulk->inst = inst;
+	bulk->pools = rbtree_create(bulk, ippool_bulk_pool_cmp, _ippool_bulk_pool_tree_free, 0);
+	if (!bulk->pools) {
+		talloc_free(bulk);
+		return -1;
+	}
+
+	pthread_mutex_init(&bulk->mutex, NULL);
+	pthread_cond_init(&bulk->cond, NULL);
+	pthread_cond_init(&bulk->done_cond, NULL);
+	inst->bulk = bulk;
+
+	rcode = pthread_create(&bulk->worker, NULL, ippool_bulk_worker, bulk);
+	if (rcode != 0) {
+		ERROR("rlm_redis_ippool (%s): Failed creating bulk allocation thread: %s",
+		      inst->name, fr_syserror(rcode));
+		return -1;
+	}
+	bulk->running = true;
+
+	return 0;
+}
+
+static int _ippool_bulk_pool_unreserve(void *ctx, void *data)
+{
+	rlm_redis_ippool_t	*inst = ctx;
+	ippool_bulk_pool_t	*pool = data;
+	REQUEST			*request;
+
+	request = request_alloc(NULL);
+	if (!request) return -1;
+
+	ippool_bulk_unreserve(inst, request, pool);
+	talloc_free(request);
+
+	return 0;
+}
+
+/** Write any queued allocations, return unused reservations, and stop the worker thread
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ */
+static void ippool_bulk_free(rlm_redis_ippool_t *inst)
+{
+	ippool_bulk_t	*bulk = inst->bulk;
+
+	if (!bulk) return;
+
+	if (bulk->running) {
+		pthread_mutex_lock(&bulk->mutex);
+		bulk->stop = true;
+		pthread_cond_broadcast(&bulk->cond);
+		pthread_mutex_unlock(&bulk->mutex);
+
+		pthread_join(bulk->worker, NULL);
+
+		rbtree_walk(bulk->pools, RBTREE_IN_ORDER, _ippool_bulk_pool_unreserve, inst);
+	}
+
+	rbtree_free(bulk->pools);
+
+	pthread_cond_destroy(&bulk->done_cond);
+	pthread_cond_destroy(&bulk->cond);
+	pthread_mutex_destroy(&bulk->mutex);
+
+	inst->bulk = NULL;
+	talloc_free(bulk);
+}
+
+/** Write a lease allocated from the local cache to the request
+ *
+ */
+static ippool_rcode_t ippool_bulk_lease_to_request(rlm_redis_ippool_t *inst, REQUEST *request,
+						   ippool_bulk_lease_t *lease, uint32_t expires)
+{
+	ippool_rcode_t ret;
+
+	ret = ippool_ip_to_request(inst, request, lease->ip);
+	if (ret < 0) return ret;
+
+	ret = ippool_range_to_request(inst, request, lease->range);
+	if (ret < 0) return ret;
+
+	if (inst->expiry_attr) return ippool_expiry_to_request(inst, request, expires);
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Allocate a new IP address from the leases reserved by this instance
+ *
+ * If the device was already allocated a lease by this instance, and that lease
+ * hasn't expired, the device is given the same lease.  If it wasn't, the server
+ * is checked for a lease allocated to the device by another instance.
+ *
+ * Otherwise the device is given one of the reserved leases, and the allocation
+ * is queued to be written to the server by the worker thread.  If there are
+ * no reserved leases, another block is reserved.
+ *
+ * If the last write of queued allocations failed, the lease is allocated
+ * directly with #lua_alloc_cmd instead.
+ */
+static ippool_rcode_t redis_ippool_bulk_allocate(rlm_redis_ippool_t *inst, REQUEST *request,
+						 uint8_t const *key_prefix, size_t key_prefix_len,
+						 uint8_t const *device_id, size_t device_id_len,
+						 uint8_t const *gateway_id, size_t gateway_id_len,
+						 uint32_t expires)
+{
+	ippool_bulk_t		*bulk = inst->bulk;
+	ippool_bulk_pool_t	*pool;
+	ippool_bulk_lease_t	*lease, find;
+	ippool_bulk_commit_t	*commit;
+	ippool_rcode_t		ret;
+	time_t			now;
+
+	rad_assert(key_prefix);
+	rad_assert(device_id);
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&bulk->mutex);
+	pool = ippool_bulk_pool_find(bulk, key_prefix, key_prefix_len, true);
+	if (!pool) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	Check to see if we already gave the device a lease,
+	 *	and if we did, give it the same one.
+	 */
+	memset(&find, 0, sizeof(find));
+	find.device_id = device_id;
+	find.device_id_len = device_id_len;
+
+	lease = rbtree_finddata(pool->devices, &find);
+	if (lease) {
+		if (lease->expires_at > now) {
+			RDEBUG2("Device already has a lease from this server");
+			ret = ippool_bulk_lease_to_request(inst, request, lease, lease->expires_at - now);
+			goto finish;
+		}
+		rbtree_deletebydata(pool->devices, lease);
+	}
+
+	/*
+	 *	Allocations aren't being written, so anything we
+	 *	hand out now could lose its reservation before the
+	 *	server knows about it.  Allocate directly instead.
+	 */
+	if (bulk->commit_failed) {
+		pthread_mutex_unlock(&bulk->mutex);
+
+		RWDEBUG("Queued allocations are not being written, allocating lease directly");
+		return redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
+					     device_id, device_id_len,
+					     gateway_id, gateway_id_len, expires);
+	}
+
+	/*
+	 *	The device may already have a lease from another
+	 *	server, or from before we restarted.  If it does,
+	 *	give it that lease rather than a reserved one, so
+	 *	it isn't renumbered.
+	 */
+	pthread_mutex_unlock(&bulk->mutex);
+	ret = ippool_bulk_device_find(&lease, inst, request, pool, device_id, device_id_len, now);
+	pthread_mutex_lock(&bulk->mutex);
+
+	if (ret == IPPOOL_RCODE_SUCCESS) {
+		ippool_bulk_lease_t *old;
+
+		old = rbtree_finddata(pool->devices, lease);
+		if (old) rbtree_deletebydata(pool->devices, old);
+
+		if (!rbtree_insert(pool->devices, lease)) {
+			talloc_free(lease);
+			ret = IPPOOL_RCODE_FAIL;
+			goto finish;
+		}
+
+		RDEBUG2("Device already has a lease");
+		ret = ippool_bulk_lease_to_request(inst, request, lease, lease->expires_at - now);
+		goto finish;
+	}
+	if (ret != IPPOOL_RCODE_NOT_FOUND) goto finish;
+
+	/*
+	 *	Another thread may have given the device a lease
+	 *	whilst we weren't holding the mutex.
+	 */
+	lease = rbtree_finddata(pool->devices, &find);
+	if (lease) {
+		if (lease->expires_at > now) {
+			RDEBUG2("Device already has a lease from this server");
+			ret = ippool_bulk_lease_to_request(inst, request, lease, lease->expires_at - now);
+			goto finish;
+		}
+		rbtree_deletebydata(pool->devices, lease);
+	}
+
+	/*
+	 *	Take the oldest reserved lease, which still has long
+	 *	enough left for the allocation to be written.  The
+	 *	rest revert on the server by themselves.
+	 */
+	while (true) {
+		ippool_bulk_lease_t	*head, *tail;
+		uint32_t		num;
+
+		lease = pool->free_head;
+		if (lease) {
+			pool->free_head = lease->next;
+			if (!pool->free_head) pool->free_tail = NULL;
+			pool->num_free--;
+			lease->next = NULL;
+
+			if (lease->reserved_until > (now + IPPOOL_BULK_MARGIN(inst))) break;
+
+			talloc_free(lease);
+			continue;
+		}
+
+		/*
+		 *	Another thread is reserving leases from
+		 *	this pool.  Wait for it, rather than
+		 *	reserving twice as many.
+		 */
+		if (pool->reserving) {
+			pthread_cond_wait(&bulk->done_cond, &bulk->mutex);
+			continue;
+		}
+
+		pool->reserving = true;
+		pthread_mutex_unlock(&bulk->mutex);
+
+		ret = ippool_bulk_reserve(&head, &tail, &num, inst, request, pool);
+
+		pthread_mutex_lock(&bulk->mutex);
+		pool->reserving = false;
+		pthread_cond_broadcast(&bulk->done_cond);
+		if (ret < 0) goto finish;
+
+		if (pool->free_tail) {
+			pool->free_tail->next = head;
+		} else {
+			pool->free_head = head;
+		}
+		pool->free_tail = tail;
+		pool->num_free += num;
+	}
+
+	lease->device_id = talloc_memdup(lease, device_id, device_id_len);
+	lease->device_id_len = device_id_len;
+	lease->expires_at = now + expires;
+
+	commit = talloc_zero(NULL, ippool_bulk_commit_t);
+	if (!commit || !rbtree_insert(pool->devices, lease)) {
+		talloc_free(commit);
+		talloc_free(lease);
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	Queue the allocation to be written
+	 */
+	commit->pool = pool;
+	commit->ip = talloc_bstrndup(commit, lease->ip->str, lease->ip->len);
+	commit->reserved_until = lease->reserved_until;
+	commit->allocated = now;
+	commit->expires = expires;
+	commit->device_id = talloc_memdup(commit, device_id, device_id_len);
+	commit->device_id_len = device_id_len;
+	commit->gateway_id = talloc_memdup(commit, gateway_id ? gateway_id : (uint8_t const *)"", gateway_id_len);
+	commit->gateway_id_len = gateway_id_len;
+	gettimeofday(&commit->queued, NULL);
+
+	if (bulk->commit_tail) {
+		bulk->commit_tail->next = commit;
+	} else {
+		bulk->commit_head = commit;
+	}
+	bulk->commit_tail = commit;
+	bulk->num_commit++;
+	pool->num_commit++;
+
+	if ((bulk->num_commit == 1) || (bulk->num_commit >= inst->bulk_commit_size)) {
+		pthread_cond_signal(&bulk->cond);
+	}
+
+	RDEBUG2("Allocated reserved lease, %u remaining", pool->num_free);
+	ret = ippool_bulk_lease_to_request(inst, request, lease, expires);
+
+finish:
+	pthread_mutex_unlock(&bulk->mutex);
+
+	return ret;
+}
+
+/** Write any queued allocations for a pool
+ *
+ * Called before leases are updated or released, so the server sees
+ * the allocations first.
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] key_prefix Name of the pool.
+ * @param[in] key_prefix_len Length of the pool name.
+ */
+static void ippool_bulk_flush(rlm_redis_ippool_t *inst, REQUEST *request,
+			      uint8_t const *key_prefix, size_t key_prefix_len)
+{
+	ippool_bulk_t		*bulk = inst->bulk;
+	ippool_bulk_pool_t	*pool;
+
+	pthread_mutex_lock(&bulk->mutex);
+	pool = ippool_bulk_pool_find(bulk, key_prefix, key_prefix_len, false);
+	while (pool && (pool->num_commit || pool->committing)) {
+		ippool_bulk_commit_t	*batch;
+		uint32_t		num;
+		int			ret;
+
+		/*
+		 *	The worker is writing them, wait for it.
+		 */
+		if (!pool->num_commit) {
+			pthread_cond_wait(&bulk->done_cond, &bulk->mutex);
+			continue;
+		}
+
+		num = ippool_bulk_dequeue(&batch, bulk, pool);
+		pool->committing += num;
+		pthread_mutex_unlock(&bulk->mutex);
+
+		ret = ippool_bulk_commit(inst, request, batch, num);
+
+		pthread_mutex_lock(&bulk->mutex);
+		pool->committing -= num;
+		bulk->commit_failed = (ret < 0);
+		pthread_cond_broadcast(&bulk->done_cond);
+
+		if (ret < 0) {
+			RWDEBUG("Failed writing queued allocations, they will be retried");
+			ippool_bulk_requeue(bulk, batch, num);
+			break;
+		}
+		ippool_bulk_commit_free(batch);
+	}
+	pthread_mutex_unlock(&bulk->mutex);
+}
+
+/** Change when a lease allocated by this instance expires
+ *
+ * Keeps the local record of which lease a device has in sync
+ * with updates and releases.
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] key_prefix Name of the pool.
+ * @param[in] key_prefix_len Length of the pool name.
+ * @param[in] device_id the lease was allocated to.
+ * @param[in] device_id_len Length of the device identifier.
+ * @param[in] expires_at New expiry time.  If 0 the lease is forgotten.
+ */
+static void ippool_bulk_lease_expiry_set(rlm_redis_ippool_t *inst,
+					 uint8_t const *key_prefix, size_t key_prefix_len,
+					 uint8_t const *device_id, size_t device_id_len,
+					 time_t expires_at)
+{
+	ippool_bulk_t		*bulk = inst->bulk;
+	ippool_bulk_pool_t	*pool;
+	ippool_bulk_lease_t	*lease, find;
+
+	if (!device_id) return;
+
+	memset(&find, 0, sizeof(find));
+	find.device_id = device_id;
+	find.device_id_len = device_id_len;
+
+	pthread_mutex_lock(&bulk->mutex);
+	pool = ippool_bulk_pool_find(bulk, key_prefix, key_prefix_len, false);
+	lease = pool ? rbtree_finddata(pool->devices, &find) : NULL;
+	if (lease) {
+		if (expires_at) {
+			lease->expires_at = expires_at;
+		} else {
+			rbtree_deletebydata(pool->devices, lease);
+		}
+	}
+	pthread_mutex_unlock(&bulk->mutex);
+}
+#endif
+
+/** Find the pool name we'll be allocating from
+ *
+ * @param out Where to write the pool name.
+ * @param outlen Size of the output buffer.
+ * @param inst This instance of the rlm_redis_ippool module.
+ * @param request The current request.
+ * @return
+ *	- < 0 on error.
+ *	- 0 if no pool attribute exists, or the pool name is a zero length string.
+ *	- > 0 on success (length of data written to out).
+ */
+static inline ssize_t ippool_pool_name(uint8_t out[], size_t outlen, rlm_redis_ippool_t *inst, REQUEST *request)
+{
+	ssize_t slen;
+	uint8_t *out_p = out;
+
+	slen = tmpl_expand(NULL, (char *)out_p, outlen - (out_p - out), request,
+			   inst->pool_name, NULL, NULL);
+	if (slen < 0) {
+		if (inst->pool_name->type == TMPL_TYPE_ATTR) {
+			RDEBUG2("Pool attribute not present in request.  Doing nothing");
+			return 0;
+		}
+		REDEBUG("Failed expanding pool name");
+		return -1;
+	}
+	if (slen == 0) {
+		RDEBUG2("Empty pool name.  Doing nothing");
+		return 0;
+	}
+
+	if (is_truncated((size_t)slen, outlen)) {
+		REDEBUG("Pool name too long.  Expected %zu bytes, got %zu bytes", outlen, (size_t)slen);
+		return -1;
+	}
+	out_p += slen;
+
+	return out_p - out;
+}
+
+static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool_action_t action)
+{
+	uint8_t		key_prefix[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
+	uint8_t const	*device_id = NULL, *gateway_id = NULL;
+	size_t		key_prefix_len, device_id_len = 0, gateway_id_len = 0;
+	ssize_t		slen;
 	fr_ipaddr_t	ip;
 	char		expires_buff[20];
 	char const	*expires_str;
 	unsigned long	expires = 0;
 	char		*q;
+	ippool_rcode_t	ret;
 
 	slen = ippool_pool_name((uint8_t *)&key_prefix, sizeof(key_prefix), inst, request);
 	if (slen < 0) return RLM_MODULE_FAIL;
@@ -1079,9 +2528,17 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      device_id, device_id_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
+#ifdef HAVE_PTHREAD_H
+		if (inst->bulk) {
+			ret = redis_ippool_bulk_allocate(inst, request, key_prefix, key_prefix_len,
+							 device_id, device_id_len,
+							 gateway_id, gateway_id_len, (uint32_t)expires);
+		} else
+#endif
+		ret = redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
+					    device_id, device_id_len,
+					    gateway_id, gateway_id_len, (uint32_t)expires);
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address lease allocated");
 			return RLM_MODULE_UPDATED;
@@ -1123,11 +2580,20 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
+#ifdef HAVE_PTHREAD_H
+		if (inst->bulk) ippool_bulk_flush(inst, request, key_prefix, key_prefix_len);
+#endif
 		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
 					    &ip, device_id, device_id_len,
 					    gateway_id, gateway_id_len, (uint32_t)expires)) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address lease updated");
+#ifdef HAVE_PTHREAD_H
+			if (inst->bulk) {
+				ippool_bulk_lease_expiry_set(inst, key_prefix, key_prefix_len,
+							     device_id, device_id_len, time(NULL) + expires);
+			}
+#endif
 
 			/*
 			 *	Copy over the input IP address to the reply attribute
@@ -1191,10 +2657,19 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, 0);
+#ifdef HAVE_PTHREAD_H
+		if (inst->bulk) ippool_bulk_flush(inst, request, key_prefix, key_prefix_len);
+#endif
 		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
 					     &ip, device_id, device_id_len)) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address released");
+#ifdef HAVE_PTHREAD_H
+			if (inst->bulk) {
+				ippool_bulk_lease_expiry_set(inst, key_prefix, key_prefix_len,
+							     device_id, device_id_len, 0);
+			}
+#endif
 			return RLM_MODULE_UPDATED;
 
 		/*
@@ -1305,6 +2780,9 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	rlm_redis_ippool_t *inst = instance;
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 	rad_assert(inst->allocated_address_attr->type == TMPL_TYPE_ATTR);
 	rad_assert(subcs);
 
@@ -1337,6 +2815,26 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
 		fr_sha1_final(digest, &sha1_ctx);
 		fr_bin2hex(lua_release_digest, digest, sizeof(digest));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_reserve_cmd, sizeof(lua_reserve_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_reserve_digest, digest, sizeof(digest));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_commit_cmd, sizeof(lua_commit_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_commit_digest, digest, sizeof(digest));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_unreserve_cmd, sizeof(lua_unreserve_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_unreserve_digest, digest, sizeof(digest));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_device_cmd, sizeof(lua_device_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_device_digest, digest, sizeof(digest));
 	}
 
 	/*
@@ -1345,6 +2843,36 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	if (inst->bulk_enable) {
+#ifdef HAVE_PTHREAD_H
+		FR_INTEGER_BOUND_CHECK("bulk.reserve", inst->bulk_reserve, >=, 1);
+		FR_INTEGER_BOUND_CHECK("bulk.reserve", inst->bulk_reserve, <=, 10000);
+		FR_INTEGER_BOUND_CHECK("bulk.commit_size", inst->bulk_commit_size, >=, 1);
+		FR_INTEGER_BOUND_CHECK("bulk.commit_size", inst->bulk_commit_size, <=, 1000);
+		FR_TIMEVAL_BOUND_CHECK("bulk.commit_delay", &inst->bulk_commit_delay, <=, 1, 0);
+
+		/*
+		 *	Reservations need to last long enough for
+		 *	leases to be handed out, and written.
+		 */
+		FR_INTEGER_BOUND_CHECK("bulk.reserve_time", inst->bulk_reserve_time, >=, 10);
+
+		if (ippool_bulk_init(inst) < 0) return -1;
+#else
+		WARN("rlm_redis_ippool (%s): Ignoring bulk allocation as the server was built without threads",
+		     inst->name);
+#endif
+	}
+
+	return 0;
+}
+
+static int mod_detach(UNUSED void *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	ippool_bulk_free(instance);
+#endif
+
 	return 0;
 }
 
@@ -1357,6 +2885,7 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
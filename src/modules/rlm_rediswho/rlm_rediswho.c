@@ -81,14 +81,9 @@ static CONF_PARSER module_config[] = {
  */
 static int rediswho_command(rlm_rediswho_t *inst, REQUEST *request, char const *fmt)
 {
-	fr_redis_conn_t		*conn;
-
 	int 			ret = -1;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
 	redisReply		*reply = NULL;
-	int			s_ret;
 
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
@@ -114,13 +109,8 @@ static int rediswho_command(rlm_rediswho_t *inst, REQUEST *request, char const *
 	 	key_len = strlen((char const *)key);
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+	if (fr_redis_cluster_command(inst->cluster, request, key, key_len, argc, argv, NULL, &reply) !=
+	    REDIS_RCODE_SUCCESS) {
 		RERROR("Failed inserting accounting data");
 	error:
 		fr_redis_reply_free(reply);
@@ -34,6 +34,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/connection.h>
 
@@ -300,7 +301,6 @@ void rest_cleanup(void)
 	curl_global_cleanup();
 }
 
-
 /** Frees a libcurl handle, and any additional memory used by context data.
  *
  * @param[in] randle rlm_rest_handle_t to close and free.
@@ -313,6 +313,466 @@ static int _mod_conn_free(rlm_rest_handle_t *randle)
 	return 0;
 }
 
+/*
+ *	Wrap a libcurl handle, with the context data required for
+ *	generating requests and parsing responses.  On success, the
+ *	libcurl handle is freed with the wrapper.
+ */
+static rlm_rest_handle_t *rest_handle_alloc(TALLOC_CTX *ctx, rlm_rest_t *inst, CURL *candle)
+{
+	rlm_rest_handle_t	*randle;
+	rlm_rest_curl_context_t	*curl_ctx;
+
+	randle = talloc_zero(ctx, rlm_rest_handle_t);
+	if (!randle) return NULL;
+
+	curl_ctx = talloc_zero(randle, rlm_rest_curl_context_t);
+	if (!curl_ctx) {
+		talloc_free(randle);
+		return NULL;
+	}
+
+	curl_ctx->headers = NULL; /* CURL needs this to be NULL */
+	curl_ctx->request.instance = inst;
+
+	randle->ctx = curl_ctx;
+	randle->handle = candle;
+	talloc_set_destructor(randle, _mod_conn_free);
+
+	return randle;
+}
+
+#ifdef HAVE_REST_MULTI
+struct rest_multi {
+	rlm_rest_t const	*inst;		//!< Instance we're performing transfers for.
+	CURLM			*mandle;	//!< Multi handle, only used by the I/O thread.
+	rlm_rest_handle_t	*active;	//!< Transfers added to the multi handle, only used by
+						//!< the I/O thread.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	rlm_rest_handle_t	*pending;	//!< Transfers waiting to be added to the multi handle.
+	rlm_rest_handle_t	*idle;		//!< Handles which aren't being used by a request.
+	bool			cancel;		//!< A transfer has been cancelled.
+	bool			stop;		//!< I/O thread should exit.  No more transfers are accepted.
+
+	int			wakeup[2];	//!< Written to when there are new transfers, or
+						//!< we're stopping.
+	pthread_t		thread;		//!< The I/O thread.
+	bool			running;	//!< Whether the I/O thread was started.
+};
+
+/*
+ *	Record the result of a transfer, and give the request back to
+ *	the interpreter.  The handle belongs to the request again
+ *	afterwards, so mustn't be touched.
+ */
+static void rest_multi_done(rlm_rest_handle_t *randle, CURLcode result)
+{
+	REQUEST *request = randle->request;
+
+	randle->result = result;
+	randle->request = NULL;
+	randle->next = randle->prev = NULL;
+
+	modcall_signal(request);
+}
+
+static void rest_multi_active_remove(rest_multi_t *multi, rlm_rest_handle_t *randle)
+{
+	if (randle->prev) {
+		randle->prev->next = randle->next;
+	} else {
+		multi->active = randle->next;
+	}
+	if (randle->next) randle->next->prev = randle->prev;
+}
+
+/*
+ *	Abort the transfers which have been cancelled.
+ */
+static void rest_multi_abort(rest_multi_t *multi)
+{
+	rlm_rest_handle_t	*randle, *next, *aborted = NULL;
+
+	pthread_mutex_lock(&multi->mutex);
+	for (randle = multi->active; randle; randle = next) {
+		next = randle->next;
+
+		if (!randle->cancelled) continue;
+
+		rest_multi_active_remove(multi, randle);
+		randle->next = aborted;
+		aborted = randle;
+	}
+	pthread_mutex_unlock(&multi->mutex);
+
+	for (randle = aborted; randle; randle = next) {
+		next = randle->next;
+
+		curl_multi_remove_handle(multi->mandle, randle->handle);
+		rest_multi_done(randle, CURLE_ABORTED_BY_CALLBACK);
+	}
+}
+
+/** Drive the multi handle
+ *
+ * New transfers are added when the request threads write to the wakeup
+ * pipe.  Everything else (connecting, sending, receiving, and reusing
+ * connections) is done by libcurl, on sockets which are only touched by
+ * this thread.
+ *
+ * When we're told to stop, transfers which are still in progress are
+ * failed, so that the requests waiting for them can clean up.
+ */
+static void *rest_multi_thread(void *arg)
+{
+	rest_multi_t		*multi = arg;
+	rlm_rest_t const	*inst = multi->inst;
+	rlm_rest_handle_t	*randle, *next;
+	struct curl_waitfd	wakeup;
+	CURLMsg			*msg;
+	CURLMcode		mret;
+	int			active = 0, queued;
+	bool			stop, cancel;
+	char			buffer[64];
+
+	memset(&wakeup, 0, sizeof(wakeup));
+	wakeup.fd = multi->wakeup[0];
+	wakeup.events = CURL_WAIT_POLLIN;
+
+	for (;;) {
+		pthread_mutex_lock(&multi->mutex);
+		stop = multi->stop;
+		cancel = multi->cancel;
+		multi->cancel = false;
+		randle = multi->pending;
+		multi->pending = NULL;
+		pthread_mutex_unlock(&multi->mutex);
+
+		/*
+		 *	rest_multi_free() fails anything still
+		 *	pending once stop is set.
+		 */
+		rad_assert(!stop || !randle);
+
+		for (; randle; randle = next) {
+			next = randle->next;
+
+			mret = curl_multi_add_handle(multi->mandle, randle->handle);
+			if (mret != CURLM_OK) {
+				ERROR("Failed adding transfer: %s", curl_multi_strerror(mret));
+				rest_multi_done(randle, CURLE_FAILED_INIT);
+				continue;
+			}
+
+			randle->prev = NULL;
+			randle->next = multi->active;
+			if (randle->next) randle->next->prev = randle;
+			multi->active = randle;
+		}
+
+		if (stop) break;
+
+		if (cancel) rest_multi_abort(multi);
+
+		mret = curl_multi_perform(multi->mandle, &active);
+		if (mret != CURLM_OK) ERROR("Failed performing transfers: %s", curl_multi_strerror(mret));
+
+		while ((msg = curl_multi_info_read(multi->mandle, &queued))) {
+			CURL		*candle = msg->easy_handle;
+			CURLcode	result = msg->data.result;
+			char		*private = NULL;
+
+			if (msg->msg != CURLMSG_DONE) continue;
+
+			curl_easy_getinfo(candle, CURLINFO_PRIVATE, &private);
+			curl_multi_remove_handle(multi->mandle, candle);
+
+			randle = (rlm_rest_handle_t *)private;
+			rest_multi_active_remove(multi, randle);
+			rest_multi_done(randle, result);
+		}
+
+		/*
+		 *	Sleeps until there's activity on one of the
+		 *	transfers, or a new one is added.
+		 */
+		wakeup.revents = 0;
+		mret = curl_multi_wait(multi->mandle, &wakeup, 1, 1000, NULL);
+		if (mret != CURLM_OK) ERROR("Failed waiting for transfers: %s", curl_multi_strerror(mret));
+
+		if (wakeup.revents) while (read(multi->wakeup[0], buffer, sizeof(buffer)) > 0);
+	}
+
+	while ((randle = multi->active) != NULL) {
+		curl_multi_remove_handle(multi->mandle, randle->handle);
+		rest_multi_active_remove(multi, randle);
+		rest_multi_done(randle, CURLE_ABORTED_BY_CALLBACK);
+	}
+
+	return NULL;
+}
+
+/** Get a handle to perform a transfer with
+ *
+ * Handles for the I/O thread aren't taken from the connection pool, as
+ * they may be released by a different thread to the one which reserved
+ * them.  They don't need to be, either.  All connections are held by
+ * the multi handle, so these are cheap.
+ *
+ * @param[in] instance	configuration data.
+ * @param[in] request	the handle is for.
+ * @return
+ *	- A handle, which must be released with rest_multi_handle_release().
+ *	- NULL on error.
+ */
+void *rest_multi_handle_get(rlm_rest_t *instance, REQUEST *request)
+{
+	rest_multi_t		*multi = instance->multi;
+	rlm_rest_handle_t	*randle;
+	CURL			*candle;
+
+	pthread_mutex_lock(&multi->mutex);
+	randle = multi->idle;
+	if (randle) multi->idle = randle->next;
+	pthread_mutex_unlock(&multi->mutex);
+
+	if (!randle) {
+		candle = curl_easy_init();
+		if (!candle) {
+			REDEBUG("Failed to create CURL handle");
+			return NULL;
+		}
+
+		/*
+		 *	Not parented by the multi handle, as handles
+		 *	are created by many threads at once.
+		 */
+		randle = rest_handle_alloc(NULL, instance, candle);
+		if (!randle) {
+			curl_easy_cleanup(candle);
+			REDEBUG("Out of memory");
+			return NULL;
+		}
+		randle->multi = multi;
+	}
+
+	randle->next = NULL;
+	randle->cancelled = false;
+
+	return randle;
+}
+
+/** Release a handle returned by rest_multi_handle_get()
+ *
+ * May be called by any thread.
+ *
+ * @param[in] handle	to release.
+ */
+void rest_multi_handle_release(void *handle)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rest_multi_t		*multi = randle->multi;
+
+	pthread_mutex_lock(&multi->mutex);
+	randle->next = multi->idle;
+	multi->idle = randle;
+	pthread_mutex_unlock(&multi->mutex);
+}
+
+/** Abort a transfer being performed by the I/O thread
+ *
+ * Called by modcall_cancel_all() when the server is stopping.  The I/O
+ * thread fails the transfer, and signals the request as usual.
+ *
+ * @param[in] request	waiting for the transfer.
+ * @param[in] handle	the transfer is being performed with.
+ */
+void rest_multi_cancel(UNUSED REQUEST *request, void *handle)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rest_multi_t		*multi = randle->multi;
+
+	pthread_mutex_lock(&multi->mutex);
+	randle->cancelled = true;
+	multi->cancel = true;
+	pthread_mutex_unlock(&multi->mutex);
+
+	if (write(multi->wakeup[1], "", 1) < 0) {
+		/* nothing */
+	}
+}
+
+/** Have the I/O thread perform a transfer
+ *
+ * The caller must already have called modcall_yield().  When the transfer
+ * completes, its result is stored in the handle, and the request is
+ * signalled.  Until then, the handle belongs to the I/O thread.
+ *
+ * @param[in] instance	configuration data.
+ * @param[in] request	waiting for the transfer.
+ * @param[in] handle	to perform the transfer with.
+ * @return
+ *	- 0 if the transfer was queued.
+ *	- -1 if the I/O thread is stopping.  The request won't be signalled.
+ */
+int rest_multi_perform(rlm_rest_t const *instance, REQUEST *request, void *handle)
+{
+	rest_multi_t		*multi = instance->multi;
+	rlm_rest_handle_t	*randle = handle;
+	CURLcode		ret;
+
+	ret = curl_easy_setopt(randle->handle, CURLOPT_PRIVATE, (char *)randle);
+	if (ret != CURLE_OK) {
+		REDEBUG("Failed setting private data: %s", curl_easy_strerror(ret));
+		return -1;
+	}
+
+	randle->request = request;
+	randle->result = CURLE_OK;
+
+	pthread_mutex_lock(&multi->mutex);
+	if (multi->stop) {
+		pthread_mutex_unlock(&multi->mutex);
+		randle->request = NULL;
+		REDEBUG("Not performing transfer, the I/O thread is stopping");
+		return -1;
+	}
+	randle->next = multi->pending;
+	multi->pending = randle;
+	if (randle->cancelled) multi->cancel = true;
+	pthread_mutex_unlock(&multi->mutex);
+
+	/*
+	 *	If the pipe is full, the I/O thread already has
+	 *	a wakeup to read.
+	 */
+	if (write(multi->wakeup[1], "", 1) < 0) {
+		/* nothing */
+	}
+
+	return 0;
+}
+
+/** Create the shared multi handle, and start the I/O thread
+ *
+ * @param[in] inst rlm_rest instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rest_multi_init(rlm_rest_t *inst)
+{
+	rest_multi_t	*multi;
+	int		rcode;
+
+	multi = talloc_zero(inst, rest_multi_t);
+	if (!multi) return -1;
+
+	multi->inst = inst;
+	multi->wakeup[0] = multi->wakeup[1] = -1;
+	pthread_mutex_init(&multi->mutex, NULL);
+	inst->multi = multi;
+
+	multi->mandle = curl_multi_init();
+	if (!multi->mandle) {
+		ERROR("Failed creating multi handle");
+	error:
+		rest_multi_free(inst);
+		return -1;
+	}
+
+	if (inst->multi_config.max_host_connections) {
+#if LIBCURL_VERSION_NUM >= 0x071e00
+		curl_multi_setopt(multi->mandle, CURLMOPT_MAX_HOST_CONNECTIONS,
+				  (long)inst->multi_config.max_host_connections);
+#else
+		WARN("Ignoring max_host_connections, libcurl is too old (needs >= 7.30.0)");
+#endif
+	}
+
+	if (inst->multi_config.http2) {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+		curl_multi_setopt(multi->mandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#else
+		WARN("Ignoring http2, libcurl is too old (needs >= 7.47.0)");
+#endif
+	}
+
+	if (pipe(multi->wakeup) < 0) {
+		multi->wakeup[0] = multi->wakeup[1] = -1;
+		ERROR("Failed creating wakeup pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+	if ((fr_nonblock(multi->wakeup[0]) < 0) || (fr_nonblock(multi->wakeup[1]) < 0)) {
+		ERROR("Failed setting wakeup pipe to non-blocking: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	rcode = pthread_create(&multi->thread, NULL, rest_multi_thread, multi);
+	if (rcode != 0) {
+		ERROR("Failed creating I/O thread: %s", fr_syserror(rcode));
+		goto error;
+	}
+	multi->running = true;
+
+	DEBUG("Performing transfers from a dedicated I/O thread");
+
+	return 0;
+}
+
+/** Stop the I/O thread, and free the shared multi handle
+ *
+ * @param[in] inst rlm_rest instance.
+ */
+void rest_multi_free(rlm_rest_t *inst)
+{
+	rest_multi_t		*multi = inst->multi;
+	rlm_rest_handle_t	*randle, *next;
+
+	if (!multi) return;
+
+	/*
+	 *	Refuse new transfers, and fail the ones which
+	 *	haven't been started, so that the requests waiting
+	 *	for them release their handles.  The I/O thread
+	 *	fails the ones it has started before exiting.
+	 */
+	pthread_mutex_lock(&multi->mutex);
+	multi->stop = true;
+	randle = multi->pending;
+	multi->pending = NULL;
+	pthread_mutex_unlock(&multi->mutex);
+
+	for (; randle; randle = next) {
+		next = randle->next;
+		rest_multi_done(randle, CURLE_ABORTED_BY_CALLBACK);
+	}
+
+	if (multi->running) {
+		if (write(multi->wakeup[1], "", 1) < 0) {
+			/* nothing */
+		}
+
+		pthread_join(multi->thread, NULL);
+	}
+
+	while ((randle = multi->idle) != NULL) {
+		multi->idle = randle->next;
+		talloc_free(randle);
+	}
+
+	if (multi->wakeup[0] >= 0) close(multi->wakeup[0]);
+	if (multi->wakeup[1] >= 0) close(multi->wakeup[1]);
+	if (multi->mandle) curl_multi_cleanup(multi->mandle);
+	pthread_mutex_destroy(&multi->mutex);
+
+	inst->multi = NULL;
+	talloc_free(multi);
+}
+#endif
+
+
 /** Creates a new connection handle for use by the FR connection API.
  *
  * Matches the fr_connection_create_t function prototype, is passed to
@@ -337,7 +797,6 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	rlm_rest_t *inst = instance;
 
 	rlm_rest_handle_t	*randle = NULL;
-	rlm_rest_curl_context_t	*curl_ctx = NULL;
 
 	CURL *candle = curl_easy_init();
 
@@ -379,15 +838,8 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	/*
 	 *  Allocate memory for the connection handle abstraction.
 	 */
-	randle = talloc_zero(ctx, rlm_rest_handle_t);
-	curl_ctx = talloc_zero(randle, rlm_rest_curl_context_t);
-
-	curl_ctx->headers = NULL; /* CURL needs this to be NULL */
-	curl_ctx->request.instance = inst;
-
-	randle->ctx = curl_ctx;
-	randle->handle = candle;
-	talloc_set_destructor(randle, _mod_conn_free);
+	randle = rest_handle_alloc(ctx, inst, candle);
+	if (!randle) goto connection_error;
 
 	/*
 	 *  Clear any previously configured options for the first request.
@@ -2025,6 +2477,18 @@ int rest_request_config(rlm_rest_t const *instance, rlm_rest_section_t *section,
 	SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
 #endif
 
+#if defined(HAVE_REST_MULTI) && (LIBCURL_VERSION_NUM >= 0x072f00)
+	/*
+	 *	Use HTTP/2 where the server supports it (negotiated
+	 *	with ALPN), and wait for an existing connection to
+	 *	the server, instead of opening another one.
+	 */
+	if (instance->multi && instance->multi_config.http2) {
+		SET_OPTION(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+	}
+#endif
+
 	/*
 	 *	FreeRADIUS custom headers
 	 */
@@ -2337,17 +2801,29 @@ int rest_request_perform(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_sect
 			 REQUEST *request, void *handle)
 {
 	rlm_rest_handle_t	*randle = handle;
-	CURL			*candle = randle->handle;
-	CURLcode		ret;
 
-	ret = curl_easy_perform(candle);
-	if (ret != CURLE_OK) {
-		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
+	randle->result = curl_easy_perform(randle->handle);
 
-		return -1;
-	}
+	return rest_request_result(request, handle);
+}
 
-	return 0;
+/** Check the result of the last transfer
+ *
+ * @param[in] request Current request.
+ * @param[in] handle the transfer was performed with.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rest_request_result(REQUEST *request, void *handle)
+{
+	rlm_rest_handle_t	*randle = handle;
+
+	if (randle->result == CURLE_OK) return 0;
+
+	REDEBUG("Request failed: %i - %s", randle->result, curl_easy_strerror(randle->result));
+
+	return -1;
 }
 
 /** Sends the response to the correct decode function.
@@ -31,6 +31,13 @@ RCSIDH(other_h, "$Id$")
 #define CURL_NO_OLDIES 1
 #include <curl/curl.h>
 
+/*
+ *	The I/O thread needs curl_multi_wait(), which was added in 7.28.0
+ */
+#if defined(HAVE_PTHREAD_H) && (LIBCURL_VERSION_NUM >= 0x071c00)
+#  define HAVE_REST_MULTI 1
+#endif
+
 /*
  *	The common JSON library (also tells us if we have json-c)
  */
@@ -139,6 +146,17 @@ typedef struct rlm_rest_section_t {
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
 } rlm_rest_section_t;
 
+/*
+ *	Configuration for the shared multi handle
+ */
+typedef struct rlm_rest_multi_config_t {
+	bool			enable;		//!< Perform transfers from a dedicated I/O thread.
+	bool			http2;		//!< Negotiate HTTP/2 and multiplex transfers.
+	uint32_t		max_host_connections;	//!< Maximum connections per host, 0 for no limit.
+} rlm_rest_multi_config_t;
+
+typedef struct rest_multi rest_multi_t;
+
 /*
  *	Structure for module configuration
  */
@@ -152,6 +170,10 @@ typedef struct rlm_rest_t {
 
 	fr_connection_pool_t	*pool;		//!< Pointer to the connection pool.
 
+	rlm_rest_multi_config_t	multi_config;	//!< Configuration for the shared multi handle.
+	rest_multi_t		*multi;		//!< Shared multi handle, or NULL if transfers are
+						//!< performed by the request thread.
+
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
 	rlm_rest_section_t	accounting;	//!< Configuration specific to accounting.
@@ -236,6 +258,16 @@ typedef struct rlm_rest_curl_context_t {
 typedef struct rlm_rest_handle_t {
 	void			*handle;	//!< Real Handle.
 	rlm_rest_curl_context_t	*ctx;		//!< Context.
+	CURLcode		result;		//!< Result of the last transfer.
+#ifdef HAVE_REST_MULTI
+	rest_multi_t		*multi;		//!< Multi handle this handle belongs to, if it's
+						//!< not from the connection pool.
+	REQUEST			*request;	//!< Waiting for the I/O thread to perform the transfer.
+	bool			cancelled;	//!< The transfer should be aborted.
+	struct rlm_rest_handle_t *prev;		//!< Previous transfer in the I/O thread's active list.
+	struct rlm_rest_handle_t *next;		//!< Next transfer in the pending or active list,
+						//!< or next handle in the idle list.
+#endif
 } rlm_rest_handle_t;
 
 /*
@@ -252,6 +284,12 @@ int rest_init(rlm_rest_t *instance);
 
 void rest_cleanup(void);
 
+#ifdef HAVE_REST_MULTI
+int rest_multi_init(rlm_rest_t *instance);
+
+void rest_multi_free(rlm_rest_t *instance);
+#endif
+
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 
 int mod_conn_alive(void *instance, void *handle);
@@ -269,6 +307,18 @@ int rest_request_perform(rlm_rest_t const *instance,
 			 rlm_rest_section_t *section, REQUEST *request,
 			 void *handle);
 
+#ifdef HAVE_REST_MULTI
+void *rest_multi_handle_get(rlm_rest_t *instance, REQUEST *request);
+
+void rest_multi_handle_release(void *handle);
+
+int rest_multi_perform(rlm_rest_t const *instance, REQUEST *request, void *handle);
+
+void rest_multi_cancel(REQUEST *request, void *handle);
+#endif
+
+int rest_request_result(REQUEST *request, void *handle);
+
 int rest_response_decode(rlm_rest_t const *instance,
 			UNUSED rlm_rest_section_t *section, REQUEST *request,
 			void *handle);
@@ -78,15 +78,98 @@ static const CONF_PARSER section_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER multi_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_rest_t, multi_config.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("http2", PW_TYPE_BOOLEAN, rlm_rest_t, multi_config.http2), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_host_connections", PW_TYPE_INTEGER, rlm_rest_t, multi_config.max_host_connections), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("connect_uri", PW_TYPE_STRING, rlm_rest_t, connect_uri) },
 	{ FR_CONF_DEPRECATED("connect_timeout", PW_TYPE_TIMEVAL, rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", PW_TYPE_STRING, rlm_rest_t, connect_proxy) },
+	{ FR_CONF_POINTER("multi", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) multi_config },
 	CONF_PARSER_TERMINATOR
 };
 
-static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, void *handle, REQUEST *request,
-			    char const *username, char const *password)
+static void rlm_rest_cleanup(rlm_rest_t const *instance, rlm_rest_section_t *section, void *handle)
+{
+	rest_request_cleanup(instance, section, handle);
+}
+
+/*
+ *	Get a handle for a module call.  Handles for transfers done by
+ *	the I/O thread don't come from the connection pool, as they're
+ *	released by whichever thread resumes the request.
+ */
+static void *rlm_rest_handle_get(rlm_rest_t *instance, REQUEST *request)
+{
+#ifdef HAVE_REST_MULTI
+	if (instance->multi) return rest_multi_handle_get(instance, request);
+#endif
+
+	return fr_connection_get(instance->pool, request);
+}
+
+static void rlm_rest_handle_release(rlm_rest_t const *instance, REQUEST *request, void *handle)
+{
+#ifdef HAVE_REST_MULTI
+	if (instance->multi) {
+		rest_multi_handle_release(handle);
+		return;
+	}
+#endif
+
+	fr_connection_release(instance->pool, request, handle);
+}
+
+/*
+ *	Check the transfer succeeded, and record the HTTP status code
+ *	in the request.
+ */
+static int rlm_rest_response(REQUEST *request, void *handle)
+{
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	**list;
+	int		code;
+	value_data_t	value;
+
+	if (rest_request_result(request, handle) < 0) return -1;
+
+	code = rest_get_handle_code(handle);
+
+	RINDENT();
+	RDEBUG2("&REST-HTTP-Code := %i", code);
+	REXDENT();
+
+	value.length = sizeof(value.integer);
+	value.integer = code;
+
+	/*
+	 *	Find the reply list, and appropriate context in the
+	 *	current request.
+	 */
+	RADIUS_LIST_AND_CTX(ctx, list, request, REQUEST_CURRENT, PAIR_LIST_REQUEST);
+	if (!list || (fr_pair_update_by_num(ctx, list, 0, PW_REST_HTTP_STATUS_CODE, TAG_ANY, PW_TYPE_INTEGER,
+					    &value) < 0)) {
+		REDEBUG("Failed updating &REST-HTTP-Code");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Configure the transfer, and start it.
+ *
+ *	If transfers are performed by the I/O thread, the request yields
+ *	until it has completed.  Otherwise the transfer is performed now,
+ *	and resume is called directly.  Either way, resume is responsible
+ *	for releasing the handle.
+ */
+static rlm_rcode_t rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, void *handle, REQUEST *request,
+				    char const *username, char const *password, modcall_resume_t resume)
 {
 	ssize_t	uri_len;
 	char	*uri = NULL;
@@ -100,7 +183,7 @@ static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, v
 	 *  request attributes.
 	 */
 	uri_len = rest_uri_build(&uri, instance, request, section->uri);
-	if (uri_len <= 0) return -1;
+	if (uri_len <= 0) goto error;
 
 	RDEBUG("Sending HTTP %s to \"%s\"", fr_int2str(http_method_table, section->method, NULL), uri);
 
@@ -111,48 +194,38 @@ static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, v
 	ret = rest_request_config(instance, section, request, handle, section->method, section->body,
 				  uri, username, password);
 	talloc_free(uri);
-	if (ret < 0) return -1;
+	if (ret < 0) goto error;
+
+#ifdef HAVE_REST_MULTI
+	/*
+	 *  Hand the transfer to the I/O thread, and give up this
+	 *  thread until it has completed.
+	 */
+	if (instance->multi) {
+		if (modcall_yield(request, resume, rest_multi_cancel, handle) != RLM_MODULE_YIELD) goto error;
+		if (rest_multi_perform(instance, request, handle) < 0) goto error;
+
+		return RLM_MODULE_YIELD;
+	}
+#endif
 
 	/*
 	 *  Send the CURL request, pre-parse headers, aggregate incoming
 	 *  HTTP body data into a single contiguous buffer.
 	 */
 	ret = rest_request_perform(instance, section, request, handle);
-	if (ret < 0) return -1;
-
-	{
-		TALLOC_CTX	*ctx;
-		VALUE_PAIR	**list;
-		int		code;
-		value_data_t	value;
-
-		code = rest_get_handle_code(handle);
+	if (ret < 0) goto error;
 
-		RINDENT();
-		RDEBUG2("&REST-HTTP-Code := %i", code);
-		REXDENT();
+	return resume(request, instance, handle);
 
-		value.length = sizeof(value.integer);
-		value.integer = code;
+error:
+	rest_response_error(request, handle);
 
-		/*
-		 *	Find the reply list, and appropriate context in the
-		 *	current request.
-		 */
-		RADIUS_LIST_AND_CTX(ctx, list, request, REQUEST_CURRENT, PAIR_LIST_REQUEST);
-		if (!list || (fr_pair_update_by_num(ctx, list, 0, PW_REST_HTTP_STATUS_CODE, TAG_ANY, PW_TYPE_INTEGER,
-						    &value) < 0)) {
-			REDEBUG("Failed updating &REST-HTTP-Code");
-			return -1;
-		}
-	}
+	rlm_rest_cleanup(instance, section, handle);
 
-	return 0;
-}
+	rlm_rest_handle_release(instance, request, handle);
 
-static void rlm_rest_cleanup(rlm_rest_t const *instance, rlm_rest_section_t *section, void *handle)
-{
-	rest_request_cleanup(instance, section, handle);
+	return RLM_MODULE_FAIL;
 }
 
 static ssize_t jsonquote_xlat(char **out, size_t outlen,
@@ -366,27 +439,18 @@ finish:
 }
 
 /*
- *	Find the named user in this modules database.  Create the set
- *	of attribute-value pairs to check and reply with for this user
- *	from the database. The authentication code only needs to check
- *	the password, the rest is done here.
+ *	Process the response to the authorize transfer.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *request)
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, void *handle)
 {
 	rlm_rest_t *inst = instance;
 	rlm_rest_section_t *section = &inst->authorize;
 
-	void *handle;
 	int hcode;
 	int rcode = RLM_MODULE_OK;
 	int ret;
 
-	if (!section->name) return RLM_MODULE_NOOP;
-
-	handle = fr_connection_get(inst->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
-
-	ret = rlm_rest_perform(instance, section, handle, request, NULL, NULL);
+	ret = rlm_rest_response(request, handle);
 	if (ret < 0) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -449,49 +513,47 @@ finish:
 		break;
 	}
 
-	rlm_rest_cleanup(instance, section, handle);
+	rlm_rest_cleanup(inst, section, handle);
 
-	fr_connection_release(inst->pool, request, handle);
+	rlm_rest_handle_release(inst, request, handle);
 
 	return rcode;
 }
 
 /*
- *	Authenticate the user with the given password.
+ *	Find the named user in this modules database.  Create the set
+ *	of attribute-value pairs to check and reply with for this user
+ *	from the database. The authentication code only needs to check
+ *	the password, the rest is done here.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *request)
 {
 	rlm_rest_t *inst = instance;
-	rlm_rest_section_t *section = &inst->authenticate;
+	rlm_rest_section_t *section = &inst->authorize;
 
 	void *handle;
-	int hcode;
-	int rcode = RLM_MODULE_OK;
-	int ret;
-
-	VALUE_PAIR const *username;
-	VALUE_PAIR const *password;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	username = request->username;
-	if (!request->username) {
-		REDEBUG("Can't perform authentication, 'User-Name' attribute not found in the request");
+	handle = rlm_rest_handle_get(inst, request);
+	if (!handle) return RLM_MODULE_FAIL;
 
-		return RLM_MODULE_INVALID;
-	}
+	return rlm_rest_perform(inst, section, handle, request, NULL, NULL, mod_authorize_resume);
+}
 
-	password = request->password;
-	if (!password ||
-	    (password->da->attr != PW_USER_PASSWORD)) {
-		REDEBUG("You set 'Auth-Type = REST' for a request that does not contain a User-Password attribute!");
-		return RLM_MODULE_INVALID;
-	}
+/*
+ *	Process the response to the authenticate transfer.
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, void *handle)
+{
+	rlm_rest_t *inst = instance;
+	rlm_rest_section_t *section = &inst->authenticate;
 
-	handle = fr_connection_get(inst->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
+	int hcode;
+	int rcode = RLM_MODULE_OK;
+	int ret;
 
-	ret = rlm_rest_perform(instance, section, handle, request, username->vp_strvalue, password->vp_strvalue);
+	ret = rlm_rest_response(request, handle);
 	if (ret < 0) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -554,32 +616,62 @@ finish:
 		break;
 	}
 
-	rlm_rest_cleanup(instance, section, handle);
+	rlm_rest_cleanup(inst, section, handle);
 
-	fr_connection_release(inst->pool, request, handle);
+	rlm_rest_handle_release(inst, request, handle);
 
 	return rcode;
 }
 
 /*
- *	Send accounting info to a REST API endpoint
+ *	Authenticate the user with the given password.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *request)
 {
 	rlm_rest_t *inst = instance;
-	rlm_rest_section_t *section = &inst->accounting;
+	rlm_rest_section_t *section = &inst->authenticate;
 
 	void *handle;
-	int hcode;
-	int rcode = RLM_MODULE_OK;
-	int ret;
+
+	VALUE_PAIR const *username;
+	VALUE_PAIR const *password;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	handle = fr_connection_get(inst->pool, request);
+	username = request->username;
+	if (!request->username) {
+		REDEBUG("Can't perform authentication, 'User-Name' attribute not found in the request");
+
+		return RLM_MODULE_INVALID;
+	}
+
+	password = request->password;
+	if (!password ||
+	    (password->da->attr != PW_USER_PASSWORD)) {
+		REDEBUG("You set 'Auth-Type = REST' for a request that does not contain a User-Password attribute!");
+		return RLM_MODULE_INVALID;
+	}
+
+	handle = rlm_rest_handle_get(inst, request);
 	if (!handle) return RLM_MODULE_FAIL;
 
-	ret = rlm_rest_perform(inst, section, handle, request, NULL, NULL);
+	return rlm_rest_perform(inst, section, handle, request, username->vp_strvalue, password->vp_strvalue,
+				mod_authenticate_resume);
+}
+
+/*
+ *	Process the response to the accounting transfer.
+ */
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *handle)
+{
+	rlm_rest_t *inst = instance;
+	rlm_rest_section_t *section = &inst->accounting;
+
+	int hcode;
+	int rcode = RLM_MODULE_OK;
+	int ret;
+
+	ret = rlm_rest_response(request, handle);
 	if (ret < 0) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -612,30 +704,42 @@ finish:
 
 	rlm_rest_cleanup(inst, section, handle);
 
-	fr_connection_release(inst->pool, request, handle);
+	rlm_rest_handle_release(inst, request, handle);
 
 	return rcode;
 }
 
 /*
- *	Send post-auth info to a REST API endpoint
+ *	Send accounting info to a REST API endpoint
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
 {
 	rlm_rest_t *inst = instance;
-	rlm_rest_section_t *section = &inst->post_auth;
+	rlm_rest_section_t *section = &inst->accounting;
 
 	void *handle;
-	int hcode;
-	int rcode = RLM_MODULE_OK;
-	int ret;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	handle = fr_connection_get(inst->pool, request);
+	handle = rlm_rest_handle_get(inst, request);
 	if (!handle) return RLM_MODULE_FAIL;
 
-	ret = rlm_rest_perform(inst, section, handle, request, NULL, NULL);
+	return rlm_rest_perform(inst, section, handle, request, NULL, NULL, mod_accounting_resume);
+}
+
+/*
+ *	Process the response to the post-auth transfer.
+ */
+static rlm_rcode_t mod_post_auth_resume(REQUEST *request, void *instance, void *handle)
+{
+	rlm_rest_t *inst = instance;
+	rlm_rest_section_t *section = &inst->post_auth;
+
+	int hcode;
+	int rcode = RLM_MODULE_OK;
+	int ret;
+
+	ret = rlm_rest_response(request, handle);
 	if (ret < 0) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -668,11 +772,29 @@ finish:
 
 	rlm_rest_cleanup(inst, section, handle);
 
-	fr_connection_release(inst->pool, request, handle);
+	rlm_rest_handle_release(inst, request, handle);
 
 	return rcode;
 }
 
+/*
+ *	Send post-auth info to a REST API endpoint
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *request)
+{
+	rlm_rest_t *inst = instance;
+	rlm_rest_section_t *section = &inst->post_auth;
+
+	void *handle;
+
+	if (!section->name) return RLM_MODULE_NOOP;
+
+	handle = rlm_rest_handle_get(inst, request);
+	if (!handle) return RLM_MODULE_FAIL;
+
+	return rlm_rest_perform(inst, section, handle, request, NULL, NULL, mod_post_auth_resume);
+}
+
 static int parse_sub_section(CONF_SECTION *parent, rlm_rest_section_t *config, rlm_components_t comp)
 {
 	CONF_SECTION *cs;
@@ -859,6 +981,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, mod_conn_alive, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (inst->multi_config.enable) {
+#ifdef HAVE_REST_MULTI
+		if (rest_multi_init(inst) < 0) return -1;
+#else
+		WARN("Ignoring multi, the server was built without threads, or libcurl is too old (needs >= 7.28.0)");
+#endif
+	}
+
 	return 0;
 }
 
@@ -870,6 +1000,9 @@ static int mod_detach(void *instance)
 {
 	rlm_rest_t *inst = instance;
 
+#ifdef HAVE_REST_MULTI
+	rest_multi_free(inst);
+#endif
 	fr_connection_pool_free(inst->pool);
 
 	/* Free any memory used by libcurl */
@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include <sys/stat.h>
+#include <ctype.h>
 
 #include "config.h"
 
@@ -64,11 +65,32 @@ static const FR_NAME_NUMBER server_warnings_table[] = {
 	{ NULL, 0 }
 };
 
+#if (MYSQL_VERSION_ID >= 40100)
+/** A prepared statement, and the binds used to execute it
+ *
+ */
+typedef struct rlm_sql_mysql_stmt {
+	MYSQL_STMT	*stmt;
+	MYSQL_BIND	*param;			//!< Parameter binds.
+	long long	*integer;		//!< Values of the integer parameters.
+
+	unsigned int	num_fields;		//!< Number of columns, 0 if the statement returns no rows.
+	MYSQL_RES	*metadata;		//!< Column names.
+	MYSQL_BIND	*result;		//!< Zero length result binds, used to find the length
+						//!< of each column before fetching it.
+	unsigned long	*length;		//!< Length of each column in the current row.
+	my_bool		*is_null;		//!< Whether each column in the current row is NULL.
+} rlm_sql_mysql_stmt_t;
+#endif
+
 typedef struct rlm_sql_mysql_conn {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
 	rlm_sql_row_t	row;
+#if (MYSQL_VERSION_ID >= 40100)
+	rlm_sql_mysql_stmt_t	*stmt;		//!< Prepared statement the current result belongs to.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct rlm_sql_mysql_config {
@@ -111,6 +133,12 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Prepared statements are closed before the
+	 *	connection they were prepared on.
+	 */
+	talloc_free_children(conn);
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -391,6 +419,10 @@ static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *con
 	int num = 0;
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) return conn->stmt->num_fields;
+#endif
+
 #if MYSQL_VERSION_ID >= 32224
 	/*
 	 *	Count takes a connection handle
@@ -429,10 +461,218 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	return rcode;
 }
 
+#if (MYSQL_VERSION_ID >= 40100)
+static int _sql_stmt_destructor(rlm_sql_mysql_stmt_t *stmt)
+{
+	if (stmt->metadata) mysql_free_result(stmt->metadata);
+	mysql_stmt_close(stmt->stmt);
+
+	return 0;
+}
+
+/*
+ *	Prepared statements are kept until the socket is closed.
+ */
+static sql_rcode_t sql_prepare(void **out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       char const *query, UNUSED sql_param_type_t const type[], int num_params)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	*stmt;
+	sql_rcode_t		rcode;
+	char			*mysql_query, *q;
+	char const		*p;
+	char			quote = '\0';
+	unsigned int		i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *	The parameters are numbered in the order they
+	 *	appear in the query, so they can be replaced
+	 *	with MySQL's positional placeholders.
+	 */
+	MEM(mysql_query = q = talloc_array(conn, char, strlen(query) + 1));
+	for (p = query; *p; p++) {
+		if (quote) {
+			if ((*p == '\\') && p[1]) {
+				*q++ = *p++;
+			} else if (*p == quote) {
+				quote = '\0';
+			}
+		} else if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+			quote = *p;
+		} else if ((*p == '$') && isdigit((uint8_t) p[1])) {
+			while (isdigit((uint8_t) p[1])) p++;
+			*q++ = '?';
+			continue;
+		}
+		*q++ = *p;
+	}
+	*q = '\0';
+
+	MEM(stmt = talloc_zero(conn, rlm_sql_mysql_stmt_t));
+	stmt->stmt = mysql_stmt_init(conn->sock);
+	if (!stmt->stmt) {
+		talloc_free(stmt);
+		talloc_free(mysql_query);
+		return sql_check_error(conn->sock, CR_OUT_OF_MEMORY);
+	}
+	talloc_set_destructor(stmt, _sql_stmt_destructor);
+
+	if (mysql_stmt_prepare(stmt->stmt, mysql_query, strlen(mysql_query)) != 0) {
+		ERROR("Failed preparing statement: %s", mysql_stmt_error(stmt->stmt));
+		rcode = sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+		talloc_free(stmt);
+		talloc_free(mysql_query);
+		return rcode;
+	}
+	talloc_free(mysql_query);
+
+	if (mysql_stmt_param_count(stmt->stmt) != (unsigned long) num_params) {
+		ERROR("Prepared statement has %lu parameters, expected %i",
+		      (unsigned long) mysql_stmt_param_count(stmt->stmt), num_params);
+		talloc_free(stmt);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	MEM(stmt->param = talloc_zero_array(stmt, MYSQL_BIND, num_params + 1));
+	MEM(stmt->integer = talloc_zero_array(stmt, long long, num_params + 1));
+
+	/*
+	 *	Columns are bound with zero length buffers, so
+	 *	only their lengths are retrieved when a row is
+	 *	fetched.  sql_stmt_fetch_row() then fetches each
+	 *	column into a buffer of the right size.
+	 */
+	stmt->metadata = mysql_stmt_result_metadata(stmt->stmt);
+	if (stmt->metadata) {
+		stmt->num_fields = mysql_num_fields(stmt->metadata);
+
+		MEM(stmt->result = talloc_zero_array(stmt, MYSQL_BIND, stmt->num_fields));
+		MEM(stmt->length = talloc_zero_array(stmt, unsigned long, stmt->num_fields));
+		MEM(stmt->is_null = talloc_zero_array(stmt, my_bool, stmt->num_fields));
+
+		for (i = 0; i < stmt->num_fields; i++) {
+			stmt->result[i].buffer_type = MYSQL_TYPE_STRING;
+			stmt->result[i].length = &stmt->length[i];
+			stmt->result[i].is_null = &stmt->is_null[i];
+		}
+	}
+
+	*out = stmt;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, void *prepared,
+			       sql_param_type_t const type[], char const * const param[], int num_params)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	*stmt = prepared;
+	int			i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	for (i = 0; i < num_params; i++) {
+		MYSQL_BIND *bind = &stmt->param[i];
+
+		if (!param[i]) {
+			bind->buffer_type = MYSQL_TYPE_NULL;
+			bind->buffer = NULL;
+			bind->buffer_length = 0;
+
+		} else if (type[i] == SQL_PARAM_INTEGER) {
+			stmt->integer[i] = strtoll(param[i], NULL, 10);
+			bind->buffer_type = MYSQL_TYPE_LONGLONG;
+			bind->buffer = &stmt->integer[i];
+			bind->buffer_length = sizeof(stmt->integer[i]);
+
+		} else {
+			bind->buffer_type = MYSQL_TYPE_STRING;
+			memcpy(&bind->buffer, &param[i], sizeof(bind->buffer));	/* Input only, drop the const */
+			bind->buffer_length = strlen(param[i]);
+		}
+	}
+
+	/*
+	 *	Errors are retrieved from the statement, and the
+	 *	result is read through it.
+	 */
+	conn->stmt = stmt;
+
+	if (mysql_stmt_bind_param(stmt->stmt, stmt->param) != 0) goto error;
+	if (mysql_stmt_execute(stmt->stmt) != 0) goto error;
+
+	if (stmt->num_fields == 0) return RLM_SQL_OK;
+
+	if (mysql_stmt_bind_result(stmt->stmt, stmt->result) != 0) goto error;
+	if (mysql_stmt_store_result(stmt->stmt) != 0) goto error;
+
+	return RLM_SQL_OK;
+
+error:
+	return sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+}
+
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	*stmt = conn->stmt;
+	rlm_sql_row_t		row;
+	unsigned int		i;
+	int			ret;
+
+	TALLOC_FREE(conn->row);
+	handle->row = NULL;
+
+	ret = mysql_stmt_fetch(stmt->stmt);
+	if (ret == MYSQL_NO_DATA) return RLM_SQL_OK;
+
+	/*
+	 *	Every non-empty column is truncated, as the
+	 *	result buffers are zero length.
+	 */
+	if ((ret != 0) && (ret != MYSQL_DATA_TRUNCATED)) {
+		return sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+	}
+
+	MEM(row = talloc_zero_array(conn, char *, stmt->num_fields + 1));
+	for (i = 0; i < stmt->num_fields; i++) {
+		MYSQL_BIND column;
+
+		if (stmt->is_null[i]) continue;
+
+		memset(&column, 0, sizeof(column));
+		column.buffer_type = MYSQL_TYPE_STRING;
+		column.buffer_length = stmt->length[i] + 1;
+		MEM(column.buffer = row[i] = talloc_zero_array(row, char, column.buffer_length));
+
+		if (mysql_stmt_fetch_column(stmt->stmt, &column, i, 0) != 0) {
+			talloc_free(row);
+			return sql_check_error(conn->sock, mysql_stmt_errno(stmt->stmt));
+		}
+	}
+
+	*out = handle->row = conn->row = row;
+
+	return RLM_SQL_OK;
+}
+#endif
+
 static int sql_num_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) return mysql_stmt_num_rows(conn->stmt->stmt);
+#endif
+
 	if (conn->result) {
 		return mysql_num_rows(conn->result);
 	}
@@ -460,6 +700,11 @@ static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, rlm_
 	 *	https://bugs.mysql.com/bug.php?id=32318
 	 * 	Hints that we don't have to free field_info.
 	 */
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) {
+		field_info = mysql_fetch_fields(conn->stmt->metadata);
+	} else
+#endif
 	field_info = mysql_fetch_fields(conn->result);
 	if (!field_info) return RLM_SQL_ERROR;
 
@@ -479,6 +724,10 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, r
 
 	*out = NULL;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) return sql_stmt_fetch_row(out, handle);
+#endif
+
 	/*
 	 *  Check pointer before de-referencing it.
 	 */
@@ -509,6 +758,15 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) {
+		TALLOC_FREE(conn->row);
+		handle->row = NULL;
+		mysql_stmt_free_result(conn->stmt->stmt);
+		conn->stmt = NULL;
+	}
+#endif
+
 	if (conn->result) {
 		mysql_free_result(conn->result);
 		conn->result = NULL;
@@ -612,6 +870,21 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 
 	error = mysql_error(conn->sock);
 
+#if (MYSQL_VERSION_ID >= 40100)
+	/*
+	 *	Errors from prepared statements are stored in
+	 *	the statement, not the connection.
+	 */
+	if (conn->stmt && (!error || (error[0] == '\0'))) {
+		MYSQL_STMT *stmt = conn->stmt->stmt;
+
+		error = mysql_stmt_error(stmt);
+		if (error && (error[0] != '\0')) {
+			error = talloc_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(stmt), error,
+						mysql_stmt_sqlstate(stmt));
+		}
+	} else
+#endif
 	/*
 	 *	Grab the error now in case it gets cleared on the next operation.
 	 */
@@ -676,6 +949,12 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	int			ret;
 	MYSQL_RES		*result;
 
+	/*
+	 *	Prepared statements return a single result set,
+	 *	which is freed with the statement's result.
+	 */
+	if (conn->stmt) return sql_free_result(handle, config);
+
 	/*
 	 *	If there's no result associated with the
 	 *	connection handle, assume the first result in the
@@ -719,6 +998,10 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt->stmt);
+#endif
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -757,5 +1040,9 @@ rlm_sql_module_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
+#if (MYSQL_VERSION_ID >= 40100)
+	.sql_prepare			= sql_prepare,
+	.sql_execute			= sql_execute,
+#endif
 	.sql_escape_func		= sql_escape_func
 };
@@ -57,6 +57,13 @@ RCSID("$Id$")
 #  define NAMEDATALEN 64
 #endif
 
+/*
+ *	From catalog/pg_type.h, which is only available to the server.
+ */
+#ifndef INT8OID
+#  define INT8OID 20
+#endif
+
 typedef struct rlm_sql_postgres_config {
 	char const	*db_string;
 	bool		send_application_name;
@@ -69,6 +76,7 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	int		num_prepared;	//!< Used to name prepared statements.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -295,28 +303,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/** Set the result fields of the conn struct, and convert the result status to an rcode
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_process_result(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -386,11 +380,94 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	return sql_process_result(conn);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
 }
 
+/*
+ *	Prepared statements live on the server until the connection
+ *	is closed, so all we need to keep is the name.
+ *
+ *	Strings are left for the server to infer the type of, as
+ *	they would be if they were quoted in a text query.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_prepare(void **out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						char const *query, sql_param_type_t const type[], int num_params)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char *name;
+	Oid *types;
+	sql_rcode_t rcode;
+	int i;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	MEM(name = talloc_asprintf(conn, "rlm_sql_%i", conn->num_prepared));
+
+	MEM(types = talloc_zero_array(name, Oid, num_params + 1));
+	for (i = 0; i < num_params; i++) {
+		if (type[i] == SQL_PARAM_INTEGER) types[i] = INT8OID;
+	}
+
+	conn->result = PQprepare(conn->db, name, query, num_params, types);
+	talloc_free(types);
+	rcode = sql_process_result(conn);
+	if (rcode != RLM_SQL_OK) {
+		talloc_free(name);
+		return rcode;
+	}
+	PQclear(conn->result);
+	conn->result = NULL;
+
+	conn->num_prepared++;
+	*out = name;
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull (1, 2, 3, 4)) sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+							     void *stmt, UNUSED sql_param_type_t const type[],
+							     char const * const param[], int num_params)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->result = PQexecPrepared(conn->db, stmt, num_params, param, NULL, NULL, 0);
+
+	return sql_process_result(conn);
+}
+
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -544,5 +621,7 @@ rlm_sql_module_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_prepare			= sql_prepare,
+	.sql_execute			= sql_execute
 };
@@ -53,6 +53,10 @@ typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	bool prepared;			//!< statement is a prepared statement, reset it instead of finalizing it.
+
+	sqlite3_stmt **prepared_stmt;	//!< Prepared statements, finalized when the socket is closed.
+	int num_prepared;
 } rlm_sql_sqlite_conn_t;
 
 typedef struct rlm_sql_sqlite_config {
@@ -501,6 +505,15 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	DEBUG2("Socket destructor called, closing socket");
 
 	if (conn->db) {
+		int i;
+
+		/*
+		 *	sqlite3_close() fails if there are
+		 *	any statements left.
+		 */
+		if (conn->statement && !conn->prepared) (void) sqlite3_finalize(conn->statement);
+		for (i = 0; i < conn->num_prepared; i++) (void) sqlite3_finalize(conn->prepared_stmt[i]);
+
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
 					      sqlite3_errmsg(conn->db));
@@ -616,6 +629,73 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+#ifdef HAVE_SQLITE3_PREPARE_V2
+/*
+ *	sqlite3_prepare_v2() statements are prepared again by SQLite if
+ *	the schema changes, so they can be kept for the life of the socket.
+ */
+static sql_rcode_t sql_prepare(void **out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       char const *query, UNUSED sql_param_type_t const type[], int num_params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sqlite3_stmt		*statement;
+	char const		*z_tail;
+	sql_rcode_t		rcode;
+	int			status;
+
+	status = sqlite3_prepare_v2(conn->db, query, strlen(query), &statement, &z_tail);
+	rcode = sql_check_error(conn->db, status);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	if (sqlite3_bind_parameter_count(statement) != num_params) {
+		ERROR("Prepared statement has %i parameters, expected %i",
+		      sqlite3_bind_parameter_count(statement), num_params);
+		(void) sqlite3_finalize(statement);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	MEM(conn->prepared_stmt = talloc_realloc(conn, conn->prepared_stmt, sqlite3_stmt *, conn->num_prepared + 1));
+	conn->prepared_stmt[conn->num_prepared++] = statement;
+
+	*out = statement;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, void *stmt,
+			       sql_param_type_t const type[], char const * const param[], int num_params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	int			i, status;
+
+	conn->statement = stmt;
+	conn->prepared = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < num_params; i++) {
+		if (!param[i]) {
+			status = sqlite3_bind_null(conn->statement, i + 1);
+		} else if (type[i] == SQL_PARAM_INTEGER) {
+			status = sqlite3_bind_int64(conn->statement, i + 1, strtoll(param[i], NULL, 10));
+		} else {
+			status = sqlite3_bind_text(conn->statement, i + 1, param[i], -1, SQLITE_TRANSIENT);
+		}
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	/*
+	 *	Rows are stepped through by sql_fetch_row(), as
+	 *	for sql_select_query().
+	 */
+	if (sqlite3_column_count(conn->statement) > 0) return RLM_SQL_OK;
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+#endif
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -735,7 +815,13 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		if (conn->prepared) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->prepared = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -810,5 +896,9 @@ rlm_sql_module_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	.sql_prepare			= sql_prepare,
+	.sql_execute			= sql_execute
+#endif
 };
@@ -79,6 +79,19 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER write_behind_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_sql_config_t, write_behind.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("workers", PW_TYPE_INTEGER, rlm_sql_config_t, write_behind.workers), .dflt = "2" },
+	{ FR_CONF_OFFSET("batch_size", PW_TYPE_INTEGER, rlm_sql_config_t, write_behind.batch_size), .dflt = "100" },
+	{ FR_CONF_OFFSET("batch_delay", PW_TYPE_TIMEVAL, rlm_sql_config_t, write_behind.batch_delay), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("queue_size", PW_TYPE_INTEGER, rlm_sql_config_t, write_behind.queue_size), .dflt = "10000" },
+	{ FR_CONF_OFFSET("transaction_start", PW_TYPE_STRING, rlm_sql_config_t, write_behind.transaction_start), .dflt = "BEGIN" },
+	{ FR_CONF_OFFSET("transaction_commit", PW_TYPE_STRING, rlm_sql_config_t, write_behind.transaction_commit), .dflt = "COMMIT" },
+	{ FR_CONF_OFFSET("transaction_rollback", PW_TYPE_STRING, rlm_sql_config_t, write_behind.transaction_rollback), .dflt = "ROLLBACK" },
+	{ FR_CONF_OFFSET("failed_logfile", PW_TYPE_STRING, rlm_sql_config_t, write_behind.failed_logfile) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", PW_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -114,9 +127,13 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", PW_TYPE_INTEGER, rlm_sql_config_t, query_timeout) },
 
+	{ FR_CONF_OFFSET("prepare", PW_TYPE_BOOLEAN, rlm_sql_config_t, prepare), .dflt = "no" },
+
 	{ FR_CONF_POINTER("accounting", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) postauth_config },
+
+	{ FR_CONF_POINTER("write_behind", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) write_behind_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -894,7 +911,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded, NULL);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
@@ -944,7 +961,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded, NULL);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
@@ -984,6 +1001,14 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_t *inst = instance;
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *  Write any queued accounting queries before we close
+	 *  the connections.
+	 */
+	sql_write_behind_free(inst);
+#endif
+
 	if (inst->pool) fr_connection_pool_free(inst->pool);
 
 	/*
@@ -1189,6 +1214,25 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Compile the queries before connecting, as each
+	 *	connection has a slot for every statement.
+	 */
+	if (inst->config->prepare) {
+		if (!inst->module->sql_prepare || !inst->module->sql_execute) {
+			WARN("Ignoring prepare, as %s does not support prepared statements", inst->module->name);
+		} else if ((sql_stmt_compile(inst, &inst->config->accounting) < 0) ||
+			   (sql_stmt_compile(inst, &inst->config->postauth) < 0)) {
+			cf_log_err_cs(conf, "Failed compiling queries");
+			return -1;
+		} else {
+			inst->authorize_check_stmt = sql_stmt_compile_query(inst, "authorize_check_query");
+			inst->authorize_reply_stmt = sql_stmt_compile_query(inst, "authorize_reply_query");
+
+			DEBUG("Compiled %i queries to prepared statements", inst->num_stmts);
+		}
+	}
+
 	/*
 	 *	Initialise the connection pool for this instance
 	 */
@@ -1204,6 +1248,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		}
 	}
 
+	if (inst->config->write_behind.enable) {
+#ifdef HAVE_PTHREAD_H
+		if (!inst->config->accounting.reference_cp) {
+			WARN("Ignoring write_behind as there are no accounting queries");
+		} else if (sql_write_behind_init(inst) < 0) {
+			return -1;
+		}
+#else
+		WARN("Ignoring write_behind as the server was built without threads");
+#endif
+	}
+
 	return RLM_MODULE_OK;
 }
 
@@ -1263,14 +1319,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (radius_axlat(&expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (!inst->authorize_check_stmt &&
+		    (radius_axlat(&expanded, request, inst->config->authorize_check_query,
+				  inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Failed generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded, inst->authorize_check_stmt);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
@@ -1311,14 +1368,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
+		if (!inst->authorize_reply_stmt &&
+		    (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
+				  inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded, inst->authorize_reply_stmt);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
@@ -1480,6 +1538,7 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 	CONF_PAIR 		*pair;
 	char const		*attr = NULL;
 	char const		*value;
+	sql_stmt_t const	*stmt;
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
@@ -1529,6 +1588,13 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 
 	sql_set_user(inst, request, NULL);
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->write_behind && (section == &inst->config->accounting)) {
+		rcode = sql_write_behind_enqueue(inst, request, &handle, section, pair);
+		goto finish;
+	}
+#endif
+
 	while (true) {
 		value = cf_pair_value(pair);
 		if (!value) {
@@ -1538,24 +1604,29 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 			goto finish;
 		}
 
-		if (radius_axlat(&expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+		stmt = sql_stmt_find(inst, pair);
+		if (stmt) {
+			sql_ret = rlm_sql_execute(inst, request, &handle, stmt);
+		} else {
+			if (radius_axlat(&expanded, request, value, inst->sql_escape_func, handle) < 0) {
+				rcode = RLM_MODULE_FAIL;
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		if (!*expanded) {
-			RDEBUG("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
+			if (!*expanded) {
+				RDEBUG("Ignoring null query");
+				rcode = RLM_MODULE_NOOP;
+				talloc_free(expanded);
 
-			goto finish;
-		}
+				goto finish;
+			}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+			rlm_sql_query_log(inst, request, section, expanded);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
+			sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+			TALLOC_FREE(expanded);
+		}
 		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -83,6 +83,26 @@ typedef struct sql_acct_section {
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
+/** Configuration for queueing accounting queries
+ *
+ */
+typedef struct sql_write_behind_config {
+	bool			enable;				//!< Queue accounting queries, instead of
+								//!< running them in the request thread.
+	uint32_t		workers;			//!< Number of threads writing queued queries.
+	uint32_t		batch_size;			//!< Maximum number of entries written in
+								//!< one transaction.
+	struct timeval		batch_delay;			//!< How long to wait for a batch to fill up.
+	uint32_t		queue_size;			//!< Maximum number of queued entries.
+
+	char const		*transaction_start;		//!< Query used to start a transaction.
+	char const		*transaction_commit;		//!< Query used to commit a transaction.
+	char const		*transaction_rollback;		//!< Query used to abort a transaction.
+
+	char const		*failed_logfile;		//!< Where to write queries which couldn't
+								//!< be run.
+} sql_write_behind_config_t;
+
 typedef struct sql_config {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -135,6 +155,10 @@ typedef struct sql_config {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepare;			//!< Run authorize, accounting and post-auth
+								//!< queries as prepared statements, where the
+								//!< driver supports them.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -148,9 +172,36 @@ typedef struct sql_config {
 	 */
 	sql_acct_section_t	postauth;
 	sql_acct_section_t	accounting;
+
+	sql_write_behind_config_t write_behind;
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
+typedef struct sql_write_behind sql_write_behind_t;
+
+/** How the value of a placeholder is bound
+ *
+ */
+typedef enum {
+	SQL_PARAM_STRING = 0,					//!< Contents of a quoted string.
+	SQL_PARAM_INTEGER					//!< Expansion outside of a quoted string.
+								//!< A 64bit integer, or NULL.
+} sql_param_type_t;
+
+/** A query template, compiled to a parameterised statement
+ *
+ * Each quoted SQL string in the template which contains an expansion, and
+ * each expansion outside of a quoted string, is replaced by a placeholder
+ * ($1, $2, ...), numbered in the order they appear.
+ */
+typedef struct sql_stmt {
+	CONF_PAIR const		*cp;				//!< Query template this statement was compiled from.
+	int			id;				//!< Index into the per-connection statement array.
+	char const		*query;				//!< Query with placeholders, passed to the driver.
+	xlat_exp_t		**param;			//!< Expansions bound to the placeholders.
+	sql_param_type_t	*type;				//!< How each placeholder is bound.
+	int			num_params;			//!< Number of placeholders.
+} sql_stmt_t;
 
 typedef struct rlm_sql_handle {
 	void			*conn;				//!< Database specific connection handle.
@@ -158,6 +209,8 @@ typedef struct rlm_sql_handle {
 	rlm_sql_t		*inst;				//!< The rlm_sql instance this connection belongs to.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid mallocing memory on
 								//!< when log strings need to be copied.
+	void			**stmt;				//!< Statements prepared by the driver on this
+								//!< connection, indexed by #sql_stmt_t id.
 } rlm_sql_handle_t;
 
 extern const FR_NAME_NUMBER sql_rcode_table[];
@@ -216,6 +269,22 @@ typedef struct rlm_sql_module_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional.  Statements returned by sql_prepare must remain
+	 *	valid until the connection is closed, and must be freed
+	 *	by the driver when it closes the connection.
+	 *
+	 *	A NULL param is bound as NULL.  Others are bound as the
+	 *	type given for them.  After sql_execute the result is
+	 *	accessed and freed as if it had been returned by
+	 *	sql_query, or by sql_select_query if the statement
+	 *	returns rows.
+	 */
+	sql_rcode_t (*sql_prepare)(void **out, rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				   char const *query, sql_param_type_t const type[], int num_params);
+	sql_rcode_t (*sql_execute)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, void *stmt,
+				   sql_param_type_t const type[], char const * const param[], int num_params);
 } rlm_sql_module_t;
 
 struct sql_inst {
@@ -239,6 +308,13 @@ struct sql_inst {
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const		*group_da;		//!< Group dictionary attribute.
+
+	sql_write_behind_t	*write_behind;		//!< Queue of accounting queries, if enabled.
+
+	rbtree_t		*stmts;			//!< Compiled query templates, keyed by CONF_PAIR.
+	int			num_stmts;		//!< Number of compiled query templates.
+	sql_stmt_t const	*authorize_check_stmt;	//!< Compiled authorize_check_query.
+	sql_stmt_t const	*authorize_reply_stmt;	//!< Compiled authorize_reply_query.
 };
 
 typedef struct sql_grouplist {
@@ -249,7 +325,8 @@ typedef struct sql_grouplist {
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			     VALUE_PAIR **pair, char const *query, sql_stmt_t const *stmt);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
@@ -258,4 +335,21 @@ sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+
+/* sql_prepare.c */
+int		sql_stmt_compile(rlm_sql_t *inst, sql_acct_section_t *section);
+sql_stmt_t const *sql_stmt_compile_query(rlm_sql_t *inst, char const *name);
+sql_stmt_t const *sql_stmt_find(rlm_sql_t const *inst, CONF_PAIR const *cp);
+sql_rcode_t	rlm_sql_execute(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				sql_stmt_t const *stmt) CC_HINT(nonnull (1, 2, 3, 4));
+sql_rcode_t	rlm_sql_select_execute(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				       sql_stmt_t const *stmt) CC_HINT(nonnull (1, 2, 3, 4));
+
+#ifdef HAVE_PTHREAD_H
+/* sql_write_behind.c */
+int		sql_write_behind_init(rlm_sql_t *inst);
+void		sql_write_behind_free(rlm_sql_t *inst);
+rlm_rcode_t	sql_write_behind_enqueue(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					 sql_acct_section_t *section, CONF_PAIR *pair);
+#endif
 #endif
@@ -77,6 +77,14 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	 */
 	handle->inst = inst;
 
+	if (inst->num_stmts) {
+		handle->stmt = talloc_zero_array(handle, void *, inst->num_stmts);
+		if (!handle->stmt) {
+			talloc_free(handle);
+			return NULL;
+		}
+	}
+
 	rcode = (inst->module->sql_socket_init)(handle, inst->config, timeout);
 	if (rcode != 0) {
 	fail:
@@ -475,11 +483,12 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
  *
  *	Function: sql_getvpdata
  *
- *	Purpose: Get any group check or reply pairs
+ *	Purpose: Get any group check or reply pairs, using stmt
+ *		 if the query has been compiled.
  *
  *************************************************************************/
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
-		  VALUE_PAIR **pair, char const *query)
+		  VALUE_PAIR **pair, char const *query, sql_stmt_t const *stmt)
 {
 	rlm_sql_row_t	row;
 	int		rows = 0;
@@ -487,7 +496,11 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 
 	rad_assert(request);
 
-	rcode = rlm_sql_select_query(inst, request, handle, query);
+	if (stmt) {
+		rcode = rlm_sql_select_execute(inst, request, handle, stmt);
+	} else {
+		rcode = rlm_sql_select_query(inst, request, handle, query);
+	}
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == 0) {
@@ -0,0 +1,531 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_prepare.c
+ * @brief Compile query templates to prepared statements.
+ *
+ * Query templates are compiled once, when the module is instantiated.  Every
+ * quoted SQL string which contains an expansion, e.g. '%{User-Name}', is
+ * replaced with a placeholder, and the contents of the string become an
+ * expansion which is bound to that placeholder.
+ *
+ * Expansions outside of quoted strings, e.g. %{integer:Event-Timestamp}, are
+ * bound as integers.  Their values must be integers, or NULL.  If they're
+ * anything else, e.g. an SQL function used as a default, the template is
+ * run as a text query for that request.
+ *
+ * Each connection prepares a statement the first time it's used, and keeps
+ * it until the connection is closed.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <ctype.h>
+
+#include "rlm_sql.h"
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	sql_stmt_t const *a = one, *b = two;
+
+	if (a->cp < b->cp) return -1;
+	if (a->cp > b->cp) return +1;
+
+	return 0;
+}
+
+/*
+ *	Whether c may be part of an SQL identifier or number.
+ */
+static bool sql_stmt_is_word(char c)
+{
+	return isalnum((uint8_t) c) || (c == '_') || (c == '.') || (c == '`') || (c == '"');
+}
+
+/*
+ *	Add an expansion as the next placeholder.
+ */
+static int sql_stmt_param_add(rlm_sql_t const *inst, sql_stmt_t *stmt, char **query, CONF_PAIR const *cp,
+			      char const *start, char const *end, sql_param_type_t type)
+{
+	char		*fmt;
+	char const	*error;
+
+	MEM(fmt = talloc_strndup(stmt, start, end - start));
+	MEM(stmt->param = talloc_realloc(stmt, stmt->param, xlat_exp_t *, stmt->num_params + 1));
+	MEM(stmt->type = talloc_realloc(stmt, stmt->type, sql_param_type_t, stmt->num_params + 1));
+	if (xlat_tokenize(stmt, fmt, &stmt->param[stmt->num_params], &error) < 0) {
+		cf_log_err_cp(cp, "Failed parsing expansion '%s': %s", fmt, error);
+		return -1;
+	}
+	stmt->type[stmt->num_params] = type;
+	stmt->num_params++;
+
+	MEM(*query = talloc_asprintf_append_buffer(*query, "$%i", stmt->num_params));
+
+	return 0;
+}
+
+/** Compile a single query template
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] cp containing the query template.
+ * @return
+ *	- New statement on success.
+ *	- NULL if the template can't be run as a prepared statement.
+ */
+static sql_stmt_t *sql_stmt_alloc(rlm_sql_t *inst, CONF_PAIR const *cp)
+{
+	sql_stmt_t	*stmt;
+	char const	*p, *q, *value;
+	char		*query;
+	int		depth;
+	bool		expand;
+
+	value = cf_pair_value(cp);
+	if (!value || !*value) return NULL;
+
+	MEM(stmt = talloc_zero(inst, sql_stmt_t));
+	MEM(query = talloc_strdup(stmt, ""));
+	stmt->cp = cp;
+
+	p = value;
+	while (*p) {
+		/*
+		 *	Backslashes are used by xlat.  Leave these
+		 *	templates alone.
+		 */
+		if (*p == '\\') goto skip;
+
+		/*
+		 *	An expansion outside of a quoted string.  It
+		 *	must be a value on its own, not part of a
+		 *	name, or of some other SQL.
+		 */
+		if (*p == '%') {
+			if (p[1] == '{') {
+				depth = 0;
+				for (q = p; *q; q++) {
+					if ((q[0] == '%') && (q[1] == '{')) {
+						depth++;
+						q++;
+						continue;
+					}
+					if ((*q == '}') && (--depth == 0)) break;
+				}
+				if (!*q) goto skip;
+			} else if (isalpha((uint8_t) p[1])) {
+				q = p + 1;
+			} else {
+				goto skip;
+			}
+			q++;
+
+			if (((p > value) && sql_stmt_is_word(p[-1])) || sql_stmt_is_word(*q) || (*q == '\'')) goto skip;
+
+			if (sql_stmt_param_add(inst, stmt, &query, cp, p, q, SQL_PARAM_INTEGER) < 0) goto skip;
+			p = q;
+			continue;
+		}
+
+		if (*p != '\'') {
+			MEM(query = talloc_asprintf_append_buffer(query, "%c", *p));
+			p++;
+			continue;
+		}
+
+		/*
+		 *	Find the end of the string, skipping over
+		 *	any quotes inside of expansions.
+		 */
+		depth = 0;
+		expand = false;
+		for (q = p + 1; *q; q++) {
+			if (*q == '\\') goto skip;
+
+			if (*q == '%') {
+				expand = true;
+				if (q[1] == '{') {
+					depth++;
+					q++;
+				}
+				continue;
+			}
+
+			if (depth > 0) {
+				if (*q == '}') depth--;
+				continue;
+			}
+
+			if (*q == '\'') break;
+		}
+
+		/*
+		 *	Unterminated string, or an escaped quote.
+		 */
+		if ((*q != '\'') || (q[1] == '\'')) goto skip;
+
+		if (!expand) {
+			MEM(query = talloc_asprintf_append_buffer(query, "%.*s", (int) (q - p) + 1, p));
+			p = q + 1;
+			continue;
+		}
+
+		if (sql_stmt_param_add(inst, stmt, &query, cp, p + 1, q, SQL_PARAM_STRING) < 0) goto skip;
+		p = q + 1;
+	}
+
+	/*
+	 *	Nothing to bind.  This also skips items which
+	 *	are only used in other queries, e.g. column_list.
+	 */
+	if (stmt->num_params == 0) goto skip;
+
+	stmt->query = query;
+
+	return stmt;
+
+skip:
+	talloc_free(stmt);
+
+	return NULL;
+}
+
+/*
+ *	Compile a query template, and add it to the instance.
+ */
+static sql_stmt_t const *sql_stmt_add(rlm_sql_t *inst, CONF_PAIR const *cp)
+{
+	sql_stmt_t	*stmt;
+
+	if (!inst->stmts) {
+		inst->stmts = rbtree_create(inst, sql_stmt_cmp, NULL, 0);
+		if (!inst->stmts) return NULL;
+	}
+
+	stmt = sql_stmt_alloc(inst, cp);
+	if (!stmt) return NULL;
+
+	stmt->id = inst->num_stmts;
+	if (!rbtree_insert(inst->stmts, stmt)) {
+		talloc_free(stmt);
+		return NULL;
+	}
+	inst->num_stmts++;
+
+	DEBUG3("Compiled query \"%s\"", stmt->query);
+
+	return stmt;
+}
+
+/** Compile the query templates in a section, and its subsections
+ *
+ */
+static int sql_stmt_compile_cs(rlm_sql_t *inst, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	int		ret, count = 0;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			ret = sql_stmt_compile_cs(inst, cf_item_to_section(ci));
+			if (ret < 0) return -1;
+
+			count += ret;
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		if (!strcmp(cf_pair_attr(cp), "reference") || !strcmp(cf_pair_attr(cp), "logfile")) continue;
+
+		if (sql_stmt_add(inst, cp)) count++;
+	}
+
+	return count;
+}
+
+/** Compile all the query templates in an accounting or post-auth section
+ *
+ * The reference is expanded at run time, so any pair in the section may
+ * be a query.  Must be called before the connection pool is created, as
+ * each connection allocates one statement slot per compiled template.
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] section to compile query templates for.
+ * @return
+ *	- Number of templates compiled.
+ *	- -1 on error.
+ */
+int sql_stmt_compile(rlm_sql_t *inst, sql_acct_section_t *section)
+{
+	char const	*logfile;
+
+	if (!section->cs) return 0;
+
+	/*
+	 *	Logging needs the text of the query, so
+	 *	there's nothing to gain.
+	 */
+	logfile = section->logfile ? section->logfile : inst->config->logfile;
+	if (logfile && *logfile) {
+		DEBUG("Not preparing queries in %s, as a logfile is set", cf_section_name1(section->cs));
+		return 0;
+	}
+
+	return sql_stmt_compile_cs(inst, section->cs);
+}
+
+/** Compile a query template from the module's configuration
+ *
+ * Must be called before the connection pool is created.
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] name of the config item containing the template, e.g. "authorize_check_query".
+ * @return the compiled statement, or NULL if the template should be run as text.
+ */
+sql_stmt_t const *sql_stmt_compile_query(rlm_sql_t *inst, char const *name)
+{
+	CONF_PAIR *cp;
+
+	cp = cf_pair_find(inst->cs, name);
+	if (!cp) return NULL;
+
+	return sql_stmt_add(inst, cp);
+}
+
+/** Find the compiled version of a query template
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] cp containing the query template.
+ * @return the compiled statement, or NULL if the template should be run as text.
+ */
+sql_stmt_t const *sql_stmt_find(rlm_sql_t const *inst, CONF_PAIR const *cp)
+{
+	sql_stmt_t find;
+
+	if (!inst->stmts) return NULL;
+
+	find.cp = cp;
+
+	return rbtree_finddata(inst->stmts, &find);
+}
+
+/*
+ *	Check the value of an expansion bound as an integer.
+ */
+static bool sql_param_is_integer(char const *value)
+{
+	char const *p = value;
+
+	if (*p == '-') p++;
+	if (!*p) return false;
+
+	while (*p) {
+		if (!isdigit((uint8_t) *p)) return false;
+		p++;
+	}
+
+	return true;
+}
+
+/*
+ *	The values of the parameters can't be bound, so expand the
+ *	template as text, and run that instead.
+ */
+static sql_rcode_t sql_stmt_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				  sql_stmt_t const *stmt, bool select)
+{
+	sql_rcode_t	ret;
+	char		*expanded = NULL;
+
+	if (radius_axlat(&expanded, request, cf_pair_value(stmt->cp), inst->sql_escape_func, *handle) < 0) {
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	if (select) {
+		ret = rlm_sql_select_query(inst, request, handle, expanded);
+	} else {
+		ret = rlm_sql_query(inst, request, handle, expanded);
+	}
+	talloc_free(expanded);
+
+	return ret;
+}
+
+/*
+ *	Expand the parameters of a statement, and run it.
+ */
+static sql_rcode_t sql_stmt_run(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				sql_stmt_t const *stmt, bool select)
+{
+	sql_rcode_t	ret = RLM_SQL_ERROR;
+	char		**param;
+	xlat_escape_t	escape;
+	int		i, count;
+
+	rad_assert(*handle);
+	rad_assert(stmt->id < inst->num_stmts);
+
+	/*
+	 *	Values are bound, so they don't need quoting.  The
+	 *	default escape function also rewrites unsafe
+	 *	characters, so use it, to store the same data as
+	 *	the text queries would.
+	 */
+	escape = inst->module->sql_escape_func ? NULL : inst->sql_escape_func;
+
+	MEM(param = talloc_zero_array(request, char *, stmt->num_params));
+	for (i = 0; i < stmt->num_params; i++) {
+		if (stmt->type[i] == SQL_PARAM_STRING) {
+			if (radius_axlat_struct(&param[i], request, stmt->param[i], escape, *handle) < 0) {
+				talloc_free(param);
+				return RLM_SQL_QUERY_INVALID;
+			}
+			RDEBUG3("$%i = '%s'", i + 1, param[i]);
+			continue;
+		}
+
+		if (radius_axlat_struct(&param[i], request, stmt->param[i], NULL, NULL) < 0) {
+			talloc_free(param);
+			return RLM_SQL_QUERY_INVALID;
+		}
+
+		if (strcasecmp(param[i], "NULL") == 0) {
+			TALLOC_FREE(param[i]);
+			RDEBUG3("$%i = NULL", i + 1);
+			continue;
+		}
+
+		if (!sql_param_is_integer(param[i])) {
+			RDEBUG2("$%i = %s is not an integer, running the query as text", i + 1, param[i]);
+			talloc_free(param);
+			return sql_stmt_query(inst, request, handle, stmt, select);
+		}
+		RDEBUG3("$%i = %s", i + 1, param[i]);
+	}
+
+	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+
+	for (i = 0; i < (count + 1); i++) {
+		rlm_sql_handle_t *conn = *handle;
+
+		RDEBUG2("Executing prepared %squery: %s", select ? "select " : "", stmt->query);
+
+		ret = RLM_SQL_OK;
+		if (!conn->stmt[stmt->id]) {
+			ret = (inst->module->sql_prepare)(&conn->stmt[stmt->id], conn, inst->config,
+							  stmt->query, stmt->type, stmt->num_params);
+		}
+		if (ret == RLM_SQL_OK) {
+			ret = (inst->module->sql_execute)(conn, inst->config, conn->stmt[stmt->id], stmt->type,
+							  (char const * const *) param, stmt->num_params);
+		}
+
+		switch (ret) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_RECONNECT:
+			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			if (!*handle) {
+				talloc_free(param);
+				return RLM_SQL_RECONNECT;
+			}
+			continue;
+
+		/*
+		 *	Same rules as rlm_sql_query() and
+		 *	rlm_sql_select_query().
+		 */
+		default:
+			if (!select && (ret == RLM_SQL_ERROR) &&
+			    !(inst->module->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY)) ret = RLM_SQL_ALT_QUERY;
+
+			rlm_sql_print_error(inst, request, *handle, !select && (ret == RLM_SQL_ALT_QUERY));
+			if (select) {
+				(inst->module->sql_finish_select_query)(*handle, inst->config);
+			} else {
+				(inst->module->sql_finish_query)(*handle, inst->config);
+			}
+			break;
+		}
+
+		talloc_free(param);
+		return ret;
+	}
+
+	talloc_free(param);
+	RERROR("Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+/** Expand the parameters of a statement, and run it, reconnecting if necessary
+ *
+ * @note Caller must call ``(inst->module->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraint violation.
+ */
+sql_rcode_t rlm_sql_execute(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			    sql_stmt_t const *stmt)
+{
+	return sql_stmt_run(inst, request, handle, stmt, false);
+}
+
+/** Expand the parameters of a statement which returns rows, and run it, reconnecting if necessary
+ *
+ * @note Caller must call ``(inst->module->sql_finish_select_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param stmt to execute.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ */
+sql_rcode_t rlm_sql_select_execute(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				   sql_stmt_t const *stmt)
+{
+	return sql_stmt_run(inst, request, handle, stmt, true);
+}
@@ -0,0 +1,548 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_write_behind.c
+ * @brief Queue accounting queries, and write them to the database in batches.
+ *
+ * Accounting queries are expanded by the request thread, and appended to a
+ * per-instance queue.  Worker threads take batches of queries from the queue,
+ * and run each batch inside a single transaction.  If the transaction fails,
+ * the queries in the batch are run one at a time.  Queries which still fail
+ * are written to "failed_logfile", so that they can be replayed later.
+ *
+ * When the queue is full, the request thread runs its own queries, so that
+ * the database latency is seen by the thread pool again.
+ *
+ * The queue is only held in memory.  The module returns "ok", and the NAS
+ * gets its Accounting-Response, before the queries have been written.  The
+ * queue is drained when the module is freed, but anything still queued when
+ * the server exits abnormally is lost.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_sql.h"
+
+#ifdef HAVE_PTHREAD_H
+/** A set of redundant queries for one request
+ *
+ */
+typedef struct sql_write_behind_entry sql_write_behind_entry_t;
+struct sql_write_behind_entry {
+	sql_write_behind_entry_t *next;			//!< Next entry in the queue.
+	struct timeval		queued;			//!< When the entry was added to the queue.
+
+	char const		*logfile;		//!< Expanded name of the query log, or NULL.
+	char			**query;		//!< Expanded queries.  The first one which
+							//!< updates a row ends the set.
+	int			num;			//!< Number of queries.
+	int			ran;			//!< Number of queries which were run.
+};
+
+struct sql_write_behind {
+	rlm_sql_t		*inst;			//!< Instance we're writing for.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		cond;			//!< Signalled when there is work, or we're stopping.
+
+	sql_write_behind_entry_t *head;			//!< Oldest queued entry.
+	sql_write_behind_entry_t *tail;			//!< Newest queued entry.
+	uint32_t		num;			//!< Number of queued entries.
+	bool			stop;			//!< Workers should exit once the queue is empty.
+
+	pthread_t		*workers;		//!< Worker threads.
+	uint32_t		num_workers;		//!< Number of workers which were started.
+};
+
+/*
+ *	Append a query to a log file.  The file name has already been
+ *	expanded, as the worker threads don't have a request.
+ */
+static void write_behind_log(rlm_sql_t const *inst, char const *filename, char const *query)
+{
+	int	fd;
+	size_t	len;
+
+	if (!filename || !*filename) return;
+
+	fd = exfile_open(inst->ef, filename, 0640, true);
+	if (fd < 0) {
+		ERROR("Couldn't open logfile '%s': %s", filename, fr_syserror(errno));
+		return;
+	}
+
+	len = strlen(query);
+	if ((write(fd, query, len) < 0) || (write(fd, ";\n", 2) < 0)) {
+		ERROR("Failed writing to logfile '%s': %s", filename, fr_syserror(errno));
+	}
+
+	exfile_close(inst->ef, fd);
+}
+
+/*
+ *	Run a non-accounting query, such as the ones which start and
+ *	end a transaction.
+ */
+static sql_rcode_t write_behind_query(rlm_sql_t const *inst, rlm_sql_handle_t **handle, char const *query)
+{
+	sql_rcode_t rcode;
+
+	rcode = rlm_sql_query(inst, NULL, handle, query);
+	if ((rcode == RLM_SQL_OK) && *handle) (inst->module->sql_finish_query)(*handle, inst->config);
+
+	return rcode;
+}
+
+/** Run the queries for one entry
+ *
+ * Follows the same rules as acct_redundant().  Each query is tried in turn,
+ * until one of them updates a row.
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] request The current request, or NULL if called from a worker.
+ * @param[in,out] handle to run the queries with.  May be set to NULL if the
+ *	connection fails.
+ * @param[in] entry to run.
+ * @param[in] transaction If true, treat constraint violations as failures, as
+ *	some databases abort the whole transaction on errors.  The queries are
+ *	logged after the transaction commits.
+ * @return
+ *	- RLM_MODULE_OK if a query updated a row.
+ *	- RLM_MODULE_NOOP if no queries updated a row.
+ *	- RLM_MODULE_INVALID if a query was invalid.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t write_behind_run(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				    sql_write_behind_entry_t *entry, bool transaction)
+{
+	int	i, numaffected;
+
+	for (i = 0; i < entry->num; i++) {
+		if (!*handle) return RLM_MODULE_FAIL;
+
+		entry->ran = i + 1;
+		if (!transaction) write_behind_log(inst, entry->logfile, entry->query[i]);
+
+		switch (rlm_sql_query(inst, request, handle, entry->query[i])) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_ERROR:
+		case RLM_SQL_RECONNECT:
+			return RLM_MODULE_FAIL;
+
+		case RLM_SQL_QUERY_INVALID:
+			return RLM_MODULE_INVALID;
+
+		case RLM_SQL_ALT_QUERY:
+			if (transaction) return RLM_MODULE_FAIL;
+			continue;
+		}
+
+		numaffected = (inst->module->sql_affected_rows)(*handle, inst->config);
+		(inst->module->sql_finish_query)(*handle, inst->config);
+		ROPTIONAL(RDEBUG, DEBUG, "%i record(s) updated", numaffected);
+
+		if (numaffected > 0) return RLM_MODULE_OK;
+	}
+
+	return RLM_MODULE_NOOP;
+}
+
+/*
+ *	Run a batch of entries inside a single transaction.
+ *
+ *	If the connection is replaced part way through, the transaction
+ *	is lost, so we give up, and the entries are run again one at a
+ *	time.  The accounting queries are written so that running one
+ *	twice is harmless.
+ */
+static bool write_behind_batch_transaction(rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+					   sql_write_behind_entry_t *batch)
+{
+	sql_write_behind_config_t const	*config = &inst->config->write_behind;
+	sql_write_behind_entry_t	*entry;
+	rlm_sql_handle_t		*start = *handle;
+	int				i;
+
+	if (write_behind_query(inst, handle, config->transaction_start) != RLM_SQL_OK) return false;
+	if (*handle != start) goto rollback;
+
+	for (entry = batch; entry; entry = entry->next) {
+		switch (write_behind_run(inst, NULL, handle, entry, true)) {
+		case RLM_MODULE_OK:
+		case RLM_MODULE_NOOP:
+			if (*handle != start) goto rollback;
+			continue;
+
+		default:
+			goto rollback;
+		}
+	}
+
+	if ((write_behind_query(inst, handle, config->transaction_commit) == RLM_SQL_OK) && (*handle == start)) {
+		for (entry = batch; entry; entry = entry->next) {
+			for (i = 0; i < entry->ran; i++) write_behind_log(inst, entry->logfile, entry->query[i]);
+		}
+		return true;
+	}
+
+rollback:
+	if (*handle) (void) write_behind_query(inst, handle, config->transaction_rollback);
+
+	return false;
+}
+
+/*
+ *	Write a batch of entries to the database.
+ */
+static void write_behind_batch(rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+			       sql_write_behind_entry_t *batch, uint32_t num)
+{
+	sql_write_behind_config_t const	*config = &inst->config->write_behind;
+	sql_write_behind_entry_t	*entry;
+
+	if ((num > 1) && config->transaction_start && *config->transaction_start) {
+		if (write_behind_batch_transaction(inst, handle, batch)) {
+			DEBUG2("Wrote %u queued accounting entries", num);
+			return;
+		}
+
+		WARN("Failed writing %u queued accounting entries as a transaction, writing them individually",
+		     num);
+	}
+
+	for (entry = batch; entry; entry = entry->next) {
+		switch (write_behind_run(inst, NULL, handle, entry, false)) {
+		case RLM_MODULE_OK:
+		case RLM_MODULE_NOOP:
+			break;
+
+		default:
+			ERROR("Failed writing queued accounting query: %s", entry->query[0]);
+			write_behind_log(inst, config->failed_logfile, entry->query[0]);
+			break;
+		}
+	}
+}
+
+static void *write_behind_worker(void *arg)
+{
+	sql_write_behind_t		*wb = arg;
+	rlm_sql_t			*inst = wb->inst;
+	sql_write_behind_config_t const	*config = &inst->config->write_behind;
+
+	pthread_mutex_lock(&wb->mutex);
+	while (true) {
+		sql_write_behind_entry_t	*batch, *last, *next;
+		rlm_sql_handle_t		*handle;
+		uint32_t			num;
+
+		if (!wb->num) {
+			if (wb->stop) break;
+
+			pthread_cond_wait(&wb->cond, &wb->mutex);
+			continue;
+		}
+
+		/*
+		 *	Wait for a full batch, unless the oldest entry
+		 *	has been waiting for long enough.
+		 */
+		if ((wb->num < config->batch_size) && !wb->stop) {
+			struct timeval	now, when;
+			struct timespec	ts;
+
+			gettimeofday(&now, NULL);
+			timeradd(&wb->head->queued, &config->batch_delay, &when);
+
+			if (timercmp(&now, &when, <)) {
+				ts.tv_sec = when.tv_sec;
+				ts.tv_nsec = when.tv_usec * 1000;
+
+				pthread_cond_timedwait(&wb->cond, &wb->mutex, &ts);
+				continue;
+			}
+		}
+
+		batch = last = wb->head;
+		for (num = 1; (num < config->batch_size) && last->next; num++) last = last->next;
+
+		wb->head = last->next;
+		if (!wb->head) wb->tail = NULL;
+		wb->num -= num;
+		last->next = NULL;
+		pthread_mutex_unlock(&wb->mutex);
+
+		handle = fr_connection_get(inst->pool, NULL);
+		if (!handle) {
+			/*
+			 *	Put the batch back, and wait before
+			 *	trying again.  Requests will run their
+			 *	own queries once the queue fills up.
+			 */
+			pthread_mutex_lock(&wb->mutex);
+			if (!wb->stop) {
+				struct timeval	now, when;
+				struct timespec	ts;
+
+				last->next = wb->head;
+				wb->head = batch;
+				if (!wb->tail) wb->tail = last;
+				wb->num += num;
+
+				gettimeofday(&now, NULL);
+				timeradd(&now, &config->batch_delay, &when);
+				ts.tv_sec = when.tv_sec;
+				ts.tv_nsec = when.tv_usec * 1000;
+
+				pthread_cond_timedwait(&wb->cond, &wb->mutex, &ts);
+				continue;
+			}
+			pthread_mutex_unlock(&wb->mutex);
+
+			ERROR("No connections available, writing %u queued accounting entries to the failed log",
+			      num);
+			for (next = batch; next; next = next->next) {
+				write_behind_log(inst, config->failed_logfile, next->query[0]);
+			}
+		} else {
+			write_behind_batch(inst, &handle, batch, num);
+			fr_connection_release(inst->pool, NULL, handle);
+		}
+
+		while (batch) {
+			next = batch->next;
+			talloc_free(batch);
+			batch = next;
+		}
+
+		pthread_mutex_lock(&wb->mutex);
+	}
+	pthread_mutex_unlock(&wb->mutex);
+
+	return NULL;
+}
+
+/** Start the write-behind worker threads
+ *
+ * @param[in] inst rlm_sql instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_write_behind_init(rlm_sql_t *inst)
+{
+	sql_write_behind_config_t	*config = &inst->config->write_behind;
+	sql_write_behind_t		*wb;
+	uint32_t			i;
+	int				rcode;
+
+	FR_INTEGER_BOUND_CHECK("write_behind.workers", config->workers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("write_behind.workers", config->workers, <=, 64);
+	FR_INTEGER_BOUND_CHECK("write_behind.batch_size", config->batch_size, >=, 1);
+	FR_INTEGER_BOUND_CHECK("write_behind.queue_size", config->queue_size, >=, config->batch_size);
+
+	wb = talloc_zero(inst, sql_write_behind_t);
+	if (!wb) return -1;
+
+	wb->inst = inst;
+	wb->workers = talloc_array(wb, pthread_t, config->workers);
+	if (!wb->workers) {
+		talloc_free(wb);
+		return -1;
+	}
+
+	pthread_mutex_init(&wb->mutex, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+	inst->write_behind = wb;
+
+	for (i = 0; i < config->workers; i++) {
+		rcode = pthread_create(&wb->workers[i], NULL, write_behind_worker, wb);
+		if (rcode != 0) {
+			ERROR("Failed creating write-behind thread: %s", fr_syserror(rcode));
+			sql_write_behind_free(inst);
+			return -1;
+		}
+		wb->num_workers++;
+	}
+
+	INFO("Queueing up to %u accounting queries, written by %u threads in batches of %u",
+	     config->queue_size, config->workers, config->batch_size);
+	WARN("Accounting packets are acknowledged before they are written to the database.  "
+	     "Up to %u queued packets will be lost if the server exits abnormally", config->queue_size);
+
+	return 0;
+}
+
+/** Write any queued queries, and stop the worker threads
+ *
+ * @param[in] inst rlm_sql instance.
+ */
+void sql_write_behind_free(rlm_sql_t *inst)
+{
+	sql_write_behind_t	*wb = inst->write_behind;
+	uint32_t		i;
+
+	if (!wb) return;
+
+	pthread_mutex_lock(&wb->mutex);
+	wb->stop = true;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->mutex);
+
+	for (i = 0; i < wb->num_workers; i++) pthread_join(wb->workers[i], NULL);
+
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->mutex);
+
+	inst->write_behind = NULL;
+	talloc_free(wb);
+}
+
+/** Expand a set of redundant queries, and add them to the write-behind queue
+ *
+ * If the queue is full, the queries are run immediately, with the caller's
+ * handle.
+ *
+ * @param[in] inst rlm_sql instance.
+ * @param[in] request The current request.
+ * @param[in,out] handle used to escape values, and to run the queries if the
+ *	queue is full.
+ * @param[in] section the queries are from.
+ * @param[in] pair The first query to run.
+ * @return
+ *	- RLM_MODULE_OK if the queries were queued, or run successfully.
+ *	- RLM_MODULE_NOOP if there were no queries, or none updated a row.
+ *	- RLM_MODULE_INVALID if a query was invalid.
+ *	- RLM_MODULE_FAIL on error.
+ */
+rlm_rcode_t sql_write_behind_enqueue(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				     sql_acct_section_t *section, CONF_PAIR *pair)
+{
+	sql_write_behind_t		*wb = inst->write_behind;
+	sql_write_behind_entry_t	*entry;
+	CONF_PAIR			*cp;
+	char const			*attr = cf_pair_attr(pair);
+	char const			*filename;
+	rlm_rcode_t			rcode;
+	int				num = 0;
+
+	for (cp = pair; cp; cp = cf_pair_find_next(section->cs, cp, attr)) num++;
+
+	entry = talloc_zero(NULL, sql_write_behind_entry_t);
+	if (!entry) return RLM_MODULE_FAIL;
+
+	entry->query = talloc_zero_array(entry, char *, num);
+	if (!entry->query) {
+	fail:
+		talloc_free(entry);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Expand all of the queries now, as the request won't
+	 *	be around when they're run.
+	 */
+	for (cp = pair; cp; cp = cf_pair_find_next(section->cs, cp, attr)) {
+		char const	*value = cf_pair_value(cp);
+		char		*expanded = NULL;
+
+		if (!value) break;
+
+		if (radius_axlat(&expanded, request, value, inst->sql_escape_func, *handle) < 0) goto fail;
+		if (!*expanded) {
+			talloc_free(expanded);
+			break;
+		}
+
+		/*
+		 *	The expansion may be in the request's pool,
+		 *	which can't be stolen from.  Copy it instead.
+		 */
+		entry->query[entry->num] = talloc_bstrndup(entry->query, expanded, talloc_array_length(expanded) - 1);
+		talloc_free(expanded);
+		if (!entry->query[entry->num]) goto fail;
+		entry->num++;
+	}
+
+	if (!entry->num) {
+		RDEBUG("Ignoring null query");
+		talloc_free(entry);
+		return RLM_MODULE_NOOP;
+	}
+
+	filename = inst->config->logfile;
+	if (section->logfile) filename = section->logfile;
+	if (filename && *filename) {
+		char *expanded = NULL;
+
+		if (radius_axlat(&expanded, request, filename, NULL, NULL) < 0) goto fail;
+		entry->logfile = talloc_bstrndup(entry, expanded, talloc_array_length(expanded) - 1);
+		talloc_free(expanded);
+		if (!entry->logfile) goto fail;
+	}
+
+	gettimeofday(&entry->queued, NULL);
+
+	/*
+	 *	Once the entry is queued, the writer thread may run
+	 *	and free it at any time.
+	 */
+	num = entry->num;
+
+	pthread_mutex_lock(&wb->mutex);
+	if (!wb->stop && (wb->num < inst->config->write_behind.queue_size)) {
+		if (wb->tail) {
+			wb->tail->next = entry;
+		} else {
+			wb->head = entry;
+		}
+		wb->tail = entry;
+		wb->num++;
+
+		if ((wb->num == 1) || (wb->num >= inst->config->write_behind.batch_size)) {
+			pthread_cond_signal(&wb->cond);
+		}
+		pthread_mutex_unlock(&wb->mutex);
+
+		RDEBUG2("Queued %i accounting %s", num, (num == 1) ? "query" : "queries");
+
+		return RLM_MODULE_OK;
+	}
+	pthread_mutex_unlock(&wb->mutex);
+
+	/*
+	 *	The queue is full.  Run the queries now, so the
+	 *	thread pool slows down to the speed of the database.
+	 */
+	RWDEBUG("Write-behind queue is full, running queries now");
+
+	rcode = write_behind_run(inst, request, handle, entry, false);
+	talloc_free(entry);
+
+	return rcode;
+}
+#endif
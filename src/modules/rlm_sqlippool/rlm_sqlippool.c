@@ -407,7 +407,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->framed_ip_address = PW_FRAMED_IPV6_PREFIX;
 	}
 
-	if (strcmp(sql_inst->module->name, "rlm_sql") != 0) {
+	if (strcmp(sql_inst->module->name, "sql") != 0) {
 		cf_log_err_cs(conf, "Module \"%s\" is not an instance of the rlm_sql module",
 			      inst->sql_instance_name);
 		return -1;
@@ -483,9 +483,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	 *	actual work is protected by a transaction.  The idea
 	 *	here is that if we're allocating 100 IPs a second,
 	 *	we're only do 1 CLEAR per second.
+	 *
+	 *	If there's no clear query, don't bother with an
+	 *	empty transaction.
 	 */
 	now = time(NULL);
-	if (inst->last_clear < now) {
+	if (inst->allocate_clear && *inst->allocate_clear && (inst->last_clear < now)) {
 		inst->last_clear = now;
 
 		DO(allocate_begin);
@@ -493,6 +496,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 		DO(allocate_commit);
 	}
 
+	/*
+	 *	If allocate_find both finds and marks the address
+	 *	as used (e.g. UPDATE ... RETURNING, or a stored
+	 *	procedure), allocate_begin, allocate_update and
+	 *	allocate_commit can be empty.  The allocation then
+	 *	takes one round trip to the database.
+	 */
 	DO(allocate_begin);
 
 	allocation_len = sqlippool_query1(allocation, sizeof(allocation),
@@ -42,6 +42,10 @@ typedef struct rlm_test_t {
 	uint32_t	value;
 	char const	*string;
 	fr_ipaddr_t	ipaddr;
+
+	bool		yield;		//!< Yield from authorize, preacct and accounting.
+	uint32_t	yield_delay;	//!< Milliseconds before another thread signals the
+					//!< request.  If 0, it's signalled before we return.
 } rlm_test_t;
 
 /*
@@ -52,6 +56,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("boolean", PW_TYPE_BOOLEAN, rlm_test_t, boolean), .dflt = "no" },
 	{ FR_CONF_OFFSET("string", PW_TYPE_STRING, rlm_test_t, string) },
 	{ FR_CONF_OFFSET("ipaddr", PW_TYPE_IPV4_ADDR, rlm_test_t, ipaddr), .dflt = "*" },
+	{ FR_CONF_OFFSET("yield", PW_TYPE_BOOLEAN, rlm_test_t, yield), .dflt = "no" },
+	{ FR_CONF_OFFSET("yield_delay", PW_TYPE_INTEGER, rlm_test_t, yield_delay), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -66,6 +72,85 @@ static int rlm_test_cmp(UNUSED void *instance, REQUEST *request, UNUSED VALUE_PA
 	return 1;
 }
 
+/*
+ *	Called once the request has been signalled.
+ */
+static rlm_rcode_t mod_resume(REQUEST *request, UNUSED void *instance, UNUSED void *ctx)
+{
+	RDEBUG("Resumed");
+
+	return RLM_MODULE_UPDATED;
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct rlm_test_signal_t {
+	REQUEST		*request;
+	uint32_t	delay;
+} rlm_test_signal_t;
+
+/*
+ *	Pretend to be a module's I/O thread.
+ */
+static void *mod_signal_thread(void *arg)
+{
+	rlm_test_signal_t	*sig = arg;
+	REQUEST			*request = sig->request;
+
+	usleep(sig->delay * 1000);
+	free(sig);
+
+	modcall_signal(request);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Yield, and have the request signalled either now, or by
+ *	another thread once yield_delay has passed.
+ */
+static rlm_rcode_t mod_yield(rlm_test_t *inst, REQUEST *request)
+{
+	rlm_rcode_t	rcode;
+
+	rcode = modcall_yield(request, mod_resume, NULL, NULL);
+	if (rcode != RLM_MODULE_YIELD) return rcode;
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->yield_delay) {
+		rlm_test_signal_t	*sig;
+		pthread_t		thread;
+		pthread_attr_t		attr;
+		int			ret;
+
+		sig = malloc(sizeof(*sig));
+		if (!sig) return RLM_MODULE_FAIL;
+
+		sig->request = request;
+		sig->delay = inst->yield_delay;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, mod_signal_thread, sig);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			REDEBUG("Failed creating thread: %s", fr_syserror(ret));
+			free(sig);
+			return RLM_MODULE_FAIL;
+		}
+
+		RDEBUG("Waiting %u ms to be signalled", inst->yield_delay);
+		return RLM_MODULE_YIELD;
+	}
+#else
+	UNUSED_VAR(inst);
+#endif
+
+	modcall_signal(request);
+
+	return RLM_MODULE_YIELD;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -106,8 +191,12 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
  *	from the database. The authentication code only needs to check
  *	the password, the rest is done here.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *request)
 {
+	rlm_test_t *inst = instance;
+
+	if (inst->yield) return mod_yield(inst, request);
+
 	RINFO("RINFO message");
 	RDEBUG("RDEBUG message");
 	RDEBUG2("RDEBUG2 message");
@@ -148,16 +237,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(UNUSED void *instance, UNUS
 /*
  *	Massage the request before recording it or proxying it
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_preacct(UNUSED void *instance, UNUSED REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, REQUEST *request)
 {
+	rlm_test_t *inst = instance;
+
+	if (inst->yield) return mod_yield(inst, request);
+
 	return RLM_MODULE_OK;
 }
 
 /*
  *	Write accounting information to this modules database.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(UNUSED void *instance, UNUSED REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
 {
+	rlm_test_t *inst = instance;
+
+	if (inst->yield) return mod_yield(inst, request);
+
 	return RLM_MODULE_OK;
 }
 
@@ -56,6 +56,10 @@ rlm_rcode_t indexed_modcall(UNUSED rlm_components_t comp, UNUSED int idx, UNUSED
 	return RLM_MODULE_OK;
 }
 
+void request_resume(UNUSED REQUEST *request)
+{
+}
+
 char const *get_radius_dir(void)
 {
 	return NULL;
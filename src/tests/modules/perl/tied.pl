@@ -0,0 +1,41 @@
+#
+#  Script for the perl module tests, using tied hashes.
+#
+use strict;
+use warnings;
+
+our (%RAD_REQUEST, %RAD_REPLY, %RAD_CONFIG);
+
+use constant {
+	RLM_MODULE_REJECT	=> 0,
+	RLM_MODULE_OK		=> 2,
+	RLM_MODULE_NOTFOUND	=> 6,
+};
+
+sub authorize {
+	return RLM_MODULE_NOTFOUND unless exists $RAD_REQUEST{'User-Name'};
+	return RLM_MODULE_REJECT if exists $RAD_REQUEST{'Tmp-String-0'};
+
+	$RAD_CONFIG{'Tmp-String-0'} = $RAD_REQUEST{'User-Name'};
+	$RAD_REPLY{'Reply-Message'} = [ 'one', 'two' ];
+
+	return RLM_MODULE_OK;
+}
+
+#
+#  %{perl:<attribute> <value>} sets a request attribute, and
+#  returns what is read back from the hash.  %{perl:<attribute>}
+#  deletes it.
+#
+sub xlat {
+	my ($name, $value) = @_;
+
+	if (!defined $value) {
+		delete $RAD_REQUEST{$name};
+		return '';
+	}
+
+	$RAD_REQUEST{$name} = $value;
+
+	return $RAD_REQUEST{$name};
+}